@@ -3,6 +3,9 @@
  * Added functions: Save and Load from text files without using cv::FileStorage.
  * Date: August 2015
  * Raúl Mur-Artal
+ *
+ * Added functions: Save and Load (memory-mapped) from binary files.
+ * Transform descends a flattened copy of the tree, in parallel over features.
  */
 
 /**
@@ -26,12 +29,20 @@
 #include <algorithm>
 #include <opencv2/core/core.hpp>
 #include <limits>
+#include <cstring>
+#include <stdint.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "FeatureVector.h"
 #include "BowVector.h"
 #include "ScoringObject.h"
 
 #include "../DUtils/Random.h"
+#include "../DUtils/ParallelFor.h"
 
 using namespace std;
 
@@ -246,6 +257,27 @@ public:
    */
   void saveToTextFile(const std::string &filename) const;  
 
+  /**
+   * Loads the vocabulary from a binary file written by saveToBinaryFile.
+   * The file is memory-mapped and the node descriptors point into the
+   * mapping, which is kept until the vocabulary is destroyed or reloaded.
+   * Only for binary descriptors stored in a CV_8U cv::Mat of F::L bytes.
+   * @param filename
+   */
+  bool loadFromBinaryFile(const std::string &filename);
+
+  /**
+   * Saves the vocabulary into a binary file
+   * @param filename
+   */
+  bool saveToBinaryFile(const std::string &filename) const;
+
+  /**
+   * Returns whether the file starts with the binary vocabulary header
+   * @param filename
+   */
+  static bool isBinaryFile(const std::string &filename);
+
   /**
    * Saves the vocabulary into a file
    * @param filename
@@ -393,6 +425,34 @@ protected:
    * Create the words of the vocabulary once the tree has been built
    */
   void createWords();
+
+  /**
+   * Builds the flattened tree used by transform from m_nodes. It is left
+   * empty, and transform descends m_nodes, if the descriptors are not binary
+   * descriptors of F::L bytes (a multiple of 8, up to 64 bytes).
+   * The descriptors of a memory-mapped vocabulary whose sibling nodes have
+   * consecutive ids are read from the mapping instead of being copied
+   */
+  void createFlatTree();
+
+  /**
+   * Returns the word id, weight and node "levelsup" levels up of every feature.
+   * The features are split among several threads if there are many of them
+   * @param features
+   * @param ids (out) word ids
+   * @param weights (out) word weights
+   * @param nids (out) if given, node ids "levelsup" levels up
+   * @param levelsup
+   */
+  void transformFeatures(const std::vector<TDescriptor>& features,
+    std::vector<WordId> &ids, std::vector<WordValue> &weights,
+    std::vector<NodeId> *nids = NULL, int levelsup = 0) const;
+
+  /**
+   * Unmaps the binary file the nodes were loaded from, if any.
+   * The nodes must have been cleared or detached from the mapping before
+   */
+  void releaseMapping();
   
   /**
    * Sets the weights of the nodes of tree according to the given features.
@@ -425,16 +485,69 @@ protected:
   /// Words of the vocabulary (tree leaves)
   /// this condition holds: m_words[wid]->word_id == wid
   std::vector<Node*> m_words;
+
+  /// Node of the flattened tree
+  struct FlatNode
+  {
+    /// Position of the first child in m_flat_nodes
+    uint32_t first_child;
+    /// Number of children (0 if the node is a word)
+    uint32_t n_children;
+    /// Node id in m_nodes
+    NodeId id;
+    /// Position of the descriptor of the first child in m_flat_data
+    uint32_t first_descriptor;
+  };
+
+  /// Flattened tree: nodes in breadth-first order, so that the children of
+  /// a node are contiguous. The descriptors of the children of a node are
+  /// m_flat_stride 64-bit words apart in m_flat_data, which points either to
+  /// m_flat_descriptors or into the mapping
+  std::vector<FlatNode> m_flat_nodes;
+  std::vector<uint64_t> m_flat_descriptors;
+  const uint64_t *m_flat_data;
+  size_t m_flat_stride;
+  int m_flat_words;
+
+  /// Memory-mapped binary file the descriptors point into (NULL if none)
+  void* m_mapped;
+
+  /// Size of the mapping
+  size_t m_mapped_size;
+
+  /// Binary file layout: header followed by one record per node except the root.
+  /// A record holds the parent id, the leaf flag, the weight and F::L descriptor
+  /// bytes, padded to a multiple of 8 bytes
+  static const char s_binary_magic[8];
+  static const uint32_t s_binary_version = 1;
+
+  struct BinaryHeader
+  {
+    char magic[8];
+    uint32_t version;
+    int32_t k;
+    int32_t L;
+    int32_t scoring;
+    int32_t weighting;
+    uint32_t nodes;
+    uint32_t descriptor_bytes;
+    uint32_t record_bytes;
+  };
   
 };
 
+template<class TDescriptor, class F>
+const char TemplatedVocabulary<TDescriptor,F>::s_binary_magic[8] =
+  {'D','B','o','W','2','B','I','N'};
+
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
 TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary
   (int k, int L, WeightingType weighting, ScoringType scoring)
   : m_k(k), m_L(L), m_weighting(weighting), m_scoring(scoring),
-  m_scoring_object(NULL)
+  m_scoring_object(NULL), m_flat_data(NULL), m_flat_stride(0),
+  m_flat_words(0), m_mapped(NULL), m_mapped_size(0)
 {
   createScoringObject();
 }
@@ -443,7 +556,9 @@ TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary
 
 template<class TDescriptor, class F>
 TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary
-  (const std::string &filename): m_scoring_object(NULL)
+  (const std::string &filename): m_scoring_object(NULL),
+  m_flat_data(NULL), m_flat_stride(0), m_flat_words(0), m_mapped(NULL),
+  m_mapped_size(0)
 {
   load(filename);
 }
@@ -452,7 +567,9 @@ TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary
 
 template<class TDescriptor, class F>
 TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary
-  (const char *filename): m_scoring_object(NULL)
+  (const char *filename): m_scoring_object(NULL),
+  m_flat_data(NULL), m_flat_stride(0), m_flat_words(0), m_mapped(NULL),
+  m_mapped_size(0)
 {
   load(filename);
 }
@@ -516,7 +633,8 @@ void TemplatedVocabulary<TDescriptor,F>::setWeightingType(WeightingType type)
 template<class TDescriptor, class F>
 TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary(
   const TemplatedVocabulary<TDescriptor, F> &voc)
-  : m_scoring_object(NULL)
+  : m_scoring_object(NULL), m_flat_data(NULL), m_flat_stride(0),
+  m_flat_words(0), m_mapped(NULL), m_mapped_size(0)
 {
   *this = voc;
 }
@@ -527,6 +645,9 @@ template<class TDescriptor, class F>
 TemplatedVocabulary<TDescriptor,F>::~TemplatedVocabulary()
 {
   delete m_scoring_object;
+  m_words.clear();
+  m_nodes.clear();
+  releaseMapping();
 }
 
 // --------------------------------------------------------------------------
@@ -545,8 +666,18 @@ TemplatedVocabulary<TDescriptor,F>::operator=
   
   this->m_nodes.clear();
   this->m_words.clear();
+  this->releaseMapping();
   
   this->m_nodes = voc.m_nodes;
+
+  // do not share the descriptors of a memory-mapped vocabulary
+  if(voc.m_mapped)
+  {
+    for(size_t i = 0; i < this->m_nodes.size(); ++i)
+      this->m_nodes[i].descriptor = voc.m_nodes[i].descriptor.clone();
+  }
+
+  // also builds the flat tree
   this->createWords();
   
   return *this;
@@ -560,6 +691,7 @@ void TemplatedVocabulary<TDescriptor,F>::create(
 {
   m_nodes.clear();
   m_words.clear();
+  releaseMapping();
   
   // expected_nodes = Sum_{i=0..L} ( k^i )
 	int expected_nodes = 
@@ -935,6 +1067,8 @@ void TemplatedVocabulary<TDescriptor,F>::createWords()
       }
     }
   }
+
+  createFlatTree();
 }
 
 // --------------------------------------------------------------------------
@@ -1077,20 +1211,19 @@ void TemplatedVocabulary<TDescriptor,F>::transform(
   LNorm norm;
   bool must = m_scoring_object->mustNormalize(norm);
 
-	typename vector<TDescriptor>::const_iterator fit;
+  vector<WordId> ids;
+  vector<WordValue> weights;
+  transformFeatures(features, ids, weights);
 
   if(m_weighting == TF || m_weighting == TF_IDF)
   {
-    for(fit = features.begin(); fit < features.end(); ++fit)
+    for(size_t i = 0; i < ids.size(); ++i)
     {
-      WordId id;
-      WordValue w; 
       // w is the idf value if TF_IDF, 1 if TF
-      
-      transform(*fit, id, w);
+      const WordValue w = weights[i];
       
       // not stopped
-      if(w > 0) v.addWeight(id, w);
+      if(w > 0) v.addWeight(ids[i], w);
     }
     
     if(!v.empty() && !must)
@@ -1104,16 +1237,13 @@ void TemplatedVocabulary<TDescriptor,F>::transform(
   }
   else // IDF || BINARY
   {
-    for(fit = features.begin(); fit < features.end(); ++fit)
+    for(size_t i = 0; i < ids.size(); ++i)
     {
-      WordId id;
-      WordValue w;
       // w is idf if IDF, or 1 if BINARY
-      
-      transform(*fit, id, w);
+      const WordValue w = weights[i];
       
       // not stopped
-      if(w > 0) v.addIfNotExist(id, w);
+      if(w > 0) v.addIfNotExist(ids[i], w);
       
     } // if add_features
   } // if m_weighting == ...
@@ -1140,24 +1270,22 @@ void TemplatedVocabulary<TDescriptor,F>::transform(
   LNorm norm;
   bool must = m_scoring_object->mustNormalize(norm);
   
-  typename vector<TDescriptor>::const_iterator fit;
+  vector<WordId> ids;
+  vector<WordValue> weights;
+  vector<NodeId> nids;
+  transformFeatures(features, ids, weights, &nids, levelsup);
   
   if(m_weighting == TF || m_weighting == TF_IDF)
   {
-    unsigned int i_feature = 0;
-    for(fit = features.begin(); fit < features.end(); ++fit, ++i_feature)
+    for(unsigned int i_feature = 0; i_feature < ids.size(); ++i_feature)
     {
-      WordId id;
-      NodeId nid;
-      WordValue w; 
       // w is the idf value if TF_IDF, 1 if TF
-      
-      transform(*fit, id, w, &nid, levelsup);
+      const WordValue w = weights[i_feature];
       
       if(w > 0) // not stopped
       { 
-        v.addWeight(id, w);
-        fv.addFeature(nid, i_feature);
+        v.addWeight(ids[i_feature], w);
+        fv.addFeature(nids[i_feature], i_feature);
       }
     }
     
@@ -1172,20 +1300,15 @@ void TemplatedVocabulary<TDescriptor,F>::transform(
   }
   else // IDF || BINARY
   {
-    unsigned int i_feature = 0;
-    for(fit = features.begin(); fit < features.end(); ++fit, ++i_feature)
+    for(unsigned int i_feature = 0; i_feature < ids.size(); ++i_feature)
     {
-      WordId id;
-      NodeId nid;
-      WordValue w;
       // w is idf if IDF, or 1 if BINARY
-      
-      transform(*fit, id, w, &nid, levelsup);
+      const WordValue w = weights[i_feature];
       
       if(w > 0) // not stopped
       {
-        v.addIfNotExist(id, w);
-        fv.addFeature(nid, i_feature);
+        v.addIfNotExist(ids[i_feature], w);
+        fv.addFeature(nids[i_feature], i_feature);
       }
     }
   } // if m_weighting == ...
@@ -1226,6 +1349,50 @@ void TemplatedVocabulary<TDescriptor,F>::transform(const TDescriptor &feature,
   const int nid_level = m_L - levelsup;
   if(nid_level <= 0 && nid != NULL) *nid = 0; // root
 
+  if(!m_flat_nodes.empty())
+  {
+    // descend the flattened tree: at each level the descriptors of all the
+    // children are contiguous and compared in a single pass
+    uint64_t query[8];
+    memcpy(query, feature.data, F::L);
+
+    const int W = m_flat_words;
+    uint32_t pos = 0; // root
+    int current_level = 0;
+
+    while(m_flat_nodes[pos].n_children > 0)
+    {
+      ++current_level;
+      const FlatNode &node = m_flat_nodes[pos];
+      const uint64_t *d = m_flat_data +
+        (size_t)node.first_descriptor * m_flat_stride;
+
+      uint32_t best = 0;
+      int best_d = std::numeric_limits<int>::max();
+      for(uint32_t c = 0; c < node.n_children; ++c, d += m_flat_stride)
+      {
+        int dist = 0;
+        for(int w = 0; w < W; ++w)
+          dist += __builtin_popcountll(query[w] ^ d[w]);
+
+        if(dist < best_d)
+        {
+          best_d = dist;
+          best = c;
+        }
+      }
+      pos = node.first_child + best;
+
+      if(nid != NULL && current_level == nid_level)
+        *nid = m_flat_nodes[pos].id;
+    }
+
+    const Node &word = m_nodes[m_flat_nodes[pos].id];
+    word_id = word.word_id;
+    weight = word.weight;
+    return;
+  }
+
   NodeId final_id = 0; // root
   int current_level = 0;
 
@@ -1260,6 +1427,112 @@ void TemplatedVocabulary<TDescriptor,F>::transform(const TDescriptor &feature,
 
 // --------------------------------------------------------------------------
 
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::transformFeatures(
+  const std::vector<TDescriptor>& features,
+  std::vector<WordId> &ids, std::vector<WordValue> &weights,
+  std::vector<NodeId> *nids, int levelsup) const
+{
+  const size_t N = features.size();
+  ids.resize(N);
+  weights.resize(N);
+  if(nids) nids->resize(N);
+
+  NodeId *pnids = (nids && N > 0) ? &(*nids)[0] : NULL;
+
+  // threads are started on every call: each one takes at least 1024
+  // features, in blocks of 256, so that usual frames use few of them
+  DUtils::ParallelFor(N, [&](size_t i)
+  {
+    transform(features[i], ids[i], weights[i], pnids ? &pnids[i] : NULL,
+      levelsup);
+  }, 256, 1024);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::createFlatTree()
+{
+  m_flat_nodes.clear();
+  m_flat_descriptors.clear();
+  m_flat_data = NULL;
+  m_flat_stride = 0;
+  m_flat_words = 0;
+
+  if(m_nodes.empty() || F::L % 8 != 0 || F::L > 64)
+    return;
+
+  const int W = F::L / 8;
+
+  // the records of a binary file store the descriptor of node nid at
+  // position nid-1, so siblings with consecutive ids are already contiguous
+  bool from_mapping = (m_mapped != NULL);
+  for(size_t i = 0; i < m_nodes.size() && from_mapping; ++i)
+  {
+    const vector<NodeId> &children = m_nodes[i].children;
+    for(size_t c = 1; c < children.size() && from_mapping; ++c)
+      from_mapping = (children[c] == children[0] + c);
+  }
+
+  std::vector<FlatNode> flat_nodes;
+  std::vector<uint64_t> flat_descriptors;
+  flat_nodes.reserve(m_nodes.size());
+  if(!from_mapping) flat_descriptors.resize(m_nodes.size() * W);
+
+  FlatNode root;
+  root.first_child = 0;
+  root.n_children = 0;
+  root.id = 0;
+  root.first_descriptor = 0;
+  flat_nodes.push_back(root);
+
+  // breadth-first traversal: the children of each node are appended together
+  for(size_t i = 0; i < flat_nodes.size(); ++i)
+  {
+    const vector<NodeId> &children = m_nodes[flat_nodes[i].id].children;
+    flat_nodes[i].first_child = flat_nodes.size();
+    flat_nodes[i].n_children = children.size();
+    if(!children.empty())
+      flat_nodes[i].first_descriptor =
+        from_mapping ? children[0] - 1 : flat_nodes.size();
+
+    for(size_t c = 0; c < children.size(); ++c)
+    {
+      const TDescriptor &d = m_nodes[children[c]].descriptor;
+      if(d.empty() || !d.isContinuous() || d.total() * d.elemSize() != (size_t)F::L)
+        return;
+
+      FlatNode child;
+      child.first_child = 0;
+      child.n_children = 0;
+      child.id = children[c];
+      child.first_descriptor = 0;
+      if(!from_mapping)
+        memcpy(&flat_descriptors[flat_nodes.size() * W], d.data, F::L);
+      flat_nodes.push_back(child);
+    }
+  }
+
+  m_flat_nodes.swap(flat_nodes);
+  if(from_mapping)
+  {
+    const uint32_t record_bytes = 16 + ((F::L + 7)/8)*8;
+    m_flat_data = (const uint64_t*)((const char*)m_mapped +
+      sizeof(BinaryHeader) + 16);
+    m_flat_stride = record_bytes / 8;
+  }
+  else
+  {
+    m_flat_descriptors.swap(flat_descriptors);
+    m_flat_data = &m_flat_descriptors[0];
+    m_flat_stride = W;
+  }
+  m_flat_words = W;
+}
+
+// --------------------------------------------------------------------------
+
 template<class TDescriptor, class F>
 NodeId TemplatedVocabulary<TDescriptor,F>::getParentNode
   (WordId wid, int levelsup) const
@@ -1345,6 +1618,7 @@ bool TemplatedVocabulary<TDescriptor,F>::loadFromTextFile(const std::string &fil
 
     m_words.clear();
     m_nodes.clear();
+    releaseMapping();
 
     string s;
     getline(f,s);
@@ -1419,6 +1693,8 @@ bool TemplatedVocabulary<TDescriptor,F>::loadFromTextFile(const std::string &fil
         }
     }
 
+    createFlatTree();
+
     return true;
 
 }
@@ -1450,6 +1726,181 @@ void TemplatedVocabulary<TDescriptor,F>::saveToTextFile(const std::string &filen
 
 // --------------------------------------------------------------------------
 
+template<class TDescriptor, class F>
+bool TemplatedVocabulary<TDescriptor,F>::saveToBinaryFile(const std::string &filename) const
+{
+    ofstream f(filename.c_str(), ios_base::out | ios_base::binary);
+    if(!f.is_open())
+        return false;
+
+    const uint32_t record_bytes = 16 + ((F::L + 7)/8)*8;
+
+    BinaryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, s_binary_magic, sizeof(header.magic));
+    header.version = s_binary_version;
+    header.k = m_k;
+    header.L = m_L;
+    header.scoring = m_scoring;
+    header.weighting = m_weighting;
+    header.nodes = m_nodes.size();
+    header.descriptor_bytes = F::L;
+    header.record_bytes = record_bytes;
+    f.write((const char*)&header, sizeof(header));
+
+    vector<char> record(record_bytes);
+    for(size_t i=1; i<m_nodes.size();i++)
+    {
+        const Node& node = m_nodes[i];
+
+        std::fill(record.begin(), record.end(), 0);
+        const uint32_t parent = node.parent;
+        const uint32_t isLeaf = node.isLeaf() ? 1 : 0;
+        const double weight = node.weight;
+        memcpy(&record[0], &parent, 4);
+        memcpy(&record[4], &isLeaf, 4);
+        memcpy(&record[8], &weight, 8);
+        memcpy(&record[16], node.descriptor.data, F::L);
+        f.write(&record[0], record_bytes);
+    }
+
+    return f.good();
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+bool TemplatedVocabulary<TDescriptor,F>::loadFromBinaryFile(const std::string &filename)
+{
+    if(!isBinaryFile(filename))
+        return false;
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd<0)
+        return false;
+
+    struct stat st;
+    if(fstat(fd, &st)!=0 || (size_t)st.st_size<sizeof(BinaryHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    const size_t size = st.st_size;
+    void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(mapped==MAP_FAILED)
+        return false;
+
+    BinaryHeader header;
+    memcpy(&header, mapped, sizeof(header));
+
+    const uint32_t record_bytes = 16 + ((F::L + 7)/8)*8;
+    if(header.version!=s_binary_version || header.descriptor_bytes!=(uint32_t)F::L ||
+       header.record_bytes!=record_bytes || header.nodes==0 ||
+       header.k<0 || header.k>20 || header.L<1 || header.L>10 ||
+       header.scoring<0 || header.scoring>5 || header.weighting<0 || header.weighting>3 ||
+       sizeof(header) + (size_t)(header.nodes-1)*record_bytes != size)
+    {
+        std::cerr << "Vocabulary loading failure: This is not a correct binary file!" << endl;
+        munmap(mapped, size);
+        return false;
+    }
+
+    m_words.clear();
+    m_nodes.clear();
+    releaseMapping();
+
+    m_mapped = mapped;
+    m_mapped_size = size;
+
+    m_k = header.k;
+    m_L = header.L;
+    m_scoring = (ScoringType)header.scoring;
+    m_weighting = (WeightingType)header.weighting;
+    createScoringObject();
+
+    m_nodes.resize(header.nodes);
+    m_nodes[0].id = 0;
+
+    // the descriptors are not copied: they point into the mapping
+    const unsigned char* records = (const unsigned char*)mapped + sizeof(header);
+    for(size_t nid=1; nid<m_nodes.size(); nid++)
+    {
+        const unsigned char* record = records + (nid-1)*record_bytes;
+
+        uint32_t parent, isLeaf;
+        double weight;
+        memcpy(&parent, record, 4);
+        memcpy(&isLeaf, record+4, 4);
+        memcpy(&weight, record+8, 8);
+
+        // nodes are saved after their parent
+        if(parent>=nid)
+        {
+            std::cerr << "Vocabulary loading failure: This is not a correct binary file!" << endl;
+            m_words.clear();
+            m_nodes.clear();
+            releaseMapping();
+            return false;
+        }
+
+        Node& node = m_nodes[nid];
+        node.id = nid;
+        node.parent = parent;
+        node.weight = weight;
+        node.descriptor = cv::Mat(1, F::L, CV_8U, (void*)(record+16));
+        m_nodes[parent].children.push_back(nid);
+
+        if(isLeaf>0)
+        {
+            node.word_id = m_words.size();
+            m_words.push_back(&node);
+        }
+    }
+
+    createFlatTree();
+
+    return true;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+bool TemplatedVocabulary<TDescriptor,F>::isBinaryFile(const std::string &filename)
+{
+    ifstream f(filename.c_str(), ios_base::in | ios_base::binary);
+    if(!f.is_open())
+        return false;
+
+    char magic[8];
+    f.read(magic, sizeof(magic));
+    return f.gcount()==(std::streamsize)sizeof(magic) &&
+        memcmp(magic, s_binary_magic, sizeof(magic))==0;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::releaseMapping()
+{
+    if(m_mapped)
+    {
+        // the flattened tree may point into the mapping
+        m_flat_nodes.clear();
+        m_flat_descriptors.clear();
+        m_flat_data = NULL;
+        m_flat_stride = 0;
+        m_flat_words = 0;
+
+        munmap(m_mapped, m_mapped_size);
+        m_mapped = NULL;
+        m_mapped_size = 0;
+    }
+}
+
+// --------------------------------------------------------------------------
+
 template<class TDescriptor, class F>
 void TemplatedVocabulary<TDescriptor,F>::save(const std::string &filename) const
 {
@@ -1575,6 +2026,7 @@ void TemplatedVocabulary<TDescriptor,F>::load(const cv::FileStorage &fs,
 {
   m_words.clear();
   m_nodes.clear();
+  releaseMapping();
   
   cv::FileNode fvoc = fs[name];
   
@@ -1619,6 +2071,8 @@ void TemplatedVocabulary<TDescriptor,F>::load(const cv::FileStorage &fs,
     m_nodes[nid].word_id = wid;
     m_words[wid] = &m_nodes[nid];
   }
+
+  createFlatTree();
 }
 
 // --------------------------------------------------------------------------
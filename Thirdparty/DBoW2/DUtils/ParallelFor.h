@@ -0,0 +1,78 @@
+/*
+ * File: ParallelFor.h
+ * Project: DUtils library
+ * Description: runs independent jobs on several threads
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#pragma once
+#ifndef __D_PARALLEL_FOR__
+#define __D_PARALLEL_FOR__
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace DUtils {
+
+/**
+ * Calls f(i) for every i in [0, n). The calling thread works together with
+ * up to hardware_concurrency()-1 helper threads, which are joined before
+ * returning. Indices are handed out in blocks of grain consecutive
+ * jobs, so that jobs of uneven cost are balanced.
+ * The helper threads are started and joined on every call, which costs some
+ * tens of microseconds per thread. No more threads than blocks are started,
+ * and no more than one thread per min_jobs jobs: loops of cheap jobs must
+ * set min_jobs so that each thread gets enough work to pay for its start.
+ * Below 2*min_jobs jobs, f is called from the calling thread only.
+ * @param n number of jobs
+ * @param f function called with the index of each job. It must be safe to
+ *   call it concurrently for different indices
+ * @param grain number of consecutive jobs taken at a time
+ * @param min_jobs minimum number of jobs per thread
+ */
+template<class F>
+void ParallelFor(size_t n, const F &f, size_t grain = 1, size_t min_jobs = 1)
+{
+  if(n == 0) return;
+  if(grain == 0) grain = 1;
+  if(min_jobs == 0) min_jobs = 1;
+
+  const size_t nblocks = (n + grain - 1) / grain;
+  const size_t nthreads = std::min(std::min(nblocks, std::max(n / min_jobs, (size_t)1)),
+    (size_t)std::max(std::thread::hardware_concurrency(), 1u));
+
+  if(nthreads == 1)
+  {
+    for(size_t i = 0; i < n; ++i)
+      f(i);
+    return;
+  }
+
+  std::atomic<size_t> next(0);
+  auto worker = [&]()
+  {
+    for(size_t b = next++; b < nblocks; b = next++)
+    {
+      const size_t i1 = std::min(n, (b + 1) * grain);
+      for(size_t i = b * grain; i < i1; ++i)
+        f(i);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  threads.reserve(nthreads - 1);
+  for(size_t t = 1; t < nthreads; ++t)
+    threads.push_back(std::thread(worker));
+  worker();
+
+  for(size_t t = 0; t < threads.size(); ++t)
+    threads[t].join();
+}
+
+} // namespace DUtils
+
+#endif
+
@@ -141,12 +141,33 @@ namespace g2o {
 
       virtual void multiplyHessian(double* dest, const double* src) const { _Hpp->multiplySymmetricUpperTriangle(dest, src);}
 
+      //! threads of the Schur complement and of the back substitution, 0 to use all the hardware threads
+      int numThreads() const { return _numThreads;}
+      void setNumThreads(int numThreads) { _numThreads = numThreads;}
+
+      //! systems with less landmarks are reduced by a single thread
+      int minLandmarksForThreads() const { return _minLandmarksForThreads;}
+      void setMinLandmarksForThreads(int minLandmarks) { _minLandmarksForThreads = minLandmarks;}
+
     protected:
       void resize(int* blockPoseIndices, int numPoseBlocks, 
           int* blockLandmarkIndices, int numLandmarkBlocks, int totalDim);
 
       void deallocate();
 
+      //! threads used to process the landmarks
+      int landmarkThreads() const;
+
+      /**
+       * marginalize the landmarks [begin, end) into the Schur complement. The
+       * contributions are accumulated into _Hschur and _coefficients if
+       * threadId < 0, otherwise into the buffers of the thread.
+       */
+      void schurComplementLandmarks(int begin, int end, int threadId);
+
+      //! solve for the landmarks [begin, end) given the pose increments
+      void backSubstituteLandmarks(int begin, int end);
+
       SparseBlockMatrix<PoseMatrixType>* _Hpp;
       SparseBlockMatrix<LandmarkMatrixType>* _Hll;
       SparseBlockMatrix<PoseLandmarkMatrixType>* _Hpl;
@@ -162,10 +183,6 @@ namespace g2o {
       std::vector<PoseVectorType, Eigen::aligned_allocator<PoseVectorType> > _diagonalBackupPose;
       std::vector<LandmarkVectorType, Eigen::aligned_allocator<LandmarkVectorType> > _diagonalBackupLandmark;
 
-#    ifdef G2O_OPENMP
-      std::vector<OpenMPMutex> _coefficientsMutex;
-#    endif
-
       bool _doSchur;
 
       double* _coefficients;
@@ -173,6 +190,13 @@ namespace g2o {
 
       int _numPoses, _numLandmarks;
       int _sizePoses, _sizeLandmarks;
+
+      int _numThreads;
+      int _minLandmarksForThreads;
+      std::vector<int> _schurColumnStart;             ///< index of the first block of each column of _HschurTransposedCCS
+      std::vector<size_t> _schurBlockOffsets;         ///< offset of each block of _HschurTransposedCCS in a thread buffer
+      std::vector<std::vector<double> > _threadSchur;         ///< per-thread accumulation of the Schur blocks
+      std::vector<std::vector<double> > _threadCoefficients;  ///< per-thread accumulation of the coefficients
   };
 
 
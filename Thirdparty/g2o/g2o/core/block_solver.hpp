@@ -26,8 +26,11 @@
 
 #include "sparse_optimizer.h"
 #include <Eigen/LU>
+#include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <iomanip>
+#include <thread>
 
 #include "../stuff/timeutil.h"
 #include "../stuff/macros.h"
@@ -38,6 +41,21 @@ namespace g2o {
 using namespace std;
 using namespace Eigen;
 
+namespace internal {
+  //! run f(threadId) on numThreads threads, the calling thread included
+  template <typename F>
+  inline void runThreads(int numThreads, F f)
+  {
+    std::vector<std::thread> threads;
+    threads.reserve(numThreads - 1);
+    for (int i = 1; i < numThreads; ++i)
+      threads.push_back(std::thread(f, i));
+    f(0);
+    for (size_t i = 0; i < threads.size(); ++i)
+      threads[i].join();
+  }
+}
+
 template <typename Traits>
 BlockSolver<Traits>::BlockSolver(LinearSolverType* linearSolver) :
   BlockSolverBase(),
@@ -59,6 +77,8 @@ BlockSolver<Traits>::BlockSolver(LinearSolverType* linearSolver) :
   _sizePoses=0;
   _sizeLandmarks=0;
   _doSchur=true;
+  _numThreads=0;
+  _minLandmarksForThreads=500;
 }
 
 template <typename Traits>
@@ -85,9 +105,6 @@ void BlockSolver<Traits>::resize(int* blockPoseIndices, int numPoseBlocks,
     _Hpl=new PoseLandmarkHessianType(blockPoseIndices, blockLandmarkIndices, numPoseBlocks, numLandmarkBlocks);
     _HplCCS = new SparseBlockMatrixCCS<PoseLandmarkMatrixType>(_Hpl->rowBlockIndices(), _Hpl->colBlockIndices());
     _HschurTransposedCCS = new SparseBlockMatrixCCS<PoseMatrixType>(_Hschur->colBlockIndices(), _Hschur->rowBlockIndices());
-#ifdef G2O_OPENMP
-    _coefficientsMutex.resize(numPoseBlocks);
-#endif
   }
 }
 
@@ -291,6 +308,22 @@ bool BlockSolver<Traits>::buildStructure(bool zeroBlocks)
   delete schurMatrixLookup;
   _Hschur->fillSparseBlockMatrixCCSTransposed(*_HschurTransposedCCS);
 
+  // layout of the Schur blocks in the per-thread accumulation buffers
+  const int numColumns = static_cast<int>(_HschurTransposedCCS->blockCols().size());
+  _schurColumnStart.resize(numColumns + 1);
+  _schurBlockOffsets.clear();
+  size_t offset = 0;
+  for (int i1 = 0; i1 < numColumns; ++i1) {
+    _schurColumnStart[i1] = _schurBlockOffsets.size();
+    const typename SparseBlockMatrixCCS<PoseMatrixType>::SparseColumn& column = _HschurTransposedCCS->blockCols()[i1];
+    for (size_t k = 0; k < column.size(); ++k) {
+      _schurBlockOffsets.push_back(offset);
+      offset += column[k].block->size();
+    }
+  }
+  _schurColumnStart[numColumns] = _schurBlockOffsets.size();
+  _schurBlockOffsets.push_back(offset);
+
   return true;
 }
 
@@ -375,10 +408,100 @@ bool BlockSolver<Traits>::solve(){
 
   //_DInvSchur->clear();
   memset (_coefficients, 0, _sizePoses*sizeof(double));
-# ifdef G2O_OPENMP
-# pragma omp parallel for default (shared) schedule(dynamic, 10)
-# endif
-  for (int landmarkIndex = 0; landmarkIndex < static_cast<int>(_Hll->blockCols().size()); ++landmarkIndex) {
+  const int numLandmarks = static_cast<int>(_Hll->blockCols().size());
+  const int numThreads = landmarkThreads();
+  if (numThreads <= 1) {
+    schurComplementLandmarks(0, numLandmarks, -1);
+  } else {
+    // the landmarks are handed out in chunks, each thread accumulates into its own buffers
+    const int chunk = 64;
+    std::atomic<int> nextLandmark(0);
+    _threadSchur.resize(numThreads);
+    _threadCoefficients.resize(numThreads);
+    internal::runThreads(numThreads, [&](int threadId) {
+      _threadSchur[threadId].assign(_schurBlockOffsets.back(), 0.);
+      _threadCoefficients[threadId].assign(_sizePoses, 0.);
+      for (int begin = nextLandmark.fetch_add(chunk); begin < numLandmarks; begin = nextLandmark.fetch_add(chunk))
+        schurComplementLandmarks(begin, std::min(begin + chunk, numLandmarks), threadId);
+    });
+
+    // sum the buffers, the block rows of the Schur complement are distributed among the threads
+    const int numColumns = static_cast<int>(_HschurTransposedCCS->blockCols().size());
+    internal::runThreads(numThreads, [&](int threadId) {
+      for (int i1 = threadId; i1 < numColumns; i1 += numThreads) {
+        const typename SparseBlockMatrixCCS<PoseMatrixType>::SparseColumn& column = _HschurTransposedCCS->blockCols()[i1];
+        for (size_t k = 0; k < column.size(); ++k) {
+          PoseMatrixType* Hi1i2 = column[k].block;
+          const size_t offset = _schurBlockOffsets[_schurColumnStart[i1] + k];
+          for (int j = 0; j < numThreads; ++j)
+            *Hi1i2 += Eigen::Map<const PoseMatrixType>(&_threadSchur[j][offset], Hi1i2->rows(), Hi1i2->cols());
+        }
+        const int base = _Hschur->rowBaseOfBlock(i1);
+        const int rows = _Hschur->rowsOfBlock(i1);
+        for (int j = 0; j < numThreads; ++j)
+          for (int r = base; r < base + rows; ++r)
+            _coefficients[r] += _threadCoefficients[j][r];
+      }
+    });
+  }
+  //cerr << "Solve [marginalize] = " <<  get_monotonic_time()-t << endl;
+
+  // _bschur = _b for calling solver, and not touching _b
+  memcpy(_bschur, _b, _sizePoses * sizeof(double));
+  for (int i=0; i<_sizePoses; ++i){
+    _bschur[i]-=_coefficients[i];
+  }
+
+  G2OBatchStatistics* globalStats = G2OBatchStatistics::globalStats();
+  if (globalStats){
+    globalStats->timeSchurComplement = get_monotonic_time() - t;
+  }
+
+  t=get_monotonic_time();
+  bool solvedPoses = _linearSolver->solve(*_Hschur, _x, _bschur);
+  if (globalStats) {
+    globalStats->timeLinearSolver = get_monotonic_time() - t;
+    globalStats->hessianPoseDimension = _Hpp->cols();
+    globalStats->hessianLandmarkDimension = _Hll->cols();
+    globalStats->hessianDimension = globalStats->hessianPoseDimension + globalStats->hessianLandmarkDimension;
+  }
+  //cerr << "Solve [decompose and solve] = " <<  get_monotonic_time()-t << endl;
+
+  if (! solvedPoses)
+    return false;
+
+  // _x contains the solution for the poses, now applying it to the landmarks to get the new part of the
+  // solution; each landmark only depends on the poses, so they are independent
+  if (numThreads <= 1) {
+    backSubstituteLandmarks(0, numLandmarks);
+  } else {
+    internal::runThreads(numThreads, [&](int threadId) {
+      const int begin = static_cast<int>(static_cast<long>(numLandmarks) * threadId / numThreads);
+      const int end = static_cast<int>(static_cast<long>(numLandmarks) * (threadId + 1) / numThreads);
+      backSubstituteLandmarks(begin, end);
+    });
+  }
+  //cerr << "Solve [landmark delta] = " <<  get_monotonic_time()-t << endl;
+
+  return true;
+}
+
+template <typename Traits>
+int BlockSolver<Traits>::landmarkThreads() const
+{
+  if (static_cast<int>(_Hll->blockCols().size()) < _minLandmarksForThreads)
+    return 1;
+  const int numThreads = _numThreads > 0 ? _numThreads : static_cast<int>(std::thread::hardware_concurrency());
+  return std::max(numThreads, 1);
+}
+
+template <typename Traits>
+void BlockSolver<Traits>::schurComplementLandmarks(int begin, int end, int threadId)
+{
+  double* coefficients = threadId < 0 ? _coefficients : &_threadCoefficients[threadId][0];
+  double* schurBuffer = threadId < 0 ? 0 : _threadSchur[threadId].data();
+
+  for (int landmarkIndex = begin; landmarkIndex < end; ++landmarkIndex) {
     const typename SparseBlockMatrix<LandmarkMatrixType>::IntBlockMap& marginalizeColumn = _Hll->blockCols()[landmarkIndex];
     assert(marginalizeColumn.size() == 1 && "more than one block in _Hll column");
 
@@ -406,14 +529,12 @@ bool BlockSolver<Traits>::solve(){
 
       PoseLandmarkMatrixType BDinv = (*Bi)*(Dinv);
       assert(_HplCCS->rowBaseOfBlock(i1) < _sizePoses && "Index out of bounds");
-      typename PoseVectorType::MapType Bb(&_coefficients[_HplCCS->rowBaseOfBlock(i1)], Bi->rows());
-#    ifdef G2O_OPENMP
-      ScopedOpenMPMutex mutexLock(&_coefficientsMutex[i1]);
-#    endif
+      typename PoseVectorType::MapType Bb(&coefficients[_HplCCS->rowBaseOfBlock(i1)], Bi->rows());
       Bb.noalias() += (*Bi)*db;
 
       assert(i1 >= 0 && i1 < static_cast<int>(_HschurTransposedCCS->blockCols().size()) && "Index out of bounds");
-      typename SparseBlockMatrixCCS<PoseMatrixType>::SparseColumn::iterator targetColumnIt = _HschurTransposedCCS->blockCols()[i1].begin();
+      typename SparseBlockMatrixCCS<PoseMatrixType>::SparseColumn::iterator targetColumnBegin = _HschurTransposedCCS->blockCols()[i1].begin();
+      typename SparseBlockMatrixCCS<PoseMatrixType>::SparseColumn::iterator targetColumnIt = targetColumnBegin;
 
       typename SparseBlockMatrixCCS<PoseLandmarkMatrixType>::RowBlock aux(i1, 0);
       typename SparseBlockMatrixCCS<PoseLandmarkMatrixType>::SparseColumn::const_iterator it_inner = lower_bound(landmarkColumn.begin(), landmarkColumn.end(), aux);
@@ -426,63 +547,38 @@ bool BlockSolver<Traits>::solve(){
         assert(targetColumnIt != _HschurTransposedCCS->blockCols()[i1].end() && targetColumnIt->row == i2 && "invalid iterator, something wrong with the matrix structure");
         PoseMatrixType* Hi1i2 = targetColumnIt->block;//_Hschur->block(i1,i2);
         assert(Hi1i2);
-        (*Hi1i2).noalias() -= BDinv*Bj->transpose();
+        if (schurBuffer) {
+          const size_t offset = _schurBlockOffsets[_schurColumnStart[i1] + (targetColumnIt - targetColumnBegin)];
+          Eigen::Map<PoseMatrixType> buffered(schurBuffer + offset, Hi1i2->rows(), Hi1i2->cols());
+          buffered.noalias() -= BDinv*Bj->transpose();
+        } else {
+          (*Hi1i2).noalias() -= BDinv*Bj->transpose();
+        }
       }
     }
   }
-  //cerr << "Solve [marginalize] = " <<  get_monotonic_time()-t << endl;
+}
 
-  // _bschur = _b for calling solver, and not touching _b
-  memcpy(_bschur, _b, _sizePoses * sizeof(double));
-  for (int i=0; i<_sizePoses; ++i){
-    _bschur[i]-=_coefficients[i];
-  }
+template <typename Traits>
+void BlockSolver<Traits>::backSubstituteLandmarks(int begin, int end)
+{
+  // xl = Dinv * (bl - Bt * xp)
+  for (int landmarkIndex = begin; landmarkIndex < end; ++landmarkIndex) {
+    const LandmarkMatrixType& Dinv = _DInvSchur->diagonal()[landmarkIndex];
+    const int base = _sizePoses + _Hll->rowBaseOfBlock(landmarkIndex);
+    LandmarkVectorType cl = typename LandmarkVectorType::ConstMapType(_b + base, Dinv.rows());
 
-  G2OBatchStatistics* globalStats = G2OBatchStatistics::globalStats();
-  if (globalStats){
-    globalStats->timeSchurComplement = get_monotonic_time() - t;
-  }
+    const typename SparseBlockMatrixCCS<PoseLandmarkMatrixType>::SparseColumn& landmarkColumn = _HplCCS->blockCols()[landmarkIndex];
+    for (typename SparseBlockMatrixCCS<PoseLandmarkMatrixType>::SparseColumn::const_iterator it = landmarkColumn.begin();
+        it != landmarkColumn.end(); ++it) {
+      const PoseLandmarkMatrixType* Bi = it->block;
+      typename PoseVectorType::ConstMapType xp(_x + _HplCCS->rowBaseOfBlock(it->row), Bi->rows());
+      cl.noalias() -= Bi->transpose() * xp;
+    }
 
-  t=get_monotonic_time();
-  bool solvedPoses = _linearSolver->solve(*_Hschur, _x, _bschur);
-  if (globalStats) {
-    globalStats->timeLinearSolver = get_monotonic_time() - t;
-    globalStats->hessianPoseDimension = _Hpp->cols();
-    globalStats->hessianLandmarkDimension = _Hll->cols();
-    globalStats->hessianDimension = globalStats->hessianPoseDimension + globalStats->hessianLandmarkDimension;
+    typename LandmarkVectorType::MapType xl(_x + base, Dinv.rows());
+    xl.noalias() = Dinv * cl;
   }
-  //cerr << "Solve [decompose and solve] = " <<  get_monotonic_time()-t << endl;
-
-  if (! solvedPoses)
-    return false;
-
-  // _x contains the solution for the poses, now applying it to the landmarks to get the new part of the
-  // solution;
-  double* xp = _x;
-  double* cp = _coefficients;
-
-  double* xl=_x+_sizePoses;
-  double* cl=_coefficients + _sizePoses;
-  double* bl=_b+_sizePoses;
-
-  // cp = -xp
-  for (int i=0; i<_sizePoses; ++i)
-    cp[i]=-xp[i];
-
-  // cl = bl
-  memcpy(cl,bl,_sizeLandmarks*sizeof(double));
-
-  // cl = bl - Bt * xp
-  //Bt->multiply(cl, cp);
-  _HplCCS->rightMultiply(cl, cp);
-
-  // xl = Dinv * cl
-  memset(xl,0, _sizeLandmarks*sizeof(double));
-  _DInvSchur->multiply(xl,cl);
-  //_DInvSchur->rightMultiply(xl,cl);
-  //cerr << "Solve [landmark delta] = " <<  get_monotonic_time()-t << endl;
-
-  return true;
 }
 
 
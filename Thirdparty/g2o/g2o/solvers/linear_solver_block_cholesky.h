@@ -0,0 +1,431 @@
+// g2o - General Graph Optimization
+// Copyright (C) 2011 R. Kuemmerle, G. Grisetti, W. Burgard
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef G2O_LINEAR_SOLVER_BLOCK_CHOLESKY_H
+#define G2O_LINEAR_SOLVER_BLOCK_CHOLESKY_H
+
+#include <Eigen/Core>
+#include <Eigen/Cholesky>
+#include <Eigen/Sparse>
+#include <Eigen/SparseCholesky>
+
+#include "../core/linear_solver.h"
+#include "../core/batch_stats.h"
+#include "../stuff/timeutil.h"
+
+#include "../core/eigen_types.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace g2o {
+
+/**
+ * \brief linear solver which uses a block (supernodal) sparse Cholesky factorization
+ *
+ * The supernodes are the blocks of the matrix (e.g. the camera poses of the reduced
+ * system), so all the numeric work is done on small dense matrices. The blocks are
+ * ordered with AMD, and the block columns of L are computed left-looking in the order
+ * of the elimination tree: a column only depends on its descendants, so independent
+ * subtrees are factorized by several threads at the same time.
+ */
+template <typename MatrixType>
+class LinearSolverBlockCholesky: public LinearSolver<MatrixType>
+{
+  public:
+    typedef Eigen::SparseMatrix<double, Eigen::ColMajor> SparseMatrix;
+    typedef Eigen::Triplet<double> Triplet;
+
+    LinearSolverBlockCholesky() :
+      LinearSolver<MatrixType>(),
+      _init(true), _numThreads(0), _minBlocksForThreads(64)
+    {
+    }
+
+    virtual ~LinearSolverBlockCholesky()
+    {
+    }
+
+    virtual bool init()
+    {
+      _init = true;
+      return true;
+    }
+
+    bool solve(const SparseBlockMatrix<MatrixType>& A, double* x, double* b)
+    {
+      if (_init) // compute the ordering and the structure of L once
+        computeSymbolicDecomposition(A);
+      _init = false;
+
+      double t=get_monotonic_time();
+      if (! factorize(A))
+        return false;
+
+      solveFactorized(A, x, b);
+
+      G2OBatchStatistics* globalStats = G2OBatchStatistics::globalStats();
+      if (globalStats) {
+        globalStats->timeNumericDecomposition = get_monotonic_time() - t;
+        globalStats->choleskyNNZ = _nnz;
+      }
+
+      return true;
+    }
+
+    //! number of threads of the numeric factorization, 0 to use all the hardware threads
+    int numThreads() const { return _numThreads;}
+    void setNumThreads(int numThreads) { _numThreads = numThreads;}
+
+    //! smaller systems (in blocks) are factorized by a single thread
+    int minBlocksForThreads() const { return _minBlocksForThreads;}
+    void setMinBlocksForThreads(int minBlocks) { _minBlocksForThreads = minBlocks;}
+
+  protected:
+    //! block column of L (in the permuted order), the first block is the diagonal one
+    struct Column
+    {
+      std::vector<int> rows;
+      std::vector<Eigen::MatrixXd> blocks;
+      //! columns k < j with L(j,k) != 0 and the position of row j in column k
+      std::vector<std::pair<int, int> > updates;
+      int parent;
+    };
+
+    //! where a block of the upper triangle of A goes in L
+    struct Target
+    {
+      int column;
+      int slot;
+      bool transpose;
+    };
+
+    bool _init;
+    int _numThreads;
+    int _minBlocksForThreads;
+    size_t _nnz;
+
+    std::vector<int> _perm;   // original block -> permuted block
+    std::vector<int> _iperm;  // permuted block -> original block
+    std::vector<Column> _columns;
+    std::vector<Target> _targets;
+    std::vector<int> _numChildren;
+    Eigen::VectorXd _work;
+
+    void computeSymbolicDecomposition(const SparseBlockMatrix<MatrixType>& A)
+    {
+      double t=get_monotonic_time();
+      const int n = A.blockCols().size();
+
+      // AMD ordering of the block structure
+      Eigen::PermutationMatrix<Eigen::Dynamic,Eigen::Dynamic> blockP;
+      {
+        std::vector<Triplet> triplets;
+        for (size_t c = 0; c < A.blockCols().size(); ++c){
+          const typename SparseBlockMatrix<MatrixType>::IntBlockMap& column = A.blockCols()[c];
+          for (typename SparseBlockMatrix<MatrixType>::IntBlockMap::const_iterator it = column.begin(); it != column.end(); ++it) {
+            const int& r = it->first;
+            if (r > static_cast<int>(c)) // only upper triangle
+              break;
+            triplets.push_back(Triplet(r, c, 0.));
+          }
+        }
+        SparseMatrix auxBlockMatrix(n, n);
+        auxBlockMatrix.setFromTriplets(triplets.begin(), triplets.end());
+        SparseMatrix C(n, n);
+        C = auxBlockMatrix.selfadjointView<Eigen::Upper>();
+        Eigen::internal::minimum_degree_ordering(C, blockP);
+      }
+
+      _iperm.resize(n);
+      _perm.resize(n);
+      for (int i = 0; i < n; ++i) {
+        _iperm[i] = blockP.indices()(i);
+        _perm[_iperm[i]] = i;
+      }
+
+      // lower triangular pattern of the permuted matrix, and where each block of A goes
+      std::vector<std::vector<int> > lowerA(n);
+      std::vector<std::pair<int, int> > positions; // (column, row) in L of each block of A
+      for (size_t c = 0; c < A.blockCols().size(); ++c){
+        const typename SparseBlockMatrix<MatrixType>::IntBlockMap& column = A.blockCols()[c];
+        for (typename SparseBlockMatrix<MatrixType>::IntBlockMap::const_iterator it = column.begin(); it != column.end(); ++it) {
+          const int& r = it->first;
+          if (r > static_cast<int>(c))
+            break;
+          const int pr = _perm[r];
+          const int pc = _perm[c];
+          positions.push_back(std::make_pair(std::min(pr, pc), std::max(pr, pc)));
+          if (pr != pc)
+            lowerA[std::min(pr, pc)].push_back(std::max(pr, pc));
+        }
+      }
+
+      // column structure of L and elimination tree:
+      // struct(j) = {j} U struct(A_j) U (struct(c) \ {c} for each child c)
+      _columns.clear();
+      _columns.resize(n);
+      std::vector<std::vector<int> > children(n);
+      for (int j = 0; j < n; ++j) {
+        std::vector<int> rows = lowerA[j];
+        rows.push_back(j);
+        for (size_t ci = 0; ci < children[j].size(); ++ci) {
+          const std::vector<int>& childRows = _columns[children[j][ci]].rows;
+          rows.insert(rows.end(), childRows.begin() + 1, childRows.end());
+        }
+        std::sort(rows.begin(), rows.end());
+        rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+
+        Column& col = _columns[j];
+        col.rows.swap(rows);
+        col.parent = col.rows.size() > 1 ? col.rows[1] : -1;
+        if (col.parent >= 0)
+          children[col.parent].push_back(j);
+      }
+
+      // row structure of L, dense blocks and number of non zeros
+      _nnz = 0;
+      _numChildren.assign(n, 0);
+      for (int k = 0; k < n; ++k) {
+        Column& col = _columns[k];
+        const int colDim = A.colsOfBlock(_iperm[k]);
+        col.blocks.resize(col.rows.size());
+        for (size_t p = 0; p < col.rows.size(); ++p) {
+          const int rowDim = A.colsOfBlock(_iperm[col.rows[p]]);
+          col.blocks[p].resize(rowDim, colDim);
+          _nnz += p == 0 ? (colDim * (colDim + 1)) / 2 : rowDim * colDim;
+          if (p > 0)
+            _columns[col.rows[p]].updates.push_back(std::make_pair(k, static_cast<int>(p)));
+        }
+        if (col.parent >= 0)
+          _numChildren[col.parent]++;
+      }
+
+      // slot of every block of A in L
+      _targets.resize(positions.size());
+      for (size_t i = 0; i < positions.size(); ++i) {
+        const Column& col = _columns[positions[i].first];
+        Target& target = _targets[i];
+        target.column = positions[i].first;
+        target.slot = std::lower_bound(col.rows.begin(), col.rows.end(), positions[i].second) - col.rows.begin();
+        target.transpose = false;
+      }
+      {
+        // the blocks of A above the diagonal of the permuted matrix are stored transposed
+        size_t i = 0;
+        for (size_t c = 0; c < A.blockCols().size(); ++c){
+          const typename SparseBlockMatrix<MatrixType>::IntBlockMap& column = A.blockCols()[c];
+          for (typename SparseBlockMatrix<MatrixType>::IntBlockMap::const_iterator it = column.begin(); it != column.end(); ++it) {
+            const int& r = it->first;
+            if (r > static_cast<int>(c))
+              break;
+            _targets[i++].transpose = _perm[r] < _perm[c];
+          }
+        }
+      }
+
+      G2OBatchStatistics* globalStats = G2OBatchStatistics::globalStats();
+      if (globalStats)
+        globalStats->timeSymbolicDecomposition = get_monotonic_time() - t;
+    }
+
+    //! copy A into the blocks of L (the fill-in is set to zero)
+    void fillBlocks(const SparseBlockMatrix<MatrixType>& A)
+    {
+      for (size_t j = 0; j < _columns.size(); ++j)
+        for (size_t p = 0; p < _columns[j].blocks.size(); ++p)
+          _columns[j].blocks[p].setZero();
+
+      size_t i = 0;
+      for (size_t c = 0; c < A.blockCols().size(); ++c){
+        const typename SparseBlockMatrix<MatrixType>::IntBlockMap& column = A.blockCols()[c];
+        for (typename SparseBlockMatrix<MatrixType>::IntBlockMap::const_iterator it = column.begin(); it != column.end(); ++it) {
+          if (it->first > static_cast<int>(c))
+            break;
+          const Target& target = _targets[i++];
+          Eigen::MatrixXd& dest = _columns[target.column].blocks[target.slot];
+          if (target.transpose)
+            dest = it->second->transpose();
+          else
+            dest = *it->second;
+        }
+      }
+    }
+
+    //! left-looking computation of the block column j of L
+    bool factorizeColumn(int j)
+    {
+      Column& col = _columns[j];
+
+      for (size_t u = 0; u < col.updates.size(); ++u) {
+        const Column& colK = _columns[col.updates[u].first];
+        const int p = col.updates[u].second;
+        const Eigen::MatrixXd& Ljk = colK.blocks[p];
+
+        // L(i,j) -= L(i,k) * L(j,k)^T for the rows i >= j of column k
+        size_t q = 0;
+        for (size_t t = p; t < colK.rows.size(); ++t) {
+          const int i = colK.rows[t];
+          while (col.rows[q] != i)
+            ++q;
+          col.blocks[q].noalias() -= colK.blocks[t] * Ljk.transpose();
+        }
+      }
+
+      Eigen::LLT<Eigen::MatrixXd> llt(col.blocks[0]);
+      if (llt.info() != Eigen::Success)
+        return false;
+      col.blocks[0] = llt.matrixL();
+
+      const Eigen::MatrixXd Ljjt = col.blocks[0].transpose();
+      for (size_t q = 1; q < col.blocks.size(); ++q)
+        Ljjt.triangularView<Eigen::Upper>().solveInPlace<Eigen::OnTheRight>(col.blocks[q]);
+
+      return true;
+    }
+
+    bool factorize(const SparseBlockMatrix<MatrixType>& A)
+    {
+      fillBlocks(A);
+
+      const int n = _columns.size();
+      int numThreads = _numThreads > 0 ? _numThreads : static_cast<int>(std::thread::hardware_concurrency());
+      if (n < _minBlocksForThreads)
+        numThreads = 1;
+
+      if (numThreads <= 1) {
+        // the natural order is a topological order of the elimination tree
+        for (int j = 0; j < n; ++j)
+          if (! factorizeColumn(j))
+            return false;
+        return true;
+      }
+
+      // a column is ready when all its children in the elimination tree are done
+      std::vector<int> pending = _numChildren;
+      std::deque<int> ready;
+      for (int j = 0; j < n; ++j)
+        if (pending[j] == 0)
+          ready.push_back(j);
+
+      std::mutex mutex;
+      std::condition_variable cv;
+      int numDone = 0;
+      bool failed = false;
+
+      auto worker = [&]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+          while (ready.empty() && numDone < n && ! failed)
+            cv.wait(lock);
+          if (numDone == n || failed)
+            return;
+
+          const int j = ready.front();
+          ready.pop_front();
+          lock.unlock();
+          const bool ok = factorizeColumn(j);
+          lock.lock();
+
+          numDone++;
+          if (! ok) {
+            failed = true;
+            cv.notify_all();
+            return;
+          }
+          const int parent = _columns[j].parent;
+          if (parent >= 0 && --pending[parent] == 0) {
+            ready.push_back(parent);
+            cv.notify_one();
+          }
+          if (numDone == n)
+            cv.notify_all();
+        }
+      };
+
+      std::vector<std::thread> threads;
+      threads.reserve(numThreads - 1);
+      for (int i = 1; i < numThreads; ++i)
+        threads.push_back(std::thread(worker));
+      worker();
+      for (size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+
+      return ! failed;
+    }
+
+    //! solve L L^T x = b with the factor of the permuted matrix
+    void solveFactorized(const SparseBlockMatrix<MatrixType>& A, double* x, double* b)
+    {
+      const int n = _columns.size();
+
+      // offsets of the blocks in the permuted vector
+      std::vector<int> offsets(n + 1, 0);
+      for (int j = 0; j < n; ++j)
+        offsets[j + 1] = offsets[j] + A.colsOfBlock(_iperm[j]);
+
+      _work.resize(offsets[n]);
+      for (int j = 0; j < n; ++j) {
+        const int o = _iperm[j];
+        _work.segment(offsets[j], A.colsOfBlock(o)) = VectorXD::ConstMapType(b + A.colBaseOfBlock(o), A.colsOfBlock(o));
+      }
+
+      // forward substitution L y = b
+      for (int j = 0; j < n; ++j) {
+        const Column& col = _columns[j];
+        const int dim = offsets[j + 1] - offsets[j];
+        col.blocks[0].template triangularView<Eigen::Lower>().solveInPlace(_work.segment(offsets[j], dim));
+        for (size_t q = 1; q < col.rows.size(); ++q) {
+          const int i = col.rows[q];
+          _work.segment(offsets[i], offsets[i + 1] - offsets[i]).noalias() -= col.blocks[q] * _work.segment(offsets[j], dim);
+        }
+      }
+
+      // backward substitution L^T x = y
+      for (int j = n - 1; j >= 0; --j) {
+        const Column& col = _columns[j];
+        const int dim = offsets[j + 1] - offsets[j];
+        for (size_t q = 1; q < col.rows.size(); ++q) {
+          const int i = col.rows[q];
+          _work.segment(offsets[j], dim).noalias() -= col.blocks[q].transpose() * _work.segment(offsets[i], offsets[i + 1] - offsets[i]);
+        }
+        col.blocks[0].transpose().template triangularView<Eigen::Upper>().solveInPlace(_work.segment(offsets[j], dim));
+      }
+
+      for (int j = 0; j < n; ++j) {
+        const int o = _iperm[j];
+        VectorXD::MapType(x + A.colBaseOfBlock(o), A.colsOfBlock(o)) = _work.segment(offsets[j], A.colsOfBlock(o));
+      }
+    }
+};
+
+} // end namespace
+
+#endif
@@ -36,6 +36,7 @@
 
 #include "../core/eigen_types.h"
 
+#include <algorithm>
 #include <iostream>
 #include <vector>
 
@@ -46,6 +47,11 @@ namespace g2o {
  *
  * Has no dependencies except Eigen. Hence, should compile almost everywhere
  * without to much issues. Performance should be similar to CSparse, I guess.
+ *
+ * The symbolic decomposition survives a re-initialization of the optimizer
+ * if the block pattern of the new system is equal to, or a subset of, the
+ * pattern it was computed for. Blocks missing from the new system (e.g.
+ * after disabling outlier edges) are kept in the structure as zeros.
  */
 template <typename MatrixType>
 class LinearSolverEigen: public LinearSolver<MatrixType>
@@ -77,7 +83,8 @@ class LinearSolverEigen: public LinearSolver<MatrixType>
   public:
     LinearSolverEigen() :
       LinearSolver<MatrixType>(),
-      _init(true), _blockOrdering(false), _writeDebug(false)
+      _init(true), _blockOrdering(false), _writeDebug(false),
+      _reuseSymbolic(true), _hasPattern(false), _zeroFill(false)
     {
     }
 
@@ -93,11 +100,29 @@ class LinearSolverEigen: public LinearSolver<MatrixType>
 
     bool solve(const SparseBlockMatrix<MatrixType>& A, double* x, double* b)
     {
-      if (_init)
-        _sparseMatrix.resize(A.rows(), A.cols());
-      fillSparseMatrix(A, !_init);
-      if (_init) // compute the symbolic composition once
-        computeSymbolicDecomposition(A);
+      if (_init) {
+        const PatternChange change = _reuseSymbolic ? comparePattern(A) : PATTERN_CHANGED;
+        if (change == PATTERN_CHANGED) {
+          // compute the symbolic composition once
+          _sparseMatrix.resize(A.rows(), A.cols());
+          fillSparseMatrix(A, false);
+          computeSymbolicDecomposition(A);
+          storePattern(A);
+          _zeroFill = false;
+        } else if (change == PATTERN_SUBSET) {
+          // keep ordering and elimination tree, the missing blocks become zeros
+          computeValueOffsets(A);
+          _zeroFill = true;
+          fillSparseMatrixSubset(A);
+        } else {
+          _zeroFill = false;
+          fillSparseMatrix(A, true);
+        }
+      } else if (_zeroFill) {
+        fillSparseMatrixSubset(A);
+      } else {
+        fillSparseMatrix(A, true);
+      }
       _init = false;
 
       double t=get_monotonic_time();
@@ -131,13 +156,97 @@ class LinearSolverEigen: public LinearSolver<MatrixType>
     virtual bool writeDebug() const { return _writeDebug;}
     virtual void setWriteDebug(bool b) { _writeDebug = b;}
 
+    //! keep the symbolic decomposition across init() if the pattern allows it
+    bool reuseSymbolic() const { return _reuseSymbolic;}
+    void setReuseSymbolic(bool reuseSymbolic) { _reuseSymbolic = reuseSymbolic; _hasPattern = false;}
+
   protected:
+    enum PatternChange {
+      PATTERN_EQUAL,    ///< same blocks as the analyzed matrix
+      PATTERN_SUBSET,   ///< some blocks of the analyzed matrix are missing
+      PATTERN_CHANGED   ///< new symbolic decomposition required
+    };
+
     bool _init;
     bool _blockOrdering;
     bool _writeDebug;
+    bool _reuseSymbolic;
+    bool _hasPattern;
+    bool _zeroFill;
     SparseMatrix _sparseMatrix;
     CholeskyDecomposition _cholesky;
 
+    std::vector<int> _patternBlockSizes;           ///< dimension of each block column of the analyzed matrix
+    std::vector<std::vector<int> > _patternRows;   ///< block rows of each column (upper triangle)
+    std::vector<int> _valueOffsets;                ///< start of each scalar column of A in the values of _sparseMatrix
+
+    PatternChange comparePattern(const SparseBlockMatrix<MatrixType>& A) const
+    {
+      if (! _hasPattern || A.blockCols().size() != _patternRows.size() || A.rows() != _sparseMatrix.rows())
+        return PATTERN_CHANGED;
+
+      bool equal = true;
+      for (size_t c = 0; c < A.blockCols().size(); ++c) {
+        if (A.colsOfBlock(c) != _patternBlockSizes[c])
+          return PATTERN_CHANGED;
+        const typename SparseBlockMatrix<MatrixType>::IntBlockMap& column = A.blockCols()[c];
+        const std::vector<int>& rows = _patternRows[c];
+        size_t q = 0;
+        for (typename SparseBlockMatrix<MatrixType>::IntBlockMap::const_iterator it = column.begin(); it != column.end(); ++it) {
+          if (it->first > static_cast<int>(c))
+            break;
+          while (q < rows.size() && rows[q] < it->first) {
+            ++q;
+            equal = false;
+          }
+          if (q == rows.size() || rows[q] != it->first)
+            return PATTERN_CHANGED;
+          ++q;
+        }
+        if (q != rows.size())
+          equal = false;
+      }
+      return equal ? PATTERN_EQUAL : PATTERN_SUBSET;
+    }
+
+    void storePattern(const SparseBlockMatrix<MatrixType>& A)
+    {
+      _patternBlockSizes.resize(A.blockCols().size());
+      _patternRows.resize(A.blockCols().size());
+      for (size_t c = 0; c < A.blockCols().size(); ++c) {
+        _patternBlockSizes[c] = A.colsOfBlock(c);
+        _patternRows[c].clear();
+        const typename SparseBlockMatrix<MatrixType>::IntBlockMap& column = A.blockCols()[c];
+        for (typename SparseBlockMatrix<MatrixType>::IntBlockMap::const_iterator it = column.begin(); it != column.end(); ++it) {
+          if (it->first > static_cast<int>(c))
+            break;
+          _patternRows[c].push_back(it->first);
+        }
+      }
+      _hasPattern = true;
+    }
+
+    //! locate the blocks of A in the (larger) pattern of _sparseMatrix
+    void computeValueOffsets(const SparseBlockMatrix<MatrixType>& A)
+    {
+      const int* outer = _sparseMatrix.outerIndexPtr();
+      const int* inner = _sparseMatrix.innerIndexPtr();
+      _valueOffsets.clear();
+      for (size_t c = 0; c < A.blockCols().size(); ++c) {
+        const int colBaseOfBlock = A.colBaseOfBlock(c);
+        const typename SparseBlockMatrix<MatrixType>::IntBlockMap& column = A.blockCols()[c];
+        for (typename SparseBlockMatrix<MatrixType>::IntBlockMap::const_iterator it = column.begin(); it != column.end(); ++it) {
+          if (it->first > static_cast<int>(c))
+            break;
+          const int rowBaseOfBlock = A.rowBaseOfBlock(it->first);
+          for (int cc = 0; cc < A.colsOfBlock(c); ++cc) {
+            const int col = colBaseOfBlock + cc;
+            _valueOffsets.push_back(std::lower_bound(inner + outer[col], inner + outer[col + 1], rowBaseOfBlock) - inner);
+          }
+        }
+      }
+    }
+
     /**
      * compute the symbolic decompostion of the matrix only once.
      * Since A has the same pattern in all the iterations, we only
@@ -200,6 +309,27 @@ class LinearSolverEigen: public LinearSolver<MatrixType>
         globalStats->timeSymbolicDecomposition = get_monotonic_time() - t;
     }
 
+    //! fill the values of A into the pattern of _sparseMatrix, the blocks not in A are zero
+    void fillSparseMatrixSubset(const SparseBlockMatrix<MatrixType>& A)
+    {
+      double* values = _sparseMatrix.valuePtr();
+      std::fill(values, values + _sparseMatrix.nonZeros(), 0.);
+      size_t idx = 0;
+      for (size_t c = 0; c < A.blockCols().size(); ++c) {
+        const typename SparseBlockMatrix<MatrixType>::IntBlockMap& column = A.blockCols()[c];
+        for (typename SparseBlockMatrix<MatrixType>::IntBlockMap::const_iterator it = column.begin(); it != column.end(); ++it) {
+          if (it->first > static_cast<int>(c))
+            break;
+          const MatrixType& m = *(it->second);
+          const bool diagonal = it->first == static_cast<int>(c);
+          for (int cc = 0; cc < m.cols(); ++cc) {
+            const int n = diagonal ? cc + 1 : m.rows();
+            VectorXD::MapType(values + _valueOffsets[idx++], n) = m.col(cc).head(n);
+          }
+        }
+      }
+    }
+
     void fillSparseMatrix(const SparseBlockMatrix<MatrixType>& A, bool onlyValues)
     {
       if (onlyValues) {
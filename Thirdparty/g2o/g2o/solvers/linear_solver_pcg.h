@@ -0,0 +1,160 @@
+// g2o - General Graph Optimization
+// Copyright (C) 2011 R. Kuemmerle, G. Grisetti, W. Burgard
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef G2O_LINEAR_SOLVER_PCG_H
+#define G2O_LINEAR_SOLVER_PCG_H
+
+#include <Eigen/Core>
+#include <Eigen/Cholesky>
+
+#include "../core/linear_solver.h"
+#include "../core/batch_stats.h"
+#include "../stuff/timeutil.h"
+
+#include "../core/eigen_types.h"
+
+#include <cmath>
+#include <vector>
+
+namespace g2o {
+
+/**
+ * \brief linear solver using conjugate gradients with a block Jacobi preconditioner
+ *
+ * Only products with A are needed, so nothing is factorized and the memory stays
+ * linear in the number of blocks. Meant for large reduced camera systems where an
+ * approximate step is enough. The iterations stop when the preconditioned residual
+ * has been reduced by the given tolerance.
+ */
+template <typename MatrixType>
+class LinearSolverPCG: public LinearSolver<MatrixType>
+{
+  public:
+    LinearSolverPCG() :
+      LinearSolver<MatrixType>(),
+      _tolerance(1e-6), _maxIterations(-1), _iterations(0)
+    {
+    }
+
+    virtual ~LinearSolverPCG()
+    {
+    }
+
+    virtual bool init()
+    {
+      return true;
+    }
+
+    bool solve(const SparseBlockMatrix<MatrixType>& A, double* x, double* b)
+    {
+      double t=get_monotonic_time();
+      const int n = A.cols();
+      const int numBlocks = A.blockCols().size();
+
+      // inverse of the diagonal blocks
+      _invDiagonal.resize(numBlocks);
+      for (int c = 0; c < numBlocks; ++c) {
+        typename SparseBlockMatrix<MatrixType>::IntBlockMap::const_iterator it = A.blockCols()[c].find(c);
+        if (it == A.blockCols()[c].end())
+          return false;
+        Eigen::LLT<Eigen::MatrixXd> llt(*it->second);
+        if (llt.info() != Eigen::Success)
+          return false;
+        _invDiagonal[c] = llt.solve(Eigen::MatrixXd::Identity(it->second->rows(), it->second->cols()));
+      }
+
+      VectorXD::MapType xx(x, n);
+      VectorXD::ConstMapType bb(b, n);
+      xx.setZero();
+
+      Eigen::VectorXd r = bb;
+      Eigen::VectorXd z(n), p(n), Ap(n);
+      applyPreconditioner(A, r, z);
+      p = z;
+      double rz = r.dot(z);
+      const double rz0 = rz;
+
+      const int maxIterations = _maxIterations > 0 ? _maxIterations : n;
+      _iterations = 0;
+      while (_iterations < maxIterations && rz > _tolerance * _tolerance * rz0) {
+        Ap.setZero();
+        double* Apdata = Ap.data();
+        A.multiplySymmetricUpperTriangle(Apdata, p.data());
+
+        const double pAp = p.dot(Ap);
+        if (pAp <= 0) // A is not positive definite in the direction p
+          break;
+
+        const double alpha = rz / pAp;
+        xx += alpha * p;
+        r -= alpha * Ap;
+
+        applyPreconditioner(A, r, z);
+        const double rzNew = r.dot(z);
+        p = z + (rzNew / rz) * p;
+        rz = rzNew;
+        ++_iterations;
+      }
+
+      G2OBatchStatistics* globalStats = G2OBatchStatistics::globalStats();
+      if (globalStats) {
+        globalStats->timeNumericDecomposition = get_monotonic_time() - t;
+        globalStats->iterationsLinearSolver = _iterations;
+      }
+
+      return std::isfinite(xx.squaredNorm());
+    }
+
+    //! relative reduction of the preconditioned residual norm to stop
+    double tolerance() const { return _tolerance;}
+    void setTolerance(double tolerance) { _tolerance = tolerance;}
+
+    //! maximum number of iterations, -1 for the system dimension
+    int maxIterations() const { return _maxIterations;}
+    void setMaxIterations(int maxIterations) { _maxIterations = maxIterations;}
+
+    //! iterations of the last solve
+    int iterations() const { return _iterations;}
+
+  protected:
+    double _tolerance;
+    int _maxIterations;
+    int _iterations;
+    std::vector<Eigen::MatrixXd> _invDiagonal;
+
+    void applyPreconditioner(const SparseBlockMatrix<MatrixType>& A, const Eigen::VectorXd& src, Eigen::VectorXd& dest) const
+    {
+      for (size_t c = 0; c < _invDiagonal.size(); ++c) {
+        const int base = A.colBaseOfBlock(c);
+        const int dim = A.colsOfBlock(c);
+        dest.segment(base, dim).noalias() = _invDiagonal[c] * src.segment(base, dim);
+      }
+    }
+};
+
+} // end namespace
+
+#endif
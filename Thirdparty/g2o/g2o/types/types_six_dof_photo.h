@@ -28,6 +28,34 @@ namespace g2o {
         std::vector< std::vector< Eigen::Vector2f > > gradient;
     };
 
+    // Bilinear interpolation of the image and gradient. Returns false outside the image.
+    inline bool getSubpixValueAndGradient(const imgStr* pImg, const float u, const float v,
+                                          float &value, float &gu, float &gv) {
+        const int x = floor(u);
+        const int y = floor(v);
+
+        if (x < 1 || y < 1 || y + 2 >= (int) pImg->image.size() || x + 2 >= (int) pImg->image[0].size())
+            return false;
+
+        const float dx = u - x;
+        const float dy = v - y;
+        const float w00 = (1.f - dx) * (1.f - dy);
+        const float w01 = dx * (1.f - dy);
+        const float w10 = (1.f - dx) * dy;
+        const float w11 = dx * dy;
+
+        const std::vector<float> &row0 = pImg->image[y];
+        const std::vector<float> &row1 = pImg->image[y + 1];
+        value = w00 * row0[x] + w01 * row0[x + 1] + w10 * row1[x] + w11 * row1[x + 1];
+
+        const std::vector<Eigen::Vector2f> &grow0 = pImg->gradient[y];
+        const std::vector<Eigen::Vector2f> &grow1 = pImg->gradient[y + 1];
+        gu = w00 * grow0[x][0] + w01 * grow0[x + 1][0] + w10 * grow1[x][0] + w11 * grow1[x + 1][0];
+        gv = w00 * grow0[x][1] + w01 * grow0[x + 1][1] + w10 * grow1[x][1] + w11 * grow1[x + 1][1];
+
+        return true;
+    }
+
     class EdgeInverseDepthPatch : public g2o::BaseMultiEdge<9, Vector9D> {
     public:
         EIGEN_MAKE_ALIGNED_OPERATOR_NEW
@@ -43,12 +43,18 @@ public:
     static cv::Mat toCvMat(const Eigen::Matrix<double,4,4> &m);
     static cv::Mat toCvMat(const Eigen::Matrix3d &m);
     static cv::Mat toCvMat(const Eigen::Matrix<double,3,1> &m);
+    static cv::Mat toCvMat(const Eigen::Matrix3f &m);
+    static cv::Mat toCvMat(const Eigen::Matrix<float,3,1> &m);
     static cv::Mat toCvSE3(const Eigen::Matrix<double,3,3> &R, const Eigen::Matrix<double,3,1> &t);
 
     static Eigen::Matrix<double,3,1> toVector3d(const cv::Mat &cvVector);
     static Eigen::Matrix<double,3,1> toVector3d(const cv::Point3f &cvPoint);
     static Eigen::Matrix<double,3,3> toMatrix3d(const cv::Mat &cvMat3);
 
+    // Fixed-size float versions, used in the tracking and mapping hot paths
+    static Eigen::Matrix<float,3,1> toVector3f(const cv::Mat &cvVector);
+    static Eigen::Matrix<float,3,3> toMatrix3f(const cv::Mat &cvMat3);
+
     static std::vector<float> toQuaternion(const cv::Mat &M);
 };
 
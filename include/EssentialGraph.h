@@ -0,0 +1,89 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ESSENTIALGRAPH_H
+#define ESSENTIALGRAPH_H
+
+#include "KeyFrame.h"
+#include "Map.h"
+#include "LoopClosing.h"
+
+#include "Thirdparty/g2o/g2o/core/sparse_optimizer.h"
+#include "Thirdparty/g2o/g2o/types/types_seven_dof_expmap.h"
+
+#include <map>
+#include <set>
+
+namespace ORB_SLAM2
+{
+
+// Essential graph (spanning tree, loop edges and strong covisibility edges) kept alive between loop closures.
+// Keyframes are added to the graph as they appear in the map, but only the region affected by a loop
+// (the keyframes inserted after the loop keyframe and the corrected ones) is relinearized and optimized.
+// Its neighbours take part in the optimization as fixed vertices and the rest of the map is left untouched.
+// The optimization only reads the map, so it can run while Local Mapping inserts keyframes.
+class EssentialGraph
+{
+public:
+
+    EssentialGraph(Map* pMap, const bool bFixScale, const int minFeat=100);
+
+    // Same inputs as Optimizer::OptimizeEssentialGraph, LoopConnections also gives the weight of the new links.
+    // The map is not modified: for each keyframe of the loop region, Corrections holds the Sim3 Swi*Siw that
+    // takes world points from its pose before the loop (NonCorrectedSim3 or its current pose) to the optimized one.
+    void Optimize(KeyFrame* pLoopKF, KeyFrame* pCurKF,
+                  const LoopClosing::KeyFrameAndPose &NonCorrectedSim3,
+                  const LoopClosing::KeyFrameAndPose &CorrectedSim3,
+                  const std::map<KeyFrame*, std::map<KeyFrame*,int> > &LoopConnections,
+                  LoopClosing::KeyFrameAndPose &Corrections);
+
+    // Remove all keyframes (the map has been reset)
+    void Clear();
+
+protected:
+
+    // Add the new keyframes of the map and remove the bad ones
+    void Update();
+
+    g2o::VertexSim3Expmap* GetVertex(KeyFrame* pKF);
+
+    // Pose of the keyframe before the optimization (corrected by the loop if it is in CorrectedSim3)
+    const g2o::Sim3& GetScw(KeyFrame* pKF, const LoopClosing::KeyFrameAndPose &CorrectedSim3,
+                            LoopClosing::KeyFrameAndPose &Scw);
+
+    // Edge between keyframes i and j with measurement Sjw*Swi
+    void AddEdge(KeyFrame* pKFi, KeyFrame* pKFj, const g2o::Sim3 &Siw, const g2o::Sim3 &Sjw,
+                 std::set<std::pair<long unsigned int,long unsigned int> > &sInsertedEdges,
+                 std::set<KeyFrame*> &sInvolvedKFs);
+
+    Map* mpMap;
+
+    bool mbFixScale;
+
+    int mnMinFeat;
+
+    g2o::SparseOptimizer mOptimizer;
+
+    std::map<KeyFrame*,g2o::VertexSim3Expmap*> mmVertices;
+};
+
+} //namespace ORB_SLAM
+
+#endif // ESSENTIALGRAPH_H
@@ -32,6 +32,7 @@
 #include "HighGradientPoint.h"
 
 #include <opencv2/opencv.hpp>
+#include <Eigen/Core>
 
 namespace ORB_SLAM2
 {
@@ -42,6 +43,29 @@ class MapPoint;
 class KeyFrame;
 class HighGradientPoint;
 
+// Structure-of-arrays copy of a set of MapPoints for the batched frustum test.
+// Buffers are kept between frames to avoid reallocations.
+struct MapPointBatch
+{
+    void clear();
+    void push_back(MapPoint* pMP);
+    size_t size() const { return vpMapPoints.size(); }
+
+    std::vector<MapPoint*> vpMapPoints;
+
+    // Input: world position, mean viewing direction and raw scale invariance distances
+    std::vector<float> vX, vY, vZ;
+    std::vector<float> vNx, vNy, vNz;
+    std::vector<float> vMinDist, vMaxDist;
+
+    // Output: visibility mask, projection, distance to the camera, predicted level and viewing cosine
+    std::vector<unsigned char> vbInView;
+    std::vector<float> vU, vV, vUR;
+    std::vector<float> vDist;
+    std::vector<int> vLevel;
+    std::vector<float> vViewCos;
+};
+
 class Frame
 {
 public:
@@ -59,6 +83,10 @@ public:
     // Constructor for Monocular cameras.
     Frame(const cv::Mat &imGray, const double &timeStamp, ORBextractor* extractor,ORBVocabulary* voc, cv::Mat &K, cv::Mat &distCoef, const float &bf, const float &thDepth);
 
+    // Constructor for stereo frames tracked without features (fast tracking mode).
+    // Keypoints are the tracked positions of the given MapPoints. There are no descriptors nor stereo matches.
+    Frame(const std::vector<cv::KeyPoint> &vKeys, const std::vector<MapPoint*> &vpMapPoints, const double &timeStamp, ORBextractor* extractorLeft, ORBextractor* extractorRight, ORBVocabulary* voc, cv::Mat &K, cv::Mat &distCoef, const float &bf, const float &thDepth);
+
     // Extract ORB on the image. 0 for left image and 1 for right image.
     void ExtractORB(int flag, const cv::Mat &im);
 
@@ -81,10 +109,28 @@ public:
         return mRwc.clone();
     }
 
+    // Fixed-size copies of the pose, used in the per-point projection loops.
+    inline const Eigen::Matrix3f &GetRotationEig() const{
+        return mRcwEig;
+    }
+
+    inline const Eigen::Vector3f &GetTranslationEig() const{
+        return mtcwEig;
+    }
+
+    inline const Eigen::Vector3f &GetCameraCenterEig() const{
+        return mOwEig;
+    }
+
     // Check if a MapPoint is in the frustum of the camera
     // and fill variables of the MapPoint to be used by the tracking
     bool isInFrustum(MapPoint* pMP, float viewingCosLimit);
 
+    // Same test as isInFrustum for all points of the batch in one pass.
+    // MapPoint variables are not touched, results are left in the batch output arrays.
+    // Returns the number of points in the frustum.
+    int isInFrustum(MapPointBatch &batch, float viewingCosLimit) const;
+
     // Compute the cell of a keypoint (return false if outside the grid)
     bool PosInGrid(const cv::KeyPoint &kp, int &posX, int &posY);
 
@@ -212,6 +258,11 @@ private:
     cv::Mat mtcw;
     cv::Mat mRwc;
     cv::Mat mOw; //==mtwc
+
+    // Same as above, stored without heap allocation
+    Eigen::Matrix3f mRcwEig;
+    Eigen::Vector3f mtcwEig;
+    Eigen::Vector3f mOwEig;
 };
 
 }// namespace ORB_SLAM
@@ -33,6 +33,7 @@
 #include "Thirdparty/g2o/g2o/types/types_six_dof_photo.h"
 
 #include <mutex>
+#include <Eigen/Core>
 
 
 namespace ORB_SLAM2
@@ -46,6 +47,8 @@ class HighGradientPoint;
 
 class KeyFrame
 {
+    friend class MapSerializer;
+
 public:
     KeyFrame(Frame &F, Map* pMap, KeyFrameDatabase* pKFDB);
 
@@ -57,6 +60,9 @@ public:
     cv::Mat GetStereoCenter();
     cv::Mat GetRotation();
     cv::Mat GetTranslation();
+    Eigen::Matrix3f GetRotationEig();
+    Eigen::Vector3f GetTranslationEig();
+    Eigen::Vector3f GetCameraCenterEig();
 
     // Bag of Words Representation
     void ComputeBoW();
@@ -144,14 +150,6 @@ public:
     long unsigned int mnBALocalForKF;
     long unsigned int mnBAFixedForKF;
 
-    // Variables used by the keyframe database
-    long unsigned int mnLoopQuery;
-    int mnLoopWords;
-    float mLoopScore;
-    long unsigned int mnRelocQuery;
-    int mnRelocWords;
-    float mRelocScore;
-
     // Variables used by loop closing
     cv::Mat mTcwGBA;
     cv::Mat mTcwBefGBA;
@@ -212,6 +210,11 @@ protected:
 
     cv::Mat Cw; // Stereo middel point. Only for visualization
 
+    // Fixed-size copies of the pose for the projection loops
+    Eigen::Matrix3f RcwEig;
+    Eigen::Vector3f tcwEig;
+    Eigen::Vector3f OwEig;
+
     // MapPoints associated to keypoints
     std::vector<MapPoint*> mvpMapPoints;
 
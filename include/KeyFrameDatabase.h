@@ -24,12 +24,12 @@
 #include <vector>
 #include <list>
 #include <set>
+#include <map>
 
 #include "KeyFrame.h"
 #include "Frame.h"
 #include "ORBVocabulary.h"
-
-#include<mutex>
+#include "SharedMutex.h"
 
 
 namespace ORB_SLAM2
@@ -59,14 +59,38 @@ public:
 
 protected:
 
+  // Entry of a posting list: slot of the keyframe and weight of the word in it
+  struct Posting
+  {
+      int nSlot;
+      float weight;
+  };
+
+  // Scans the posting lists of the query words and scores every keyframe that shares
+  // enough words with the query. Keyframes in spExcluded are skipped. All counters live
+  // in arrays local to the call, so the keyframes are never written.
+  void ScoreKeyFramesSharingWords(const DBoW2::BowVector &vBowVec, const std::set<KeyFrame*> &spExcluded,
+                                  std::vector<std::pair<float,KeyFrame*> > &vScoreAndMatch);
+
+  // Accumulates the scores of the best covisible keyframes of each match and returns
+  // those whose accumulated score is higher than 0.75 of the best one
+  std::vector<KeyFrame*> AccumulateByCovisibility(const std::vector<std::pair<float,KeyFrame*> > &vScoreAndMatch,
+                                                  const std::map<KeyFrame*,float> &mScores, float bestAccScore);
+
   // Associated vocabulary
   const ORBVocabulary* mpVoc;
 
-  // Inverted file
-  std::vector<list<KeyFrame*> > mvInvertedFile;
+  // Inverted file, one contiguous posting list per word
+  std::vector<std::vector<Posting> > mvInvertedFile;
+
+  // Keyframe of each slot (NULL if free), free slots and slot of each keyframe
+  std::vector<KeyFrame*> mvpKeyFrames;
+  std::vector<int> mvFreeSlots;
+  std::map<KeyFrame*,int> mmKeyFrameSlots;
 
-  // Mutex
-  std::mutex mMutex;
+  // Queries only read the index and hold the mutex in shared mode, so relocalization
+  // and loop detection can run at the same time. add/erase/clear take it exclusively.
+  SharedMutex mMutex;
 };
 
 } //namespace ORB_SLAM
@@ -0,0 +1,93 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef KEYFRAMEQUEUE_H
+#define KEYFRAMEQUEUE_H
+
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+
+namespace ORB_SLAM2
+{
+
+class KeyFrame;
+
+// Bounded single-producer/single-consumer ring buffer of keyframes.
+// Push is only called by the producer thread, Pop and Clear by the consumer thread
+// (or by another thread while the consumer is stopped). Size can be called from any thread.
+// When the queue is full Push does not insert the keyframe: the producer decides what to do with it.
+class KeyFrameQueue
+{
+public:
+    KeyFrameQueue(size_t capacity);
+
+    // Returns false if the queue is full (the keyframe is counted as dropped)
+    bool Push(KeyFrame* pKF);
+
+    // Returns NULL if the queue is empty
+    KeyFrame* Pop();
+
+    // Remove all keyframes, which are returned
+    std::vector<KeyFrame*> Clear();
+
+    size_t Size() const;
+    bool Empty() const;
+    bool Full() const;
+    size_t Capacity() const {
+        return mnSlots-1;
+    }
+
+    // Statistics: keyframes inserted, dropped, maximum depth and waiting time (ms)
+    size_t Pushed() const { return mnPushed; }
+    size_t Dropped() const { return mnDropped; }
+    size_t MaxDepth() const { return mnMaxDepth; }
+    double MeanWaitTime() const;
+    double MaxWaitTime() const;
+
+protected:
+
+    typedef std::chrono::steady_clock Clock;
+
+    struct Slot {
+        KeyFrame* pKF;
+        Clock::time_point tPush;
+    };
+
+    // One slot is kept empty to distinguish a full queue from an empty one
+    const size_t mnSlots;
+    std::vector<Slot> mvSlots;
+
+    // Next slot to read (consumer) and to write (producer)
+    std::atomic<size_t> mnHead;
+    std::atomic<size_t> mnTail;
+
+    std::atomic<size_t> mnPushed;
+    std::atomic<size_t> mnDropped;
+    std::atomic<size_t> mnMaxDepth;
+    std::atomic<size_t> mnPopped;
+    std::atomic<long long> mnWaitMicros;
+    std::atomic<long long> mnMaxWaitMicros;
+};
+
+} //namespace ORB_SLAM
+
+#endif // KEYFRAMEQUEUE_H
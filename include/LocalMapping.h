@@ -26,8 +26,10 @@
 #include "LoopClosing.h"
 #include "Tracking.h"
 #include "KeyFrameDatabase.h"
+#include "KeyFrameQueue.h"
 
 #include <mutex>
+#include <condition_variable>
 
 
 namespace ORB_SLAM2
@@ -36,11 +38,12 @@ namespace ORB_SLAM2
 class Tracking;
 class LoopClosing;
 class Map;
+class ORBmatcher;
 
 class LocalMapping
 {
 public:
-    LocalMapping(Map* pMap, const float bMonocular);
+    LocalMapping(Map* pMap, const float bMonocular, const int nQueueCapacity=5);
 
     void SetLoopCloser(LoopClosing* pLoopCloser);
 
@@ -57,6 +60,8 @@ public:
     bool Stop();
     void Release();
     bool isStopped();
+    // Block until Local Mapping has effectively stopped (or finished)
+    void WaitUntilStopped();
     bool stopRequested();
     bool AcceptKeyFrames();
     void SetAcceptKeyFrames(bool flag);
@@ -68,19 +73,67 @@ public:
     bool isFinished();
 
     int KeyframesInQueue(){
-        unique_lock<std::mutex> lock(mMutexNewKFs);
-        return mlNewKeyFrames.size();
+        return mNewKeyFrames.Size();
+    }
+
+    // Tracking must not create keyframes while the queue is full
+    bool KeyframeQueueFull(){
+        return mNewKeyFrames.Full();
+    }
+
+    const KeyFrameQueue& GetKeyFrameQueue() const {
+        return mNewKeyFrames;
+    }
+
+    // Defers the deletion of any image pyramid until every acquirer has called ReleasePyramidKeyFrames.
+    void AcquirePyramids();
+    void ReleasePyramidKeyFrames();
+
+    // Photometric BA over the keyframes that keep their pyramids, requested by Loop Closing after a
+    // loop correction while this thread is stopped. It runs here one window at a time when no keyframe waits.
+    void RequestPhotometricRefinement();
+    void SetPhotometricRefinement(const bool bActive){
+        unique_lock<std::mutex> lock(mMutexRefinement);
+        mbPhotometricRefinement = bActive;
     }
 
 protected:
 
     bool CheckNewKeyFrames();
     void ProcessNewKeyFrame();
+
+    // The thread sleeps until a keyframe arrives or a stop/reset/finish is requested
+    void WakeUp();
+    void WaitForEvent();
+    bool mbWakeUp;
+    std::mutex mMutexWakeUp;
+    std::condition_variable mcvWakeUp;
     void CreateNewMapPoints();
 
+    // New MapPoint triangulated from a match between the current keyframe and a neighbor
+    struct TriangulatedMatch
+    {
+        Eigen::Vector3f x3D;
+        size_t idx1;
+        size_t idx2;
+    };
+
+    void TriangulateMatches(ORBmatcher &matcher, KeyFrame* pKF2, std::vector<TriangulatedMatch> &vTriangulated);
+
     void MapPointCulling();
     void SearchInNeighbors();
 
+    // Search of duplicated MapPoints of SearchInNeighbors: project pvpMapPoints in pKF
+    struct FuseJob
+    {
+        KeyFrame* pKF;
+        const std::vector<MapPoint*>* pvpMapPoints;
+    };
+    typedef std::vector<std::pair<MapPoint*,size_t> > FuseMatches;
+
+    // Run the jobs in parallel, the matches of each job are returned in vMatches
+    void RunFuseJobs(const std::vector<FuseJob> &vJobs, std::vector<FuseMatches> &vMatches);
+
     void KeyFrameCulling();
 
     cv::Mat ComputeF12(KeyFrame* &pKF1, KeyFrame* &pKF2);
@@ -92,6 +145,7 @@ protected:
     void ResetIfRequested();
     bool mbResetRequested;
     std::mutex mMutexReset;
+    std::condition_variable mcvReset;
 
     bool CheckFinish();
     void SetFinish();
@@ -104,7 +158,8 @@ protected:
     LoopClosing* mpLoopCloser;
     Tracking* mpTracker;
 
-    std::list<KeyFrame*> mlNewKeyFrames;
+    // Tracking is the producer, Local Mapping the consumer
+    KeyFrameQueue mNewKeyFrames;
 
     KeyFrame* mpCurrentKeyFrame;
 
@@ -118,12 +173,33 @@ protected:
     bool mbStopRequested;
     bool mbNotStop;
     std::mutex mMutexStop;
+    std::condition_variable mcvStopped;
 
     bool mbAcceptKeyFrames;
     std::mutex mMutexAccept;
 
     std::list<KeyFrame*> pbaKeyFrames;
     std::list<HighGradientPoint*> hgMap;
+
+    // Image pyramids kept after the photometric BA window for the global photometric refinement
+    void RetainPyramids(KeyFrame* pKF);
+    void ReleasePyramids(KeyFrame* pKF);
+    void ReleaseRetainedPyramids();
+    static void DeletePyramids(KeyFrame* pKF);
+    std::list<KeyFrame*> mlpPyramidKeyFrames;
+    std::list<KeyFrame*> mlpPyramidsToRelease;
+    int mnMaxPyramidKeyFrames;
+    int mnPyramidsAcquired;
+    std::mutex mMutexPyramids;
+
+    // Runs the next window of the refinement, from the newest keyframes to the oldest. Returns false
+    // if there is nothing to do. The window is interrupted through mbAbortBA and run again later.
+    // The keyframes newer than mnRefinementLastKFId have already been refined.
+    bool RefinePhotometricWindow();
+    bool mbPhotometricRefinement;
+    bool mbRefinementPending;
+    long unsigned int mnRefinementLastKFId;
+    std::mutex mMutexRefinement;
 };
 
 } //namespace ORB_SLAM
@@ -28,9 +28,12 @@
 #include "Tracking.h"
 
 #include "KeyFrameDatabase.h"
+#include "KeyFrameQueue.h"
 
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include "Thirdparty/g2o/g2o/types/types_seven_dof_expmap.h"
 
 namespace ORB_SLAM2
@@ -39,6 +42,7 @@ namespace ORB_SLAM2
 class Tracking;
 class LocalMapping;
 class KeyFrameDatabase;
+class EssentialGraph;
 
 
 class LoopClosing
@@ -51,12 +55,16 @@ public:
 
 public:
 
-    LoopClosing(Map* pMap, KeyFrameDatabase* pDB, ORBVocabulary* pVoc,const bool bFixScale);
+    LoopClosing(Map* pMap, KeyFrameDatabase* pDB, ORBVocabulary* pVoc,const bool bFixScale, const int nQueueCapacity=20);
 
     void SetTracker(Tracking* pTracker);
 
     void SetLocalMapper(LocalMapping* pLocalMapper);
 
+    // Global BA after each loop, off by default. Maps with more than nPartitionSize keyframes
+    // are optimized by covisibility partitions (the default size is kept if nPartitionSize<=0).
+    void SetGlobalBundleAdjustment(const bool bActive, const int nPartitionSize);
+
     // Main function
     void Run();
 
@@ -80,6 +88,10 @@ public:
 
     bool isFinished();
 
+    const KeyFrameQueue& GetKeyFrameQueue() const {
+        return mLoopKeyFrameQueue;
+    }
+
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
 protected:
@@ -90,13 +102,38 @@ protected:
 
     bool ComputeSim3();
 
-    void SearchAndFuse(const KeyFrameAndPose &CorrectedPosesMap);
+    // Worker of ComputeSim3 for the candidate pKF at index nCandidate. Gives up when a candidate with a lower index
+    // has been verified.
+    bool VerifyCandidate(KeyFrame* pKF, const int nCandidate, g2o::Sim3 &gScm, std::vector<MapPoint*> &vpMapPointMatches,
+                         const std::atomic<int> &nMatchedCandidate);
+
+    // The MapPoints of the loop side matched in each keyframe of CorrectedPosesMap (keypoint index or -1).
+    // The map is not modified, the duplications are fused by ApplyLoopCorrection.
+    void SearchAndFuse(const KeyFrameAndPose &CorrectedPosesMap, std::vector<std::vector<int> > &vvLoopMatches);
+
+    // Covisibility links, with their weights, that the fusion will create between both sides of the loop
+    void ComputeLoopConnections(const KeyFrameAndPose &CorrectedPosesMap, const std::vector<std::vector<int> > &vvLoopMatches,
+                                std::map<KeyFrame*, std::map<KeyFrame*,int> > &LoopConnections);
+
+    // Critical section of the loop correction: poses and MapPoints are corrected with the essential graph
+    // corrections and the duplications are fused. Keyframes inserted meanwhile take the correction of their parent.
+    void ApplyLoopCorrection(const KeyFrameAndPose &CorrectedPosesMap, const std::vector<std::vector<int> > &vvLoopMatches,
+                             KeyFrameAndPose &Corrections);
 
     void CorrectLoop();
 
+    // The thread sleeps until a keyframe arrives, Local Mapping becomes idle during a refinement,
+    // or a reset/finish is requested
+    void WakeUp();
+    void WaitForEvent();
+    bool mbWakeUp;
+    std::mutex mMutexWakeUp;
+    std::condition_variable mcvWakeUp;
+
     void ResetIfRequested();
     bool mbResetRequested;
     std::mutex mMutexReset;
+    std::condition_variable mcvReset;
 
     bool CheckFinish();
     void SetFinish();
@@ -112,9 +149,8 @@ protected:
 
     LocalMapping *mpLocalMapper;
 
-    std::list<KeyFrame*> mlpLoopKeyFrameQueue;
-
-    std::mutex mMutexLoopQueue;
+    // Local Mapping is the producer, Loop Closing the consumer
+    KeyFrameQueue mLoopKeyFrameQueue;
 
     // Loop detector parameters
     float mnCovisibilityConsistencyTh;
@@ -133,15 +169,22 @@ protected:
     long unsigned int mLastLoopKFid;
 
     // Variables related to Global Bundle Adjustment
+    bool mbGlobalBA;
     bool mbRunningGBA;
     bool mbFinishedGBA;
     bool mbStopGBA;
     std::mutex mMutexGBA;
     std::thread* mpThreadGBA;
 
+    // Maps with more keyframes are optimized by covisibility partitions of this size
+    int mnGBAPartitionSize;
+
     // Fix scale in the stereo/RGB-D case
     bool mbFixScale;
 
+    // Essential graph kept between loops, only the region of each loop is optimized
+    EssentialGraph* mpEssentialGraph;
+
 
     bool mnFullBAIdx;
 };
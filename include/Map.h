@@ -47,6 +47,8 @@ public:
     void SetReferenceMapPoints(const std::vector<MapPoint*> &vpMPs);
     void InformNewBigChange();
     int GetLastBigChangeIdx();
+    void InformNewLocalMapChange();
+    int GetLastLocalMapChangeIdx();
 
     std::vector<KeyFrame*> GetAllKeyFrames();
     std::vector<MapPoint*> GetAllMapPoints();
@@ -77,6 +79,9 @@ protected:
     // Index related to a big change in the map (loop closure, global BA)
     int mnBigChangeIdx;
 
+    // Index related to a change in the covisibility or points of the local map (local mapping)
+    int mnLocalMapChangeIdx;
+
     std::mutex mMutexMap;
 };
 
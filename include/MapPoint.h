@@ -26,6 +26,7 @@
 #include"Map.h"
 
 #include<opencv2/core/core.hpp>
+#include<Eigen/Core>
 #include<mutex>
 
 namespace ORB_SLAM2
@@ -38,6 +39,8 @@ class Frame;
 
 class MapPoint
 {
+    friend class MapSerializer;
+
 public:
     MapPoint(const cv::Mat &Pos, KeyFrame* pRefKF, Map* pMap);
     MapPoint(const cv::Mat &Pos,  Map* pMap, Frame* pFrame, const int &idxF);
@@ -48,6 +51,10 @@ public:
     cv::Mat GetNormal();
     KeyFrame* GetReferenceKeyFrame();
 
+    // Same as GetWorldPos/GetNormal, without allocating a cv::Mat
+    Eigen::Vector3f GetWorldPosEig();
+    Eigen::Vector3f GetNormalEig();
+
     std::map<KeyFrame*,size_t> GetObservations();
     int Observations();
 
@@ -78,6 +85,9 @@ public:
 
     float GetMinDistanceInvariance();
     float GetMaxDistanceInvariance();
+
+    // Position, normal and scale invariance distances read under a single lock.
+    void GetFrustumData(Eigen::Vector3f &Pos, Eigen::Vector3f &Normal, float &minDistance, float &maxDistance);
     int PredictScale(const float &currentDist, KeyFrame*pKF);
     int PredictScale(const float &currentDist, Frame* pF);
 
@@ -123,9 +133,22 @@ protected:
      // Mean viewing direction
      cv::Mat mNormalVector;
 
+     // Fixed-size copies of mWorldPos and mNormalVector, kept in sync under mMutexPos
+     Eigen::Vector3f mWorldPosEig;
+     Eigen::Vector3f mNormalVectorEig;
+
      // Best descriptor to fast matching
      cv::Mat mDescriptor;
 
+     // Observations used to select mDescriptor (the nMaxDescriptorObs of the most recent keyframes)
+     // and their pairwise descriptor distances. Updated incrementally by ComputeDistinctiveDescriptors.
+     static const size_t nMaxDescriptorObs;
+     std::vector<KeyFrame*> mvpDescKFs;
+     std::vector<size_t> mvDescIdx;
+     std::vector<std::vector<unsigned short> > mvvDescDistances;
+     std::mutex mMutexDescriptors;
+     void EraseDescriptorObservation(const size_t i);
+
      // Reference KeyFrame
      KeyFrame* mpRefKF;
 
@@ -0,0 +1,59 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MAPSERIALIZER_H
+#define MAPSERIALIZER_H
+
+#include <string>
+
+#include "Map.h"
+#include "KeyFrameDatabase.h"
+#include "ORBVocabulary.h"
+
+namespace ORB_SLAM2
+{
+
+class Map;
+class KeyFrameDatabase;
+
+// Saves and loads a Map in a versioned binary format made of tagged chunks:
+// one chunk per keyframe, one per map point, one with the graph links of each keyframe
+// (covisibility, spanning tree and loop edges) and one with the map origins.
+// Chunks are written as they are serialized, so the map is never copied into a single buffer.
+// The file is memory-mapped when loading and records are decoded straight from the mapping.
+// Unknown chunks are skipped, so readers stay compatible with files that add new chunk types.
+class MapSerializer
+{
+public:
+
+    // The map must not be modified while saving (Local Mapping stopped, map update mutex held).
+    static bool Save(const std::string &filename, Map* pMap);
+
+    // Loads the keyframes and map points into an empty map and adds the keyframes to the database.
+    // Bag of Words vectors are recomputed with the given vocabulary. Image pyramids are not stored,
+    // loaded keyframes only take part in the photometric optimization through new keyframes.
+    static bool Load(const std::string &filename, Map* pMap, KeyFrameDatabase* pKFDB, ORBVocabulary* pVoc);
+
+    static const unsigned int nVersion;
+};
+
+} //namespace ORB_SLAM
+
+#endif // MAPSERIALIZER_H
@@ -87,9 +87,16 @@ public:
         return mvInvLevelSigma2;
     }
 
+    // Compute only the photometric pyramid, without features (fast tracking mode).
+    void ComputePhotometricPyramid(cv::InputArray image);
+
     std::vector<cv::Mat> mvImagePyramid;
     std::vector<g2o::imgStr*> photobaImagePyramid;
 
+    // If set, the next feature extraction keeps photobaImagePyramid instead of recomputing it.
+    // Set by the tracker when a rejected fast tracking attempt already computed it for the same image.
+    bool mbReusePhotometricPyramid;
+
 protected:
 
     void ComputePyramid(cv::Mat image);
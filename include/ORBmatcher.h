@@ -23,6 +23,7 @@
 #define ORBMATCHER_H
 
 #include<vector>
+#include<set>
 #include<opencv2/core/core.hpp>
 #include<opencv2/features2d/features2d.hpp>
 
@@ -43,6 +44,9 @@ public:
     // Computes the Hamming distance between two ORB descriptors
     static int DescriptorDistance(const cv::Mat &a, const cv::Mat &b);
 
+    // Same as above, on raw 256 bit descriptors
+    static int DescriptorDistance(const unsigned char *a, const unsigned char *b);
+
     // Search matches between Frame keypoints and projected MapPoints. Returns number of matches
     // Used to track the local map (Tracking)
     int SearchByProjection(Frame &F, const std::vector<MapPoint*> &vpMapPoints, const float th=3);
@@ -79,9 +83,19 @@ public:
     // Project MapPoints into KeyFrame and search for duplicated MapPoints.
     int Fuse(KeyFrame* pKF, const vector<MapPoint *> &vpMapPoints, const float th=3.0);
 
+    // Fuse in two phases. SearchFuse only reads the keyframe and the MapPoints (it can run in parallel)
+    // and returns the matches (MapPoint, keypoint index). ApplyFuse must be called serially,
+    // the MapPoints whose observations changed are inserted in sChanged.
+    int SearchFuse(KeyFrame* pKF, const vector<MapPoint *> &vpMapPoints, vector<pair<MapPoint*,size_t> > &vMatches, const float th=3.0);
+    int ApplyFuse(KeyFrame* pKF, const vector<pair<MapPoint*,size_t> > &vMatches, std::set<MapPoint*> &sChanged);
+
     // Project MapPoints into KeyFrame using a given Sim3 and search for duplicated MapPoints.
     int Fuse(KeyFrame* pKF, cv::Mat Scw, const std::vector<MapPoint*> &vpPoints, float th, vector<MapPoint *> &vpReplacePoint);
 
+    // Search of Fuse with a Sim3, the keyframe and the MapPoints are only read.
+    // vnMatches[i] is the keypoint matched to vpPoints[i] or -1.
+    int SearchFuse(KeyFrame* pKF, cv::Mat Scw, const std::vector<MapPoint*> &vpPoints, float th, std::vector<int> &vnMatches);
+
 public:
 
     static const int TH_LOW;
@@ -35,6 +35,8 @@
 #include "Thirdparty/g2o/g2o/types/types_six_dof_expmap.h"
 #include "Thirdparty/g2o/g2o/core/robust_kernel_impl.h"
 #include "Thirdparty/g2o/g2o/solvers/linear_solver_dense.h"
+#include "Thirdparty/g2o/g2o/solvers/linear_solver_block_cholesky.h"
+#include "Thirdparty/g2o/g2o/solvers/linear_solver_pcg.h"
 #include "Thirdparty/g2o/g2o/types/types_seven_dof_expmap.h"
 #include "Thirdparty/g2o/g2o/types/types_six_dof_photo.h"
 
@@ -46,12 +48,28 @@ class LoopClosing;
 class Optimizer
 {
 public:
+    // Linear solver for the reduced camera system
+    enum eLinearSolver{
+        LINEAR_SOLVER_EIGEN=0,      // Eigen simplicial LDLT
+        LINEAR_SOLVER_CHOLESKY=1,   // Block (supernodal) Cholesky, multi-threaded
+        LINEAR_SOLVER_PCG=2         // Block Jacobi preconditioned conjugate gradient
+    };
+
     void static BundleAdjustment(const std::vector<KeyFrame*> &vpKF, const std::vector<MapPoint*> &vpMP,
                                  int nIterations = 5, bool *pbStopFlag=NULL, const unsigned long nLoopKF=0,
-                                 const bool bRobust = true);
+                                 const bool bRobust = true, const eLinearSolver linearSolver = LINEAR_SOLVER_EIGEN);
     void static GlobalBundleAdjustemnt(Map* pMap, int nIterations=5, bool *pbStopFlag=NULL,
-                                       const unsigned long nLoopKF=0, const bool bRobust = true);
-    void static LocalBundleAdjustment(KeyFrame* pKF, bool *pbStopFlag, Map *pMap);
+                                       const unsigned long nLoopKF=0, const bool bRobust = true,
+                                       const eLinearSolver linearSolver = LINEAR_SOLVER_EIGEN);
+    void static LocalBundleAdjustment(KeyFrame* pKF, bool *pbStopFlag, Map *pMap,
+                                      const eLinearSolver linearSolver = LINEAR_SOLVER_EIGEN);
+    // Global BA of large maps. The keyframes are split in covisibility clusters of at most nMaxKFs,
+    // which are optimized in parallel with the keyframes and points of the other clusters fixed.
+    // This is repeated nRounds times so the separators converge. Only one graph per thread is alive.
+    // Run after a loop on maps larger than LoopClosing.GBAPartitionSize when LoopClosing.GlobalBA is set.
+    void static PartitionedGlobalBundleAdjustment(Map* pMap, const int nMaxKFs, const int nRounds, int nIterations=5,
+                                                  bool *pbStopFlag=NULL, const unsigned long nLoopKF=0, const bool bRobust = true,
+                                                  const eLinearSolver linearSolver = LINEAR_SOLVER_EIGEN);
 
     int static PoseOptimization(Frame* pFrame);
 
@@ -60,7 +78,7 @@ public:
                                        const LoopClosing::KeyFrameAndPose &NonCorrectedSim3,
                                        const LoopClosing::KeyFrameAndPose &CorrectedSim3,
                                        const map<KeyFrame *, set<KeyFrame *> > &LoopConnections,
-                                       const bool &bFixScale);
+                                       const bool &bFixScale, const eLinearSolver linearSolver = LINEAR_SOLVER_EIGEN);
 
     // if bFixScale is true, optimize SE3 (stereo,rgbd), Sim3 otherwise (mono)
     static int OptimizeSim3(KeyFrame* pKF1, KeyFrame* pKF2, std::vector<MapPoint *> &vpMatches1,
@@ -68,11 +86,18 @@ public:
 
 
     // Modification by Michal Nowicki
-    void static LocalPhotometricBundleAdjustment(list<KeyFrame*> &lLocalKeyFrames, std::list<HighGradientPoint*> &lHGMap, bool *pbStopFlag, Map *pMap, int optimizationLvL, bool bDoMoreAtAll);
+    void static LocalPhotometricBundleAdjustment(const list<KeyFrame*> &lPBAKeyFrames, std::list<HighGradientPoint*> &lHGMap, bool *pbStopFlag, Map *pMap, int optimizationLvL, bool bDoMoreAtAll,
+                                                 const eLinearSolver linearSolver = LINEAR_SOLVER_EIGEN);
     static g2o::EdgeInverseDepthPatch* AddEdgeInverseDepthPatch(g2o::SparseOptimizer &optimizer, int featureId, KeyFrame* refKF, KeyFrame* curKF, double thHuber);
 
-    double static OptimizeInitialHGPointDepth(list<KeyFrame*> &lLocalKeyFrames, HighGradientPoint* hgPoint);
-    void static OptimizeInitialHGPointDepth(list<KeyFrame*> &lLocalKeyFrames, vector<HighGradientPoint*> &hgMap);
+    // Coarse-to-fine direct alignment of the frame against the high-gradient points of pRefKF.
+    // The initial guess is the current pose of pFrame, which is updated. Returns the number of inlier points.
+    // The pyramids of pRefKF must be acquired from Local Mapping and the map update mutex held by the caller.
+    int static PoseDirectAlignment(Frame* pFrame, KeyFrame* pRefKF);
+
+    // The optimized inverse depth is returned in invDepth, hgPoint is not updated
+    double static OptimizeInitialHGPointDepth(list<KeyFrame*> &lLocalKeyFrames, HighGradientPoint* hgPoint, double &invDepth);
+    void static OptimizeInitialHGPointDepth(list<KeyFrame*> &lLocalKeyFrames, vector<HighGradientPoint*> &hgMap, Map* pMap);
 
     static std::string ComputeAvgChi2(std::vector<g2o::EdgeInverseDepthPatch*> &edges, vector<MapPoint*> &vpMapPointEdgeStereo, double thHuberSquared);
     static std::string ComputeAvgChi2(std::vector<g2o::EdgeInverseDepthPatch*> &edges, double thHuberSquared);
@@ -0,0 +1,88 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PATCHTRACKER_H
+#define PATCHTRACKER_H
+
+#include<vector>
+
+#include<opencv2/core/core.hpp>
+
+#include"Frame.h"
+#include"MapPoint.h"
+#include"Thirdparty/g2o/g2o/types/types_six_dof_photo.h"
+
+namespace ORB_SLAM2
+{
+
+class Frame;
+class MapPoint;
+
+// Tracks the MapPoints matched in the last frame into a new image with pyramidal
+// Lucas-Kanade on the photometric pyramids (g2o::imgStr). It is used by the fast
+// tracking mode, where ORB features are only extracted when a keyframe is needed.
+class PatchTracker
+{
+public:
+    PatchTracker(int nLevels, int halfPatchSize=4, int nIterations=10);
+
+    // Store the patches around the tracked MapPoints of F.
+    // vPyramid is the photometric pyramid of the left image of F.
+    void SetReference(const Frame &F, const std::vector<g2o::imgStr*> &vPyramid);
+
+    // Track the reference patches in vPyramid. The initial guess of every point is the
+    // projection of its MapPoint with the predicted pose Tcw.
+    // Returns the number of tracked points, whose keypoints and MapPoints are in vKeys, vpMapPoints.
+    int Track(const std::vector<g2o::imgStr*> &vPyramid, const cv::Mat &Tcw,
+              std::vector<cv::KeyPoint> &vKeys, std::vector<MapPoint*> &vpMapPoints);
+
+    void Clear();
+
+    bool empty() const {
+        return mvpMapPoints.empty();
+    }
+
+protected:
+
+    // Refine the position (u,v) at one pyramid level. Returns false if the point was lost.
+    bool TrackAtLevel(const g2o::imgStr* pImg, const float* pPatch, float &u, float &v, float &residual);
+
+    // Levels used for coarse-to-fine tracking (the finest ones of the ORB pyramid)
+    int mnLevels;
+
+    int mnHalfPatchSize;
+    int mnPatchArea;
+    int mnIterations;
+
+    // Reference points
+    std::vector<MapPoint*> mvpMapPoints;
+    std::vector<cv::KeyPoint> mvKeys;
+
+    // Zero-mean reference patches, mnPatchArea values per point and level
+    std::vector<float> mvPatches;
+    std::vector<unsigned char> mvbValidPatch;
+
+    // Intensities and gradients of the current patch
+    std::vector<float> mvBuffer;
+};
+
+} //namespace ORB_SLAM
+
+#endif // PATCHTRACKER_H
@@ -23,7 +23,9 @@
 #define SIM3SOLVER_H
 
 #include <opencv2/opencv.hpp>
+#include <Eigen/Dense>
 #include <vector>
+#include <random>
 
 #include "KeyFrame.h"
 
@@ -51,9 +53,8 @@ public:
 
 protected:
 
-    void ComputeCentroid(cv::Mat &P, cv::Mat &Pr, cv::Mat &C);
-
-    void ComputeSim3(cv::Mat &P1, cv::Mat &P2);
+    // Points of the minimal set are the columns of P1 and P2
+    void ComputeSim3(const Eigen::Matrix3f &P1, const Eigen::Matrix3f &P2);
 
     void CheckInliers();
 
@@ -105,6 +106,9 @@ protected:
     // Indices for random selection
     std::vector<size_t> mvAllIndices;
 
+    // Own generator, seeded with the keyframe ids, so that solvers can run in parallel
+    std::mt19937 mRng;
+
     // Projections
     std::vector<cv::Mat> mvP1im1;
     std::vector<cv::Mat> mvP2im2;
@@ -35,6 +35,7 @@
 #include "KeyFrameDatabase.h"
 #include "ORBVocabulary.h"
 #include "Viewer.h"
+#include "KeyFrameQueue.h"
 
 namespace ORB_SLAM2
 {
@@ -112,9 +113,15 @@ public:
     // See format details at: http://www.cvlibs.net/datasets/kitti/eval_odometry.php
     void SaveTrajectoryKITTI(const string &filename);
 
-    // TODO: Save/Load functions
-    // SaveMap(const string &filename);
-    // LoadMap(const string &filename);
+    // Save the whole map (keyframes, map points, covisibility graph, spanning tree, loop edges
+    // and high gradient points) in binary format. Local Mapping is paused while saving.
+    // It can also be called after Shutdown().
+    bool SaveMap(const string &filename);
+
+    // Replace the current map by a map saved with SaveMap. Call it from the thread that feeds
+    // the images, e.g. before the first frame. Tracking relocalizes in the loaded map, which is
+    // then extended as usual, or only used to localize if ActivateLocalizationMode() is called.
+    bool LoadMap(const string &filename);
 
     // Information from most recent processed frame
     // You can call this right after TrackMonocular (or stereo or RGBD)
@@ -124,6 +131,9 @@ public:
 
 private:
 
+    // Print the statistics of a keyframe queue between threads
+    void PrintQueueStats(const string &name, const KeyFrameQueue &queue);
+
     // Input sensor
     eSensor mSensor;
 
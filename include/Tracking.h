@@ -37,6 +37,7 @@
 #include "Initializer.h"
 #include "MapDrawer.h"
 #include "System.h"
+#include "PatchTracker.h"
 
 #include <mutex>
 
@@ -74,6 +75,9 @@ public:
     // Use this function if you have deactivated local mapping and you only want to localize the camera.
     void InformOnlyTracking(const bool &flag);
 
+    // Use this function after loading a map (in an empty system). Tracking relocalizes in it.
+    void InformMapLoaded();
+
 
 public:
 
@@ -132,18 +136,34 @@ protected:
     void UpdateLastFrame();
     bool TrackWithMotionModel();
 
+    // Direct alignment against the last keyframe. On success the pose is kept in mDirectTcw.
+    bool TrackDirect();
+
     bool Relocalization();
 
+    // Fast tracking mode: track the last frame points with patches, without extracting ORB features.
+    // Returns false if the frame has to be processed by the full pipeline.
+    bool TrackWithPatches(const cv::Mat &imGray, const double &timestamp);
+
     void UpdateLocalMap();
     void UpdateLocalPoints();
     void UpdateLocalKeyFrames();
+    // Votes of the map points of the current frame for the keyframes that observe them
+    void CountKeyFrameVotes(std::map<KeyFrame*,int> &keyframeCounter);
 
     bool TrackLocalMap();
     void SearchLocalPoints();
 
+    // Keyframe insertion criteria, without any effect on Local Mapping
+    bool NewKeyFrameDue();
+    // Same decision, but interrupts the local BA if Local Mapping is busy
     bool NeedNewKeyFrame();
     void CreateNewKeyFrame();
 
+    // Motion model, last frame and trajectory bookkeeping once the current frame is processed.
+    // bTracked is false for the frame that initializes the map and for frames not tracked.
+    void FinishFrame(const bool bTracked);
+
     // In case of performing only localization, this flag is true when there are no matches to
     // points in the map. Still tracking will continue if there are enough matches with temporal points.
     // In that case we are doing visual odometry. The system will try to do relocalization to recover
@@ -169,6 +189,14 @@ protected:
     KeyFrame* mpReferenceKF;
     std::vector<KeyFrame*> mvpLocalKeyFrames;
     std::vector<MapPoint*> mvpLocalMapPoints;
+
+    // Buffers for the batched frustum test of the local map points
+    MapPointBatch mLocalPointsBatch;
+
+    // State of the map when the local map was last built (see UpdateLocalMap)
+    KeyFrame* mpLocalMapRefKF;
+    int mnLocalMapChangeIdx;
+    int mnLocalMapBigChangeIdx;
     
     // System
     System* mpSystem;
@@ -213,6 +241,15 @@ protected:
     //Color order (true RGB, false BGR, ignored if grayscale)
     bool mbRGB;
 
+    // Fast tracking mode (stereo only). ORB features are extracted only for keyframes
+    // or when patch tracking fails.
+    bool mbFastTracking;
+    PatchTracker* mpPatchTracker;
+
+    // Direct photometric alignment as initial pose estimation
+    bool mbDirectTracking;
+    cv::Mat mDirectTcw;
+
     list<MapPoint*> mlpTemporalPoints;
 };
 
@@ -0,0 +1,303 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "EssentialGraph.h"
+
+#include "Converter.h"
+
+#include "Thirdparty/g2o/g2o/core/block_solver.h"
+#include "Thirdparty/g2o/g2o/core/optimization_algorithm_levenberg.h"
+#include "Thirdparty/g2o/g2o/solvers/linear_solver_block_cholesky.h"
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+EssentialGraph::EssentialGraph(Map *pMap, const bool bFixScale, const int minFeat):
+    mpMap(pMap), mbFixScale(bFixScale), mnMinFeat(minFeat)
+{
+    // The Sim3 poses are the blocks of the supernodal factorization
+    g2o::BlockSolver_7_3::LinearSolverType * linearSolver =
+           new g2o::LinearSolverBlockCholesky<g2o::BlockSolver_7_3::PoseMatrixType>();
+    g2o::BlockSolver_7_3 * solver_ptr= new g2o::BlockSolver_7_3(linearSolver);
+    g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
+
+    solver->setUserLambdaInit(1e-16);
+    mOptimizer.setAlgorithm(solver);
+    mOptimizer.setVerbose(false);
+}
+
+void EssentialGraph::Clear()
+{
+    mOptimizer.clear();
+    mmVertices.clear();
+}
+
+void EssentialGraph::Update()
+{
+    const vector<KeyFrame*> vpKFs = mpMap->GetAllKeyFrames();
+
+    set<KeyFrame*> sAliveKFs;
+    for(size_t i=0, iend=vpKFs.size(); i<iend; i++)
+    {
+        KeyFrame* pKF = vpKFs[i];
+        if(pKF->isBad())
+            continue;
+        sAliveKFs.insert(pKF);
+        GetVertex(pKF);
+    }
+
+    // Removing a vertex also deletes its edges
+    for(map<KeyFrame*,g2o::VertexSim3Expmap*>::iterator mit=mmVertices.begin(); mit!=mmVertices.end();)
+    {
+        if(!sAliveKFs.count(mit->first))
+        {
+            mOptimizer.removeVertex(mit->second);
+            mmVertices.erase(mit++);
+        }
+        else
+            mit++;
+    }
+}
+
+g2o::VertexSim3Expmap* EssentialGraph::GetVertex(KeyFrame *pKF)
+{
+    map<KeyFrame*,g2o::VertexSim3Expmap*>::iterator mit = mmVertices.find(pKF);
+    if(mit!=mmVertices.end())
+    {
+        if(mit->second->id()==(int)pKF->mnId)
+            return mit->second;
+
+        // The keyframe of this vertex was deleted and its address reused
+        mOptimizer.removeVertex(mit->second);
+        mmVertices.erase(mit);
+    }
+
+    g2o::HyperGraph::Vertex* pOldVertex = mOptimizer.vertex(pKF->mnId);
+    if(pOldVertex)
+    {
+        for(mit=mmVertices.begin(); mit!=mmVertices.end(); mit++)
+        {
+            if(mit->second==pOldVertex)
+            {
+                mmVertices.erase(mit);
+                break;
+            }
+        }
+        mOptimizer.removeVertex(pOldVertex);
+    }
+
+    g2o::VertexSim3Expmap* VSim3 = new g2o::VertexSim3Expmap();
+    const cv::Mat Tcw = pKF->GetPose();
+    Eigen::Matrix<double,3,3> Rcw = Converter::toMatrix3d(Tcw.rowRange(0,3).colRange(0,3));
+    Eigen::Matrix<double,3,1> tcw = Converter::toVector3d(Tcw.rowRange(0,3).col(3));
+    VSim3->setEstimate(g2o::Sim3(Rcw,tcw,1.0));
+    VSim3->setId(pKF->mnId);
+    VSim3->setMarginalized(false);
+    VSim3->_fix_scale = mbFixScale;
+    mOptimizer.addVertex(VSim3);
+
+    mmVertices[pKF]=VSim3;
+
+    return VSim3;
+}
+
+const g2o::Sim3& EssentialGraph::GetScw(KeyFrame *pKF, const LoopClosing::KeyFrameAndPose &CorrectedSim3,
+                                        LoopClosing::KeyFrameAndPose &Scw)
+{
+    LoopClosing::KeyFrameAndPose::iterator it = Scw.find(pKF);
+    if(it!=Scw.end())
+        return it->second;
+
+    LoopClosing::KeyFrameAndPose::const_iterator itc = CorrectedSim3.find(pKF);
+    if(itc!=CorrectedSim3.end())
+        return Scw[pKF] = itc->second;
+
+    // Local Mapping may be updating the pose, rotation and translation are read at once
+    const cv::Mat Tcw = pKF->GetPose();
+    Eigen::Matrix<double,3,3> Rcw = Converter::toMatrix3d(Tcw.rowRange(0,3).colRange(0,3));
+    Eigen::Matrix<double,3,1> tcw = Converter::toVector3d(Tcw.rowRange(0,3).col(3));
+    return Scw[pKF] = g2o::Sim3(Rcw,tcw,1.0);
+}
+
+void EssentialGraph::AddEdge(KeyFrame *pKFi, KeyFrame *pKFj, const g2o::Sim3 &Siw, const g2o::Sim3 &Sjw,
+                             set<pair<long unsigned int,long unsigned int> > &sInsertedEdges,
+                             set<KeyFrame*> &sInvolvedKFs)
+{
+    g2o::EdgeSim3* e = new g2o::EdgeSim3();
+    e->setVertex(1, mmVertices[pKFj]);
+    e->setVertex(0, mmVertices[pKFi]);
+    e->setMeasurement(Sjw*Siw.inverse());
+    e->information() = Eigen::Matrix<double,7,7>::Identity();
+    mOptimizer.addEdge(e);
+
+    sInsertedEdges.insert(make_pair(min(pKFi->mnId,pKFj->mnId),max(pKFi->mnId,pKFj->mnId)));
+    sInvolvedKFs.insert(pKFi);
+    sInvolvedKFs.insert(pKFj);
+}
+
+void EssentialGraph::Optimize(KeyFrame *pLoopKF, KeyFrame *pCurKF,
+                              const LoopClosing::KeyFrameAndPose &NonCorrectedSim3,
+                              const LoopClosing::KeyFrameAndPose &CorrectedSim3,
+                              const map<KeyFrame *, map<KeyFrame *,int> > &LoopConnections,
+                              LoopClosing::KeyFrameAndPose &Corrections)
+{
+    Update();
+
+    // Loop region: keyframes inserted after the loop keyframe and the ones corrected with the loop
+    set<KeyFrame*> sRegionKFs;
+    for(map<KeyFrame*,g2o::VertexSim3Expmap*>::iterator mit=mmVertices.begin(), mend=mmVertices.end(); mit!=mend; mit++)
+    {
+        if(mit->first->mnId>pLoopKF->mnId)
+            sRegionKFs.insert(mit->first);
+    }
+    for(LoopClosing::KeyFrameAndPose::const_iterator mit=CorrectedSim3.begin(), mend=CorrectedSim3.end(); mit!=mend; mit++)
+    {
+        if(mit->first!=pLoopKF && mmVertices.count(mit->first))
+            sRegionKFs.insert(mit->first);
+    }
+
+    // Relinearize the region: its edges are rebuilt from the poses before the correction
+    for(set<KeyFrame*>::iterator sit=sRegionKFs.begin(), send=sRegionKFs.end(); sit!=send; sit++)
+    {
+        const g2o::HyperGraph::EdgeSet edges = mmVertices[*sit]->edges();
+        for(g2o::HyperGraph::EdgeSet::const_iterator eit=edges.begin(), eend=edges.end(); eit!=eend; eit++)
+            mOptimizer.removeEdge(*eit);
+    }
+
+    LoopClosing::KeyFrameAndPose Scw;
+    set<pair<long unsigned int,long unsigned int> > sInsertedEdges;
+    set<KeyFrame*> sInvolvedKFs;
+
+    // Set Loop edges
+    for(map<KeyFrame *, map<KeyFrame *,int> >::const_iterator mit = LoopConnections.begin(), mend=LoopConnections.end(); mit!=mend; mit++)
+    {
+        KeyFrame* pKF = mit->first;
+        if(!mmVertices.count(pKF))
+            continue;
+
+        const map<KeyFrame*,int> &mConnections = mit->second;
+        const g2o::Sim3 Siw = GetScw(pKF,CorrectedSim3,Scw);
+
+        for(map<KeyFrame*,int>::const_iterator sit=mConnections.begin(), send=mConnections.end(); sit!=send; sit++)
+        {
+            KeyFrame* pKFj = sit->first;
+            if(!mmVertices.count(pKFj))
+                continue;
+            if((pKF!=pCurKF || pKFj!=pLoopKF) && sit->second<mnMinFeat)
+                continue;
+
+            AddEdge(pKF,pKFj,Siw,GetScw(pKFj,CorrectedSim3,Scw),sInsertedEdges,sInvolvedKFs);
+        }
+    }
+
+    // Set normal edges. Edges with another keyframe of the region are added from the newest one.
+    for(set<KeyFrame*>::iterator sit=sRegionKFs.begin(), send=sRegionKFs.end(); sit!=send; sit++)
+    {
+        KeyFrame* pKF = *sit;
+
+        LoopClosing::KeyFrameAndPose::const_iterator iti = NonCorrectedSim3.find(pKF);
+        const g2o::Sim3 Siw = iti!=NonCorrectedSim3.end() ? iti->second : GetScw(pKF,CorrectedSim3,Scw);
+
+        // Spanning tree edges
+        KeyFrame* pParentKF = pKF->GetParent();
+        if(pParentKF && mmVertices.count(pParentKF))
+        {
+            LoopClosing::KeyFrameAndPose::const_iterator itj = NonCorrectedSim3.find(pParentKF);
+            const g2o::Sim3 Sjw = itj!=NonCorrectedSim3.end() ? itj->second : GetScw(pParentKF,CorrectedSim3,Scw);
+            AddEdge(pKF,pParentKF,Siw,Sjw,sInsertedEdges,sInvolvedKFs);
+        }
+
+        const set<KeyFrame*> sChilds = pKF->GetChilds();
+        for(set<KeyFrame*>::const_iterator cit=sChilds.begin(), cend=sChilds.end(); cit!=cend; cit++)
+        {
+            KeyFrame* pChildKF = *cit;
+            if(sRegionKFs.count(pChildKF) || !mmVertices.count(pChildKF))
+                continue;
+
+            LoopClosing::KeyFrameAndPose::const_iterator itj = NonCorrectedSim3.find(pChildKF);
+            const g2o::Sim3 Sjw = itj!=NonCorrectedSim3.end() ? itj->second : GetScw(pChildKF,CorrectedSim3,Scw);
+            AddEdge(pChildKF,pKF,Sjw,Siw,sInsertedEdges,sInvolvedKFs);
+        }
+
+        // Loop edges
+        const set<KeyFrame*> sLoopEdges = pKF->GetLoopEdges();
+        for(set<KeyFrame*>::const_iterator lit=sLoopEdges.begin(), lend=sLoopEdges.end(); lit!=lend; lit++)
+        {
+            KeyFrame* pLKF = *lit;
+            if(!mmVertices.count(pLKF) || (sRegionKFs.count(pLKF) && pLKF->mnId>pKF->mnId))
+                continue;
+
+            LoopClosing::KeyFrameAndPose::const_iterator itl = NonCorrectedSim3.find(pLKF);
+            const g2o::Sim3 Slw = itl!=NonCorrectedSim3.end() ? itl->second : GetScw(pLKF,CorrectedSim3,Scw);
+            AddEdge(pKF,pLKF,Siw,Slw,sInsertedEdges,sInvolvedKFs);
+        }
+
+        // Covisibility graph edges
+        const vector<KeyFrame*> vpConnectedKFs = pKF->GetCovisiblesByWeight(mnMinFeat);
+        for(vector<KeyFrame*>::const_iterator vit=vpConnectedKFs.begin(); vit!=vpConnectedKFs.end(); vit++)
+        {
+            KeyFrame* pKFn = *vit;
+            if(!pKFn || pKFn==pParentKF || pKF->hasChild(pKFn) || sLoopEdges.count(pKFn))
+                continue;
+            if(pKFn->isBad() || !mmVertices.count(pKFn) || (sRegionKFs.count(pKFn) && pKFn->mnId>pKF->mnId))
+                continue;
+            if(sInsertedEdges.count(make_pair(min(pKF->mnId,pKFn->mnId),max(pKF->mnId,pKFn->mnId))))
+                continue;
+
+            LoopClosing::KeyFrameAndPose::const_iterator itn = NonCorrectedSim3.find(pKFn);
+            const g2o::Sim3 Snw = itn!=NonCorrectedSim3.end() ? itn->second : GetScw(pKFn,CorrectedSim3,Scw);
+            AddEdge(pKF,pKFn,Siw,Snw,sInsertedEdges,sInvolvedKFs);
+        }
+    }
+
+    for(set<KeyFrame*>::iterator sit=sRegionKFs.begin(), send=sRegionKFs.end(); sit!=send; sit++)
+        mmVertices[*sit]->setEstimate(GetScw(*sit,CorrectedSim3,Scw));
+
+    // Only the region is optimized, the keyframes connected to it are fixed
+    g2o::HyperGraph::VertexSet vsOptimized;
+    for(set<KeyFrame*>::iterator sit=sInvolvedKFs.begin(), send=sInvolvedKFs.end(); sit!=send; sit++)
+    {
+        KeyFrame* pKF = *sit;
+        g2o::VertexSim3Expmap* VSim3 = mmVertices[pKF];
+        VSim3->setEstimate(GetScw(pKF,CorrectedSim3,Scw));
+        VSim3->setFixed(pKF==pLoopKF || !sRegionKFs.count(pKF));
+        vsOptimized.insert(VSim3);
+    }
+
+    // Optimize!
+    mOptimizer.initializeOptimization(vsOptimized);
+    mOptimizer.optimize(20);
+
+    // Corrections with respect to the poses before the loop, the loop correction of CorrectedSim3 included
+    Corrections.clear();
+    for(set<KeyFrame*>::iterator sit=sRegionKFs.begin(), send=sRegionKFs.end(); sit!=send; sit++)
+    {
+        KeyFrame* pKFi = *sit;
+
+        LoopClosing::KeyFrameAndPose::const_iterator iti = NonCorrectedSim3.find(pKFi);
+        const g2o::Sim3 &Siw = iti!=NonCorrectedSim3.end() ? iti->second : GetScw(pKFi,CorrectedSim3,Scw);
+
+        Corrections[pKFi] = mmVertices[pKFi]->estimate().inverse()*Siw;
+    }
+}
+
+} //namespace ORB_SLAM
@@ -256,6 +256,39 @@ Frame::Frame(const cv::Mat &imGray, const double &timeStamp, ORBextractor* extra
     AssignFeaturesToGrid();
 }
 
+Frame::Frame(const vector<cv::KeyPoint> &vKeys, const vector<MapPoint*> &vpMapPoints, const double &timeStamp, ORBextractor* extractorLeft, ORBextractor* extractorRight, ORBVocabulary* voc, cv::Mat &K, cv::Mat &distCoef, const float &bf, const float &thDepth)
+    :mpORBvocabulary(voc),mpORBextractorLeft(extractorLeft),mpORBextractorRight(extractorRight), mTimeStamp(timeStamp), mK(K.clone()),mDistCoef(distCoef.clone()), mbf(bf), mThDepth(thDepth),
+     mpReferenceKF(static_cast<KeyFrame*>(NULL))
+{
+    // Frame ID
+    mnId=nNextId++;
+
+    // Scale Level Info
+    mnScaleLevels = mpORBextractorLeft->GetLevels();
+    mfScaleFactor = mpORBextractorLeft->GetScaleFactor();
+    mfLogScaleFactor = log(mfScaleFactor);
+    mvScaleFactors = mpORBextractorLeft->GetScaleFactors();
+    mvInvScaleFactors = mpORBextractorLeft->GetInverseScaleFactors();
+    mvLevelSigma2 = mpORBextractorLeft->GetScaleSigmaSquares();
+    mvInvLevelSigma2 = mpORBextractorLeft->GetInverseScaleSigmaSquares();
+
+    // Stereo images are rectified
+    mvKeys = vKeys;
+    mvKeysUn = vKeys;
+    N = mvKeys.size();
+
+    mvuRight = vector<float>(N,-1.0f);
+    mvDepth = vector<float>(N,-1.0f);
+
+    mvpMapPoints = vpMapPoints;
+    mvbOutlier = vector<bool>(N,false);
+
+    // Image bounds and calibration were already computed by the first frame
+    mb = mbf/fx;
+
+    AssignFeaturesToGrid();
+}
+
 void Frame::AssignFeaturesToGrid()
 {
     int nReserve = 0.5f*N/(FRAME_GRID_COLS*FRAME_GRID_ROWS);
@@ -281,6 +314,27 @@ void Frame::ExtractORB(int flag, const cv::Mat &im)
         (*mpORBextractorRight)(im,cv::Mat(),mvKeysRight,mDescriptorsRight, mvHighGradientPointsRight);
 }
 
+void MapPointBatch::clear()
+{
+    vpMapPoints.clear();
+    vX.clear(); vY.clear(); vZ.clear();
+    vNx.clear(); vNy.clear(); vNz.clear();
+    vMinDist.clear(); vMaxDist.clear();
+}
+
+void MapPointBatch::push_back(MapPoint *pMP)
+{
+    Eigen::Vector3f Pos, Normal;
+    float minDistance, maxDistance;
+    pMP->GetFrustumData(Pos,Normal,minDistance,maxDistance);
+
+    vpMapPoints.push_back(pMP);
+    vX.push_back(Pos(0)); vY.push_back(Pos(1)); vZ.push_back(Pos(2));
+    vNx.push_back(Normal(0)); vNy.push_back(Normal(1)); vNz.push_back(Normal(2));
+    vMinDist.push_back(minDistance);
+    vMaxDist.push_back(maxDistance);
+}
+
 void Frame::SetPose(cv::Mat Tcw)
 {
     mTcw = Tcw.clone();
@@ -293,6 +347,10 @@ void Frame::UpdatePoseMatrices()
     mRwc = mRcw.t();
     mtcw = mTcw.rowRange(0,3).col(3);
     mOw = -mRcw.t()*mtcw;
+
+    mRcwEig = Converter::toMatrix3f(mRcw);
+    mtcwEig = Converter::toVector3f(mtcw);
+    mOwEig = -mRcwEig.transpose()*mtcwEig;
 }
 
 bool Frame::isInFrustum(MapPoint *pMP, float viewingCosLimit)
@@ -300,13 +358,13 @@ bool Frame::isInFrustum(MapPoint *pMP, float viewingCosLimit)
     pMP->mbTrackInView = false;
 
     // 3D in absolute coordinates
-    cv::Mat P = pMP->GetWorldPos(); 
+    const Eigen::Vector3f P = pMP->GetWorldPosEig();
 
     // 3D in camera coordinates
-    const cv::Mat Pc = mRcw*P+mtcw;
-    const float &PcX = Pc.at<float>(0);
-    const float &PcY= Pc.at<float>(1);
-    const float &PcZ = Pc.at<float>(2);
+    const Eigen::Vector3f Pc = mRcwEig*P+mtcwEig;
+    const float &PcX = Pc(0);
+    const float &PcY= Pc(1);
+    const float &PcZ = Pc(2);
 
     // Check positive depth
     if(PcZ<0.0f)
@@ -325,14 +383,14 @@ bool Frame::isInFrustum(MapPoint *pMP, float viewingCosLimit)
     // Check distance is in the scale invariance region of the MapPoint
     const float maxDistance = pMP->GetMaxDistanceInvariance();
     const float minDistance = pMP->GetMinDistanceInvariance();
-    const cv::Mat PO = P-mOw;
-    const float dist = cv::norm(PO);
+    const Eigen::Vector3f PO = P-mOwEig;
+    const float dist = PO.norm();
 
     if(dist<minDistance || dist>maxDistance)
         return false;
 
    // Check viewing angle
-    cv::Mat Pn = pMP->GetNormal();
+    const Eigen::Vector3f Pn = pMP->GetNormalEig();
 
     const float viewCos = PO.dot(Pn)/dist;
 
@@ -353,6 +411,91 @@ bool Frame::isInFrustum(MapPoint *pMP, float viewingCosLimit)
     return true;
 }
 
+int Frame::isInFrustum(MapPointBatch &batch, float viewingCosLimit) const
+{
+    const int n = batch.size();
+    batch.vbInView.resize(n);
+    batch.vU.resize(n);
+    batch.vV.resize(n);
+    batch.vUR.resize(n);
+    batch.vDist.resize(n);
+    batch.vLevel.resize(n);
+    batch.vViewCos.resize(n);
+
+    const float* X = batch.vX.data();
+    const float* Y = batch.vY.data();
+    const float* Z = batch.vZ.data();
+    const float* Nx = batch.vNx.data();
+    const float* Ny = batch.vNy.data();
+    const float* Nz = batch.vNz.data();
+    const float* MinDist = batch.vMinDist.data();
+    const float* MaxDist = batch.vMaxDist.data();
+    unsigned char* bInView = batch.vbInView.data();
+    float* U = batch.vU.data();
+    float* V = batch.vV.data();
+    float* UR = batch.vUR.data();
+    float* Dist = batch.vDist.data();
+    int* Level = batch.vLevel.data();
+    float* ViewCos = batch.vViewCos.data();
+
+    const float r00 = mRcwEig(0,0), r01 = mRcwEig(0,1), r02 = mRcwEig(0,2);
+    const float r10 = mRcwEig(1,0), r11 = mRcwEig(1,1), r12 = mRcwEig(1,2);
+    const float r20 = mRcwEig(2,0), r21 = mRcwEig(2,1), r22 = mRcwEig(2,2);
+    const float t0 = mtcwEig(0), t1 = mtcwEig(1), t2 = mtcwEig(2);
+    const float o0 = mOwEig(0), o1 = mOwEig(1), o2 = mOwEig(2);
+
+    // The loop has no branches nor calls so that the compiler can vectorize it.
+    // All the conditions of isInFrustum are accumulated in the mask.
+    for(int i=0; i<n; i++)
+    {
+        const float PcX = r00*X[i]+r01*Y[i]+r02*Z[i]+t0;
+        const float PcY = r10*X[i]+r11*Y[i]+r12*Z[i]+t1;
+        const float PcZ = r20*X[i]+r21*Y[i]+r22*Z[i]+t2;
+
+        const float invz = 1.0f/PcZ;
+        const float u = fx*PcX*invz+cx;
+        const float v = fy*PcY*invz+cy;
+
+        const float POx = X[i]-o0;
+        const float POy = Y[i]-o1;
+        const float POz = Z[i]-o2;
+        const float dist = std::sqrt(POx*POx+POy*POy+POz*POz);
+        const float viewCos = (POx*Nx[i]+POy*Ny[i]+POz*Nz[i])/dist;
+
+        const bool bIn = (PcZ>=0.0f) &
+                         (u>=mnMinX) & (u<=mnMaxX) & (v>=mnMinY) & (v<=mnMaxY) &
+                         (dist>=0.8f*MinDist[i]) & (dist<=1.2f*MaxDist[i]) &
+                         (viewCos>=viewingCosLimit);
+
+        bInView[i] = bIn;
+        U[i] = u;
+        V[i] = v;
+        UR[i] = u - mbf*invz;
+        Dist[i] = dist;
+        ViewCos[i] = viewCos;
+    }
+
+    // Predicted scale is the number of pyramid levels whose scale factor is below
+    // the ratio maxDistance/dist, equivalent to ceil(log(ratio)/log(scaleFactor))
+    // clamped to [0,nLevels-1] (see MapPoint::PredictScale) without the log.
+    const int nLevels = mnScaleLevels;
+    const float* scaleFactors = mvScaleFactors.data();
+    int nInView = 0;
+    for(int i=0; i<n; i++)
+    {
+        const float ratio = MaxDist[i]/Dist[i];
+
+        int nScale = 0;
+        for(int l=0; l<nLevels-1; l++)
+            nScale += scaleFactors[l]<ratio;
+
+        Level[i] = nScale;
+        nInView += bInView[i];
+    }
+
+    return nInView;
+}
+
 vector<size_t> Frame::GetFeaturesInArea(const float &x, const float  &y, const float  &r, const int minLevel, const int maxLevel) const
 {
     vector<size_t> vIndices;
@@ -501,24 +644,34 @@ void Frame::ComputeStereoMatches()
 
     const int nRows = mpORBextractorLeft->mvImagePyramid[0].rows;
 
-    //Assign keypoints to row table
-    vector<vector<size_t> > vRowIndices(nRows,vector<size_t>());
-
-    for(int i=0; i<nRows; i++)
-        vRowIndices[i].reserve(200);
-
+    //Assign keypoints to row table. The table is stored in compressed rows (CSR):
+    //candidates of row y are vRowCandidates[vRowStart[y]] ... vRowCandidates[vRowStart[y+1]-1]
     const int Nr = mvKeysRight.size();
 
+    vector<int> vRowStart(nRows+1,0);
+    vector<int> vMinRow(Nr), vMaxRow(Nr);
+
     for(int iR=0; iR<Nr; iR++)
     {
         const cv::KeyPoint &kp = mvKeysRight[iR];
         const float &kpY = kp.pt.y;
         const float r = 2.0f*mvScaleFactors[mvKeysRight[iR].octave];
-        const int maxr = ceil(kpY+r);
-        const int minr = floor(kpY-r);
+        vMaxRow[iR] = min(nRows-1,(int)ceil(kpY+r));
+        vMinRow[iR] = max(0,(int)floor(kpY-r));
 
-        for(int yi=minr;yi<=maxr;yi++)
-            vRowIndices[yi].push_back(iR);
+        for(int yi=vMinRow[iR];yi<=vMaxRow[iR];yi++)
+            vRowStart[yi+1]++;
+    }
+
+    for(int yi=0; yi<nRows; yi++)
+        vRowStart[yi+1] += vRowStart[yi];
+
+    vector<int> vRowCandidates(vRowStart[nRows]);
+    {
+        vector<int> vRowFill(vRowStart.begin(),vRowStart.end()-1);
+        for(int iR=0; iR<Nr; iR++)
+            for(int yi=vMinRow[iR];yi<=vMaxRow[iR];yi++)
+                vRowCandidates[vRowFill[yi]++] = iR;
     }
 
     // Set limits for search
@@ -530,6 +683,10 @@ void Frame::ComputeStereoMatches()
     vector<pair<int, int> > vDistIdx;
     vDistIdx.reserve(N);
 
+    // Right candidates of the current left keypoint that pass the level and disparity checks
+    vector<int> vValidR;
+    vValidR.reserve(Nr);
+
     for(int iL=0; iL<N; iL++)
     {
         const cv::KeyPoint &kpL = mvKeys[iL];
@@ -537,9 +694,14 @@ void Frame::ComputeStereoMatches()
         const float &vL = kpL.pt.y;
         const float &uL = kpL.pt.x;
 
-        const vector<size_t> &vCandidates = vRowIndices[vL];
+        const int rowL = vL;
+        if(rowL<0 || rowL>=nRows)
+            continue;
+
+        const int *pCandidates = vRowCandidates.data()+vRowStart[rowL];
+        const int nCandidates = vRowStart[rowL+1]-vRowStart[rowL];
 
-        if(vCandidates.empty())
+        if(nCandidates==0)
             continue;
 
         const float minU = uL-maxD;
@@ -548,15 +710,10 @@ void Frame::ComputeStereoMatches()
         if(maxU<0)
             continue;
 
-        int bestDist = ORBmatcher::TH_HIGH;
-        size_t bestIdxR = 0;
-
-        const cv::Mat &dL = mDescriptors.row(iL);
-
-        // Compare descriptor to right keypoints
-        for(size_t iC=0; iC<vCandidates.size(); iC++)
+        vValidR.clear();
+        for(int iC=0; iC<nCandidates; iC++)
         {
-            const size_t iR = vCandidates[iC];
+            const int iR = pCandidates[iC];
             const cv::KeyPoint &kpR = mvKeysRight[iR];
 
             if(kpR.octave<levelL-1 || kpR.octave>levelL+1)
@@ -565,15 +722,24 @@ void Frame::ComputeStereoMatches()
             const float &uR = kpR.pt.x;
 
             if(uR>=minU && uR<=maxU)
-            {
-                const cv::Mat &dR = mDescriptorsRight.row(iR);
-                const int dist = ORBmatcher::DescriptorDistance(dL,dR);
+                vValidR.push_back(iR);
+        }
 
-                if(dist<bestDist)
-                {
-                    bestDist = dist;
-                    bestIdxR = iR;
-                }
+        // Compare descriptor to the remaining right keypoints
+        int bestDist = ORBmatcher::TH_HIGH;
+        size_t bestIdxR = 0;
+
+        const unsigned char* dL = mDescriptors.ptr<unsigned char>(iL);
+
+        for(size_t iC=0, iCend=vValidR.size(); iC<iCend; iC++)
+        {
+            const int iR = vValidR[iC];
+            const int dist = ORBmatcher::DescriptorDistance(dL,mDescriptorsRight.ptr<unsigned char>(iR));
+
+            if(dist<bestDist)
+            {
+                bestDist = dist;
+                bestIdxR = iR;
             }
         }
 
@@ -589,35 +755,55 @@ void Frame::ComputeStereoMatches()
 
             // sliding window search
             const int w = 5;
-            cv::Mat IL = mpORBextractorLeft->mvImagePyramid[kpL.octave].rowRange(scaledvL-w,scaledvL+w+1).colRange(scaleduL-w,scaleduL+w+1);
-            IL.convertTo(IL,CV_32F);
-            IL = IL - IL.at<float>(w,w) *cv::Mat::ones(IL.rows,IL.cols,CV_32F);
-
-            int bestDist = INT_MAX;
-            int bestincR = 0;
             const int L = 5;
-            vector<float> vDists;
-            vDists.resize(2*L+1);
+            const cv::Mat &imL = mpORBextractorLeft->mvImagePyramid[kpL.octave];
+            const cv::Mat &imR = mpORBextractorRight->mvImagePyramid[kpL.octave];
 
             const float iniu = scaleduR0+L-w;
             const float endu = scaleduR0+L+w+1;
-            if(iniu<0 || endu >= mpORBextractorRight->mvImagePyramid[kpL.octave].cols)
+            if(iniu<0 || endu >= imR.cols)
                 continue;
 
-            for(int incR=-L; incR<=+L; incR++)
+            const int v0 = scaledvL;
+            const int u0L = scaleduL;
+            const int u0R = scaleduR0;
+
+            // SAD of the intensity patches after removing the central value,
+            // computed on integers straight from the pyramid rows
+            int vDists[2*L+1];
+            for(int k=0; k<2*L+1; k++)
+                vDists[k] = 0;
+
+            const int centerL = imL.ptr<unsigned char>(v0)[u0L];
+            for(int dv=-w; dv<=w; dv++)
             {
-                cv::Mat IR = mpORBextractorRight->mvImagePyramid[kpL.octave].rowRange(scaledvL-w,scaledvL+w+1).colRange(scaleduR0+incR-w,scaleduR0+incR+w+1);
-                IR.convertTo(IR,CV_32F);
-                IR = IR - IR.at<float>(w,w) *cv::Mat::ones(IR.rows,IR.cols,CV_32F);
+                const unsigned char* rowL = imL.ptr<unsigned char>(v0+dv)+u0L-w;
+                const unsigned char* rowR = imR.ptr<unsigned char>(v0+dv)+u0R-w;
 
-                float dist = cv::norm(IL,IR,cv::NORM_L1);
-                if(dist<bestDist)
+                int patchL[2*w+1];
+                for(int du=0; du<2*w+1; du++)
+                    patchL[du] = (int)rowL[du]-centerL;
+
+                for(int incR=-L; incR<=+L; incR++)
                 {
-                    bestDist =  dist;
-                    bestincR = incR;
+                    const int centerR = imR.ptr<unsigned char>(v0)[u0R+incR];
+                    const unsigned char* pR = rowR+incR;
+                    int sad = 0;
+                    for(int du=0; du<2*w+1; du++)
+                        sad += abs(patchL[du]-((int)pR[du]-centerR));
+                    vDists[L+incR] += sad;
                 }
+            }
 
-                vDists[L+incR] = dist;
+            int bestDist = INT_MAX;
+            int bestincR = 0;
+            for(int incR=-L; incR<=+L; incR++)
+            {
+                if(vDists[L+incR]<bestDist)
+                {
+                    bestDist = vDists[L+incR];
+                    bestincR = incR;
+                }
             }
 
             if(bestincR==-L || bestincR==L)
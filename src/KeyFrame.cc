@@ -31,8 +31,7 @@ long unsigned int KeyFrame::nNextId=0;
 KeyFrame::KeyFrame(Frame &F, Map *pMap, KeyFrameDatabase *pKFDB):
     mnFrameId(F.mnId),  mTimeStamp(F.mTimeStamp), mnGridCols(FRAME_GRID_COLS), mnGridRows(FRAME_GRID_ROWS),
     mfGridElementWidthInv(F.mfGridElementWidthInv), mfGridElementHeightInv(F.mfGridElementHeightInv),
-    mnTrackReferenceForFrame(0), mnFuseTargetForKF(0), mnBALocalForKF(0), mnBAFixedForKF(0),
-    mnLoopQuery(0), mnLoopWords(0), mnRelocQuery(0), mnRelocWords(0), mnBAGlobalForKF(0),
+    mnTrackReferenceForFrame(0), mnFuseTargetForKF(0), mnBALocalForKF(0), mnBAFixedForKF(0), mnBAGlobalForKF(0),
     fx(F.fx), fy(F.fy), cx(F.cx), cy(F.cy), invfx(F.invfx), invfy(F.invfy),
     mbf(F.mbf), mb(F.mb), mThDepth(F.mThDepth), N(F.N), mvKeys(F.mvKeys), mvKeysUn(F.mvKeysUn),
     mvuRight(F.mvuRight), mvDepth(F.mvDepth), mDescriptors(F.mDescriptors.clone()),
@@ -54,7 +53,8 @@ KeyFrame::KeyFrame(Frame &F, Map *pMap, KeyFrameDatabase *pKFDB):
     }
 
     SetPose(F.mTcw);
-    imagePyramidLeft = F.mpORBextractorLeft->photobaImagePyramid;
+    if (F.mpORBextractorLeft)
+        imagePyramidLeft = F.mpORBextractorLeft->photobaImagePyramid;
     if (F.mpORBextractorRight)
         imagePyramidRight = F.mpORBextractorRight->photobaImagePyramid;
 
@@ -105,6 +105,10 @@ void KeyFrame::SetPose(const cv::Mat &Tcw_)
     Ow.copyTo(Twc.rowRange(0,3).col(3));
     cv::Mat center = (cv::Mat_<float>(4,1) << mHalfBaseline, 0 , 0, 1);
     Cw = Twc*center;
+
+    RcwEig = Converter::toMatrix3f(Rcw);
+    tcwEig = Converter::toVector3f(tcw);
+    OwEig = Converter::toVector3f(Ow);
 }
 
 cv::Mat KeyFrame::GetPose()
@@ -144,6 +148,24 @@ cv::Mat KeyFrame::GetTranslation()
     return Tcw.rowRange(0,3).col(3).clone();
 }
 
+Eigen::Matrix3f KeyFrame::GetRotationEig()
+{
+    unique_lock<mutex> lock(mMutexPose);
+    return RcwEig;
+}
+
+Eigen::Vector3f KeyFrame::GetTranslationEig()
+{
+    unique_lock<mutex> lock(mMutexPose);
+    return tcwEig;
+}
+
+Eigen::Vector3f KeyFrame::GetCameraCenterEig()
+{
+    unique_lock<mutex> lock(mMutexPose);
+    return OwEig;
+}
+
 void KeyFrame::AddConnection(KeyFrame *pKF, const int &weight)
 {
     {
@@ -39,113 +39,151 @@ KeyFrameDatabase::KeyFrameDatabase (const ORBVocabulary &voc):
 
 void KeyFrameDatabase::add(KeyFrame *pKF)
 {
-    unique_lock<mutex> lock(mMutex);
+    unique_lock<SharedMutex> lock(mMutex);
+
+    if(mmKeyFrameSlots.count(pKF))
+        return;
+
+    // Reuse the slot of an erased keyframe if there is one
+    int nSlot;
+    if(!mvFreeSlots.empty())
+    {
+        nSlot = mvFreeSlots.back();
+        mvFreeSlots.pop_back();
+        mvpKeyFrames[nSlot] = pKF;
+    }
+    else
+    {
+        nSlot = mvpKeyFrames.size();
+        mvpKeyFrames.push_back(pKF);
+    }
+    mmKeyFrameSlots[pKF] = nSlot;
 
     for(DBoW2::BowVector::const_iterator vit= pKF->mBowVec.begin(), vend=pKF->mBowVec.end(); vit!=vend; vit++)
-        mvInvertedFile[vit->first].push_back(pKF);
+    {
+        Posting posting;
+        posting.nSlot = nSlot;
+        posting.weight = vit->second;
+        mvInvertedFile[vit->first].push_back(posting);
+    }
 }
 
 void KeyFrameDatabase::erase(KeyFrame* pKF)
 {
-    unique_lock<mutex> lock(mMutex);
+    unique_lock<SharedMutex> lock(mMutex);
+
+    map<KeyFrame*,int>::iterator mit = mmKeyFrameSlots.find(pKF);
+    if(mit==mmKeyFrameSlots.end())
+        return;
+
+    const int nSlot = mit->second;
 
     // Erase elements in the Inverse File for the entry
     for(DBoW2::BowVector::const_iterator vit=pKF->mBowVec.begin(), vend=pKF->mBowVec.end(); vit!=vend; vit++)
     {
-        // List of keyframes that share the word
-        list<KeyFrame*> &lKFs =   mvInvertedFile[vit->first];
+        // Postings of the keyframes that share the word
+        vector<Posting> &vPostings = mvInvertedFile[vit->first];
 
-        for(list<KeyFrame*>::iterator lit=lKFs.begin(), lend= lKFs.end(); lit!=lend; lit++)
+        for(vector<Posting>::iterator pit=vPostings.begin(), pend=vPostings.end(); pit!=pend; pit++)
         {
-            if(pKF==*lit)
+            if(pit->nSlot==nSlot)
             {
-                lKFs.erase(lit);
+                vPostings.erase(pit);
                 break;
             }
         }
     }
+
+    mvpKeyFrames[nSlot] = static_cast<KeyFrame*>(NULL);
+    mvFreeSlots.push_back(nSlot);
+    mmKeyFrameSlots.erase(mit);
 }
 
 void KeyFrameDatabase::clear()
 {
+    unique_lock<SharedMutex> lock(mMutex);
+
     mvInvertedFile.clear();
     mvInvertedFile.resize(mpVoc->size());
+    mvpKeyFrames.clear();
+    mvFreeSlots.clear();
+    mmKeyFrameSlots.clear();
 }
 
-
-vector<KeyFrame*> KeyFrameDatabase::DetectLoopCandidates(KeyFrame* pKF, float minScore)
+void KeyFrameDatabase::ScoreKeyFramesSharingWords(const DBoW2::BowVector &vBowVec, const set<KeyFrame*> &spExcluded,
+                                                  vector<pair<float,KeyFrame*> > &vScoreAndMatch)
 {
-    set<KeyFrame*> spConnectedKeyFrames = pKF->GetConnectedKeyFrames();
-    list<KeyFrame*> lKFsSharingWords;
+    vScoreAndMatch.clear();
 
-    // Search all keyframes that share a word with current keyframes
-    // Discard keyframes connected to the query keyframe
+    SharedLock lock(mMutex);
+
+    // Query-local counters indexed by keyframe slot. Excluded keyframes are marked with -1
+    const size_t nSlots = mvpKeyFrames.size();
+    vector<int> vnCommonWords(nSlots,0);
+    vector<float> vScores(nSlots,0.f);
+    vector<int> vSharingSlots;
+
+    for(set<KeyFrame*>::const_iterator sit=spExcluded.begin(), send=spExcluded.end(); sit!=send; sit++)
+    {
+        map<KeyFrame*,int>::const_iterator mit = mmKeyFrameSlots.find(*sit);
+        if(mit!=mmKeyFrameSlots.end())
+            vnCommonWords[mit->second] = -1;
+    }
+
+    // With L1 scoring the similarity of two normalized vectors is the sum over their
+    // common words of the smaller weight, so it is accumulated during the scan itself
+    const bool bAccumulate = mpVoc->getScoringType()==DBoW2::L1_NORM;
+
+    // Search all keyframes that share a word with the query
+    for(DBoW2::BowVector::const_iterator vit=vBowVec.begin(), vend=vBowVec.end(); vit != vend; vit++)
     {
-        unique_lock<mutex> lock(mMutex);
+        const vector<Posting> &vPostings = mvInvertedFile[vit->first];
+        const float qweight = vit->second;
 
-        for(DBoW2::BowVector::const_iterator vit=pKF->mBowVec.begin(), vend=pKF->mBowVec.end(); vit != vend; vit++)
+        for(vector<Posting>::const_iterator pit=vPostings.begin(), pend=vPostings.end(); pit!=pend; pit++)
         {
-            list<KeyFrame*> &lKFs =   mvInvertedFile[vit->first];
-
-            for(list<KeyFrame*>::iterator lit=lKFs.begin(), lend= lKFs.end(); lit!=lend; lit++)
-            {
-                KeyFrame* pKFi=*lit;
-                if(pKFi->mnLoopQuery!=pKF->mnId)
-                {
-                    pKFi->mnLoopWords=0;
-                    if(!spConnectedKeyFrames.count(pKFi))
-                    {
-                        pKFi->mnLoopQuery=pKF->mnId;
-                        lKFsSharingWords.push_back(pKFi);
-                    }
-                }
-                pKFi->mnLoopWords++;
-            }
+            int &nCommonWords = vnCommonWords[pit->nSlot];
+            if(nCommonWords<0)
+                continue;
+            if(nCommonWords==0)
+                vSharingSlots.push_back(pit->nSlot);
+            nCommonWords++;
+            vScores[pit->nSlot] += min(qweight,pit->weight);
         }
     }
 
-    if(lKFsSharingWords.empty())
-        return vector<KeyFrame*>();
-
-    list<pair<float,KeyFrame*> > lScoreAndMatch;
+    if(vSharingSlots.empty())
+        return;
 
     // Only compare against those keyframes that share enough words
     int maxCommonWords=0;
-    for(list<KeyFrame*>::iterator lit=lKFsSharingWords.begin(), lend= lKFsSharingWords.end(); lit!=lend; lit++)
+    for(vector<int>::const_iterator vit=vSharingSlots.begin(), vend=vSharingSlots.end(); vit!=vend; vit++)
     {
-        if((*lit)->mnLoopWords>maxCommonWords)
-            maxCommonWords=(*lit)->mnLoopWords;
+        if(vnCommonWords[*vit]>maxCommonWords)
+            maxCommonWords=vnCommonWords[*vit];
     }
 
     int minCommonWords = maxCommonWords*0.8f;
 
-    int nscores=0;
-
-    // Compute similarity score. Retain the matches whose score is higher than minScore
-    for(list<KeyFrame*>::iterator lit=lKFsSharingWords.begin(), lend= lKFsSharingWords.end(); lit!=lend; lit++)
+    vScoreAndMatch.reserve(vSharingSlots.size());
+    for(vector<int>::const_iterator vit=vSharingSlots.begin(), vend=vSharingSlots.end(); vit!=vend; vit++)
     {
-        KeyFrame* pKFi = *lit;
-
-        if(pKFi->mnLoopWords>minCommonWords)
+        if(vnCommonWords[*vit]>minCommonWords)
         {
-            nscores++;
-
-            float si = mpVoc->score(pKF->mBowVec,pKFi->mBowVec);
-
-            pKFi->mLoopScore = si;
-            if(si>=minScore)
-                lScoreAndMatch.push_back(make_pair(si,pKFi));
+            KeyFrame* pKFi = mvpKeyFrames[*vit];
+            const float si = bAccumulate ? vScores[*vit] : mpVoc->score(vBowVec,pKFi->mBowVec);
+            vScoreAndMatch.push_back(make_pair(si,pKFi));
         }
     }
+}
 
-    if(lScoreAndMatch.empty())
-        return vector<KeyFrame*>();
-
+vector<KeyFrame*> KeyFrameDatabase::AccumulateByCovisibility(const vector<pair<float,KeyFrame*> > &vScoreAndMatch,
+                                                             const map<KeyFrame*,float> &mScores, float bestAccScore)
+{
     list<pair<float,KeyFrame*> > lAccScoreAndMatch;
-    float bestAccScore = minScore;
 
     // Lets now accumulate score by covisibility
-    for(list<pair<float,KeyFrame*> >::iterator it=lScoreAndMatch.begin(), itend=lScoreAndMatch.end(); it!=itend; it++)
+    for(vector<pair<float,KeyFrame*> >::const_iterator it=vScoreAndMatch.begin(), itend=vScoreAndMatch.end(); it!=itend; it++)
     {
         KeyFrame* pKFi = it->second;
         vector<KeyFrame*> vpNeighs = pKFi->GetBestCovisibilityKeyFrames(10);
@@ -155,15 +193,15 @@ vector<KeyFrame*> KeyFrameDatabase::DetectLoopCandidates(KeyFrame* pKF, float mi
         KeyFrame* pBestKF = pKFi;
         for(vector<KeyFrame*>::iterator vit=vpNeighs.begin(), vend=vpNeighs.end(); vit!=vend; vit++)
         {
-            KeyFrame* pKF2 = *vit;
-            if(pKF2->mnLoopQuery==pKF->mnId && pKF2->mnLoopWords>minCommonWords)
+            map<KeyFrame*,float>::const_iterator mit = mScores.find(*vit);
+            if(mit==mScores.end())
+                continue;
+
+            accScore+=mit->second;
+            if(mit->second>bestScore)
             {
-                accScore+=pKF2->mLoopScore;
-                if(pKF2->mLoopScore>bestScore)
-                {
-                    pBestKF=pKF2;
-                    bestScore = pKF2->mLoopScore;
-                }
+                pBestKF=mit->first;
+                bestScore = mit->second;
             }
         }
 
@@ -176,8 +214,8 @@ vector<KeyFrame*> KeyFrameDatabase::DetectLoopCandidates(KeyFrame* pKF, float mi
     float minScoreToRetain = 0.75f*bestAccScore;
 
     set<KeyFrame*> spAlreadyAddedKF;
-    vector<KeyFrame*> vpLoopCandidates;
-    vpLoopCandidates.reserve(lAccScoreAndMatch.size());
+    vector<KeyFrame*> vpCandidates;
+    vpCandidates.reserve(lAccScoreAndMatch.size());
 
     for(list<pair<float,KeyFrame*> >::iterator it=lAccScoreAndMatch.begin(), itend=lAccScoreAndMatch.end(); it!=itend; it++)
     {
@@ -186,126 +224,58 @@ vector<KeyFrame*> KeyFrameDatabase::DetectLoopCandidates(KeyFrame* pKF, float mi
             KeyFrame* pKFi = it->second;
             if(!spAlreadyAddedKF.count(pKFi))
             {
-                vpLoopCandidates.push_back(pKFi);
+                vpCandidates.push_back(pKFi);
                 spAlreadyAddedKF.insert(pKFi);
             }
         }
     }
 
-
-    return vpLoopCandidates;
+    return vpCandidates;
 }
 
-vector<KeyFrame*> KeyFrameDatabase::DetectRelocalizationCandidates(Frame *F)
-{
-    list<KeyFrame*> lKFsSharingWords;
 
-    // Search all keyframes that share a word with current frame
-    {
-        unique_lock<mutex> lock(mMutex);
+vector<KeyFrame*> KeyFrameDatabase::DetectLoopCandidates(KeyFrame* pKF, float minScore)
+{
+    // Discard keyframes connected to the query keyframe
+    set<KeyFrame*> spConnectedKeyFrames = pKF->GetConnectedKeyFrames();
 
-        for(DBoW2::BowVector::const_iterator vit=F->mBowVec.begin(), vend=F->mBowVec.end(); vit != vend; vit++)
-        {
-            list<KeyFrame*> &lKFs =   mvInvertedFile[vit->first];
+    vector<pair<float,KeyFrame*> > vScores;
+    ScoreKeyFramesSharingWords(pKF->mBowVec,spConnectedKeyFrames,vScores);
 
-            for(list<KeyFrame*>::iterator lit=lKFs.begin(), lend= lKFs.end(); lit!=lend; lit++)
-            {
-                KeyFrame* pKFi=*lit;
-                if(pKFi->mnRelocQuery!=F->mnId)
-                {
-                    pKFi->mnRelocWords=0;
-                    pKFi->mnRelocQuery=F->mnId;
-                    lKFsSharingWords.push_back(pKFi);
-                }
-                pKFi->mnRelocWords++;
-            }
-        }
-    }
-    if(lKFsSharingWords.empty())
+    if(vScores.empty())
         return vector<KeyFrame*>();
 
-    // Only compare against those keyframes that share enough words
-    int maxCommonWords=0;
-    for(list<KeyFrame*>::iterator lit=lKFsSharingWords.begin(), lend= lKFsSharingWords.end(); lit!=lend; lit++)
+    // Retain the matches whose score is higher than minScore. All scored keyframes
+    // still contribute to the covisibility accumulation
+    map<KeyFrame*,float> mScores;
+    vector<pair<float,KeyFrame*> > vScoreAndMatch;
+    vScoreAndMatch.reserve(vScores.size());
+    for(vector<pair<float,KeyFrame*> >::iterator it=vScores.begin(), itend=vScores.end(); it!=itend; it++)
     {
-        if((*lit)->mnRelocWords>maxCommonWords)
-            maxCommonWords=(*lit)->mnRelocWords;
-    }
-
-    int minCommonWords = maxCommonWords*0.8f;
-
-    list<pair<float,KeyFrame*> > lScoreAndMatch;
-
-    int nscores=0;
-
-    // Compute similarity score.
-    for(list<KeyFrame*>::iterator lit=lKFsSharingWords.begin(), lend= lKFsSharingWords.end(); lit!=lend; lit++)
-    {
-        KeyFrame* pKFi = *lit;
-
-        if(pKFi->mnRelocWords>minCommonWords)
-        {
-            nscores++;
-            float si = mpVoc->score(F->mBowVec,pKFi->mBowVec);
-            pKFi->mRelocScore=si;
-            lScoreAndMatch.push_back(make_pair(si,pKFi));
-        }
+        mScores[it->second] = it->first;
+        if(it->first>=minScore)
+            vScoreAndMatch.push_back(*it);
     }
 
-    if(lScoreAndMatch.empty())
+    if(vScoreAndMatch.empty())
         return vector<KeyFrame*>();
 
-    list<pair<float,KeyFrame*> > lAccScoreAndMatch;
-    float bestAccScore = 0;
-
-    // Lets now accumulate score by covisibility
-    for(list<pair<float,KeyFrame*> >::iterator it=lScoreAndMatch.begin(), itend=lScoreAndMatch.end(); it!=itend; it++)
-    {
-        KeyFrame* pKFi = it->second;
-        vector<KeyFrame*> vpNeighs = pKFi->GetBestCovisibilityKeyFrames(10);
-
-        float bestScore = it->first;
-        float accScore = bestScore;
-        KeyFrame* pBestKF = pKFi;
-        for(vector<KeyFrame*>::iterator vit=vpNeighs.begin(), vend=vpNeighs.end(); vit!=vend; vit++)
-        {
-            KeyFrame* pKF2 = *vit;
-            if(pKF2->mnRelocQuery!=F->mnId)
-                continue;
+    return AccumulateByCovisibility(vScoreAndMatch,mScores,minScore);
+}
 
-            accScore+=pKF2->mRelocScore;
-            if(pKF2->mRelocScore>bestScore)
-            {
-                pBestKF=pKF2;
-                bestScore = pKF2->mRelocScore;
-            }
+vector<KeyFrame*> KeyFrameDatabase::DetectRelocalizationCandidates(Frame *F)
+{
+    vector<pair<float,KeyFrame*> > vScoreAndMatch;
+    ScoreKeyFramesSharingWords(F->mBowVec,set<KeyFrame*>(),vScoreAndMatch);
 
-        }
-        lAccScoreAndMatch.push_back(make_pair(accScore,pBestKF));
-        if(accScore>bestAccScore)
-            bestAccScore=accScore;
-    }
+    if(vScoreAndMatch.empty())
+        return vector<KeyFrame*>();
 
-    // Return all those keyframes with a score higher than 0.75*bestScore
-    float minScoreToRetain = 0.75f*bestAccScore;
-    set<KeyFrame*> spAlreadyAddedKF;
-    vector<KeyFrame*> vpRelocCandidates;
-    vpRelocCandidates.reserve(lAccScoreAndMatch.size());
-    for(list<pair<float,KeyFrame*> >::iterator it=lAccScoreAndMatch.begin(), itend=lAccScoreAndMatch.end(); it!=itend; it++)
-    {
-        const float &si = it->first;
-        if(si>minScoreToRetain)
-        {
-            KeyFrame* pKFi = it->second;
-            if(!spAlreadyAddedKF.count(pKFi))
-            {
-                vpRelocCandidates.push_back(pKFi);
-                spAlreadyAddedKF.insert(pKFi);
-            }
-        }
-    }
+    map<KeyFrame*,float> mScores;
+    for(vector<pair<float,KeyFrame*> >::iterator it=vScoreAndMatch.begin(), itend=vScoreAndMatch.end(); it!=itend; it++)
+        mScores[it->second] = it->first;
 
-    return vpRelocCandidates;
+    return AccumulateByCovisibility(vScoreAndMatch,mScores,0);
 }
 
 } //namespace ORB_SLAM
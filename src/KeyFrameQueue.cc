@@ -0,0 +1,118 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "KeyFrameQueue.h"
+
+namespace ORB_SLAM2
+{
+
+KeyFrameQueue::KeyFrameQueue(size_t capacity):
+    mnSlots(capacity+1), mvSlots(capacity+1), mnHead(0), mnTail(0), mnPushed(0), mnDropped(0),
+    mnMaxDepth(0), mnPopped(0), mnWaitMicros(0), mnMaxWaitMicros(0)
+{
+}
+
+bool KeyFrameQueue::Push(KeyFrame* pKF)
+{
+    const size_t tail = mnTail.load(std::memory_order_relaxed);
+    const size_t next = (tail+1)%mnSlots;
+
+    if(next==mnHead.load(std::memory_order_acquire))
+    {
+        mnDropped++;
+        return false;
+    }
+
+    mvSlots[tail].pKF = pKF;
+    mvSlots[tail].tPush = Clock::now();
+    mnTail.store(next, std::memory_order_release);
+
+    mnPushed++;
+    const size_t depth = Size();
+    if(depth>mnMaxDepth)
+        mnMaxDepth = depth;
+
+    return true;
+}
+
+KeyFrame* KeyFrameQueue::Pop()
+{
+    const size_t head = mnHead.load(std::memory_order_relaxed);
+    if(head==mnTail.load(std::memory_order_acquire))
+        return static_cast<KeyFrame*>(NULL);
+
+    KeyFrame* pKF = mvSlots[head].pKF;
+    const long long wait = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now()-mvSlots[head].tPush).count();
+    mnHead.store((head+1)%mnSlots, std::memory_order_release);
+
+    mnPopped++;
+    mnWaitMicros += wait;
+    if(wait>mnMaxWaitMicros)
+        mnMaxWaitMicros = wait;
+
+    return pKF;
+}
+
+std::vector<KeyFrame*> KeyFrameQueue::Clear()
+{
+    std::vector<KeyFrame*> vpKFs;
+    size_t head = mnHead.load(std::memory_order_relaxed);
+    const size_t tail = mnTail.load(std::memory_order_acquire);
+    while(head!=tail)
+    {
+        vpKFs.push_back(mvSlots[head].pKF);
+        head = (head+1)%mnSlots;
+    }
+    mnHead.store(head, std::memory_order_release);
+
+    return vpKFs;
+}
+
+size_t KeyFrameQueue::Size() const
+{
+    const size_t head = mnHead.load(std::memory_order_acquire);
+    const size_t tail = mnTail.load(std::memory_order_acquire);
+    return (tail+mnSlots-head)%mnSlots;
+}
+
+bool KeyFrameQueue::Empty() const
+{
+    return mnHead.load(std::memory_order_acquire)==mnTail.load(std::memory_order_acquire);
+}
+
+bool KeyFrameQueue::Full() const
+{
+    return Size()==Capacity();
+}
+
+double KeyFrameQueue::MeanWaitTime() const
+{
+    const size_t n = mnPopped;
+    if(n==0)
+        return 0;
+    return mnWaitMicros/(1000.0*n);
+}
+
+double KeyFrameQueue::MaxWaitTime() const
+{
+    return mnMaxWaitMicros/1000.0;
+}
+
+} //namespace ORB_SLAM
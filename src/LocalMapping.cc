@@ -22,15 +22,22 @@
 #include "LoopClosing.h"
 #include "ORBmatcher.h"
 #include "Optimizer.h"
+#include "Converter.h"
 
+#include "Thirdparty/DBoW2/DUtils/ParallelFor.h"
+
+#include<limits>
 #include<mutex>
+#include<thread>
 
 namespace ORB_SLAM2
 {
 
-LocalMapping::LocalMapping(Map *pMap, const float bMonocular):
-    mbMonocular(bMonocular), mbResetRequested(false), mbFinishRequested(false), mbFinished(true), mpMap(pMap),
-    mbAbortBA(false), mbStopped(false), mbStopRequested(false), mbNotStop(false), mbAcceptKeyFrames(true)
+LocalMapping::LocalMapping(Map *pMap, const float bMonocular, const int nQueueCapacity):
+    mbWakeUp(false), mbMonocular(bMonocular), mbResetRequested(false), mbFinishRequested(false), mbFinished(true), mpMap(pMap),
+    mNewKeyFrames(nQueueCapacity), mbAbortBA(false), mbStopped(false), mbStopRequested(false), mbNotStop(false), mbAcceptKeyFrames(true),
+    mnMaxPyramidKeyFrames(30), mnPyramidsAcquired(0), mbPhotometricRefinement(true), mbRefinementPending(false),
+    mnRefinementLastKFId(0)
 {
 }
 
@@ -86,6 +93,17 @@ void LocalMapping::Run()
 //                        Optimizer::LocalBundleAdjustment(mpCurrentKeyFrame,&mbAbortBA, mpMap);
 //                    else {
                     if(mpMap->KeyFramesInMap()>2) {
+                        // Culled keyframes leave the window here so that their pyramids go through the pyramid API
+                        for(list<KeyFrame*>::iterator lit=pbaKeyFrames.begin(); lit!=pbaKeyFrames.end();)
+                        {
+                            if((*lit)->isBad())
+                            {
+                                ReleasePyramids(*lit);
+                                lit = pbaKeyFrames.erase(lit);
+                            }
+                            else
+                                lit++;
+                        }
                         Optimizer::LocalPhotometricBundleAdjustment(pbaKeyFrames, hgMap, &mbAbortBA, mpMap, 7, false);
                         mbAbortBA = false;
                         Optimizer::LocalPhotometricBundleAdjustment(pbaKeyFrames, hgMap, &mbAbortBA, mpMap, 4, false);
@@ -99,6 +117,9 @@ void LocalMapping::Run()
                 KeyFrameCulling();
             }
 
+            // Covisibility and points around the new keyframe changed, Tracking must rebuild its local map
+            mpMap->InformNewLocalMapChange();
+
             mpLoopCloser->InsertKeyFrame(mpCurrentKeyFrame);
         }
         else if(Stop())
@@ -106,7 +127,7 @@ void LocalMapping::Run()
             // Safe area to stop
             while(isStopped() && !CheckFinish())
             {
-                usleep(3000);
+                WaitForEvent();
             }
             if(CheckFinish())
                 break;
@@ -120,7 +141,9 @@ void LocalMapping::Run()
         if(CheckFinish())
             break;
 
-        usleep(3000);
+        // Refine the map after a loop while no keyframe waits
+        if(!CheckNewKeyFrames() && !RefinePhotometricWindow())
+            WaitForEvent();
     }
 
     SetFinish();
@@ -128,25 +151,42 @@ void LocalMapping::Run()
 
 void LocalMapping::InsertKeyFrame(KeyFrame *pKF)
 {
-    unique_lock<mutex> lock(mMutexNewKFs);
-    mlNewKeyFrames.push_back(pKF);
-    mbAbortBA=true;
+    // Tracking checks KeyframeQueueFull before creating a keyframe, so the push only fails
+    // if this is called from another thread
+    if(!mNewKeyFrames.Push(pKF))
+        cerr << "Local Mapping queue full, keyframe " << pKF->mnId << " not inserted" << endl;
+
+    {
+        unique_lock<mutex> lock(mMutexNewKFs);
+        mbAbortBA=true;
+    }
+    WakeUp();
+}
+
+void LocalMapping::WakeUp()
+{
+    unique_lock<mutex> lock(mMutexWakeUp);
+    mbWakeUp = true;
+    mcvWakeUp.notify_one();
+}
+
+void LocalMapping::WaitForEvent()
+{
+    unique_lock<mutex> lock(mMutexWakeUp);
+    while(!mbWakeUp)
+        mcvWakeUp.wait(lock);
+    mbWakeUp = false;
 }
 
 
 bool LocalMapping::CheckNewKeyFrames()
 {
-    unique_lock<mutex> lock(mMutexNewKFs);
-    return(!mlNewKeyFrames.empty());
+    return(!mNewKeyFrames.Empty());
 }
 
 void LocalMapping::ProcessNewKeyFrame()
 {
-    {
-        unique_lock<mutex> lock(mMutexNewKFs);
-        mpCurrentKeyFrame = mlNewKeyFrames.front();
-        mlNewKeyFrames.pop_front();
-    }
+    mpCurrentKeyFrame = mNewKeyFrames.Pop();
 
     // Compute Bags of Words structures
     mpCurrentKeyFrame->ComputeBoW();
@@ -186,23 +226,28 @@ void LocalMapping::ProcessNewKeyFrame()
         std::cout << "Removing oldKF to release memory" << std::endl;
 
         KeyFrame* oldKF = pbaKeyFrames.front();
-        for (int i = 0; i < oldKF->imagePyramidLeft.size(); i++) {
-            delete oldKF->imagePyramidLeft[i];
-            delete oldKF->imagePyramidRight[i];
-        }
-        for (int i = 0; i < oldKF->mHGPoints.size(); i++) {
-            delete oldKF->mHGPoints[i];
-        }
-
-        if (pbaKeyFrames.front()->mnId%3 != 0)
-            pbaKeyFrames.front()->SetBadFlag();
-
         for (auto it = hgMap.begin(); it != hgMap.end();) {
-            if ( (*it)->refKF == pbaKeyFrames.front() )
+            if ( (*it)->refKF == oldKF )
                 it = hgMap.erase(it);
             else
                 it++;
         }
+        {
+            // Tracking reads the points of its last keyframe under the map update mutex
+            unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
+            for (int i = 0; i < oldKF->mHGPoints.size(); i++) {
+                delete oldKF->mHGPoints[i];
+            }
+            oldKF->mHGPoints.clear();
+        }
+
+        // Keyframes that stay in the map keep their pyramids for the global photometric refinement
+        if (oldKF->mnId%3 != 0) {
+            oldKF->SetBadFlag();
+            ReleasePyramids(oldKF);
+        }
+        else
+            RetainPyramids(oldKF);
 
         pbaKeyFrames.pop_front();
     }
@@ -217,7 +262,7 @@ void LocalMapping::ProcessNewKeyFrame()
     const int maxBorderY = mpCurrentKeyFrame->mnMaxY;
 
     //Optimizer::OptimizeInitialHGPointDepth(pbaKeyFrames, mpCurrentKeyFrame->mHGPoints[0]);
-    Optimizer::OptimizeInitialHGPointDepth(pbaKeyFrames, mpCurrentKeyFrame->mHGPoints);
+    Optimizer::OptimizeInitialHGPointDepth(pbaKeyFrames, mpCurrentKeyFrame->mHGPoints, mpMap);
 
     std::cout << "HighGradientPoint::DistributeOctTree: BEFORE: " << hgMap.size() << std::endl;
     hgMap = HighGradientPoint::DistributeOctTree(mpCurrentKeyFrame, hgMap, minBorderX, maxBorderX,
@@ -270,242 +315,268 @@ void LocalMapping::CreateNewMapPoints()
         nn=20;
     const vector<KeyFrame*> vpNeighKFs = mpCurrentKeyFrame->GetBestCovisibilityKeyFrames(nn);
 
-    ORBmatcher matcher(0.6,false);
+    if(vpNeighKFs.empty())
+        return;
 
-    cv::Mat Rcw1 = mpCurrentKeyFrame->GetRotation();
-    cv::Mat Rwc1 = Rcw1.t();
-    cv::Mat tcw1 = mpCurrentKeyFrame->GetTranslation();
-    cv::Mat Tcw1(3,4,CV_32F);
-    Rcw1.copyTo(Tcw1.colRange(0,3));
-    tcw1.copyTo(Tcw1.col(3));
-    cv::Mat Ow1 = mpCurrentKeyFrame->GetCameraCenter();
+    // Matching and triangulation only read the keyframes: neighbors are processed in parallel
+    vector<vector<TriangulatedMatch> > vvTriangulated(vpNeighKFs.size());
+    DUtils::ParallelFor(vpNeighKFs.size(), [&](size_t i)
+    {
+        // Skip the remaining neighbors if a new keyframe is waiting
+        if(i>0 && CheckNewKeyFrames())
+            return;
 
-    const float &fx1 = mpCurrentKeyFrame->fx;
-    const float &fy1 = mpCurrentKeyFrame->fy;
-    const float &cx1 = mpCurrentKeyFrame->cx;
-    const float &cy1 = mpCurrentKeyFrame->cy;
-    const float &invfx1 = mpCurrentKeyFrame->invfx;
-    const float &invfy1 = mpCurrentKeyFrame->invfy;
+        ORBmatcher matcher(0.6,false);
+        TriangulateMatches(matcher,vpNeighKFs[i],vvTriangulated[i]);
+    });
 
-    const float ratioFactor = 1.5f*mpCurrentKeyFrame->mfScaleFactor;
+    // Create the MapPoints in the order of the neighbors. If a keypoint of the current
+    // keyframe was triangulated with several neighbors, the first one is kept.
+    unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
 
     int nnew=0;
-
-    // Search matches with epipolar restriction and triangulate
     for(size_t i=0; i<vpNeighKFs.size(); i++)
     {
-        if(i>0 && CheckNewKeyFrames())
-            return;
-
         KeyFrame* pKF2 = vpNeighKFs[i];
+        const vector<TriangulatedMatch> &vTriangulated = vvTriangulated[i];
 
-        // Check first that baseline is not too short
-        cv::Mat Ow2 = pKF2->GetCameraCenter();
-        cv::Mat vBaseline = Ow2-Ow1;
-        const float baseline = cv::norm(vBaseline);
-
-        if(!mbMonocular)
+        for(size_t j=0; j<vTriangulated.size(); j++)
         {
-            if(baseline<pKF2->mb)
-            continue;
-        }
-        else
-        {
-            const float medianDepthKF2 = pKF2->ComputeSceneMedianDepth(2);
-            const float ratioBaselineDepth = baseline/medianDepthKF2;
-
-            if(ratioBaselineDepth<0.01)
+            const TriangulatedMatch &match = vTriangulated[j];
+            if(mpCurrentKeyFrame->GetMapPoint(match.idx1))
                 continue;
-        }
 
-        // Compute Fundamental Matrix
-        cv::Mat F12 = ComputeF12(mpCurrentKeyFrame,pKF2);
-
-        // Search matches that fullfil epipolar constraint
-        vector<pair<size_t,size_t> > vMatchedIndices;
-        matcher.SearchForTriangulation(mpCurrentKeyFrame,pKF2,F12,vMatchedIndices,false);
-
-        cv::Mat Rcw2 = pKF2->GetRotation();
-        cv::Mat Rwc2 = Rcw2.t();
-        cv::Mat tcw2 = pKF2->GetTranslation();
-        cv::Mat Tcw2(3,4,CV_32F);
-        Rcw2.copyTo(Tcw2.colRange(0,3));
-        tcw2.copyTo(Tcw2.col(3));
-
-        const float &fx2 = pKF2->fx;
-        const float &fy2 = pKF2->fy;
-        const float &cx2 = pKF2->cx;
-        const float &cy2 = pKF2->cy;
-        const float &invfx2 = pKF2->invfx;
-        const float &invfy2 = pKF2->invfy;
-
-        // Triangulate each match
-        const int nmatches = vMatchedIndices.size();
-        for(int ikp=0; ikp<nmatches; ikp++)
-        {
-            const int &idx1 = vMatchedIndices[ikp].first;
-            const int &idx2 = vMatchedIndices[ikp].second;
+            MapPoint* pMP = new MapPoint(Converter::toCvMat(match.x3D),mpCurrentKeyFrame,mpMap);
 
-            const cv::KeyPoint &kp1 = mpCurrentKeyFrame->mvKeysUn[idx1];
-            const float kp1_ur=mpCurrentKeyFrame->mvuRight[idx1];
-            bool bStereo1 = kp1_ur>=0;
+            pMP->AddObservation(mpCurrentKeyFrame,match.idx1);
+            pMP->AddObservation(pKF2,match.idx2);
 
-            const cv::KeyPoint &kp2 = pKF2->mvKeysUn[idx2];
-            const float kp2_ur = pKF2->mvuRight[idx2];
-            bool bStereo2 = kp2_ur>=0;
+            mpCurrentKeyFrame->AddMapPoint(pMP,match.idx1);
+            pKF2->AddMapPoint(pMP,match.idx2);
 
-            // Check parallax between rays
-            cv::Mat xn1 = (cv::Mat_<float>(3,1) << (kp1.pt.x-cx1)*invfx1, (kp1.pt.y-cy1)*invfy1, 1.0);
-            cv::Mat xn2 = (cv::Mat_<float>(3,1) << (kp2.pt.x-cx2)*invfx2, (kp2.pt.y-cy2)*invfy2, 1.0);
+            pMP->ComputeDistinctiveDescriptors();
 
-            cv::Mat ray1 = Rwc1*xn1;
-            cv::Mat ray2 = Rwc2*xn2;
-            const float cosParallaxRays = ray1.dot(ray2)/(cv::norm(ray1)*cv::norm(ray2));
+            pMP->UpdateNormalAndDepth();
 
-            float cosParallaxStereo = cosParallaxRays+1;
-            float cosParallaxStereo1 = cosParallaxStereo;
-            float cosParallaxStereo2 = cosParallaxStereo;
+            mpMap->AddMapPoint(pMP);
+            mlpRecentAddedMapPoints.push_back(pMP);
 
-            if(bStereo1)
-                cosParallaxStereo1 = cos(2*atan2(mpCurrentKeyFrame->mb/2,mpCurrentKeyFrame->mvDepth[idx1]));
-            else if(bStereo2)
-                cosParallaxStereo2 = cos(2*atan2(pKF2->mb/2,pKF2->mvDepth[idx2]));
+            nnew++;
+        }
+    }
+}
 
-            cosParallaxStereo = min(cosParallaxStereo1,cosParallaxStereo2);
+void LocalMapping::TriangulateMatches(ORBmatcher &matcher, KeyFrame* pKF2, vector<TriangulatedMatch> &vTriangulated)
+{
+    KeyFrame* pKF1 = mpCurrentKeyFrame;
 
-            cv::Mat x3D;
-            if(cosParallaxRays<cosParallaxStereo && cosParallaxRays>0 && (bStereo1 || bStereo2 || cosParallaxRays<0.9998))
-            {
-                // Linear Triangulation Method
-                cv::Mat A(4,4,CV_32F);
-                A.row(0) = xn1.at<float>(0)*Tcw1.row(2)-Tcw1.row(0);
-                A.row(1) = xn1.at<float>(1)*Tcw1.row(2)-Tcw1.row(1);
-                A.row(2) = xn2.at<float>(0)*Tcw2.row(2)-Tcw2.row(0);
-                A.row(3) = xn2.at<float>(1)*Tcw2.row(2)-Tcw2.row(1);
+    const Eigen::Matrix3f Rcw1 = pKF1->GetRotationEig();
+    const Eigen::Matrix3f Rwc1 = Rcw1.transpose();
+    const Eigen::Vector3f tcw1 = pKF1->GetTranslationEig();
+    Eigen::Matrix<float,3,4> Tcw1;
+    Tcw1 << Rcw1, tcw1;
+    const Eigen::Vector3f Ow1 = pKF1->GetCameraCenterEig();
 
-                cv::Mat w,u,vt;
-                cv::SVD::compute(A,w,u,vt,cv::SVD::MODIFY_A| cv::SVD::FULL_UV);
+    const float &fx1 = pKF1->fx;
+    const float &fy1 = pKF1->fy;
+    const float &cx1 = pKF1->cx;
+    const float &cy1 = pKF1->cy;
+    const float &invfx1 = pKF1->invfx;
+    const float &invfy1 = pKF1->invfy;
 
-                x3D = vt.row(3).t();
+    const float ratioFactor = 1.5f*pKF1->mfScaleFactor;
 
-                if(x3D.at<float>(3)==0)
-                    continue;
+    // Check first that baseline is not too short
+    const Eigen::Vector3f Ow2 = pKF2->GetCameraCenterEig();
+    const float baseline = (Ow2-Ow1).norm();
 
-                // Euclidean coordinates
-                x3D = x3D.rowRange(0,3)/x3D.at<float>(3);
+    if(!mbMonocular)
+    {
+        if(baseline<pKF2->mb)
+        return;
+    }
+    else
+    {
+        const float medianDepthKF2 = pKF2->ComputeSceneMedianDepth(2);
+        const float ratioBaselineDepth = baseline/medianDepthKF2;
 
-            }
-            else if(bStereo1 && cosParallaxStereo1<cosParallaxStereo2)
-            {
-                x3D = mpCurrentKeyFrame->UnprojectStereo(idx1);                
-            }
-            else if(bStereo2 && cosParallaxStereo2<cosParallaxStereo1)
-            {
-                x3D = pKF2->UnprojectStereo(idx2);
-            }
-            else
-                continue; //No stereo and very low parallax
+        if(ratioBaselineDepth<0.01)
+            return;
+    }
 
-            cv::Mat x3Dt = x3D.t();
+    // Compute Fundamental Matrix
+    cv::Mat F12 = ComputeF12(pKF1,pKF2);
+
+    // Search matches that fullfil epipolar constraint
+    vector<pair<size_t,size_t> > vMatchedIndices;
+    matcher.SearchForTriangulation(pKF1,pKF2,F12,vMatchedIndices,false);
+
+    const Eigen::Matrix3f Rcw2 = pKF2->GetRotationEig();
+    const Eigen::Matrix3f Rwc2 = Rcw2.transpose();
+    const Eigen::Vector3f tcw2 = pKF2->GetTranslationEig();
+    Eigen::Matrix<float,3,4> Tcw2;
+    Tcw2 << Rcw2, tcw2;
+
+    const float &fx2 = pKF2->fx;
+    const float &fy2 = pKF2->fy;
+    const float &cx2 = pKF2->cx;
+    const float &cy2 = pKF2->cy;
+    const float &invfx2 = pKF2->invfx;
+    const float &invfy2 = pKF2->invfy;
+
+    // Triangulate each match
+    const int nmatches = vMatchedIndices.size();
+    for(int ikp=0; ikp<nmatches; ikp++)
+    {
+        const int &idx1 = vMatchedIndices[ikp].first;
+        const int &idx2 = vMatchedIndices[ikp].second;
 
-            //Check triangulation in front of cameras
-            float z1 = Rcw1.row(2).dot(x3Dt)+tcw1.at<float>(2);
-            if(z1<=0)
-                continue;
+        const cv::KeyPoint &kp1 = pKF1->mvKeysUn[idx1];
+        const float kp1_ur=pKF1->mvuRight[idx1];
+        bool bStereo1 = kp1_ur>=0;
 
-            float z2 = Rcw2.row(2).dot(x3Dt)+tcw2.at<float>(2);
-            if(z2<=0)
-                continue;
+        const cv::KeyPoint &kp2 = pKF2->mvKeysUn[idx2];
+        const float kp2_ur = pKF2->mvuRight[idx2];
+        bool bStereo2 = kp2_ur>=0;
 
-            //Check reprojection error in first keyframe
-            const float &sigmaSquare1 = mpCurrentKeyFrame->mvLevelSigma2[kp1.octave];
-            const float x1 = Rcw1.row(0).dot(x3Dt)+tcw1.at<float>(0);
-            const float y1 = Rcw1.row(1).dot(x3Dt)+tcw1.at<float>(1);
-            const float invz1 = 1.0/z1;
+        // Check parallax between rays
+        const Eigen::Vector3f xn1((kp1.pt.x-cx1)*invfx1, (kp1.pt.y-cy1)*invfy1, 1.0f);
+        const Eigen::Vector3f xn2((kp2.pt.x-cx2)*invfx2, (kp2.pt.y-cy2)*invfy2, 1.0f);
 
-            if(!bStereo1)
-            {
-                float u1 = fx1*x1*invz1+cx1;
-                float v1 = fy1*y1*invz1+cy1;
-                float errX1 = u1 - kp1.pt.x;
-                float errY1 = v1 - kp1.pt.y;
-                if((errX1*errX1+errY1*errY1)>5.991*sigmaSquare1)
-                    continue;
-            }
-            else
-            {
-                float u1 = fx1*x1*invz1+cx1;
-                float u1_r = u1 - mpCurrentKeyFrame->mbf*invz1;
-                float v1 = fy1*y1*invz1+cy1;
-                float errX1 = u1 - kp1.pt.x;
-                float errY1 = v1 - kp1.pt.y;
-                float errX1_r = u1_r - kp1_ur;
-                if((errX1*errX1+errY1*errY1+errX1_r*errX1_r)>7.8*sigmaSquare1)
-                    continue;
-            }
+        const Eigen::Vector3f ray1 = Rwc1*xn1;
+        const Eigen::Vector3f ray2 = Rwc2*xn2;
+        const float cosParallaxRays = ray1.dot(ray2)/(ray1.norm()*ray2.norm());
 
-            //Check reprojection error in second keyframe
-            const float sigmaSquare2 = pKF2->mvLevelSigma2[kp2.octave];
-            const float x2 = Rcw2.row(0).dot(x3Dt)+tcw2.at<float>(0);
-            const float y2 = Rcw2.row(1).dot(x3Dt)+tcw2.at<float>(1);
-            const float invz2 = 1.0/z2;
-            if(!bStereo2)
-            {
-                float u2 = fx2*x2*invz2+cx2;
-                float v2 = fy2*y2*invz2+cy2;
-                float errX2 = u2 - kp2.pt.x;
-                float errY2 = v2 - kp2.pt.y;
-                if((errX2*errX2+errY2*errY2)>5.991*sigmaSquare2)
-                    continue;
-            }
-            else
-            {
-                float u2 = fx2*x2*invz2+cx2;
-                float u2_r = u2 - mpCurrentKeyFrame->mbf*invz2;
-                float v2 = fy2*y2*invz2+cy2;
-                float errX2 = u2 - kp2.pt.x;
-                float errY2 = v2 - kp2.pt.y;
-                float errX2_r = u2_r - kp2_ur;
-                if((errX2*errX2+errY2*errY2+errX2_r*errX2_r)>7.8*sigmaSquare2)
-                    continue;
-            }
+        float cosParallaxStereo = cosParallaxRays+1;
+        float cosParallaxStereo1 = cosParallaxStereo;
+        float cosParallaxStereo2 = cosParallaxStereo;
 
-            //Check scale consistency
-            cv::Mat normal1 = x3D-Ow1;
-            float dist1 = cv::norm(normal1);
+        if(bStereo1)
+            cosParallaxStereo1 = cos(2*atan2(pKF1->mb/2,pKF1->mvDepth[idx1]));
+        else if(bStereo2)
+            cosParallaxStereo2 = cos(2*atan2(pKF2->mb/2,pKF2->mvDepth[idx2]));
 
-            cv::Mat normal2 = x3D-Ow2;
-            float dist2 = cv::norm(normal2);
+        cosParallaxStereo = min(cosParallaxStereo1,cosParallaxStereo2);
 
-            if(dist1==0 || dist2==0)
+        Eigen::Vector3f x3D;
+        if(cosParallaxRays<cosParallaxStereo && cosParallaxRays>0 && (bStereo1 || bStereo2 || cosParallaxRays<0.9998))
+        {
+            // Linear Triangulation Method, A*[x3D;1]=0 solved in the least squares sense
+            Eigen::Matrix4f A;
+            A.row(0) = xn1(0)*Tcw1.row(2)-Tcw1.row(0);
+            A.row(1) = xn1(1)*Tcw1.row(2)-Tcw1.row(1);
+            A.row(2) = xn2(0)*Tcw2.row(2)-Tcw2.row(0);
+            A.row(3) = xn2(1)*Tcw2.row(2)-Tcw2.row(1);
+
+            const Eigen::Matrix<float,4,3> B = A.leftCols<3>();
+            const Eigen::Matrix3f BtB = B.transpose()*B;
+
+            // Point at infinity
+            bool bInvertible;
+            Eigen::Matrix3f BtBinv;
+            BtB.computeInverseWithCheck(BtBinv,bInvertible,1e-10f);
+            if(!bInvertible)
                 continue;
 
-            const float ratioDist = dist2/dist1;
-            const float ratioOctave = mpCurrentKeyFrame->mvScaleFactors[kp1.octave]/pKF2->mvScaleFactors[kp2.octave];
+            x3D = -BtBinv*(B.transpose()*A.col(3));
 
-            /*if(fabs(ratioDist-ratioOctave)>ratioFactor)
-                continue;*/
-            if(ratioDist*ratioFactor<ratioOctave || ratioDist>ratioOctave*ratioFactor)
-                continue;
+        }
+        else if(bStereo1 && cosParallaxStereo1<cosParallaxStereo2)
+        {
+            x3D = Converter::toVector3f(pKF1->UnprojectStereo(idx1));
+        }
+        else if(bStereo2 && cosParallaxStereo2<cosParallaxStereo1)
+        {
+            x3D = Converter::toVector3f(pKF2->UnprojectStereo(idx2));
+        }
+        else
+            continue; //No stereo and very low parallax
 
-            // Triangulation is succesfull
-            MapPoint* pMP = new MapPoint(x3D,mpCurrentKeyFrame,mpMap);
+        //Check triangulation in front of cameras
+        const Eigen::Vector3f x3Dc1 = Rcw1*x3D+tcw1;
+        const float z1 = x3Dc1(2);
+        if(z1<=0)
+            continue;
 
-            pMP->AddObservation(mpCurrentKeyFrame,idx1);            
-            pMP->AddObservation(pKF2,idx2);
+        const Eigen::Vector3f x3Dc2 = Rcw2*x3D+tcw2;
+        const float z2 = x3Dc2(2);
+        if(z2<=0)
+            continue;
 
-            mpCurrentKeyFrame->AddMapPoint(pMP,idx1);
-            pKF2->AddMapPoint(pMP,idx2);
+        //Check reprojection error in first keyframe
+        const float &sigmaSquare1 = pKF1->mvLevelSigma2[kp1.octave];
+        const float x1 = x3Dc1(0);
+        const float y1 = x3Dc1(1);
+        const float invz1 = 1.0/z1;
 
-            pMP->ComputeDistinctiveDescriptors();
+        if(!bStereo1)
+        {
+            float u1 = fx1*x1*invz1+cx1;
+            float v1 = fy1*y1*invz1+cy1;
+            float errX1 = u1 - kp1.pt.x;
+            float errY1 = v1 - kp1.pt.y;
+            if((errX1*errX1+errY1*errY1)>5.991*sigmaSquare1)
+                continue;
+        }
+        else
+        {
+            float u1 = fx1*x1*invz1+cx1;
+            float u1_r = u1 - pKF1->mbf*invz1;
+            float v1 = fy1*y1*invz1+cy1;
+            float errX1 = u1 - kp1.pt.x;
+            float errY1 = v1 - kp1.pt.y;
+            float errX1_r = u1_r - kp1_ur;
+            if((errX1*errX1+errY1*errY1+errX1_r*errX1_r)>7.8*sigmaSquare1)
+                continue;
+        }
 
-            pMP->UpdateNormalAndDepth();
+        //Check reprojection error in second keyframe
+        const float sigmaSquare2 = pKF2->mvLevelSigma2[kp2.octave];
+        const float x2 = x3Dc2(0);
+        const float y2 = x3Dc2(1);
+        const float invz2 = 1.0/z2;
+        if(!bStereo2)
+        {
+            float u2 = fx2*x2*invz2+cx2;
+            float v2 = fy2*y2*invz2+cy2;
+            float errX2 = u2 - kp2.pt.x;
+            float errY2 = v2 - kp2.pt.y;
+            if((errX2*errX2+errY2*errY2)>5.991*sigmaSquare2)
+                continue;
+        }
+        else
+        {
+            float u2 = fx2*x2*invz2+cx2;
+            float u2_r = u2 - pKF1->mbf*invz2;
+            float v2 = fy2*y2*invz2+cy2;
+            float errX2 = u2 - kp2.pt.x;
+            float errY2 = v2 - kp2.pt.y;
+            float errX2_r = u2_r - kp2_ur;
+            if((errX2*errX2+errY2*errY2+errX2_r*errX2_r)>7.8*sigmaSquare2)
+                continue;
+        }
 
-            mpMap->AddMapPoint(pMP);
-            mlpRecentAddedMapPoints.push_back(pMP);
+        //Check scale consistency
+        const float dist1 = (x3D-Ow1).norm();
+        const float dist2 = (x3D-Ow2).norm();
 
-            nnew++;
-        }
+        if(dist1==0 || dist2==0)
+            continue;
+
+        const float ratioDist = dist2/dist1;
+        const float ratioOctave = pKF1->mvScaleFactors[kp1.octave]/pKF2->mvScaleFactors[kp2.octave];
+
+        /*if(fabs(ratioDist-ratioOctave)>ratioFactor)
+            continue;*/
+        if(ratioDist*ratioFactor<ratioOctave || ratioDist>ratioOctave*ratioFactor)
+            continue;
+
+        // Triangulation is succesfull
+        TriangulatedMatch match;
+        match.x3D = x3D;
+        match.idx1 = idx1;
+        match.idx2 = idx2;
+        vTriangulated.push_back(match);
     }
 }
 
@@ -537,16 +608,26 @@ void LocalMapping::SearchInNeighbors()
     }
 
 
-    // Search matches by projection from current KF in target KFs
+    // The search of duplicated MapPoints is done in parallel, then the fusions are applied serially.
+    // Only MapPoints whose observations changed need to update descriptor, normal and depth.
     ORBmatcher matcher;
+    set<MapPoint*> sChangedMPs;
+
+    // Search matches by projection from current KF in target KFs
     vector<MapPoint*> vpMapPointMatches = mpCurrentKeyFrame->GetMapPointMatches();
-    for(vector<KeyFrame*>::iterator vit=vpTargetKFs.begin(), vend=vpTargetKFs.end(); vit!=vend; vit++)
+    vector<FuseJob> vJobs(vpTargetKFs.size());
+    for(size_t i=0; i<vpTargetKFs.size(); i++)
     {
-        KeyFrame* pKFi = *vit;
-
-        matcher.Fuse(pKFi,vpMapPointMatches);
+        vJobs[i].pKF = vpTargetKFs[i];
+        vJobs[i].pvpMapPoints = &vpMapPointMatches;
     }
 
+    vector<FuseMatches> vFuseMatches;
+    RunFuseJobs(vJobs,vFuseMatches);
+
+    for(size_t i=0; i<vJobs.size(); i++)
+        matcher.ApplyFuse(vJobs[i].pKF,vFuseMatches[i],sChangedMPs);
+
     // Search matches by projection from target KFs in current KF
     vector<MapPoint*> vpFuseCandidates;
     vpFuseCandidates.reserve(vpTargetKFs.size()*vpMapPointMatches.size());
@@ -569,21 +650,33 @@ void LocalMapping::SearchInNeighbors()
         }
     }
 
-    matcher.Fuse(mpCurrentKeyFrame,vpFuseCandidates);
+    // All candidates are fused in the current KF, split them among the threads
+    const size_t nChunks = min(vpFuseCandidates.size(),(size_t)max(thread::hardware_concurrency(),1u));
+    vector<vector<MapPoint*> > vvpCandidateChunks(nChunks);
+    for(size_t i=0; i<vpFuseCandidates.size(); i++)
+        vvpCandidateChunks[i%nChunks].push_back(vpFuseCandidates[i]);
+
+    vJobs.resize(nChunks);
+    for(size_t i=0; i<nChunks; i++)
+    {
+        vJobs[i].pKF = mpCurrentKeyFrame;
+        vJobs[i].pvpMapPoints = &vvpCandidateChunks[i];
+    }
+
+    RunFuseJobs(vJobs,vFuseMatches);
+
+    for(size_t i=0; i<vJobs.size(); i++)
+        matcher.ApplyFuse(mpCurrentKeyFrame,vFuseMatches[i],sChangedMPs);
 
 
     // Update points
-    vpMapPointMatches = mpCurrentKeyFrame->GetMapPointMatches();
-    for(size_t i=0, iend=vpMapPointMatches.size(); i<iend; i++)
+    for(set<MapPoint*>::iterator sit=sChangedMPs.begin(), send=sChangedMPs.end(); sit!=send; sit++)
     {
-        MapPoint* pMP=vpMapPointMatches[i];
-        if(pMP)
+        MapPoint* pMP = *sit;
+        if(!pMP->isBad())
         {
-            if(!pMP->isBad())
-            {
-                pMP->ComputeDistinctiveDescriptors();
-                pMP->UpdateNormalAndDepth();
-            }
+            pMP->ComputeDistinctiveDescriptors();
+            pMP->UpdateNormalAndDepth();
         }
     }
 
@@ -591,6 +684,17 @@ void LocalMapping::SearchInNeighbors()
     mpCurrentKeyFrame->UpdateConnections();
 }
 
+void LocalMapping::RunFuseJobs(const vector<FuseJob> &vJobs, vector<FuseMatches> &vMatches)
+{
+    vMatches.assign(vJobs.size(),FuseMatches());
+
+    DUtils::ParallelFor(vJobs.size(), [&](size_t i)
+    {
+        ORBmatcher matcher;
+        matcher.SearchFuse(vJobs[i].pKF,*vJobs[i].pvpMapPoints,vMatches[i]);
+    });
+}
+
 cv::Mat LocalMapping::ComputeF12(KeyFrame *&pKF1, KeyFrame *&pKF2)
 {
     cv::Mat R1w = pKF1->GetRotation();
@@ -612,10 +716,13 @@ cv::Mat LocalMapping::ComputeF12(KeyFrame *&pKF1, KeyFrame *&pKF2)
 
 void LocalMapping::RequestStop()
 {
-    unique_lock<mutex> lock(mMutexStop);
-    mbStopRequested = true;
-    unique_lock<mutex> lock2(mMutexNewKFs);
-    mbAbortBA = true;
+    {
+        unique_lock<mutex> lock(mMutexStop);
+        mbStopRequested = true;
+        unique_lock<mutex> lock2(mMutexNewKFs);
+        mbAbortBA = true;
+    }
+    WakeUp();
 }
 
 bool LocalMapping::Stop()
@@ -624,6 +731,7 @@ bool LocalMapping::Stop()
     if(mbStopRequested && !mbNotStop)
     {
         mbStopped = true;
+        mcvStopped.notify_all();
         cout << "Local Mapping STOP" << endl;
         return true;
     }
@@ -637,6 +745,13 @@ bool LocalMapping::isStopped()
     return mbStopped;
 }
 
+void LocalMapping::WaitUntilStopped()
+{
+    unique_lock<mutex> lock(mMutexStop);
+    while(!mbStopped)
+        mcvStopped.wait(lock);
+}
+
 bool LocalMapping::stopRequested()
 {
     unique_lock<mutex> lock(mMutexStop);
@@ -645,15 +760,19 @@ bool LocalMapping::stopRequested()
 
 void LocalMapping::Release()
 {
-    unique_lock<mutex> lock(mMutexStop);
-    unique_lock<mutex> lock2(mMutexFinish);
-    if(mbFinished)
-        return;
-    mbStopped = false;
-    mbStopRequested = false;
-    for(list<KeyFrame*>::iterator lit = mlNewKeyFrames.begin(), lend=mlNewKeyFrames.end(); lit!=lend; lit++)
-        delete *lit;
-    mlNewKeyFrames.clear();
+    {
+        unique_lock<mutex> lock(mMutexStop);
+        unique_lock<mutex> lock2(mMutexFinish);
+        if(mbFinished)
+            return;
+        mbStopped = false;
+        mbStopRequested = false;
+        // Local Mapping is stopped, the queue can be emptied from this thread
+        const vector<KeyFrame*> vpKFs = mNewKeyFrames.Clear();
+        for(vector<KeyFrame*>::const_iterator vit = vpKFs.begin(), vend=vpKFs.end(); vit!=vend; vit++)
+            delete *vit;
+    }
+    WakeUp();
 
     cout << "Local Mapping RELEASE" << endl;
 }
@@ -679,6 +798,10 @@ bool LocalMapping::SetNotStop(bool flag)
 
     mbNotStop = flag;
 
+    // A pending stop request can be served now
+    if(!flag)
+        WakeUp();
+
     return true;
 }
 
@@ -772,17 +895,14 @@ void LocalMapping::RequestReset()
     {
         unique_lock<mutex> lock(mMutexReset);
         mbResetRequested = true;
+        unique_lock<mutex> lock2(mMutexNewKFs);
+        mbAbortBA = true;
     }
+    WakeUp();
 
-    while(1)
-    {
-        {
-            unique_lock<mutex> lock2(mMutexReset);
-            if(!mbResetRequested)
-                break;
-        }
-        usleep(3000);
-    }
+    unique_lock<mutex> lock2(mMutexReset);
+    while(mbResetRequested)
+        mcvReset.wait(lock2);
 }
 
 void LocalMapping::ResetIfRequested()
@@ -790,16 +910,177 @@ void LocalMapping::ResetIfRequested()
     unique_lock<mutex> lock(mMutexReset);
     if(mbResetRequested)
     {
-        mlNewKeyFrames.clear();
+        mNewKeyFrames.Clear();
         mlpRecentAddedMapPoints.clear();
+        ReleaseRetainedPyramids();
+        {
+            unique_lock<mutex> lock2(mMutexRefinement);
+            mbRefinementPending = false;
+        }
         mbResetRequested=false;
+        mcvReset.notify_all();
+    }
+}
+
+void LocalMapping::DeletePyramids(KeyFrame* pKF)
+{
+    for (size_t i = 0; i < pKF->imagePyramidLeft.size(); i++) {
+        delete pKF->imagePyramidLeft[i];
+        delete pKF->imagePyramidRight[i];
+    }
+    pKF->imagePyramidLeft.clear();
+    pKF->imagePyramidRight.clear();
+}
+
+void LocalMapping::ReleasePyramids(KeyFrame* pKF)
+{
+    unique_lock<mutex> lock(mMutexPyramids);
+    if(mnPyramidsAcquired>0)
+        mlpPyramidsToRelease.push_back(pKF);
+    else
+        DeletePyramids(pKF);
+}
+
+void LocalMapping::RetainPyramids(KeyFrame* pKF)
+{
+    unique_lock<mutex> lock(mMutexPyramids);
+    mlpPyramidKeyFrames.push_back(pKF);
+    while((int)mlpPyramidKeyFrames.size()>mnMaxPyramidKeyFrames)
+    {
+        KeyFrame* pOldKF = mlpPyramidKeyFrames.front();
+        mlpPyramidKeyFrames.pop_front();
+        if(mnPyramidsAcquired>0)
+            mlpPyramidsToRelease.push_back(pOldKF);
+        else
+            DeletePyramids(pOldKF);
     }
 }
 
+void LocalMapping::ReleaseRetainedPyramids()
+{
+    unique_lock<mutex> lock(mMutexPyramids);
+    for(list<KeyFrame*>::iterator lit=mlpPyramidKeyFrames.begin(); lit!=mlpPyramidKeyFrames.end(); lit++)
+    {
+        if(mnPyramidsAcquired>0)
+            mlpPyramidsToRelease.push_back(*lit);
+        else
+            DeletePyramids(*lit);
+    }
+    mlpPyramidKeyFrames.clear();
+}
+
+void LocalMapping::AcquirePyramids()
+{
+    unique_lock<mutex> lock(mMutexPyramids);
+    mnPyramidsAcquired++;
+}
+
+void LocalMapping::ReleasePyramidKeyFrames()
+{
+    unique_lock<mutex> lock(mMutexPyramids);
+    mnPyramidsAcquired--;
+    if(mnPyramidsAcquired>0)
+        return;
+    for(list<KeyFrame*>::iterator lit=mlpPyramidsToRelease.begin(); lit!=mlpPyramidsToRelease.end(); lit++)
+        DeletePyramids(*lit);
+    mlpPyramidsToRelease.clear();
+}
+
+void LocalMapping::RequestPhotometricRefinement()
+{
+    unique_lock<mutex> lock(mMutexRefinement);
+    if(!mbPhotometricRefinement)
+        return;
+
+    // A refinement in progress starts again from the newest keyframes
+    mbRefinementPending = true;
+    mnRefinementLastKFId = numeric_limits<long unsigned int>::max();
+}
+
+bool LocalMapping::RefinePhotometricWindow()
+{
+    long unsigned int nLastKFId;
+    {
+        unique_lock<mutex> lock(mMutexRefinement);
+        if(!mbRefinementPending)
+            return false;
+        nLastKFId = mnRefinementLastKFId;
+    }
+
+    if(stopRequested())
+        return false;
+
+    {
+        unique_lock<mutex> lock(mMutexNewKFs);
+        mbAbortBA = false;
+    }
+    // A keyframe inserted before the flag was cleared is processed first
+    if(CheckNewKeyFrames())
+        return true;
+
+    if(nLastKFId==numeric_limits<long unsigned int>::max())
+        cout << "Starting global photometric refinement" << endl;
+
+    // Only this thread deletes the retained pyramids
+    vector<KeyFrame*> vpKFs;
+    {
+        unique_lock<mutex> lock(mMutexPyramids);
+        for(list<KeyFrame*>::iterator lit=mlpPyramidKeyFrames.begin(); lit!=mlpPyramidKeyFrames.end(); lit++)
+        {
+            KeyFrame* pKF = *lit;
+            if(!pKF->isBad() && pKF->mnId<=nLastKFId && !pKF->imagePyramidLeft.empty() && !pKF->imagePyramidRight.empty())
+                vpKFs.push_back(pKF);
+        }
+    }
+    sort(vpKFs.begin(),vpKFs.end(),KeyFrame::lId);
+
+    // Windows of the size of the local photometric BA. The newest keyframe of a window is fixed,
+    // it is the oldest one of the previous window.
+    const size_t nWindow = 10;
+    const int vLevels[3] = {7, 4, 0};
+    const list<KeyFrame*> lWindow(vpKFs.end()-min(nWindow,vpKFs.size()),vpKFs.end());
+    if(lWindow.size()>1)
+    {
+        list<HighGradientPoint*> lHGPoints;
+        for(int l=0; l<3 && !mbAbortBA; l++)
+            Optimizer::LocalPhotometricBundleAdjustment(lWindow, lHGPoints, &mbAbortBA, mpMap, vLevels[l], false,
+                                                        Optimizer::LINEAR_SOLVER_CHOLESKY);
+    }
+
+    // New keyframe, stop, reset or finish: the window is run again when idle
+    if(mbAbortBA)
+        return true;
+
+    if(vpKFs.size()>nWindow)
+    {
+        unique_lock<mutex> lock(mMutexRefinement);
+        mnRefinementLastKFId = lWindow.front()->mnId;
+        return true;
+    }
+
+    {
+        unique_lock<mutex> lock(mMutexRefinement);
+        mbRefinementPending = false;
+    }
+    mpMap->InformNewBigChange();
+
+    // The retained pyramids are only kept for the refinement
+    ReleaseRetainedPyramids();
+
+    cout << "Global photometric refinement finished" << endl;
+
+    return true;
+}
+
 void LocalMapping::RequestFinish()
 {
-    unique_lock<mutex> lock(mMutexFinish);
-    mbFinishRequested = true;
+    {
+        unique_lock<mutex> lock(mMutexFinish);
+        mbFinishRequested = true;
+        unique_lock<mutex> lock2(mMutexNewKFs);
+        mbAbortBA = true;
+    }
+    WakeUp();
 }
 
 bool LocalMapping::CheckFinish()
@@ -814,6 +1095,7 @@ void LocalMapping::SetFinish()
     mbFinished = true;    
     unique_lock<mutex> lock2(mMutexStop);
     mbStopped = true;
+    mcvStopped.notify_all();
 }
 
 bool LocalMapping::isFinished()
@@ -26,21 +26,31 @@
 
 #include "Optimizer.h"
 
+#include "EssentialGraph.h"
+
 #include "ORBmatcher.h"
 
+#include "Thirdparty/DBoW2/DUtils/ParallelFor.h"
+
 #include<mutex>
 #include<thread>
+#include<atomic>
+#include<algorithm>
+#include<unistd.h>
 
 
 namespace ORB_SLAM2
 {
 
-LoopClosing::LoopClosing(Map *pMap, KeyFrameDatabase *pDB, ORBVocabulary *pVoc, const bool bFixScale):
-    mbResetRequested(false), mbFinishRequested(false), mbFinished(true), mpMap(pMap),
-    mpKeyFrameDB(pDB), mpORBVocabulary(pVoc), mpMatchedKF(NULL), mLastLoopKFid(0), mbRunningGBA(false), mbFinishedGBA(true),
+LoopClosing::LoopClosing(Map *pMap, KeyFrameDatabase *pDB, ORBVocabulary *pVoc, const bool bFixScale, const int nQueueCapacity):
+    mbWakeUp(false), mbResetRequested(false), mbFinishRequested(false), mbFinished(true), mpMap(pMap),
+    mpKeyFrameDB(pDB), mpORBVocabulary(pVoc), mLoopKeyFrameQueue(nQueueCapacity), mpMatchedKF(NULL), mLastLoopKFid(0), mbRunningGBA(false), mbFinishedGBA(true),
     mbStopGBA(false), mpThreadGBA(NULL), mbFixScale(bFixScale), mnFullBAIdx(0)
 {
     mnCovisibilityConsistencyTh = 3;
+    mpEssentialGraph = new EssentialGraph(pMap,bFixScale);
+    mbGlobalBA = false;
+    mnGBAPartitionSize = 200;
 }
 
 void LoopClosing::SetTracker(Tracking *pTracker)
@@ -53,6 +63,13 @@ void LoopClosing::SetLocalMapper(LocalMapping *pLocalMapper)
     mpLocalMapper=pLocalMapper;
 }
 
+void LoopClosing::SetGlobalBundleAdjustment(const bool bActive, const int nPartitionSize)
+{
+    mbGlobalBA = bActive;
+    if(nPartitionSize>0)
+        mnGBAPartitionSize = nPartitionSize;
+}
+
 
 void LoopClosing::Run()
 {
@@ -81,7 +98,8 @@ void LoopClosing::Run()
         if(CheckFinish())
             break;
 
-        usleep(5000);
+        if(!CheckNewKeyFrames())
+            WaitForEvent();
     }
 
     SetFinish();
@@ -89,26 +107,42 @@ void LoopClosing::Run()
 
 void LoopClosing::InsertKeyFrame(KeyFrame *pKF)
 {
-    unique_lock<mutex> lock(mMutexLoopQueue);
-    if(pKF->mnId!=0)
-        mlpLoopKeyFrameQueue.push_back(pKF);
+    if(pKF->mnId==0)
+        return;
+
+    // If loop detection falls behind, the keyframe is not checked for loops
+    // but it is still added to the database for relocalization and future loops
+    if(!mLoopKeyFrameQueue.Push(pKF))
+        mpKeyFrameDB->add(pKF);
+
+    WakeUp();
+}
+
+void LoopClosing::WakeUp()
+{
+    unique_lock<mutex> lock(mMutexWakeUp);
+    mbWakeUp = true;
+    mcvWakeUp.notify_one();
+}
+
+void LoopClosing::WaitForEvent()
+{
+    unique_lock<mutex> lock(mMutexWakeUp);
+    while(!mbWakeUp)
+        mcvWakeUp.wait(lock);
+    mbWakeUp = false;
 }
 
 bool LoopClosing::CheckNewKeyFrames()
 {
-    unique_lock<mutex> lock(mMutexLoopQueue);
-    return(!mlpLoopKeyFrameQueue.empty());
+    return(!mLoopKeyFrameQueue.Empty());
 }
 
 bool LoopClosing::DetectLoop()
 {
-    {
-        unique_lock<mutex> lock(mMutexLoopQueue);
-        mpCurrentKF = mlpLoopKeyFrameQueue.front();
-        mlpLoopKeyFrameQueue.pop_front();
-        // Avoid that a keyframe can be erased while it is being process by this thread
-        mpCurrentKF->SetNotErase();
-    }
+    mpCurrentKF = mLoopKeyFrameQueue.Pop();
+    // Avoid that a keyframe can be erased while it is being process by this thread
+    mpCurrentKF->SetNotErase();
 
     //If the map contains less than 10 KF or less than 10 KF have passed from last loop detection
     if(mpCurrentKF->mnId<mLastLoopKFid+10)
@@ -234,114 +268,31 @@ bool LoopClosing::ComputeSim3()
 
     const int nInitialCandidates = mvpEnoughConsistentCandidates.size();
 
-    // We compute first ORB matches for each candidate
-    // If enough matches are found, we setup a Sim3Solver
-    ORBmatcher matcher(0.75,true);
-
-    vector<Sim3Solver*> vpSim3Solvers;
-    vpSim3Solvers.resize(nInitialCandidates);
-
-    vector<vector<MapPoint*> > vvpMapPointMatches;
-    vvpMapPointMatches.resize(nInitialCandidates);
-
-    vector<bool> vbDiscarded;
-    vbDiscarded.resize(nInitialCandidates);
-
-    int nCandidates=0; //candidates with enough matches
-
+    // avoid that local mapping erase them while they are being processed in this thread
     for(int i=0; i<nInitialCandidates; i++)
-    {
-        KeyFrame* pKF = mvpEnoughConsistentCandidates[i];
-
-        // avoid that local mapping erase it while it is being processed in this thread
-        pKF->SetNotErase();
-
-        if(pKF->isBad())
-        {
-            vbDiscarded[i] = true;
-            continue;
-        }
+        mvpEnoughConsistentCandidates[i]->SetNotErase();
 
-        int nmatches = matcher.SearchByBoW(mpCurrentKF,pKF,vvpMapPointMatches[i]);
+    // Candidates are matched and verified in parallel, the successful one with the lowest index is the loop
+    vector<g2o::Sim3,Eigen::aligned_allocator<g2o::Sim3> > vgScm(nInitialCandidates);
+    vector<vector<MapPoint*> > vvpMapPointMatches(nInitialCandidates);
+    atomic<int> nMatchedCandidate(-1);
 
-        if(nmatches<20)
-        {
-            vbDiscarded[i] = true;
-            continue;
-        }
-        else
-        {
-            Sim3Solver* pSolver = new Sim3Solver(mpCurrentKF,pKF,vvpMapPointMatches[i],mbFixScale);
-            pSolver->SetRansacParameters(0.99,20,300);
-            vpSim3Solvers[i] = pSolver;
-        }
-
-        nCandidates++;
-    }
-
-    bool bMatch = false;
-
-    // Perform alternatively RANSAC iterations for each candidate
-    // until one is succesful or all fail
-    while(nCandidates>0 && !bMatch)
+    DUtils::ParallelFor(nInitialCandidates, [&](size_t i)
     {
-        for(int i=0; i<nInitialCandidates; i++)
-        {
-            if(vbDiscarded[i])
-                continue;
-
-            KeyFrame* pKF = mvpEnoughConsistentCandidates[i];
-
-            // Perform 5 Ransac Iterations
-            vector<bool> vbInliers;
-            int nInliers;
-            bool bNoMore;
-
-            Sim3Solver* pSolver = vpSim3Solvers[i];
-            cv::Mat Scm  = pSolver->iterate(5,bNoMore,vbInliers,nInliers);
-
-            // If Ransac reachs max. iterations discard keyframe
-            if(bNoMore)
-            {
-                vbDiscarded[i]=true;
-                nCandidates--;
-            }
-
-            // If RANSAC returns a Sim3, perform a guided matching and optimize with all correspondences
-            if(!Scm.empty())
-            {
-                vector<MapPoint*> vpMapPointMatches(vvpMapPointMatches[i].size(), static_cast<MapPoint*>(NULL));
-                for(size_t j=0, jend=vbInliers.size(); j<jend; j++)
-                {
-                    if(vbInliers[j])
-                       vpMapPointMatches[j]=vvpMapPointMatches[i][j];
-                }
-
-                cv::Mat R = pSolver->GetEstimatedRotation();
-                cv::Mat t = pSolver->GetEstimatedTranslation();
-                const float s = pSolver->GetEstimatedScale();
-                matcher.SearchBySim3(mpCurrentKF,pKF,vpMapPointMatches,s,R,t,7.5);
-
-                g2o::Sim3 gScm(Converter::toMatrix3d(R),Converter::toVector3d(t),s);
-                const int nInliers = Optimizer::OptimizeSim3(mpCurrentKF, pKF, vpMapPointMatches, gScm, 10, mbFixScale);
-
-                // If optimization is succesful stop ransacs and continue
-                if(nInliers>=20)
-                {
-                    bMatch = true;
-                    mpMatchedKF = pKF;
-                    g2o::Sim3 gSmw(Converter::toMatrix3d(pKF->GetRotation()),Converter::toVector3d(pKF->GetTranslation()),1.0);
-                    mg2oScw = gScm*gSmw;
-                    mScw = Converter::toCvMat(mg2oScw);
+        const int nCandidate = i;
+        int nBest = nMatchedCandidate;
+        if(nBest>=0 && nBest<nCandidate)
+            return;
 
-                    mvpCurrentMatchedPoints = vpMapPointMatches;
-                    break;
-                }
-            }
+        if(VerifyCandidate(mvpEnoughConsistentCandidates[i],nCandidate,vgScm[i],vvpMapPointMatches[i],nMatchedCandidate))
+        {
+            // The verified candidate with the lowest index is the loop, as if they were checked in order
+            nBest = nMatchedCandidate;
+            while((nBest<0 || nCandidate<nBest) && !nMatchedCandidate.compare_exchange_weak(nBest,nCandidate));
         }
-    }
+    });
 
-    if(!bMatch)
+    if(nMatchedCandidate<0)
     {
         for(int i=0; i<nInitialCandidates; i++)
              mvpEnoughConsistentCandidates[i]->SetErase();
@@ -349,6 +300,13 @@ bool LoopClosing::ComputeSim3()
         return false;
     }
 
+    mpMatchedKF = mvpEnoughConsistentCandidates[nMatchedCandidate];
+    g2o::Sim3 gSmw(Converter::toMatrix3d(mpMatchedKF->GetRotation()),Converter::toVector3d(mpMatchedKF->GetTranslation()),1.0);
+    mg2oScw = vgScm[nMatchedCandidate]*gSmw;
+    mScw = Converter::toCvMat(mg2oScw);
+
+    mvpCurrentMatchedPoints = vvpMapPointMatches[nMatchedCandidate];
+
     // Retrieve MapPoints seen in Loop Keyframe and neighbors
     vector<KeyFrame*> vpLoopConnectedKFs = mpMatchedKF->GetVectorCovisibleKeyFrames();
     vpLoopConnectedKFs.push_back(mpMatchedKF);
@@ -372,6 +330,7 @@ bool LoopClosing::ComputeSim3()
     }
 
     // Find more matches projecting with the computed Sim3
+    ORBmatcher matcher(0.75,true);
     matcher.SearchByProjection(mpCurrentKF, mScw, mvpLoopMapPoints, mvpCurrentMatchedPoints,10);
 
     // If enough matches accept Loop
@@ -399,14 +358,64 @@ bool LoopClosing::ComputeSim3()
 
 }
 
+bool LoopClosing::VerifyCandidate(KeyFrame *pKF, const int nCandidate, g2o::Sim3 &gScm, vector<MapPoint*> &vpMapPointMatches,
+                                  const atomic<int> &nMatchedCandidate)
+{
+    if(pKF->isBad())
+        return false;
+
+    // We compute first ORB matches with the candidate
+    // If enough matches are found, we setup a Sim3Solver
+    ORBmatcher matcher(0.75,true);
+
+    vector<MapPoint*> vpBoWMatches;
+    const int nmatches = matcher.SearchByBoW(mpCurrentKF,pKF,vpBoWMatches);
+    if(nmatches<20)
+        return false;
+
+    Sim3Solver solver(mpCurrentKF,pKF,vpBoWMatches,mbFixScale);
+    solver.SetRansacParameters(0.99,20,300);
+
+    // Perform 5 Ransac Iterations at a time, until RANSAC reachs max. iterations or a candidate with a lower index is verified
+    bool bNoMore = false;
+    while(!bNoMore && (nMatchedCandidate<0 || nMatchedCandidate>nCandidate))
+    {
+        vector<bool> vbInliers;
+        int nInliers;
+
+        cv::Mat Scm  = solver.iterate(5,bNoMore,vbInliers,nInliers);
+
+        // If RANSAC returns a Sim3, perform a guided matching and optimize with all correspondences
+        if(Scm.empty())
+            continue;
+
+        vpMapPointMatches.assign(vpBoWMatches.size(), static_cast<MapPoint*>(NULL));
+        for(size_t j=0, jend=vbInliers.size(); j<jend; j++)
+        {
+            if(vbInliers[j])
+               vpMapPointMatches[j]=vpBoWMatches[j];
+        }
+
+        cv::Mat R = solver.GetEstimatedRotation();
+        cv::Mat t = solver.GetEstimatedTranslation();
+        const float s = solver.GetEstimatedScale();
+        matcher.SearchBySim3(mpCurrentKF,pKF,vpMapPointMatches,s,R,t,7.5);
+
+        gScm = g2o::Sim3(Converter::toMatrix3d(R),Converter::toVector3d(t),s);
+        const int nOptInliers = Optimizer::OptimizeSim3(mpCurrentKF, pKF, vpMapPointMatches, gScm, 10, mbFixScale);
+
+        // If optimization is succesful stop ransacs and continue
+        if(nOptInliers>=20)
+            return true;
+    }
+
+    return false;
+}
+
 void LoopClosing::CorrectLoop()
 {
     cout << "Loop detected!" << endl;
 
-    // Send a stop signal to Local Mapping
-    // Avoid new keyframes are inserted while correcting the loop
-    mpLocalMapper->RequestStop();
-
     // If a Global Bundle Adjustment is running, abort it
     if(isRunningGBA())
     {
@@ -422,11 +431,8 @@ void LoopClosing::CorrectLoop()
         }
     }
 
-    // Wait until Local Mapping has effectively stopped
-    while(!mpLocalMapper->isStopped())
-    {
-        usleep(1000);
-    }
+    // Corrected poses, fusion matches and the optimized essential graph are computed without modifying
+    // the map while Local Mapping keeps running. They are applied at the end in a single critical section.
 
     // Ensure current keyframe is updated
     mpCurrentKF->UpdateConnections();
@@ -448,6 +454,9 @@ void LoopClosing::CorrectLoop()
         {
             KeyFrame* pKFi = *vit;
 
+            // avoid that local mapping erase it before the correction is applied
+            pKFi->SetNotErase();
+
             cv::Mat Tiw = pKFi->GetPose();
 
             if(pKFi!=mpCurrentKF)
@@ -467,151 +476,284 @@ void LoopClosing::CorrectLoop()
             //Pose without correction
             NonCorrectedSim3[pKFi]=g2oSiw;
         }
+    }
+
+    // MapPoints observed by current keyframe and neighbors are aligned with the other side of the loop
+    // using the correction of the first of them that observes the point
+    for(KeyFrameAndPose::iterator mit=CorrectedSim3.begin(), mend=CorrectedSim3.end(); mit!=mend; mit++)
+    {
+        KeyFrame* pKFi = mit->first;
 
-        // Correct all MapPoints obsrved by current keyframe and neighbors, so that they align with the other side of the loop
-        for(KeyFrameAndPose::iterator mit=CorrectedSim3.begin(), mend=CorrectedSim3.end(); mit!=mend; mit++)
+        vector<MapPoint*> vpMPsi = pKFi->GetMapPointMatches();
+        for(size_t iMP=0, endMPi = vpMPsi.size(); iMP<endMPi; iMP++)
         {
-            KeyFrame* pKFi = mit->first;
-            g2o::Sim3 g2oCorrectedSiw = mit->second;
-            g2o::Sim3 g2oCorrectedSwi = g2oCorrectedSiw.inverse();
+            MapPoint* pMPi = vpMPsi[iMP];
+            if(!pMPi)
+                continue;
+            if(pMPi->isBad())
+                continue;
+            if(pMPi->mnCorrectedByKF==mpCurrentKF->mnId)
+                continue;
 
-            g2o::Sim3 g2oSiw =NonCorrectedSim3[pKFi];
+            pMPi->mnCorrectedByKF = mpCurrentKF->mnId;
+            pMPi->mnCorrectedReference = pKFi->mnId;
+        }
+    }
 
-            vector<MapPoint*> vpMPsi = pKFi->GetMapPointMatches();
-            for(size_t iMP=0, endMPi = vpMPsi.size(); iMP<endMPi; iMP++)
-            {
-                MapPoint* pMPi = vpMPsi[iMP];
-                if(!pMPi)
-                    continue;
-                if(pMPi->isBad())
-                    continue;
-                if(pMPi->mnCorrectedByKF==mpCurrentKF->mnId)
-                    continue;
+    // Project MapPoints observed in the neighborhood of the loop keyframe
+    // into the current keyframe and neighbors using corrected poses.
+    // Search duplications.
+    vector<vector<int> > vvLoopMatches;
+    SearchAndFuse(CorrectedSim3,vvLoopMatches);
 
-                // Project with non-corrected pose and project back with corrected pose
-                cv::Mat P3Dw = pMPi->GetWorldPos();
-                Eigen::Matrix<double,3,1> eigP3Dw = Converter::toVector3d(P3Dw);
-                Eigen::Matrix<double,3,1> eigCorrectedP3Dw = g2oCorrectedSwi.map(g2oSiw.map(eigP3Dw));
+    // After the MapPoint fusion, new links in the covisibility graph will appear attaching both sides of the loop
+    map<KeyFrame*, map<KeyFrame*,int> > LoopConnections;
+    ComputeLoopConnections(CorrectedSim3,vvLoopMatches,LoopConnections);
 
-                cv::Mat cvCorrectedP3Dw = Converter::toCvMat(eigCorrectedP3Dw);
-                pMPi->SetWorldPos(cvCorrectedP3Dw);
-                pMPi->mnCorrectedByKF = mpCurrentKF->mnId;
-                pMPi->mnCorrectedReference = pKFi->mnId;
-                pMPi->UpdateNormalAndDepth();
-            }
+    // Optimize graph
+    KeyFrameAndPose Corrections;
+    mpEssentialGraph->Optimize(mpMatchedKF, mpCurrentKF, NonCorrectedSim3, CorrectedSim3, LoopConnections, Corrections);
 
-            // Update keyframe pose with corrected Sim3. First transform Sim3 to SE3 (scale translation)
-            Eigen::Matrix3d eigR = g2oCorrectedSiw.rotation().toRotationMatrix();
-            Eigen::Vector3d eigt = g2oCorrectedSiw.translation();
-            double s = g2oCorrectedSiw.scale();
+    // Local Mapping only stops while the correction is applied, so that no result
+    // computed with the poses before the correction is written afterwards
+    mpLocalMapper->RequestStop();
+    mpLocalMapper->WaitUntilStopped();
 
-            eigt *=(1./s); //[R t/s;0 1]
+    // Correct the map and fuse duplications
+    ApplyLoopCorrection(CorrectedSim3,vvLoopMatches,Corrections);
 
-            cv::Mat correctedTiw = Converter::toCvSE3(eigR,eigt);
+    mpMap->InformNewBigChange();
 
-            pKFi->SetPose(correctedTiw);
+    // Add loop edge
+    mpMatchedKF->AddLoopEdge(mpCurrentKF);
+    mpCurrentKF->AddLoopEdge(mpMatchedKF);
+
+    for(vector<KeyFrame*>::iterator vit=mvpCurrentConnectedKFs.begin(), vend=mvpCurrentConnectedKFs.end(); vit!=vend; vit++)
+        (*vit)->SetErase();
+
+    // Global BA is off by default as it destroys photometric gains. The photometric refinement
+    // is requested after the global BA, or here, before the release. Local Mapping runs it when idle.
+    if(mbGlobalBA)
+    {
+        // Launch a new thread to perform Global Bundle Adjustment
+        mbRunningGBA = true;
+        mbFinishedGBA = false;
+        mbStopGBA = false;
+        mpThreadGBA = new thread(&LoopClosing::RunGlobalBundleAdjustment,this,mpCurrentKF->mnId);
+    }
+    else
+        mpLocalMapper->RequestPhotometricRefinement();
+
+    // Loop closed. Release Local Mapping.
+    mpLocalMapper->Release();
+
+    mLastLoopKFid = mpCurrentKF->mnId;   
+}
+
+void LoopClosing::SearchAndFuse(const KeyFrameAndPose &CorrectedPosesMap, vector<vector<int> > &vvLoopMatches)
+{
+    ORBmatcher matcher(0.8);
 
-            // Make sure connections are updated
-            pKFi->UpdateConnections();
+    vvLoopMatches.clear();
+    vvLoopMatches.reserve(CorrectedPosesMap.size());
+
+    for(KeyFrameAndPose::const_iterator mit=CorrectedPosesMap.begin(), mend=CorrectedPosesMap.end(); mit!=mend;mit++)
+    {
+        KeyFrame* pKF = mit->first;
+
+        g2o::Sim3 g2oScw = mit->second;
+        cv::Mat cvScw = Converter::toCvMat(g2oScw);
+
+        vvLoopMatches.push_back(vector<int>());
+        matcher.SearchFuse(pKF,cvScw,mvpLoopMapPoints,4,vvLoopMatches.back());
+    }
+}
+
+void LoopClosing::ComputeLoopConnections(const KeyFrameAndPose &CorrectedPosesMap, const vector<vector<int> > &vvLoopMatches,
+                                         map<KeyFrame*, map<KeyFrame*,int> > &LoopConnections)
+{
+    const set<KeyFrame*> spConnectedKFs(mvpCurrentConnectedKFs.begin(),mvpCurrentConnectedKFs.end());
+
+    size_t i=0;
+    for(KeyFrameAndPose::const_iterator mit=CorrectedPosesMap.begin(), mend=CorrectedPosesMap.end(); mit!=mend; mit++, i++)
+    {
+        KeyFrame* pKFi = mit->first;
+        const vector<int> &vnMatches = vvLoopMatches[i];
+
+        // MapPoints of the loop side that the keyframe will observe after the fusion
+        set<MapPoint*> spLoopMPs;
+        for(size_t iMP=0, iend=vnMatches.size(); iMP<iend; iMP++)
+        {
+            if(vnMatches[iMP]>=0)
+                spLoopMPs.insert(mvpLoopMapPoints[iMP]);
+        }
+        if(pKFi==mpCurrentKF)
+        {
+            for(size_t iMP=0, iend=mvpCurrentMatchedPoints.size(); iMP<iend; iMP++)
+            {
+                if(mvpCurrentMatchedPoints[iMP])
+                    spLoopMPs.insert(mvpCurrentMatchedPoints[iMP]);
+            }
         }
 
-        // Start Loop Fusion
-        // Update matched map points and replace if duplicated
-        for(size_t i=0; i<mvpCurrentMatchedPoints.size(); i++)
+        // Each one adds a shared MapPoint with the keyframes observing it
+        map<KeyFrame*,int> &mConnections = LoopConnections[pKFi];
+        for(set<MapPoint*>::iterator sit=spLoopMPs.begin(), send=spLoopMPs.end(); sit!=send; sit++)
         {
-            if(mvpCurrentMatchedPoints[i])
+            MapPoint* pMP = *sit;
+            if(pMP->isBad())
+                continue;
+
+            const map<KeyFrame*,size_t> observations = pMP->GetObservations();
+            for(map<KeyFrame*,size_t>::const_iterator oit=observations.begin(), oend=observations.end(); oit!=oend; oit++)
             {
-                MapPoint* pLoopMP = mvpCurrentMatchedPoints[i];
-                MapPoint* pCurMP = mpCurrentKF->GetMapPoint(i);
-                if(pCurMP)
-                    pCurMP->Replace(pLoopMP);
-                else
-                {
-                    mpCurrentKF->AddMapPoint(pLoopMP,i);
-                    pLoopMP->AddObservation(mpCurrentKF,i);
-                    pLoopMP->ComputeDistinctiveDescriptors();
-                }
+                if(!spConnectedKFs.count(oit->first))
+                    mConnections[oit->first]++;
             }
         }
 
+        // Detect new links
+        const vector<KeyFrame*> vpPreviousNeighbors = pKFi->GetVectorCovisibleKeyFrames();
+        for(vector<KeyFrame*>::const_iterator vit_prev=vpPreviousNeighbors.begin(), vend_prev=vpPreviousNeighbors.end(); vit_prev!=vend_prev; vit_prev++)
+        {
+            mConnections.erase(*vit_prev);
+        }
     }
+}
 
-    // Project MapPoints observed in the neighborhood of the loop keyframe
-    // into the current keyframe and neighbors using corrected poses.
-    // Fuse duplications.
-    SearchAndFuse(CorrectedSim3);
-
+void LoopClosing::ApplyLoopCorrection(const KeyFrameAndPose &CorrectedPosesMap, const vector<vector<int> > &vvLoopMatches,
+                                      KeyFrameAndPose &Corrections)
+{
+    // Get Map Mutex
+    unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
 
-    // After the MapPoint fusion, new links in the covisibility graph will appear attaching both sides of the loop
-    map<KeyFrame*, set<KeyFrame*> > LoopConnections;
+    vector<KeyFrame*> vpKFs = mpMap->GetAllKeyFrames();
+    sort(vpKFs.begin(),vpKFs.end(),KeyFrame::lId);
 
-    for(vector<KeyFrame*>::iterator vit=mvpCurrentConnectedKFs.begin(), vend=mvpCurrentConnectedKFs.end(); vit!=vend; vit++)
+    map<long unsigned int,KeyFrame*> mCorrectedKFs;
+    for(size_t i=0, iend=vpKFs.size(); i<iend; i++)
     {
-        KeyFrame* pKFi = *vit;
-        vector<KeyFrame*> vpPreviousNeighbors = pKFi->GetVectorCovisibleKeyFrames();
+        KeyFrame* pKF = vpKFs[i];
+        if(pKF->isBad())
+            continue;
 
-        // Update connections. Detect new links.
-        pKFi->UpdateConnections();
-        LoopConnections[pKFi]=pKFi->GetConnectedKeyFrames();
-        for(vector<KeyFrame*>::iterator vit_prev=vpPreviousNeighbors.begin(), vend_prev=vpPreviousNeighbors.end(); vit_prev!=vend_prev; vit_prev++)
-        {
-            LoopConnections[pKFi].erase(*vit_prev);
-        }
-        for(vector<KeyFrame*>::iterator vit2=mvpCurrentConnectedKFs.begin(), vend2=mvpCurrentConnectedKFs.end(); vit2!=vend2; vit2++)
+        KeyFrameAndPose::iterator it = Corrections.find(pKF);
+        if(it==Corrections.end())
         {
-            LoopConnections[pKFi].erase(*vit2);
+            // Keyframes inserted during the optimization are corrected with their parent
+            if(pKF->mnId<=mpMatchedKF->mnId)
+                continue;
+            KeyFrameAndPose::iterator itp = Corrections.find(pKF->GetParent());
+            if(itp==Corrections.end())
+                continue;
+            it = Corrections.insert(make_pair(pKF,itp->second)).first;
         }
+        mCorrectedKFs[pKF->mnId]=pKF;
+
+        // Update keyframe pose with corrected Sim3. First transform Sim3 to SE3 (scale translation)
+        cv::Mat Tiw = pKF->GetPose();
+        g2o::Sim3 g2oSiw(Converter::toMatrix3d(Tiw.rowRange(0,3).colRange(0,3)),Converter::toVector3d(Tiw.rowRange(0,3).col(3)),1.0);
+        g2o::Sim3 g2oCorrectedSiw = g2oSiw*(it->second).inverse();
+
+        Eigen::Matrix3d eigR = g2oCorrectedSiw.rotation().toRotationMatrix();
+        Eigen::Vector3d eigt = g2oCorrectedSiw.translation();
+        double s = g2oCorrectedSiw.scale();
+
+        eigt *=(1./s); //[R t/s;0 1]
+
+        cv::Mat correctedTiw = Converter::toCvSE3(eigR,eigt);
+
+        pKF->SetPose(correctedTiw);
     }
 
-    // Optimize graph
-    Optimizer::OptimizeEssentialGraph(mpMap, mpMatchedKF, mpCurrentKF, NonCorrectedSim3, CorrectedSim3, LoopConnections, mbFixScale);
+    // Correct points with the correction of their reference keyframe
+    const vector<MapPoint*> vpMPs = mpMap->GetAllMapPoints();
+    for(size_t i=0, iend=vpMPs.size(); i<iend; i++)
+    {
+        MapPoint* pMP = vpMPs[i];
 
-    mpMap->InformNewBigChange();
+        if(pMP->isBad())
+            continue;
 
-    // Add loop edge
-    mpMatchedKF->AddLoopEdge(mpCurrentKF);
-    mpCurrentKF->AddLoopEdge(mpMatchedKF);
+        KeyFrame* pRefKF;
+        if(pMP->mnCorrectedByKF==mpCurrentKF->mnId)
+        {
+            map<long unsigned int,KeyFrame*>::iterator mit = mCorrectedKFs.find(pMP->mnCorrectedReference);
+            if(mit==mCorrectedKFs.end())
+                continue;
+            pRefKF = mit->second;
+        }
+        else
+            pRefKF = pMP->GetReferenceKeyFrame();
 
-    // Launch a new thread to perform Global Bundle Adjustment
-    mbRunningGBA = true;
-    mbFinishedGBA = false;
-    mbStopGBA = false;
+        KeyFrameAndPose::const_iterator it = Corrections.find(pRefKF);
+        if(it==Corrections.end())
+            continue;
 
-    // TODO: Turn off GBA as it destroys photometric gains
-//    mpThreadGBA = new thread(&LoopClosing::RunGlobalBundleAdjustment,this,mpCurrentKF->mnId);
+        cv::Mat P3Dw = pMP->GetWorldPos();
+        Eigen::Matrix<double,3,1> eigP3Dw = Converter::toVector3d(P3Dw);
+        Eigen::Matrix<double,3,1> eigCorrectedP3Dw = (it->second).map(eigP3Dw);
 
-    // Loop closed. Release Local Mapping.
-    mpLocalMapper->Release();    
+        cv::Mat cvCorrectedP3Dw = Converter::toCvMat(eigCorrectedP3Dw);
+        pMP->SetWorldPos(cvCorrectedP3Dw);
 
-    mLastLoopKFid = mpCurrentKF->mnId;   
-}
+        pMP->UpdateNormalAndDepth();
+    }
 
-void LoopClosing::SearchAndFuse(const KeyFrameAndPose &CorrectedPosesMap)
-{
-    ORBmatcher matcher(0.8);
+    // Start Loop Fusion
+    // Update matched map points and replace if duplicated
+    for(size_t i=0; i<mvpCurrentMatchedPoints.size(); i++)
+    {
+        if(mvpCurrentMatchedPoints[i])
+        {
+            MapPoint* pLoopMP = mvpCurrentMatchedPoints[i];
+            if(pLoopMP->isBad())
+                continue;
+            MapPoint* pCurMP = mpCurrentKF->GetMapPoint(i);
+            if(pCurMP)
+                pCurMP->Replace(pLoopMP);
+            else if(!pLoopMP->IsInKeyFrame(mpCurrentKF))
+            {
+                mpCurrentKF->AddMapPoint(pLoopMP,i);
+                pLoopMP->AddObservation(mpCurrentKF,i);
+                pLoopMP->ComputeDistinctiveDescriptors();
+            }
+        }
+    }
 
-    for(KeyFrameAndPose::const_iterator mit=CorrectedPosesMap.begin(), mend=CorrectedPosesMap.end(); mit!=mend;mit++)
+    // Fuse the duplications found with the corrected poses
+    size_t iKF=0;
+    for(KeyFrameAndPose::const_iterator mit=CorrectedPosesMap.begin(), mend=CorrectedPosesMap.end(); mit!=mend; mit++, iKF++)
     {
         KeyFrame* pKF = mit->first;
+        const vector<int> &vnMatches = vvLoopMatches[iKF];
 
-        g2o::Sim3 g2oScw = mit->second;
-        cv::Mat cvScw = Converter::toCvMat(g2oScw);
+        for(size_t iMP=0, iendMP=vnMatches.size(); iMP<iendMP; iMP++)
+        {
+            if(vnMatches[iMP]<0)
+                continue;
 
-        vector<MapPoint*> vpReplacePoints(mvpLoopMapPoints.size(),static_cast<MapPoint*>(NULL));
-        matcher.Fuse(pKF,cvScw,mvpLoopMapPoints,4,vpReplacePoints);
+            MapPoint* pLoopMP = mvpLoopMapPoints[iMP];
+            if(pLoopMP->isBad() || pLoopMP->IsInKeyFrame(pKF))
+                continue;
 
-        // Get Map Mutex
-        unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
-        const int nLP = mvpLoopMapPoints.size();
-        for(int i=0; i<nLP;i++)
-        {
-            MapPoint* pRep = vpReplacePoints[i];
-            if(pRep)
+            MapPoint* pMPinKF = pKF->GetMapPoint(vnMatches[iMP]);
+            if(pMPinKF)
             {
-                pRep->Replace(mvpLoopMapPoints[i]);
+                if(!pMPinKF->isBad())
+                    pMPinKF->Replace(pLoopMP);
+            }
+            else
+            {
+                pLoopMP->AddObservation(pKF,vnMatches[iMP]);
+                pKF->AddMapPoint(pLoopMP,vnMatches[iMP]);
             }
         }
     }
+
+    // Make sure connections are updated
+    for(vector<KeyFrame*>::iterator vit=mvpCurrentConnectedKFs.begin(), vend=mvpCurrentConnectedKFs.end(); vit!=vend; vit++)
+        (*vit)->UpdateConnections();
 }
 
 
@@ -621,16 +763,11 @@ void LoopClosing::RequestReset()
         unique_lock<mutex> lock(mMutexReset);
         mbResetRequested = true;
     }
+    WakeUp();
 
-    while(1)
-    {
-        {
-        unique_lock<mutex> lock2(mMutexReset);
-        if(!mbResetRequested)
-            break;
-        }
-        usleep(5000);
-    }
+    unique_lock<mutex> lock2(mMutexReset);
+    while(mbResetRequested)
+        mcvReset.wait(lock2);
 }
 
 void LoopClosing::ResetIfRequested()
@@ -638,9 +775,11 @@ void LoopClosing::ResetIfRequested()
     unique_lock<mutex> lock(mMutexReset);
     if(mbResetRequested)
     {
-        mlpLoopKeyFrameQueue.clear();
+        mLoopKeyFrameQueue.Clear();
+        mpEssentialGraph->Clear();
         mLastLoopKFid=0;
         mbResetRequested=false;
+        mcvReset.notify_all();
     }
 }
 
@@ -649,7 +788,10 @@ void LoopClosing::RunGlobalBundleAdjustment(unsigned long nLoopKF)
     cout << "Starting Global Bundle Adjustment" << endl;
 
     int idx =  mnFullBAIdx;
-    Optimizer::GlobalBundleAdjustemnt(mpMap,10,&mbStopGBA,nLoopKF,false);
+    if((int)mpMap->KeyFramesInMap()>mnGBAPartitionSize)
+        Optimizer::PartitionedGlobalBundleAdjustment(mpMap,mnGBAPartitionSize,3,10,&mbStopGBA,nLoopKF,false,Optimizer::LINEAR_SOLVER_CHOLESKY);
+    else
+        Optimizer::GlobalBundleAdjustemnt(mpMap,10,&mbStopGBA,nLoopKF,false,Optimizer::LINEAR_SOLVER_CHOLESKY);
 
     // Update all MapPoints and KeyFrames
     // Local Mapping was active during BA, that means that there might be new keyframes
@@ -665,12 +807,8 @@ void LoopClosing::RunGlobalBundleAdjustment(unsigned long nLoopKF)
             cout << "Global Bundle Adjustment finished" << endl;
             cout << "Updating map ..." << endl;
             mpLocalMapper->RequestStop();
-            // Wait until Local Mapping has effectively stopped
-
-            while(!mpLocalMapper->isStopped() && !mpLocalMapper->isFinished())
-            {
-                usleep(1000);
-            }
+            // Wait until Local Mapping has effectively stopped (or finished)
+            mpLocalMapper->WaitUntilStopped();
 
             // Get Map Mutex
             unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
@@ -740,6 +878,8 @@ void LoopClosing::RunGlobalBundleAdjustment(unsigned long nLoopKF)
 
             mpMap->InformNewBigChange();
 
+            mpLocalMapper->RequestPhotometricRefinement();
+
             mpLocalMapper->Release();
 
             cout << "Map updated!" << endl;
@@ -752,8 +892,11 @@ void LoopClosing::RunGlobalBundleAdjustment(unsigned long nLoopKF)
 
 void LoopClosing::RequestFinish()
 {
-    unique_lock<mutex> lock(mMutexFinish);
-    mbFinishRequested = true;
+    {
+        unique_lock<mutex> lock(mMutexFinish);
+        mbFinishRequested = true;
+    }
+    WakeUp();
 }
 
 bool LoopClosing::CheckFinish()
@@ -25,7 +25,7 @@
 namespace ORB_SLAM2
 {
 
-Map::Map():mnMaxKFid(0),mnBigChangeIdx(0)
+Map::Map():mnMaxKFid(0),mnBigChangeIdx(0),mnLocalMapChangeIdx(0)
 {
 }
 
@@ -79,6 +79,18 @@ int Map::GetLastBigChangeIdx()
     return mnBigChangeIdx;
 }
 
+void Map::InformNewLocalMapChange()
+{
+    unique_lock<mutex> lock(mMutexMap);
+    mnLocalMapChangeIdx++;
+}
+
+int Map::GetLastLocalMapChangeIdx()
+{
+    unique_lock<mutex> lock(mMutexMap);
+    return mnLocalMapChangeIdx;
+}
+
 vector<KeyFrame*> Map::GetAllKeyFrames()
 {
     unique_lock<mutex> lock(mMutexMap);
@@ -128,6 +140,7 @@ void Map::clear()
     mnMaxKFid = 0;
     mvpReferenceMapPoints.clear();
     mvpKeyFrameOrigins.clear();
+    mnLocalMapChangeIdx++;
 }
 
 } //namespace ORB_SLAM
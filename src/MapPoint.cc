@@ -20,6 +20,7 @@
 
 #include "MapPoint.h"
 #include "ORBmatcher.h"
+#include "Converter.h"
 
 #include<mutex>
 
@@ -27,6 +28,7 @@ namespace ORB_SLAM2
 {
 
 long unsigned int MapPoint::nNextId=0;
+const size_t MapPoint::nMaxDescriptorObs=32;
 mutex MapPoint::mGlobalMutex;
 
 MapPoint::MapPoint(const cv::Mat &Pos, KeyFrame *pRefKF, Map* pMap):
@@ -37,6 +39,8 @@ MapPoint::MapPoint(const cv::Mat &Pos, KeyFrame *pRefKF, Map* pMap):
 {
     Pos.copyTo(mWorldPos);
     mNormalVector = cv::Mat::zeros(3,1,CV_32F);
+    mWorldPosEig = Converter::toVector3f(mWorldPos);
+    mNormalVectorEig.setZero();
 
     // MapPoints can be created from Tracking and Local Mapping. This mutex avoid conflicts with id.
     unique_lock<mutex> lock(mpMap->mMutexPointCreation);
@@ -53,6 +57,8 @@ MapPoint::MapPoint(const cv::Mat &Pos, Map* pMap, Frame* pFrame, const int &idxF
     cv::Mat Ow = pFrame->GetCameraCenter();
     mNormalVector = mWorldPos - Ow;
     mNormalVector = mNormalVector/cv::norm(mNormalVector);
+    mWorldPosEig = Converter::toVector3f(mWorldPos);
+    mNormalVectorEig = Converter::toVector3f(mNormalVector);
 
     cv::Mat PC = Pos - Ow;
     const float dist = cv::norm(PC);
@@ -75,6 +81,7 @@ void MapPoint::SetWorldPos(const cv::Mat &Pos)
     unique_lock<mutex> lock2(mGlobalMutex);
     unique_lock<mutex> lock(mMutexPos);
     Pos.copyTo(mWorldPos);
+    mWorldPosEig = Converter::toVector3f(mWorldPos);
 }
 
 cv::Mat MapPoint::GetWorldPos()
@@ -89,6 +96,18 @@ cv::Mat MapPoint::GetNormal()
     return mNormalVector.clone();
 }
 
+Eigen::Vector3f MapPoint::GetWorldPosEig()
+{
+    unique_lock<mutex> lock(mMutexPos);
+    return mWorldPosEig;
+}
+
+Eigen::Vector3f MapPoint::GetNormalEig()
+{
+    unique_lock<mutex> lock(mMutexPos);
+    return mNormalVectorEig;
+}
+
 KeyFrame* MapPoint::GetReferenceKeyFrame()
 {
     unique_lock<mutex> lock(mMutexFeatures);
@@ -242,9 +261,6 @@ float MapPoint::GetFoundRatio()
 
 void MapPoint::ComputeDistinctiveDescriptors()
 {
-    // Retrieve all observed descriptors
-    vector<cv::Mat> vDescriptors;
-
     map<KeyFrame*,size_t> observations;
 
     {
@@ -257,42 +273,82 @@ void MapPoint::ComputeDistinctiveDescriptors()
     if(observations.empty())
         return;
 
-    vDescriptors.reserve(observations.size());
+    unique_lock<mutex> lock(mMutexDescriptors);
 
+    // Remove the descriptors of observations that were erased or changed
+    for(size_t i=0; i<mvpDescKFs.size();)
+    {
+        map<KeyFrame*,size_t>::const_iterator mit = observations.find(mvpDescKFs[i]);
+        if(mit==observations.end() || mit->second!=mvDescIdx[i] || mvpDescKFs[i]->isBad())
+            EraseDescriptorObservation(i);
+        else
+            i++;
+    }
+
+    // New observations in keyframe order, so that the most recent ones are kept
+    vector<pair<long unsigned int,map<KeyFrame*,size_t>::iterator> > vNewObs;
     for(map<KeyFrame*,size_t>::iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
     {
         KeyFrame* pKF = mit->first;
-
-        if(!pKF->isBad())
-            vDescriptors.push_back(pKF->mDescriptors.row(mit->second));
+        if(pKF->isBad() || find(mvpDescKFs.begin(),mvpDescKFs.end(),pKF)!=mvpDescKFs.end())
+            continue;
+        vNewObs.push_back(make_pair(pKF->mnId,mit));
     }
+    sort(vNewObs.begin(),vNewObs.end(),
+         [](const pair<long unsigned int,map<KeyFrame*,size_t>::iterator> &a,
+            const pair<long unsigned int,map<KeyFrame*,size_t>::iterator> &b) { return a.first<b.first; });
+    if(vNewObs.size()>nMaxDescriptorObs)
+        vNewObs.erase(vNewObs.begin(),vNewObs.end()-nMaxDescriptorObs);
+
+    // Add the new observations, only distances to the new descriptor are computed.
+    // When the set is full the observation of the oldest keyframe is replaced.
+    for(size_t n=0; n<vNewObs.size(); n++)
+    {
+        KeyFrame* pKF = vNewObs[n].second->first;
+        const size_t idx = vNewObs[n].second->second;
 
-    if(vDescriptors.empty())
-        return;
-
-    // Compute distances between them
-    const size_t N = vDescriptors.size();
+        if(mvpDescKFs.size()>=nMaxDescriptorObs)
+        {
+            size_t iOldest = 0;
+            for(size_t i=1; i<mvpDescKFs.size(); i++)
+            {
+                if(mvpDescKFs[i]->mnId<mvpDescKFs[iOldest]->mnId)
+                    iOldest = i;
+            }
+            if(mvpDescKFs[iOldest]->mnId>pKF->mnId)
+                continue;
+            EraseDescriptorObservation(iOldest);
+        }
 
-    float Distances[N][N];
-    for(size_t i=0;i<N;i++)
-    {
-        Distances[i][i]=0;
-        for(size_t j=i+1;j<N;j++)
+        const unsigned char* pDesc = pKF->mDescriptors.ptr<unsigned char>(idx);
+        const size_t N = mvpDescKFs.size();
+        vector<unsigned short> vDists(N+1,0);
+        for(size_t j=0; j<N; j++)
         {
-            int distij = ORBmatcher::DescriptorDistance(vDescriptors[i],vDescriptors[j]);
-            Distances[i][j]=distij;
-            Distances[j][i]=distij;
+            const unsigned char* pDescj = mvpDescKFs[j]->mDescriptors.ptr<unsigned char>(mvDescIdx[j]);
+            vDists[j] = ORBmatcher::DescriptorDistance(pDesc,pDescj);
+            mvvDescDistances[j].push_back(vDists[j]);
         }
+
+        mvpDescKFs.push_back(pKF);
+        mvDescIdx.push_back(idx);
+        mvvDescDistances.push_back(vDists);
     }
 
+    if(mvpDescKFs.empty())
+        return;
+
     // Take the descriptor with least median distance to the rest
+    const size_t N = mvpDescKFs.size();
+    const size_t nMedian = 0.5*(N-1);
+    vector<unsigned short> vDists;
     int BestMedian = INT_MAX;
     int BestIdx = 0;
     for(size_t i=0;i<N;i++)
     {
-        vector<int> vDists(Distances[i],Distances[i]+N);
-        sort(vDists.begin(),vDists.end());
-        int median = vDists[0.5*(N-1)];
+        vDists = mvvDescDistances[i];
+        nth_element(vDists.begin(),vDists.begin()+nMedian,vDists.end());
+        int median = vDists[nMedian];
 
         if(median<BestMedian)
         {
@@ -302,11 +358,20 @@ void MapPoint::ComputeDistinctiveDescriptors()
     }
 
     {
-        unique_lock<mutex> lock(mMutexFeatures);
-        mDescriptor = vDescriptors[BestIdx].clone();
+        unique_lock<mutex> lock2(mMutexFeatures);
+        mDescriptor = mvpDescKFs[BestIdx]->mDescriptors.row(mvDescIdx[BestIdx]).clone();
     }
 }
 
+void MapPoint::EraseDescriptorObservation(const size_t i)
+{
+    mvpDescKFs.erase(mvpDescKFs.begin()+i);
+    mvDescIdx.erase(mvDescIdx.begin()+i);
+    mvvDescDistances.erase(mvvDescDistances.begin()+i);
+    for(size_t j=0; j<mvvDescDistances.size(); j++)
+        mvvDescDistances[j].erase(mvvDescDistances[j].begin()+i);
+}
+
 cv::Mat MapPoint::GetDescriptor()
 {
     unique_lock<mutex> lock(mMutexFeatures);
@@ -332,7 +397,7 @@ void MapPoint::UpdateNormalAndDepth()
 {
     map<KeyFrame*,size_t> observations;
     KeyFrame* pRefKF;
-    cv::Mat Pos;
+    Eigen::Vector3f Pos;
     {
         unique_lock<mutex> lock1(mMutexFeatures);
         unique_lock<mutex> lock2(mMutexPos);
@@ -340,25 +405,23 @@ void MapPoint::UpdateNormalAndDepth()
             return;
         observations=mObservations;
         pRefKF=mpRefKF;
-        Pos = mWorldPos.clone();
+        Pos = mWorldPosEig;
     }
 
     if(observations.empty())
         return;
 
-    cv::Mat normal = cv::Mat::zeros(3,1,CV_32F);
+    Eigen::Vector3f normal = Eigen::Vector3f::Zero();
     int n=0;
     for(map<KeyFrame*,size_t>::iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
     {
         KeyFrame* pKF = mit->first;
-        cv::Mat Owi = pKF->GetCameraCenter();
-        cv::Mat normali = mWorldPos - Owi;
-        normal = normal + normali/cv::norm(normali);
+        const Eigen::Vector3f normali = Pos - pKF->GetCameraCenterEig();
+        normal += normali/normali.norm();
         n++;
     }
 
-    cv::Mat PC = Pos - pRefKF->GetCameraCenter();
-    const float dist = cv::norm(PC);
+    const float dist = (Pos - pRefKF->GetCameraCenterEig()).norm();
     const int level = pRefKF->mvKeysUn[observations[pRefKF]].octave;
     const float levelScaleFactor =  pRefKF->mvScaleFactors[level];
     const int nLevels = pRefKF->mnScaleLevels;
@@ -367,7 +430,8 @@ void MapPoint::UpdateNormalAndDepth()
         unique_lock<mutex> lock3(mMutexPos);
         mfMaxDistance = dist*levelScaleFactor;
         mfMinDistance = mfMaxDistance/pRefKF->mvScaleFactors[nLevels-1];
-        mNormalVector = normal/n;
+        mNormalVectorEig = normal/n;
+        mNormalVector = Converter::toCvMat(mNormalVectorEig);
     }
 }
 
@@ -383,6 +447,15 @@ float MapPoint::GetMaxDistanceInvariance()
     return 1.2f*mfMaxDistance;
 }
 
+void MapPoint::GetFrustumData(Eigen::Vector3f &Pos, Eigen::Vector3f &Normal, float &minDistance, float &maxDistance)
+{
+    unique_lock<mutex> lock(mMutexPos);
+    Pos = mWorldPosEig;
+    Normal = mNormalVectorEig;
+    minDistance = mfMinDistance;
+    maxDistance = mfMaxDistance;
+}
+
 int MapPoint::PredictScale(const float &currentDist, KeyFrame* pKF)
 {
     float ratio;
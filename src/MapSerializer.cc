@@ -0,0 +1,794 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "MapSerializer.h"
+
+#include "KeyFrame.h"
+#include "MapPoint.h"
+#include "Frame.h"
+#include "HighGradientPoint.h"
+
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <stdint.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+const unsigned int MapSerializer::nVersion = 1;
+
+namespace
+{
+
+const char sMagic[8] = {'O','R','B','S','L','M','A','P'};
+
+inline uint32_t ChunkTag(const char tag[5])
+{
+    return uint32_t(tag[0]) | (uint32_t(tag[1])<<8) | (uint32_t(tag[2])<<16) | (uint32_t(tag[3])<<24);
+}
+
+const uint32_t nTagKeyFrame = ChunkTag("KFRM");
+const uint32_t nTagMapPoint = ChunkTag("MPNT");
+const uint32_t nTagGraph = ChunkTag("KFGR");
+const uint32_t nTagOrigins = ChunkTag("ORIG");
+const uint32_t nTagEnd = ChunkTag("END!");
+
+struct ChunkHeader
+{
+    uint32_t tag;
+    uint32_t reserved;
+    uint64_t size;
+};
+
+// Serializes one chunk into a reusable buffer and appends it to the file
+class ChunkWriter
+{
+public:
+    ChunkWriter(ofstream &f): mFile(f){}
+
+    void Begin(uint32_t tag)
+    {
+        mnTag = tag;
+        mvBuffer.clear();
+    }
+
+    bool End()
+    {
+        ChunkHeader header;
+        header.tag = mnTag;
+        header.reserved = 0;
+        header.size = mvBuffer.size();
+        mFile.write((const char*)&header, sizeof(header));
+        if(!mvBuffer.empty())
+            mFile.write(&mvBuffer[0], mvBuffer.size());
+        return mFile.good();
+    }
+
+    template<typename T> void Put(const T &value)
+    {
+        PutBytes(&value, sizeof(T));
+    }
+
+    template<typename T> void PutVector(const vector<T> &v)
+    {
+        Put<uint32_t>(v.size());
+        if(!v.empty())
+            PutBytes(&v[0], v.size()*sizeof(T));
+    }
+
+    void PutBytes(const void* data, size_t n)
+    {
+        const char* p = (const char*)data;
+        mvBuffer.insert(mvBuffer.end(), p, p+n);
+    }
+
+    void PutMat(const cv::Mat &M)
+    {
+        Put<int32_t>(M.rows);
+        Put<int32_t>(M.cols);
+        Put<int32_t>(M.type());
+        for(int i=0; i<M.rows; i++)
+            PutBytes(M.ptr(i), M.cols*M.elemSize());
+    }
+
+    void PutKeyPoints(const vector<cv::KeyPoint> &vKeys)
+    {
+        Put<uint32_t>(vKeys.size());
+        for(size_t i=0; i<vKeys.size(); i++)
+        {
+            const cv::KeyPoint &kp = vKeys[i];
+            Put<float>(kp.pt.x);
+            Put<float>(kp.pt.y);
+            Put<float>(kp.size);
+            Put<float>(kp.angle);
+            Put<float>(kp.response);
+            Put<int32_t>(kp.octave);
+            Put<int32_t>(kp.class_id);
+        }
+    }
+
+private:
+    ofstream &mFile;
+    uint32_t mnTag;
+    vector<char> mvBuffer;
+};
+
+// Decodes a chunk payload in place. Reads past the end of the chunk fail and
+// leave the reader in an error state instead of touching memory.
+class ChunkReader
+{
+public:
+    ChunkReader(const char* data, size_t size): mpData(data), mpEnd(data+size), mbOk(true){}
+
+    bool Ok() const { return mbOk; }
+
+    template<typename T> T Get()
+    {
+        T value = T();
+        GetBytes(&value, sizeof(T));
+        return value;
+    }
+
+    template<typename T> void GetVector(vector<T> &v)
+    {
+        const uint32_t n = Get<uint32_t>();
+        if(!Check(size_t(n)*sizeof(T)))
+            return;
+        v.resize(n);
+        if(n>0)
+            GetBytes(&v[0], n*sizeof(T));
+    }
+
+    void GetBytes(void* data, size_t n)
+    {
+        if(!Check(n))
+            return;
+        memcpy(data, mpData, n);
+        mpData += n;
+    }
+
+    cv::Mat GetMat()
+    {
+        const int rows = Get<int32_t>();
+        const int cols = Get<int32_t>();
+        const int type = Get<int32_t>();
+        if(!mbOk || rows<0 || cols<0)
+        {
+            mbOk = false;
+            return cv::Mat();
+        }
+        cv::Mat M(rows, cols, type);
+        for(int i=0; i<rows && mbOk; i++)
+            GetBytes(M.ptr(i), cols*M.elemSize());
+        return M;
+    }
+
+    void GetKeyPoints(vector<cv::KeyPoint> &vKeys)
+    {
+        const uint32_t n = Get<uint32_t>();
+        if(!Check(size_t(n)*28))
+            return;
+        vKeys.resize(n);
+        for(size_t i=0; i<n; i++)
+        {
+            cv::KeyPoint &kp = vKeys[i];
+            kp.pt.x = Get<float>();
+            kp.pt.y = Get<float>();
+            kp.size = Get<float>();
+            kp.angle = Get<float>();
+            kp.response = Get<float>();
+            kp.octave = Get<int32_t>();
+            kp.class_id = Get<int32_t>();
+        }
+    }
+
+private:
+    bool Check(size_t n)
+    {
+        if(!mbOk || size_t(mpEnd-mpData)<n)
+            mbOk = false;
+        return mbOk;
+    }
+
+    const char* mpData;
+    const char* mpEnd;
+    bool mbOk;
+};
+
+// Read-only memory mapping of a whole file
+class MappedFile
+{
+public:
+    MappedFile(const string &filename): mpData(NULL), mnSize(0)
+    {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if(fd<0)
+            return;
+        struct stat st;
+        if(fstat(fd, &st)==0 && st.st_size>0)
+        {
+            void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(p!=MAP_FAILED)
+            {
+                mpData = (const char*)p;
+                mnSize = st.st_size;
+            }
+        }
+        close(fd);
+    }
+
+    ~MappedFile()
+    {
+        if(mpData)
+            munmap((void*)mpData, mnSize);
+    }
+
+    const char* Data() const { return mpData; }
+    size_t Size() const { return mnSize; }
+
+private:
+    const char* mpData;
+    size_t mnSize;
+};
+
+struct Chunk
+{
+    uint32_t tag;
+    const char* data;
+    size_t size;
+};
+
+} // namespace
+
+bool MapSerializer::Save(const string &filename, Map* pMap)
+{
+    ofstream f(filename.c_str(), ios_base::out | ios_base::binary);
+    if(!f.is_open())
+    {
+        cerr << "Could not open " << filename << " to save the map" << endl;
+        return false;
+    }
+
+    f.write(sMagic, sizeof(sMagic));
+    const uint32_t version = nVersion;
+    f.write((const char*)&version, sizeof(version));
+
+    vector<KeyFrame*> vpKFs = pMap->GetAllKeyFrames();
+    sort(vpKFs.begin(),vpKFs.end(),KeyFrame::lId);
+    vector<MapPoint*> vpMPs = pMap->GetAllMapPoints();
+
+    ChunkWriter writer(f);
+
+    size_t nKFs = 0;
+    for(size_t i=0; i<vpKFs.size(); i++)
+    {
+        KeyFrame* pKF = vpKFs[i];
+        if(pKF->isBad())
+            continue;
+
+        writer.Begin(nTagKeyFrame);
+        writer.Put<uint64_t>(pKF->mnId);
+        writer.Put<uint64_t>(pKF->mnFrameId);
+        writer.Put<double>(pKF->mTimeStamp);
+
+        // Calibration and image bounds
+        writer.Put<float>(pKF->fx);
+        writer.Put<float>(pKF->fy);
+        writer.Put<float>(pKF->cx);
+        writer.Put<float>(pKF->cy);
+        writer.Put<float>(pKF->mbf);
+        writer.Put<float>(pKF->mb);
+        writer.Put<float>(pKF->mThDepth);
+        writer.Put<float>(pKF->mfGridElementWidthInv);
+        writer.Put<float>(pKF->mfGridElementHeightInv);
+        writer.Put<int32_t>(pKF->mnMinX);
+        writer.Put<int32_t>(pKF->mnMinY);
+        writer.Put<int32_t>(pKF->mnMaxX);
+        writer.Put<int32_t>(pKF->mnMaxY);
+        writer.PutMat(pKF->mK);
+
+        // Scale pyramid
+        writer.Put<int32_t>(pKF->mnScaleLevels);
+        writer.Put<float>(pKF->mfScaleFactor);
+        writer.Put<float>(pKF->mfLogScaleFactor);
+        writer.PutVector(pKF->mvScaleFactors);
+        writer.PutVector(pKF->mvLevelSigma2);
+        writer.PutVector(pKF->mvInvLevelSigma2);
+
+        // Features
+        writer.PutKeyPoints(pKF->mvKeys);
+        writer.PutKeyPoints(pKF->mvKeysUn);
+        writer.PutVector(pKF->mvuRight);
+        writer.PutVector(pKF->mvDepth);
+        writer.PutMat(pKF->mDescriptors);
+
+        // Pose and affine brightness parameters
+        writer.PutMat(pKF->GetPose());
+        writer.Put<double>(pKF->affineAL);
+        writer.Put<double>(pKF->affineBL);
+        writer.Put<double>(pKF->affineAR);
+        writer.Put<double>(pKF->affineBR);
+
+        // High gradient points
+        writer.Put<uint32_t>(pKF->mHGPoints.size());
+        for(size_t j=0; j<pKF->mHGPoints.size(); j++)
+        {
+            HighGradientPoint* pHG = pKF->mHGPoints[j];
+            writer.Put<double>(pHG->u);
+            writer.Put<double>(pHG->v);
+            writer.Put<double>(pHG->invDepth);
+            writer.Put<double>(pHG->curKF_u);
+            writer.Put<double>(pHG->curKF_v);
+            writer.Put<int32_t>(pHG->obsCounter);
+        }
+
+        if(!writer.End())
+            return false;
+        nKFs++;
+    }
+
+    size_t nMPs = 0;
+    for(size_t i=0; i<vpMPs.size(); i++)
+    {
+        MapPoint* pMP = vpMPs[i];
+        if(pMP->isBad())
+            continue;
+
+        KeyFrame* pRefKF = pMP->GetReferenceKeyFrame();
+        map<KeyFrame*,size_t> observations = pMP->GetObservations();
+
+        writer.Begin(nTagMapPoint);
+        writer.Put<uint64_t>(pMP->mnId);
+        writer.Put<int64_t>(pMP->mnFirstKFid);
+        writer.Put<int64_t>(pMP->mnFirstFrame);
+        writer.Put<int64_t>(pRefKF ? (int64_t)pRefKF->mnId : -1);
+        writer.PutMat(pMP->GetWorldPos());
+        writer.PutMat(pMP->GetNormal());
+        writer.PutMat(pMP->GetDescriptor());
+        {
+            unique_lock<mutex> lock(pMP->mMutexPos);
+            writer.Put<float>(pMP->mfMinDistance);
+            writer.Put<float>(pMP->mfMaxDistance);
+        }
+        {
+            unique_lock<mutex> lock(pMP->mMutexFeatures);
+            writer.Put<int32_t>(pMP->mnVisible);
+            writer.Put<int32_t>(pMP->mnFound);
+        }
+
+        writer.Put<uint32_t>(observations.size());
+        for(map<KeyFrame*,size_t>::iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
+        {
+            writer.Put<uint64_t>(mit->first->mnId);
+            writer.Put<uint32_t>(mit->second);
+        }
+
+        if(!writer.End())
+            return false;
+        nMPs++;
+    }
+
+    for(size_t i=0; i<vpKFs.size(); i++)
+    {
+        KeyFrame* pKF = vpKFs[i];
+        if(pKF->isBad())
+            continue;
+
+        writer.Begin(nTagGraph);
+        writer.Put<uint64_t>(pKF->mnId);
+
+        KeyFrame* pParent = pKF->GetParent();
+        writer.Put<int64_t>(pParent ? (int64_t)pParent->mnId : -1);
+
+        {
+            unique_lock<mutex> lock(pKF->mMutexConnections);
+            writer.Put<uint8_t>(pKF->mbFirstConnection ? 1 : 0);
+            writer.Put<uint32_t>(pKF->mConnectedKeyFrameWeights.size());
+            for(map<KeyFrame*,int>::iterator mit=pKF->mConnectedKeyFrameWeights.begin(), mend=pKF->mConnectedKeyFrameWeights.end(); mit!=mend; mit++)
+            {
+                writer.Put<uint64_t>(mit->first->mnId);
+                writer.Put<int32_t>(mit->second);
+            }
+        }
+
+        set<KeyFrame*> spLoopEdges = pKF->GetLoopEdges();
+        writer.Put<uint32_t>(spLoopEdges.size());
+        for(set<KeyFrame*>::iterator sit=spLoopEdges.begin(), send=spLoopEdges.end(); sit!=send; sit++)
+            writer.Put<uint64_t>((*sit)->mnId);
+
+        if(!writer.End())
+            return false;
+    }
+
+    writer.Begin(nTagOrigins);
+    writer.Put<uint32_t>(pMap->mvpKeyFrameOrigins.size());
+    for(size_t i=0; i<pMap->mvpKeyFrameOrigins.size(); i++)
+        writer.Put<uint64_t>(pMap->mvpKeyFrameOrigins[i]->mnId);
+    if(!writer.End())
+        return false;
+
+    writer.Begin(nTagEnd);
+    if(!writer.End())
+        return false;
+
+    cout << "Map saved to " << filename << ": " << nKFs << " keyframes, " << nMPs << " map points" << endl;
+
+    return true;
+}
+
+bool MapSerializer::Load(const string &filename, Map* pMap, KeyFrameDatabase* pKFDB, ORBVocabulary* pVoc)
+{
+    MappedFile file(filename);
+    if(!file.Data() || file.Size()<sizeof(sMagic)+sizeof(uint32_t) || memcmp(file.Data(),sMagic,sizeof(sMagic))!=0)
+    {
+        cerr << "Could not open " << filename << " as a map file" << endl;
+        return false;
+    }
+
+    uint32_t version;
+    memcpy(&version, file.Data()+sizeof(sMagic), sizeof(version));
+    if(version>nVersion)
+    {
+        cerr << "Map file version " << version << " is newer than the supported version " << nVersion << endl;
+        return false;
+    }
+
+    // Chunk table
+    vector<Chunk> vChunks;
+    size_t offset = sizeof(sMagic)+sizeof(uint32_t);
+    bool bEnd = false;
+    while(!bEnd && offset+sizeof(ChunkHeader)<=file.Size())
+    {
+        ChunkHeader header;
+        memcpy(&header, file.Data()+offset, sizeof(header));
+        offset += sizeof(header);
+        if(header.size>file.Size()-offset)
+            break;
+
+        Chunk chunk;
+        chunk.tag = header.tag;
+        chunk.data = file.Data()+offset;
+        chunk.size = header.size;
+        vChunks.push_back(chunk);
+
+        offset += header.size;
+        bEnd = header.tag==nTagEnd;
+    }
+
+    if(!bEnd)
+    {
+        cerr << "Map file " << filename << " is truncated" << endl;
+        return false;
+    }
+
+    // The keyframes take their calibration from the Frame static members, which are set
+    // from each record. If a frame was already processed its calibration is put back after.
+    const bool bRestoreFrameCalibration = !Frame::mbInitialComputations;
+    const float fx = Frame::fx, fy = Frame::fy, cx = Frame::cx, cy = Frame::cy;
+    const float invfx = Frame::invfx, invfy = Frame::invfy;
+    const float minX = Frame::mnMinX, minY = Frame::mnMinY, maxX = Frame::mnMaxX, maxY = Frame::mnMaxY;
+    const float gridW = Frame::mfGridElementWidthInv, gridH = Frame::mfGridElementHeightInv;
+
+    map<unsigned long, KeyFrame*> mKFs;
+    map<unsigned long, MapPoint*> mMPs;
+    vector<KeyFrame*> vpKFs;
+    vector<MapPoint*> vpMPs;
+    unsigned long maxFrameId = 0;
+    bool bOk = true;
+
+    // Keyframes
+    for(size_t c=0; c<vChunks.size() && bOk; c++)
+    {
+        if(vChunks[c].tag!=nTagKeyFrame)
+            continue;
+
+        ChunkReader reader(vChunks[c].data, vChunks[c].size);
+
+        Frame F;
+        F.mpORBvocabulary = pVoc;
+        F.mpORBextractorLeft = static_cast<ORBextractor*>(NULL);
+        F.mpORBextractorRight = static_cast<ORBextractor*>(NULL);
+        F.mpReferenceKF = static_cast<KeyFrame*>(NULL);
+
+        const unsigned long nId = reader.Get<uint64_t>();
+        F.mnId = reader.Get<uint64_t>();
+        F.mTimeStamp = reader.Get<double>();
+
+        Frame::fx = reader.Get<float>();
+        Frame::fy = reader.Get<float>();
+        Frame::cx = reader.Get<float>();
+        Frame::cy = reader.Get<float>();
+        Frame::invfx = 1.0f/Frame::fx;
+        Frame::invfy = 1.0f/Frame::fy;
+        F.mbf = reader.Get<float>();
+        F.mb = reader.Get<float>();
+        F.mThDepth = reader.Get<float>();
+        Frame::mfGridElementWidthInv = reader.Get<float>();
+        Frame::mfGridElementHeightInv = reader.Get<float>();
+        Frame::mnMinX = reader.Get<int32_t>();
+        Frame::mnMinY = reader.Get<int32_t>();
+        Frame::mnMaxX = reader.Get<int32_t>();
+        Frame::mnMaxY = reader.Get<int32_t>();
+        F.mK = reader.GetMat();
+
+        F.mnScaleLevels = reader.Get<int32_t>();
+        F.mfScaleFactor = reader.Get<float>();
+        F.mfLogScaleFactor = reader.Get<float>();
+        reader.GetVector(F.mvScaleFactors);
+        reader.GetVector(F.mvLevelSigma2);
+        reader.GetVector(F.mvInvLevelSigma2);
+
+        reader.GetKeyPoints(F.mvKeys);
+        reader.GetKeyPoints(F.mvKeysUn);
+        reader.GetVector(F.mvuRight);
+        reader.GetVector(F.mvDepth);
+        F.mDescriptors = reader.GetMat();
+        F.N = F.mvKeysUn.size();
+
+        F.mTcw = reader.GetMat();
+        const double affineAL = reader.Get<double>();
+        const double affineBL = reader.Get<double>();
+        const double affineAR = reader.Get<double>();
+        const double affineBR = reader.Get<double>();
+
+        const uint32_t nHG = reader.Get<uint32_t>();
+        for(uint32_t j=0; j<nHG && reader.Ok(); j++)
+        {
+            const double u = reader.Get<double>();
+            const double v = reader.Get<double>();
+            const double invDepth = reader.Get<double>();
+            HighGradientPoint* pHG = new HighGradientPoint(u,v,invDepth);
+            pHG->curKF_u = reader.Get<double>();
+            pHG->curKF_v = reader.Get<double>();
+            pHG->obsCounter = reader.Get<int32_t>();
+            F.mHGPoints.push_back(pHG);
+        }
+
+        if(!reader.Ok() || F.mvKeys.size()!=(size_t)F.N || F.mvuRight.size()!=(size_t)F.N ||
+           F.mvDepth.size()!=(size_t)F.N || F.mDescriptors.rows!=F.N || F.mTcw.rows!=4 || F.mTcw.cols!=4)
+        {
+            for(size_t j=0; j<F.mHGPoints.size(); j++)
+                delete F.mHGPoints[j];
+            bOk = false;
+            break;
+        }
+
+        F.mvpMapPoints = vector<MapPoint*>(F.N,static_cast<MapPoint*>(NULL));
+        for(int i=0; i<F.N; i++)
+        {
+            int nGridPosX, nGridPosY;
+            if(F.PosInGrid(F.mvKeysUn[i],nGridPosX,nGridPosY))
+                F.mGrid[nGridPosX][nGridPosY].push_back(i);
+        }
+
+        KeyFrame* pKF = new KeyFrame(F,pMap,pKFDB);
+        pKF->mnId = nId;
+        pKF->affineAL = affineAL;
+        pKF->affineBL = affineBL;
+        pKF->affineAR = affineAR;
+        pKF->affineBR = affineBR;
+
+        mKFs[nId] = pKF;
+        vpKFs.push_back(pKF);
+        maxFrameId = max(maxFrameId,(unsigned long)F.mnId);
+    }
+
+    if(bRestoreFrameCalibration)
+    {
+        Frame::fx = fx; Frame::fy = fy; Frame::cx = cx; Frame::cy = cy;
+        Frame::invfx = invfx; Frame::invfy = invfy;
+        Frame::mnMinX = minX; Frame::mnMinY = minY; Frame::mnMaxX = maxX; Frame::mnMaxY = maxY;
+        Frame::mfGridElementWidthInv = gridW; Frame::mfGridElementHeightInv = gridH;
+    }
+
+    // Map points and observations
+    for(size_t c=0; c<vChunks.size() && bOk; c++)
+    {
+        if(vChunks[c].tag!=nTagMapPoint)
+            continue;
+
+        ChunkReader reader(vChunks[c].data, vChunks[c].size);
+
+        const unsigned long nId = reader.Get<uint64_t>();
+        const long int nFirstKFid = reader.Get<int64_t>();
+        const long int nFirstFrame = reader.Get<int64_t>();
+        const int64_t nRefKFid = reader.Get<int64_t>();
+        cv::Mat Pos = reader.GetMat();
+        cv::Mat Normal = reader.GetMat();
+        cv::Mat Descriptor = reader.GetMat();
+        const float minDistance = reader.Get<float>();
+        const float maxDistance = reader.Get<float>();
+        const int nVisible = reader.Get<int32_t>();
+        const int nFound = reader.Get<int32_t>();
+
+        vector<pair<KeyFrame*,size_t> > vObservations;
+        const uint32_t nObs = reader.Get<uint32_t>();
+        for(uint32_t j=0; j<nObs && reader.Ok(); j++)
+        {
+            const unsigned long nKFid = reader.Get<uint64_t>();
+            const size_t idx = reader.Get<uint32_t>();
+            map<unsigned long,KeyFrame*>::iterator mit = mKFs.find(nKFid);
+            if(mit!=mKFs.end() && idx<(size_t)mit->second->N)
+                vObservations.push_back(make_pair(mit->second,idx));
+        }
+
+        if(!reader.Ok() || Pos.rows!=3 || Normal.rows!=3)
+        {
+            bOk = false;
+            break;
+        }
+
+        if(vObservations.empty())
+            continue;
+
+        KeyFrame* pRefKF = vObservations[0].first;
+        map<unsigned long,KeyFrame*>::iterator mit = mKFs.find(nRefKFid);
+        if(nRefKFid>=0 && mit!=mKFs.end())
+            pRefKF = mit->second;
+
+        MapPoint* pMP = new MapPoint(Pos,pRefKF,pMap);
+        pMP->mnId = nId;
+        pMP->mnFirstKFid = nFirstKFid;
+        pMP->mnFirstFrame = nFirstFrame;
+        pMP->mNormalVector = Normal;
+        pMP->mNormalVectorEig = Eigen::Vector3f(Normal.at<float>(0),Normal.at<float>(1),Normal.at<float>(2));
+        pMP->mDescriptor = Descriptor;
+        pMP->mfMinDistance = minDistance;
+        pMP->mfMaxDistance = maxDistance;
+        pMP->mnVisible = nVisible;
+        pMP->mnFound = nFound;
+
+        for(size_t j=0; j<vObservations.size(); j++)
+        {
+            pMP->AddObservation(vObservations[j].first,vObservations[j].second);
+            vObservations[j].first->AddMapPoint(pMP,vObservations[j].second);
+        }
+
+        mMPs[nId] = pMP;
+        vpMPs.push_back(pMP);
+    }
+
+    // Covisibility graph, spanning tree and loop edges
+    for(size_t c=0; c<vChunks.size() && bOk; c++)
+    {
+        if(vChunks[c].tag!=nTagGraph)
+            continue;
+
+        ChunkReader reader(vChunks[c].data, vChunks[c].size);
+
+        const unsigned long nId = reader.Get<uint64_t>();
+        const int64_t nParentId = reader.Get<int64_t>();
+        const bool bFirstConnection = reader.Get<uint8_t>()>0;
+
+        map<unsigned long,KeyFrame*>::iterator mit = mKFs.find(nId);
+        if(mit==mKFs.end())
+            continue;
+        KeyFrame* pKF = mit->second;
+
+        map<KeyFrame*,int> mConnections;
+        const uint32_t nConnections = reader.Get<uint32_t>();
+        for(uint32_t j=0; j<nConnections && reader.Ok(); j++)
+        {
+            const unsigned long nKFid = reader.Get<uint64_t>();
+            const int weight = reader.Get<int32_t>();
+            map<unsigned long,KeyFrame*>::iterator mit2 = mKFs.find(nKFid);
+            if(mit2!=mKFs.end())
+                mConnections[mit2->second] = weight;
+        }
+
+        set<KeyFrame*> spLoopEdges;
+        const uint32_t nLoopEdges = reader.Get<uint32_t>();
+        for(uint32_t j=0; j<nLoopEdges && reader.Ok(); j++)
+        {
+            map<unsigned long,KeyFrame*>::iterator mit2 = mKFs.find(reader.Get<uint64_t>());
+            if(mit2!=mKFs.end())
+                spLoopEdges.insert(mit2->second);
+        }
+
+        if(!reader.Ok())
+        {
+            bOk = false;
+            break;
+        }
+
+        {
+            unique_lock<mutex> lock(pKF->mMutexConnections);
+            pKF->mConnectedKeyFrameWeights = mConnections;
+            pKF->mbFirstConnection = bFirstConnection;
+            pKF->mspLoopEdges = spLoopEdges;
+
+            map<unsigned long,KeyFrame*>::iterator mitParent = mKFs.find(nParentId);
+            if(nParentId>=0 && mitParent!=mKFs.end())
+                pKF->mpParent = mitParent->second;
+        }
+        pKF->UpdateBestCovisibles();
+        if(pKF->GetParent())
+            pKF->GetParent()->AddChild(pKF);
+    }
+
+    // Origins
+    for(size_t c=0; c<vChunks.size() && bOk; c++)
+    {
+        if(vChunks[c].tag!=nTagOrigins)
+            continue;
+
+        ChunkReader reader(vChunks[c].data, vChunks[c].size);
+        const uint32_t nOrigins = reader.Get<uint32_t>();
+        for(uint32_t j=0; j<nOrigins && reader.Ok(); j++)
+        {
+            map<unsigned long,KeyFrame*>::iterator mit = mKFs.find(reader.Get<uint64_t>());
+            if(mit!=mKFs.end())
+                pMap->mvpKeyFrameOrigins.push_back(mit->second);
+        }
+        bOk = reader.Ok();
+    }
+
+    if(!bOk || vpKFs.empty())
+    {
+        cerr << "Map file " << filename << " is corrupted" << endl;
+        for(size_t i=0; i<vpMPs.size(); i++)
+            delete vpMPs[i];
+        for(size_t i=0; i<vpKFs.size(); i++)
+        {
+            for(size_t j=0; j<vpKFs[i]->mHGPoints.size(); j++)
+                delete vpKFs[i]->mHGPoints[j];
+            delete vpKFs[i];
+        }
+        pMap->mvpKeyFrameOrigins.clear();
+        return false;
+    }
+
+    if(pMap->mvpKeyFrameOrigins.empty())
+        pMap->mvpKeyFrameOrigins.push_back(mKFs.begin()->second);
+
+    for(size_t i=0; i<vpKFs.size(); i++)
+    {
+        KeyFrame* pKF = vpKFs[i];
+        pKF->ComputeBoW();
+        pMap->AddKeyFrame(pKF);
+        pKFDB->add(pKF);
+    }
+
+    for(size_t i=0; i<vpMPs.size(); i++)
+        pMap->AddMapPoint(vpMPs[i]);
+
+    // New keyframes, map points and frames continue after the loaded ids
+    KeyFrame::nNextId = mKFs.rbegin()->first+1;
+    if(!mMPs.empty())
+        MapPoint::nNextId = max(MapPoint::nNextId,mMPs.rbegin()->first+1);
+    Frame::nNextId = max(Frame::nNextId,maxFrameId+1);
+
+    pMap->InformNewBigChange();
+
+    cout << "Map loaded from " << filename << ": " << vpKFs.size() << " keyframes, " << vpMPs.size() << " map points" << endl;
+
+    return true;
+}
+
+} //namespace ORB_SLAM
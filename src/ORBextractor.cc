@@ -411,7 +411,7 @@ static int bit_pattern_31_[256*4] =
 ORBextractor::ORBextractor(int _nfeatures, float _scaleFactor, int _nlevels,
          int _iniThFAST, int _minThFAST):
     nfeatures(_nfeatures), scaleFactor(_scaleFactor), nlevels(_nlevels),
-    iniThFAST(_iniThFAST), minThFAST(_minThFAST)
+    iniThFAST(_iniThFAST), minThFAST(_minThFAST), mbReusePhotometricPyramid(false)
 {
     mvScaleFactor.resize(nlevels);
     mvLevelSigma2.resize(nlevels);
@@ -1097,7 +1097,9 @@ void ORBextractor::operator()( InputArray _image, InputArray _mask, vector<KeyPo
     ComputePyramid(image);
 
     // Pre-compute the image gradient and floating-point pyramid
-    ComputePhotometricBAPyramid(image);
+    if(!mbReusePhotometricPyramid)
+        ComputePhotometricBAPyramid(image);
+    mbReusePhotometricPyramid = false;
 
     vector < vector<KeyPoint> > allKeypoints, allPoints;
     ComputeKeyPointsOctTree(allKeypoints, allPoints);
@@ -1173,6 +1175,17 @@ void ORBextractor::operator()( InputArray _image, InputArray _mask, vector<KeyPo
 }
 
 
+void ORBextractor::ComputePhotometricPyramid(InputArray _image)
+{
+    if(_image.empty())
+        return;
+
+    Mat image = _image.getMat();
+    assert(image.type() == CV_8UC1 );
+
+    ComputePhotometricBAPyramid(image);
+}
+
 void ORBextractor::ComputePyramid(cv::Mat image)
 {
     for (int level = 0; level < nlevels; ++level)
@@ -824,8 +824,17 @@ int ORBmatcher::SearchForTriangulation(KeyFrame *pKF1, KeyFrame *pKF2, cv::Mat F
 
 int ORBmatcher::Fuse(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, const float th)
 {
-    cv::Mat Rcw = pKF->GetRotation();
-    cv::Mat tcw = pKF->GetTranslation();
+    vector<pair<MapPoint*,size_t> > vMatches;
+    SearchFuse(pKF,vpMapPoints,vMatches,th);
+
+    set<MapPoint*> sChanged;
+    return ApplyFuse(pKF,vMatches,sChanged);
+}
+
+int ORBmatcher::SearchFuse(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, vector<pair<MapPoint*,size_t> > &vMatches, const float th)
+{
+    const Eigen::Matrix3f Rcw = pKF->GetRotationEig();
+    const Eigen::Vector3f tcw = pKF->GetTranslationEig();
 
     const float &fx = pKF->fx;
     const float &fy = pKF->fy;
@@ -833,7 +842,7 @@ int ORBmatcher::Fuse(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, const
     const float &cy = pKF->cy;
     const float &bf = pKF->mbf;
 
-    cv::Mat Ow = pKF->GetCameraCenter();
+    const Eigen::Vector3f Ow = pKF->GetCameraCenterEig();
 
     int nFused=0;
 
@@ -849,16 +858,16 @@ int ORBmatcher::Fuse(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, const
         if(pMP->isBad() || pMP->IsInKeyFrame(pKF))
             continue;
 
-        cv::Mat p3Dw = pMP->GetWorldPos();
-        cv::Mat p3Dc = Rcw*p3Dw + tcw;
+        const Eigen::Vector3f p3Dw = pMP->GetWorldPosEig();
+        const Eigen::Vector3f p3Dc = Rcw*p3Dw + tcw;
 
         // Depth must be positive
-        if(p3Dc.at<float>(2)<0.0f)
+        if(p3Dc(2)<0.0f)
             continue;
 
-        const float invz = 1/p3Dc.at<float>(2);
-        const float x = p3Dc.at<float>(0)*invz;
-        const float y = p3Dc.at<float>(1)*invz;
+        const float invz = 1/p3Dc(2);
+        const float x = p3Dc(0)*invz;
+        const float y = p3Dc(1)*invz;
 
         const float u = fx*x+cx;
         const float v = fy*y+cy;
@@ -871,15 +880,15 @@ int ORBmatcher::Fuse(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, const
 
         const float maxDistance = pMP->GetMaxDistanceInvariance();
         const float minDistance = pMP->GetMinDistanceInvariance();
-        cv::Mat PO = p3Dw-Ow;
-        const float dist3D = cv::norm(PO);
+        const Eigen::Vector3f PO = p3Dw-Ow;
+        const float dist3D = PO.norm();
 
         // Depth must be inside the scale pyramid of the image
         if(dist3D<minDistance || dist3D>maxDistance )
             continue;
 
         // Viewing angle must be less than 60 deg
-        cv::Mat Pn = pMP->GetNormal();
+        const Eigen::Vector3f Pn = pMP->GetNormalEig();
 
         if(PO.dot(Pn)<0.5*dist3D)
             continue;
@@ -948,33 +957,89 @@ int ORBmatcher::Fuse(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, const
             }
         }
 
-        // If there is already a MapPoint replace otherwise add new measurement
         if(bestDist<=TH_LOW)
         {
-            MapPoint* pMPinKF = pKF->GetMapPoint(bestIdx);
-            if(pMPinKF)
+            vMatches.push_back(make_pair(pMP,(size_t)bestIdx));
+            nFused++;
+        }
+    }
+
+    return nFused;
+}
+
+int ORBmatcher::ApplyFuse(KeyFrame *pKF, const vector<pair<MapPoint*,size_t> > &vMatches, set<MapPoint*> &sChanged)
+{
+    int nFused=0;
+
+    for(size_t i=0, iend=vMatches.size(); i<iend; i++)
+    {
+        MapPoint* pMP = vMatches[i].first;
+        const size_t idx = vMatches[i].second;
+
+        // A previous match may have changed the point
+        if(pMP->isBad() || pMP->IsInKeyFrame(pKF))
+            continue;
+
+        // If there is already a MapPoint replace otherwise add new measurement
+        MapPoint* pMPinKF = pKF->GetMapPoint(idx);
+        if(pMPinKF)
+        {
+            if(!pMPinKF->isBad())
             {
-                if(!pMPinKF->isBad())
+                if(pMPinKF->Observations()>pMP->Observations())
                 {
-                    if(pMPinKF->Observations()>pMP->Observations())
-                        pMP->Replace(pMPinKF);
-                    else
-                        pMPinKF->Replace(pMP);
+                    pMP->Replace(pMPinKF);
+                    sChanged.insert(pMPinKF);
+                }
+                else
+                {
+                    pMPinKF->Replace(pMP);
+                    sChanged.insert(pMP);
                 }
             }
-            else
-            {
-                pMP->AddObservation(pKF,bestIdx);
-                pKF->AddMapPoint(pMP,bestIdx);
-            }
-            nFused++;
         }
+        else
+        {
+            pMP->AddObservation(pKF,idx);
+            pKF->AddMapPoint(pMP,idx);
+            sChanged.insert(pMP);
+        }
+        nFused++;
     }
 
     return nFused;
 }
 
 int ORBmatcher::Fuse(KeyFrame *pKF, cv::Mat Scw, const vector<MapPoint *> &vpPoints, float th, vector<MapPoint *> &vpReplacePoint)
+{
+    vector<int> vnMatches;
+    const int nFused = SearchFuse(pKF,Scw,vpPoints,th,vnMatches);
+
+    // If there is already a MapPoint replace otherwise add new measurement
+    for(size_t iMP=0, iend=vpPoints.size(); iMP<iend; iMP++)
+    {
+        const int bestIdx = vnMatches[iMP];
+        if(bestIdx<0)
+            continue;
+
+        MapPoint* pMP = vpPoints[iMP];
+        MapPoint* pMPinKF = pKF->GetMapPoint(bestIdx);
+        if(pMPinKF)
+        {
+            if(!pMPinKF->isBad())
+                vpReplacePoint[iMP] = pMPinKF;
+        }
+        else
+        {
+            pMP->AddObservation(pKF,bestIdx);
+            pKF->AddMapPoint(pMP,bestIdx);
+        }
+    }
+
+    return nFused;
+}
+
+int ORBmatcher::SearchFuse(KeyFrame *pKF, cv::Mat Scw, const vector<MapPoint *> &vpPoints, float th, vector<int> &vnMatches)
 {
     // Get Calibration Parameters for later projection
     const float &fx = pKF->fx;
@@ -996,6 +1061,8 @@ int ORBmatcher::Fuse(KeyFrame *pKF, cv::Mat Scw, const vector<MapPoint *> &vpPoi
 
     const int nPoints = vpPoints.size();
 
+    vnMatches = vector<int>(nPoints,-1);
+
     // For each candidate MapPoint project and match
     for(int iMP=0; iMP<nPoints; iMP++)
     {
@@ -1078,20 +1145,9 @@ int ORBmatcher::Fuse(KeyFrame *pKF, cv::Mat Scw, const vector<MapPoint *> &vpPoi
             }
         }
 
-        // If there is already a MapPoint replace otherwise add new measurement
         if(bestDist<=TH_LOW)
         {
-            MapPoint* pMPinKF = pKF->GetMapPoint(bestIdx);
-            if(pMPinKF)
-            {
-                if(!pMPinKF->isBad())
-                    vpReplacePoint[iMP] = pMPinKF;
-            }
-            else
-            {
-                pMP->AddObservation(pKF,bestIdx);
-                pKF->AddMapPoint(pMP,bestIdx);
-            }
+            vnMatches[iMP] = bestIdx;
             nFused++;
         }
     }
@@ -1335,18 +1391,18 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, const Frame &LastFrame,
         rotHist[i].reserve(500);
     const float factor = 1.0f/HISTO_LENGTH;
 
-    const cv::Mat Rcw = CurrentFrame.mTcw.rowRange(0,3).colRange(0,3);
-    const cv::Mat tcw = CurrentFrame.mTcw.rowRange(0,3).col(3);
+    const Eigen::Matrix3f &Rcw = CurrentFrame.GetRotationEig();
+    const Eigen::Vector3f &tcw = CurrentFrame.GetTranslationEig();
 
-    const cv::Mat twc = -Rcw.t()*tcw;
+    const Eigen::Vector3f &twc = CurrentFrame.GetCameraCenterEig();
 
-    const cv::Mat Rlw = LastFrame.mTcw.rowRange(0,3).colRange(0,3);
-    const cv::Mat tlw = LastFrame.mTcw.rowRange(0,3).col(3);
+    const Eigen::Matrix3f &Rlw = LastFrame.GetRotationEig();
+    const Eigen::Vector3f &tlw = LastFrame.GetTranslationEig();
 
-    const cv::Mat tlc = Rlw*twc+tlw;
+    const Eigen::Vector3f tlc = Rlw*twc+tlw;
 
-    const bool bForward = tlc.at<float>(2)>CurrentFrame.mb && !bMono;
-    const bool bBackward = -tlc.at<float>(2)>CurrentFrame.mb && !bMono;
+    const bool bForward = tlc(2)>CurrentFrame.mb && !bMono;
+    const bool bBackward = -tlc(2)>CurrentFrame.mb && !bMono;
 
     for(int i=0; i<LastFrame.N; i++)
     {
@@ -1357,12 +1413,12 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, const Frame &LastFrame,
             if(!LastFrame.mvbOutlier[i])
             {
                 // Project
-                cv::Mat x3Dw = pMP->GetWorldPos();
-                cv::Mat x3Dc = Rcw*x3Dw+tcw;
+                const Eigen::Vector3f x3Dw = pMP->GetWorldPosEig();
+                const Eigen::Vector3f x3Dc = Rcw*x3Dw+tcw;
 
-                const float xc = x3Dc.at<float>(0);
-                const float yc = x3Dc.at<float>(1);
-                const float invzc = 1.0/x3Dc.at<float>(2);
+                const float xc = x3Dc(0);
+                const float yc = x3Dc(1);
+                const float invzc = 1.0/x3Dc(2);
 
                 if(invzc<0)
                     continue;
@@ -1473,9 +1529,9 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, KeyFrame *pKF, const set
 {
     int nmatches = 0;
 
-    const cv::Mat Rcw = CurrentFrame.mTcw.rowRange(0,3).colRange(0,3);
-    const cv::Mat tcw = CurrentFrame.mTcw.rowRange(0,3).col(3);
-    const cv::Mat Ow = -Rcw.t()*tcw;
+    const Eigen::Matrix3f &Rcw = CurrentFrame.GetRotationEig();
+    const Eigen::Vector3f &tcw = CurrentFrame.GetTranslationEig();
+    const Eigen::Vector3f &Ow = CurrentFrame.GetCameraCenterEig();
 
     // Rotation Histogram (to check rotation consistency)
     vector<int> rotHist[HISTO_LENGTH];
@@ -1494,12 +1550,12 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, KeyFrame *pKF, const set
             if(!pMP->isBad() && !sAlreadyFound.count(pMP))
             {
                 //Project
-                cv::Mat x3Dw = pMP->GetWorldPos();
-                cv::Mat x3Dc = Rcw*x3Dw+tcw;
+                const Eigen::Vector3f x3Dw = pMP->GetWorldPosEig();
+                const Eigen::Vector3f x3Dc = Rcw*x3Dw+tcw;
 
-                const float xc = x3Dc.at<float>(0);
-                const float yc = x3Dc.at<float>(1);
-                const float invzc = 1.0/x3Dc.at<float>(2);
+                const float xc = x3Dc(0);
+                const float yc = x3Dc(1);
+                const float invzc = 1.0/x3Dc(2);
 
                 const float u = CurrentFrame.fx*xc*invzc+CurrentFrame.cx;
                 const float v = CurrentFrame.fy*yc*invzc+CurrentFrame.cy;
@@ -1510,8 +1566,7 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, KeyFrame *pKF, const set
                     continue;
 
                 // Compute predicted scale level
-                cv::Mat PO = x3Dw-Ow;
-                float dist3D = cv::norm(PO);
+                const float dist3D = (x3Dw-Ow).norm();
 
                 const float maxDistance = pMP->GetMaxDistanceInvariance();
                 const float minDistance = pMP->GetMinDistanceInvariance();
@@ -1662,4 +1717,17 @@ int ORBmatcher::DescriptorDistance(const cv::Mat &a, const cv::Mat &b)
     return dist;
 }
 
+int ORBmatcher::DescriptorDistance(const unsigned char *a, const unsigned char *b)
+{
+    const uint64_t *pa = reinterpret_cast<const uint64_t*>(a);
+    const uint64_t *pb = reinterpret_cast<const uint64_t*>(b);
+
+    int dist=0;
+
+    for(int i=0; i<4; i++)
+        dist += __builtin_popcountll(pa[i]^pb[i]);
+
+    return dist;
+}
+
 } //namespace ORB_SLAM
@@ -25,22 +25,109 @@
 
 #include "Converter.h"
 
+#include "Thirdparty/DBoW2/DUtils/ParallelFor.h"
+
+#include<cmath>
 #include<mutex>
 
 namespace ORB_SLAM2
 {
 
+// Linear solver of the given type for the reduced system of a block solver
+template<class TBlockSolver>
+static typename TBlockSolver::LinearSolverType* CreateLinearSolver(const Optimizer::eLinearSolver type)
+{
+    typedef typename TBlockSolver::PoseMatrixType PoseMatrixType;
+    switch(type)
+    {
+    case Optimizer::LINEAR_SOLVER_CHOLESKY:
+        return new g2o::LinearSolverBlockCholesky<PoseMatrixType>();
+    case Optimizer::LINEAR_SOLVER_PCG:
+        return new g2o::LinearSolverPCG<PoseMatrixType>();
+    default:
+        return new g2o::LinearSolverEigen<PoseMatrixType>();
+    }
+}
+
+// Reprojection edge (monocular or stereo) of the keypoint idx of pKF
+static g2o::OptimizableGraph::Edge* CreateReprojectionEdge(KeyFrame* pKF, const size_t idx, g2o::OptimizableGraph::Vertex* vPoint,
+                                                           g2o::OptimizableGraph::Vertex* vKF, const bool bRobust)
+{
+    const float thHuber2D = sqrt(5.99);
+    const float thHuber3D = sqrt(7.815);
+
+    const cv::KeyPoint &kpUn = pKF->mvKeysUn[idx];
+    const float &invSigma2 = pKF->mvInvLevelSigma2[kpUn.octave];
+
+    if(pKF->mvuRight[idx]<0)
+    {
+        Eigen::Matrix<double,2,1> obs;
+        obs << kpUn.pt.x, kpUn.pt.y;
+
+        g2o::EdgeSE3ProjectXYZ* e = new g2o::EdgeSE3ProjectXYZ();
+
+        e->setVertex(0, vPoint);
+        e->setVertex(1, vKF);
+        e->setMeasurement(obs);
+        e->setInformation(Eigen::Matrix2d::Identity()*invSigma2);
+
+        if(bRobust)
+        {
+            g2o::RobustKernelHuber* rk = new g2o::RobustKernelHuber;
+            e->setRobustKernel(rk);
+            rk->setDelta(thHuber2D);
+        }
+
+        e->fx = pKF->fx;
+        e->fy = pKF->fy;
+        e->cx = pKF->cx;
+        e->cy = pKF->cy;
+
+        return e;
+    }
+    else
+    {
+        Eigen::Matrix<double,3,1> obs;
+        const float kp_ur = pKF->mvuRight[idx];
+        obs << kpUn.pt.x, kpUn.pt.y, kp_ur;
+
+        g2o::EdgeStereoSE3ProjectXYZ* e = new g2o::EdgeStereoSE3ProjectXYZ();
+
+        e->setVertex(0, vPoint);
+        e->setVertex(1, vKF);
+        e->setMeasurement(obs);
+        Eigen::Matrix3d Info = Eigen::Matrix3d::Identity()*invSigma2;
+        e->setInformation(Info);
+
+        if(bRobust)
+        {
+            g2o::RobustKernelHuber* rk = new g2o::RobustKernelHuber;
+            e->setRobustKernel(rk);
+            rk->setDelta(thHuber3D);
+        }
+
+        e->fx = pKF->fx;
+        e->fy = pKF->fy;
+        e->cx = pKF->cx;
+        e->cy = pKF->cy;
+        e->bf = pKF->mbf;
 
-void Optimizer::GlobalBundleAdjustemnt(Map* pMap, int nIterations, bool* pbStopFlag, const unsigned long nLoopKF, const bool bRobust)
+        return e;
+    }
+}
+
+void Optimizer::GlobalBundleAdjustemnt(Map* pMap, int nIterations, bool* pbStopFlag, const unsigned long nLoopKF, const bool bRobust,
+                                       const eLinearSolver linearSolver)
 {
     vector<KeyFrame*> vpKFs = pMap->GetAllKeyFrames();
     vector<MapPoint*> vpMP = pMap->GetAllMapPoints();
-    BundleAdjustment(vpKFs,vpMP,nIterations,pbStopFlag, nLoopKF, bRobust);
+    BundleAdjustment(vpKFs,vpMP,nIterations,pbStopFlag, nLoopKF, bRobust, linearSolver);
 }
 
 
 void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<MapPoint *> &vpMP,
-                                 int nIterations, bool* pbStopFlag, const unsigned long nLoopKF, const bool bRobust)
+                                 int nIterations, bool* pbStopFlag, const unsigned long nLoopKF, const bool bRobust,
+                                 const eLinearSolver eSolver)
 {
     vector<bool> vbNotIncludedMP;
     vbNotIncludedMP.resize(vpMP.size());
@@ -48,7 +135,7 @@ void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<M
     g2o::SparseOptimizer optimizer;
     g2o::BlockSolver_6_3::LinearSolverType * linearSolver;
 
-    linearSolver = new g2o::LinearSolverEigen<g2o::BlockSolver_6_3::PoseMatrixType>();
+    linearSolver = CreateLinearSolver<g2o::BlockSolver_6_3>(eSolver);
 
     g2o::BlockSolver_6_3 * solver_ptr = new g2o::BlockSolver_6_3(linearSolver);
 
@@ -75,9 +162,6 @@ void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<M
             maxKFid=pKF->mnId;
     }
 
-    const float thHuber2D = sqrt(5.99);
-    const float thHuber3D = sqrt(7.815);
-
     // Set MapPoint vertices
     for(size_t i=0; i<vpMP.size(); i++)
     {
@@ -104,65 +188,9 @@ void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<M
 
             nEdges++;
 
-            const cv::KeyPoint &kpUn = pKF->mvKeysUn[mit->second];
-
-            if(pKF->mvuRight[mit->second]<0)
-            {
-                Eigen::Matrix<double,2,1> obs;
-                obs << kpUn.pt.x, kpUn.pt.y;
-
-                g2o::EdgeSE3ProjectXYZ* e = new g2o::EdgeSE3ProjectXYZ();
-
-                e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(id)));
-                e->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(pKF->mnId)));
-                e->setMeasurement(obs);
-                const float &invSigma2 = pKF->mvInvLevelSigma2[kpUn.octave];
-                e->setInformation(Eigen::Matrix2d::Identity()*invSigma2);
-
-                if(bRobust)
-                {
-                    g2o::RobustKernelHuber* rk = new g2o::RobustKernelHuber;
-                    e->setRobustKernel(rk);
-                    rk->setDelta(thHuber2D);
-                }
-
-                e->fx = pKF->fx;
-                e->fy = pKF->fy;
-                e->cx = pKF->cx;
-                e->cy = pKF->cy;
-
-                optimizer.addEdge(e);
-            }
-            else
-            {
-                Eigen::Matrix<double,3,1> obs;
-                const float kp_ur = pKF->mvuRight[mit->second];
-                obs << kpUn.pt.x, kpUn.pt.y, kp_ur;
-
-                g2o::EdgeStereoSE3ProjectXYZ* e = new g2o::EdgeStereoSE3ProjectXYZ();
-
-                e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(id)));
-                e->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(pKF->mnId)));
-                e->setMeasurement(obs);
-                const float &invSigma2 = pKF->mvInvLevelSigma2[kpUn.octave];
-                Eigen::Matrix3d Info = Eigen::Matrix3d::Identity()*invSigma2;
-                e->setInformation(Info);
-
-                if(bRobust)
-                {
-                    g2o::RobustKernelHuber* rk = new g2o::RobustKernelHuber;
-                    e->setRobustKernel(rk);
-                    rk->setDelta(thHuber3D);
-                }
-
-                e->fx = pKF->fx;
-                e->fy = pKF->fy;
-                e->cx = pKF->cx;
-                e->cy = pKF->cy;
-                e->bf = pKF->mbf;
-
-                optimizer.addEdge(e);
-            }
+            optimizer.addEdge(CreateReprojectionEdge(pKF, mit->second, vPoint,
+                                                     dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(pKF->mnId)),
+                                                     bRobust));
         }
 
         if(nEdges==0)
@@ -229,125 +257,526 @@ void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<M
 
 }
 
-int Optimizer::PoseOptimization(Frame *pFrame)
+// Keyframes and points of PartitionedGlobalBundleAdjustment. The estimates of the previous round are read
+// by all the partitions, the ones of the current round are written only by the partition owning the element.
+struct GBAPartitions
+{
+    vector<KeyFrame*> vpKFs;
+    vector<MapPoint*> vpMP;
+    map<KeyFrame*,size_t> mKFIndex;
+    map<MapPoint*,size_t> mMPIndex;
+    long unsigned int maxKFid;
+
+    vector<int> vKFPartition;
+    vector<int> vMPPartition;
+    vector<vector<size_t> > vPartitionKFs;
+    vector<vector<size_t> > vPartitionMPs;
+
+    vector<g2o::SE3Quat, Eigen::aligned_allocator<g2o::SE3Quat> > vPoses, vPosesPrev;
+    vector<Eigen::Vector3d, Eigen::aligned_allocator<Eigen::Vector3d> > vPoints, vPointsPrev;
+    vector<char> vbIncludedMP;
+};
+
+// Keyframe vertex of the partition graph, fixed if it belongs to another partition
+static g2o::OptimizableGraph::Vertex* GetPartitionKFVertex(g2o::SparseOptimizer &optimizer, const GBAPartitions &P,
+                                                          const size_t idx, const int nPartition)
+{
+    KeyFrame* pKF = P.vpKFs[idx];
+    g2o::OptimizableGraph::Vertex* v = optimizer.vertex(pKF->mnId);
+    if(v)
+        return v;
+
+    g2o::VertexSE3Expmap * vSE3 = new g2o::VertexSE3Expmap();
+    vSE3->setEstimate(P.vPosesPrev[idx]);
+    vSE3->setId(pKF->mnId);
+    vSE3->setFixed(pKF->mnId==0 || P.vKFPartition[idx]!=nPartition);
+    optimizer.addVertex(vSE3);
+    return vSE3;
+}
+
+static void OptimizeGBAPartition(GBAPartitions &P, const int nPartition, int nIterations, bool* pbStopFlag,
+                                 const bool bRobust, const Optimizer::eLinearSolver eSolver)
 {
     g2o::SparseOptimizer optimizer;
     g2o::BlockSolver_6_3::LinearSolverType * linearSolver;
 
-    linearSolver = new g2o::LinearSolverDense<g2o::BlockSolver_6_3::PoseMatrixType>();
+    linearSolver = CreateLinearSolver<g2o::BlockSolver_6_3>(eSolver);
 
     g2o::BlockSolver_6_3 * solver_ptr = new g2o::BlockSolver_6_3(linearSolver);
 
     g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
     optimizer.setAlgorithm(solver);
 
-    int nInitialCorrespondences=0;
+    if(pbStopFlag)
+        optimizer.setForceStopFlag(pbStopFlag);
 
-    // Set Frame vertex
-    g2o::VertexSE3Expmap * vSE3 = new g2o::VertexSE3Expmap();
-    vSE3->setEstimate(Converter::toSE3Quat(pFrame->mTcw));
-    vSE3->setId(0);
-    vSE3->setFixed(false);
-    optimizer.addVertex(vSE3);
+    const vector<size_t> &vKFs = P.vPartitionKFs[nPartition];
+    const vector<size_t> &vMPs = P.vPartitionMPs[nPartition];
 
-    // Set MapPoint vertices
-    const int N = pFrame->N;
+    for(size_t i=0; i<vKFs.size(); i++)
+        GetPartitionKFVertex(optimizer,P,vKFs[i],nPartition);
 
-    vector<g2o::EdgeSE3ProjectXYZOnlyPose*> vpEdgesMono;
-    vector<size_t> vnIndexEdgeMono;
-    vpEdgesMono.reserve(N);
-    vnIndexEdgeMono.reserve(N);
+    // Points of the partition, with all their observations
+    vector<int> vnEdges(vMPs.size(),0);
+    for(size_t i=0; i<vMPs.size(); i++)
+    {
+        MapPoint* pMP = P.vpMP[vMPs[i]];
+        g2o::VertexSBAPointXYZ* vPoint = new g2o::VertexSBAPointXYZ();
+        vPoint->setEstimate(P.vPointsPrev[vMPs[i]]);
+        vPoint->setId(pMP->mnId+P.maxKFid+1);
+        vPoint->setMarginalized(true);
+        optimizer.addVertex(vPoint);
 
-    vector<g2o::EdgeStereoSE3ProjectXYZOnlyPose*> vpEdgesStereo;
-    vector<size_t> vnIndexEdgeStereo;
-    vpEdgesStereo.reserve(N);
-    vnIndexEdgeStereo.reserve(N);
+        const map<KeyFrame*,size_t> observations = pMP->GetObservations();
+        for(map<KeyFrame*,size_t>::const_iterator mit=observations.begin(); mit!=observations.end(); mit++)
+        {
+            map<KeyFrame*,size_t>::const_iterator kit = P.mKFIndex.find(mit->first);
+            if(kit==P.mKFIndex.end() || mit->first->isBad())
+                continue;
 
-    const float deltaMono = sqrt(5.991);
-    const float deltaStereo = sqrt(7.815);
+            g2o::OptimizableGraph::Vertex* vKF = GetPartitionKFVertex(optimizer,P,kit->second,nPartition);
+            optimizer.addEdge(CreateReprojectionEdge(mit->first, mit->second, vPoint, vKF, bRobust));
+            vnEdges[i]++;
+        }
 
+        if(vnEdges[i]==0)
+            optimizer.removeVertex(vPoint);
+    }
 
+    // Points of other partitions seen by the keyframes of the partition are the fixed separator
+    for(size_t i=0; i<vKFs.size(); i++)
     {
-    unique_lock<mutex> lock(MapPoint::mGlobalMutex);
+        KeyFrame* pKF = P.vpKFs[vKFs[i]];
+        g2o::OptimizableGraph::Vertex* vKF = GetPartitionKFVertex(optimizer,P,vKFs[i],nPartition);
+        const vector<MapPoint*> vpMPs = pKF->GetMapPointMatches();
+        for(size_t j=0; j<vpMPs.size(); j++)
+        {
+            MapPoint* pMP = vpMPs[j];
+            if(!pMP || pMP->isBad())
+                continue;
+            map<MapPoint*,size_t>::const_iterator mit = P.mMPIndex.find(pMP);
+            if(mit==P.mMPIndex.end() || P.vMPPartition[mit->second]<0 || P.vMPPartition[mit->second]==nPartition)
+                continue;
 
-    for(int i=0; i<N; i++)
+            const int id = pMP->mnId+P.maxKFid+1;
+            g2o::OptimizableGraph::Vertex* vPoint = optimizer.vertex(id);
+            if(!vPoint)
+            {
+                g2o::VertexSBAPointXYZ* vFixed = new g2o::VertexSBAPointXYZ();
+                vFixed->setEstimate(P.vPointsPrev[mit->second]);
+                vFixed->setId(id);
+                vFixed->setFixed(true);
+                optimizer.addVertex(vFixed);
+                vPoint = vFixed;
+            }
+            optimizer.addEdge(CreateReprojectionEdge(pKF, j, vPoint, vKF, bRobust));
+        }
+    }
+
+    optimizer.initializeOptimization();
+    optimizer.optimize(nIterations);
+
+    for(size_t i=0; i<vKFs.size(); i++)
     {
-        MapPoint* pMP = pFrame->mvpMapPoints[i];
-        if(pMP)
+        g2o::VertexSE3Expmap* vSE3 = static_cast<g2o::VertexSE3Expmap*>(optimizer.vertex(P.vpKFs[vKFs[i]]->mnId));
+        P.vPoses[vKFs[i]] = vSE3->estimate();
+    }
+
+    for(size_t i=0; i<vMPs.size(); i++)
+    {
+        if(vnEdges[i]==0)
+            continue;
+        g2o::VertexSBAPointXYZ* vPoint = static_cast<g2o::VertexSBAPointXYZ*>(optimizer.vertex(P.vpMP[vMPs[i]]->mnId+P.maxKFid+1));
+        P.vPoints[vMPs[i]] = vPoint->estimate();
+        P.vbIncludedMP[vMPs[i]] = 1;
+    }
+}
+
+void Optimizer::PartitionedGlobalBundleAdjustment(Map* pMap, const int nMaxKFs, const int nRounds, int nIterations,
+                                                  bool* pbStopFlag, const unsigned long nLoopKF, const bool bRobust,
+                                                  const eLinearSolver eSolver)
+{
+    GBAPartitions P;
+    P.vpKFs = pMap->GetAllKeyFrames();
+    P.vpMP = pMap->GetAllMapPoints();
+    sort(P.vpKFs.begin(),P.vpKFs.end(),KeyFrame::lId);
+
+    P.maxKFid = 0;
+    P.vPoses.resize(P.vpKFs.size());
+    for(size_t i=0; i<P.vpKFs.size(); i++)
+    {
+        KeyFrame* pKF = P.vpKFs[i];
+        if(pKF->isBad())
+            continue;
+        P.mKFIndex[pKF] = i;
+        P.vPoses[i] = Converter::toSE3Quat(pKF->GetPose());
+        if(pKF->mnId>P.maxKFid)
+            P.maxKFid=pKF->mnId;
+    }
+
+    // Grow covisibility clusters from the oldest keyframe not yet assigned
+    P.vKFPartition.assign(P.vpKFs.size(),-1);
+    int nPartitions = 0;
+    for(size_t i=0; i<P.vpKFs.size(); i++)
+    {
+        if(P.vKFPartition[i]>=0 || P.vpKFs[i]->isBad())
+            continue;
+
+        P.vPartitionKFs.push_back(vector<size_t>(1,i));
+        P.vKFPartition[i] = nPartitions;
+        list<KeyFrame*> lpQueue(1,P.vpKFs[i]);
+        while(!lpQueue.empty() && (int)P.vPartitionKFs.back().size()<nMaxKFs)
         {
-            // Monocular observation
-            if(pFrame->mvuRight[i]<0)
+            const vector<KeyFrame*> vpCovisible = lpQueue.front()->GetVectorCovisibleKeyFrames();
+            lpQueue.pop_front();
+            for(size_t j=0; j<vpCovisible.size() && (int)P.vPartitionKFs.back().size()<nMaxKFs; j++)
             {
-                nInitialCorrespondences++;
-                pFrame->mvbOutlier[i] = false;
+                map<KeyFrame*,size_t>::const_iterator kit = P.mKFIndex.find(vpCovisible[j]);
+                if(kit==P.mKFIndex.end() || P.vKFPartition[kit->second]>=0)
+                    continue;
+                P.vKFPartition[kit->second] = nPartitions;
+                P.vPartitionKFs.back().push_back(kit->second);
+                lpQueue.push_back(vpCovisible[j]);
+            }
+        }
+        nPartitions++;
+    }
 
-                Eigen::Matrix<double,2,1> obs;
-                const cv::KeyPoint &kpUn = pFrame->mvKeysUn[i];
-                obs << kpUn.pt.x, kpUn.pt.y;
+    // A point is optimized by the partition of its reference keyframe (or of its first observation)
+    P.vMPPartition.assign(P.vpMP.size(),-1);
+    P.vPartitionMPs.resize(nPartitions);
+    P.vPoints.resize(P.vpMP.size());
+    P.vbIncludedMP.assign(P.vpMP.size(),0);
+    for(size_t i=0; i<P.vpMP.size(); i++)
+    {
+        MapPoint* pMP = P.vpMP[i];
+        if(pMP->isBad())
+            continue;
+        P.mMPIndex[pMP] = i;
+        P.vPoints[i] = Converter::toVector3d(pMP->GetWorldPos());
 
-                g2o::EdgeSE3ProjectXYZOnlyPose* e = new g2o::EdgeSE3ProjectXYZOnlyPose();
+        map<KeyFrame*,size_t>::const_iterator kit = P.mKFIndex.find(pMP->GetReferenceKeyFrame());
+        if(kit==P.mKFIndex.end())
+        {
+            const map<KeyFrame*,size_t> observations = pMP->GetObservations();
+            for(map<KeyFrame*,size_t>::const_iterator mit=observations.begin(); mit!=observations.end() && kit==P.mKFIndex.end(); mit++)
+                kit = P.mKFIndex.find(mit->first);
+        }
+        if(kit==P.mKFIndex.end())
+            continue;
 
-                e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(0)));
-                e->setMeasurement(obs);
-                const float invSigma2 = pFrame->mvInvLevelSigma2[kpUn.octave];
-                e->setInformation(Eigen::Matrix2d::Identity()*invSigma2);
+        P.vMPPartition[i] = P.vKFPartition[kit->second];
+        P.vPartitionMPs[P.vMPPartition[i]].push_back(i);
+    }
 
-                g2o::RobustKernelHuber* rk = new g2o::RobustKernelHuber;
-                e->setRobustKernel(rk);
-                rk->setDelta(deltaMono);
+    // Jacobi iterations over the partitions, one graph per thread is alive at a time
+    const int nTotalRounds = nPartitions>1 ? nRounds : 1;
+    for(int r=0; r<nTotalRounds; r++)
+    {
+        if(pbStopFlag && *pbStopFlag)
+            break;
 
-                e->fx = pFrame->fx;
-                e->fy = pFrame->fy;
-                e->cx = pFrame->cx;
-                e->cy = pFrame->cy;
-                cv::Mat Xw = pMP->GetWorldPos();
-                e->Xw[0] = Xw.at<float>(0);
-                e->Xw[1] = Xw.at<float>(1);
-                e->Xw[2] = Xw.at<float>(2);
+        P.vPosesPrev = P.vPoses;
+        P.vPointsPrev = P.vPoints;
 
-                optimizer.addEdge(e);
+        DUtils::ParallelFor(nPartitions, [&](size_t p)
+        {
+            OptimizeGBAPartition(P,p,nIterations,pbStopFlag,bRobust,eSolver);
+        });
+    }
+
+    // Recover optimized data
+
+    //Keyframes
+    for(size_t i=0; i<P.vpKFs.size(); i++)
+    {
+        KeyFrame* pKF = P.vpKFs[i];
+        if(pKF->isBad() || P.vKFPartition[i]<0)
+            continue;
+        if(nLoopKF==0)
+        {
+            pKF->SetPose(Converter::toCvMat(P.vPoses[i]));
+        }
+        else
+        {
+            pKF->mTcwGBA.create(4,4,CV_32F);
+            Converter::toCvMat(P.vPoses[i]).copyTo(pKF->mTcwGBA);
+            pKF->mnBAGlobalForKF = nLoopKF;
+        }
+    }
+
+    //Points
+    for(size_t i=0; i<P.vpMP.size(); i++)
+    {
+        if(!P.vbIncludedMP[i])
+            continue;
+
+        MapPoint* pMP = P.vpMP[i];
+
+        if(pMP->isBad())
+            continue;
+
+        if(nLoopKF==0)
+        {
+            pMP->SetWorldPos(Converter::toCvMat(P.vPoints[i]));
+            pMP->UpdateNormalAndDepth();
+        }
+        else
+        {
+            pMP->mPosGBA.create(3,1,CV_32F);
+            Converter::toCvMat(P.vPoints[i]).copyTo(pMP->mPosGBA);
+            pMP->mnBAGlobalForKF = nLoopKF;
+        }
+    }
+}
+
+// Pose-only problem of PoseOptimization. Observations and points are stored contiguously
+// and the 6x6 normal equations are built directly, without a g2o graph.
+// The pose is updated on the left, T <- exp([omega upsilon])*T, as VertexSE3Expmap.
+struct PoseOnlyProblem
+{
+    typedef Eigen::Matrix<double,6,6> Matrix6d;
+    typedef Eigen::Matrix<double,6,1> Vector6d;
+
+    double fx, fy, cx, cy, bf;
+    double deltaMono2, deltaStereo2;
+    bool bRobust;
+
+    std::vector<Eigen::Vector3d> vXw;
+    std::vector<Eigen::Vector3d> vObs; // u, v and uRight (stereo only)
+    std::vector<double> vInvSigma2;
+    std::vector<unsigned char> vbStereo;
+    std::vector<unsigned char> vbActive;
+
+    void reserve(const int N)
+    {
+        vXw.reserve(N);
+        vObs.reserve(N);
+        vInvSigma2.reserve(N);
+        vbStereo.reserve(N);
+        vbActive.reserve(N);
+    }
+
+    // Squared error weighted by the information matrix
+    double Chi2(const Eigen::Matrix3d &R, const Eigen::Vector3d &t, const size_t i) const
+    {
+        const Eigen::Vector3d Pc = R*vXw[i]+t;
+        if(Pc[2]<=0)
+            return numeric_limits<double>::max();
 
-                vpEdgesMono.push_back(e);
-                vnIndexEdgeMono.push_back(i);
+        const double invz = 1.0/Pc[2];
+        const double u = fx*Pc[0]*invz+cx;
+        const double v = fy*Pc[1]*invz+cy;
+        const Eigen::Vector3d &obs = vObs[i];
+
+        double chi2 = (u-obs[0])*(u-obs[0]) + (v-obs[1])*(v-obs[1]);
+        if(vbStereo[i])
+        {
+            const double ur = u-bf*invz;
+            chi2 += (ur-obs[2])*(ur-obs[2]);
+        }
+        return chi2*vInvSigma2[i];
+    }
+
+    // Huber kernel as g2o::RobustKernelHuber: cost and weight of a squared error
+    void Robustify(const double chi2, const double delta2, double &cost, double &weight) const
+    {
+        if(!bRobust || chi2<=delta2)
+        {
+            cost = chi2;
+            weight = 1.0;
+        }
+        else
+        {
+            const double e = sqrt(chi2);
+            const double delta = sqrt(delta2);
+            cost = 2*delta*e-delta2;
+            weight = delta/e;
+        }
+    }
+
+    double Cost(const g2o::SE3Quat &T) const
+    {
+        const Eigen::Matrix3d R = T.rotation().toRotationMatrix();
+        const Eigen::Vector3d &t = T.translation();
+
+        double cost = 0;
+        for(size_t i=0, iend=vXw.size(); i<iend; i++)
+        {
+            if(!vbActive[i])
+                continue;
+            double rho, w;
+            Robustify(Chi2(R,t,i),vbStereo[i] ? deltaStereo2 : deltaMono2,rho,w);
+            cost += rho;
+        }
+        return cost;
+    }
+
+    // Gauss-Newton approximation of the Hessian and gradient. Returns the cost.
+    double Linearize(const g2o::SE3Quat &T, Matrix6d &H, Vector6d &g) const
+    {
+        const Eigen::Matrix3d R = T.rotation().toRotationMatrix();
+        const Eigen::Vector3d &t = T.translation();
+
+        H.setZero();
+        g.setZero();
+        double cost = 0;
+
+        Eigen::Matrix<double,3,6> J;
+        for(size_t i=0, iend=vXw.size(); i<iend; i++)
+        {
+            if(!vbActive[i])
+                continue;
+
+            const Eigen::Vector3d Pc = R*vXw[i]+t;
+            if(Pc[2]<=0)
+                continue;
+
+            const double x = Pc[0], y = Pc[1], z = Pc[2];
+            const double invz = 1.0/z;
+            const double invz_2 = invz*invz;
+            const Eigen::Vector3d &obs = vObs[i];
+
+            Eigen::Vector3d r;
+            r[0] = fx*x*invz+cx-obs[0];
+            r[1] = fy*y*invz+cy-obs[1];
+            r[2] = vbStereo[i] ? r[0]+obs[0]-bf*invz-obs[2] : 0;
+
+            const double chi2 = r.squaredNorm()*vInvSigma2[i];
+            double rho, w;
+            Robustify(chi2,vbStereo[i] ? deltaStereo2 : deltaMono2,rho,w);
+            cost += rho;
+
+            // Derivatives of the projection with respect to the pose
+            J(0,0) = -x*y*invz_2*fx;
+            J(0,1) = (1+x*x*invz_2)*fx;
+            J(0,2) = -y*invz*fx;
+            J(0,3) = invz*fx;
+            J(0,4) = 0;
+            J(0,5) = -x*invz_2*fx;
+
+            J(1,0) = -(1+y*y*invz_2)*fy;
+            J(1,1) = x*y*invz_2*fy;
+            J(1,2) = x*invz*fy;
+            J(1,3) = 0;
+            J(1,4) = invz*fy;
+            J(1,5) = -y*invz_2*fy;
+
+            const double wi = w*vInvSigma2[i];
+            if(vbStereo[i])
+            {
+                J(2,0) = J(0,0)+bf*y*invz_2;
+                J(2,1) = J(0,1)-bf*x*invz_2;
+                J(2,2) = J(0,2);
+                J(2,3) = J(0,3);
+                J(2,4) = 0;
+                J(2,5) = J(0,5)+bf*invz_2;
+
+                H.noalias() += wi*J.transpose()*J;
+                g.noalias() += wi*J.transpose()*r;
             }
-            else  // Stereo observation
+            else
             {
-                nInitialCorrespondences++;
-                pFrame->mvbOutlier[i] = false;
-
-                //SET EDGE
-                Eigen::Matrix<double,3,1> obs;
-                const cv::KeyPoint &kpUn = pFrame->mvKeysUn[i];
-                const float &kp_ur = pFrame->mvuRight[i];
-                obs << kpUn.pt.x, kpUn.pt.y, kp_ur;
-
-                g2o::EdgeStereoSE3ProjectXYZOnlyPose* e = new g2o::EdgeStereoSE3ProjectXYZOnlyPose();
-
-                e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(0)));
-                e->setMeasurement(obs);
-                const float invSigma2 = pFrame->mvInvLevelSigma2[kpUn.octave];
-                Eigen::Matrix3d Info = Eigen::Matrix3d::Identity()*invSigma2;
-                e->setInformation(Info);
-
-                g2o::RobustKernelHuber* rk = new g2o::RobustKernelHuber;
-                e->setRobustKernel(rk);
-                rk->setDelta(deltaStereo);
-
-                e->fx = pFrame->fx;
-                e->fy = pFrame->fy;
-                e->cx = pFrame->cx;
-                e->cy = pFrame->cy;
-                e->bf = pFrame->mbf;
-                cv::Mat Xw = pMP->GetWorldPos();
-                e->Xw[0] = Xw.at<float>(0);
-                e->Xw[1] = Xw.at<float>(1);
-                e->Xw[2] = Xw.at<float>(2);
+                H.noalias() += wi*J.topRows<2>().transpose()*J.topRows<2>();
+                g.noalias() += wi*J.topRows<2>().transpose()*r.head<2>();
+            }
+        }
 
-                optimizer.addEdge(e);
+        return cost;
+    }
+
+    // Levenberg-Marquardt with the same damping strategy as g2o::OptimizationAlgorithmLevenberg
+    void Optimize(g2o::SE3Quat &T, const int nIterations) const
+    {
+        Matrix6d H;
+        Vector6d g;
+        double lambda = -1;
+        double ni = 2;
+
+        for(int it=0; it<nIterations; it++)
+        {
+            const double cost = Linearize(T,H,g);
+
+            if(lambda<0)
+                lambda = 1e-5*H.diagonal().maxCoeff();
 
-                vpEdgesStereo.push_back(e);
-                vnIndexEdgeStereo.push_back(i);
+            bool bAccepted = false;
+            for(int tries=0; tries<10 && !bAccepted; tries++)
+            {
+                Matrix6d Hd = H;
+                Hd.diagonal().array() += lambda;
+                const Vector6d delta = Hd.ldlt().solve(-g);
+
+                const g2o::SE3Quat Tnew = g2o::SE3Quat::exp(delta)*T;
+                const double newCost = Cost(Tnew);
+
+                const double scale = delta.dot(lambda*delta-g)+1e-3;
+                const double rho = (cost-newCost)/scale;
+
+                if(rho>0 && std::isfinite(newCost))
+                {
+                    T = Tnew;
+                    const double alpha = 1.-pow((2*rho-1),3);
+                    lambda *= std::max(1./3., std::min(alpha,2./3.));
+                    ni = 2;
+                    bAccepted = true;
+                }
+                else
+                {
+                    lambda *= ni;
+                    ni *= 2;
+                }
             }
+
+            if(!bAccepted)
+                break;
+        }
+    }
+};
+
+int Optimizer::PoseOptimization(Frame *pFrame)
+{
+    int nInitialCorrespondences=0;
+
+    // Set MapPoint observations
+    const int N = pFrame->N;
+
+    PoseOnlyProblem problem;
+    problem.fx = pFrame->fx;
+    problem.fy = pFrame->fy;
+    problem.cx = pFrame->cx;
+    problem.cy = pFrame->cy;
+    problem.bf = pFrame->mbf;
+    problem.deltaMono2 = 5.991;
+    problem.deltaStereo2 = 7.815;
+    problem.bRobust = true;
+    problem.reserve(N);
+
+    vector<size_t> vnIndexObs;
+    vnIndexObs.reserve(N);
+
+    {
+    unique_lock<mutex> lock(MapPoint::mGlobalMutex);
+
+    for(int i=0; i<N; i++)
+    {
+        MapPoint* pMP = pFrame->mvpMapPoints[i];
+        if(pMP)
+        {
+            nInitialCorrespondences++;
+            pFrame->mvbOutlier[i] = false;
+
+            const cv::KeyPoint &kpUn = pFrame->mvKeysUn[i];
+            const float &kp_ur = pFrame->mvuRight[i];
+
+            // Monocular observation if kp_ur<0, stereo otherwise
+            problem.vXw.push_back(pMP->GetWorldPosEig().cast<double>());
+            problem.vObs.push_back(Eigen::Vector3d(kpUn.pt.x, kpUn.pt.y, kp_ur));
+            problem.vInvSigma2.push_back(pFrame->mvInvLevelSigma2[kpUn.octave]);
+            problem.vbStereo.push_back(kp_ur>=0);
+            problem.vbActive.push_back(true);
+
+            vnIndexObs.push_back(i);
         }
 
     }
@@ -363,87 +792,55 @@ int Optimizer::PoseOptimization(Frame *pFrame)
     const float chi2Stereo[4]={7.815,7.815,7.815, 7.815};
     const int its[4]={10,10,10,10};    
 
+    const g2o::SE3Quat Tini = Converter::toSE3Quat(pFrame->mTcw);
+    g2o::SE3Quat Tcw = Tini;
+
     int nBad=0;
     for(size_t it=0; it<4; it++)
     {
 
-        vSE3->setEstimate(Converter::toSE3Quat(pFrame->mTcw));
-        optimizer.initializeOptimization(0);
-        optimizer.optimize(its[it]);
+        Tcw = Tini;
+        problem.Optimize(Tcw,its[it]);
+
+        const Eigen::Matrix3d R = Tcw.rotation().toRotationMatrix();
+        const Eigen::Vector3d &t = Tcw.translation();
 
         nBad=0;
-        for(size_t i=0, iend=vpEdgesMono.size(); i<iend; i++)
+        for(size_t i=0, iend=vnIndexObs.size(); i<iend; i++)
         {
-            g2o::EdgeSE3ProjectXYZOnlyPose* e = vpEdgesMono[i];
-
-            const size_t idx = vnIndexEdgeMono[i];
-
-            if(pFrame->mvbOutlier[idx])
-            {
-                e->computeError();
-            }
+            const size_t idx = vnIndexObs[i];
 
-            const float chi2 = e->chi2();
+            const float chi2 = problem.Chi2(R,t,i);
+            const float chi2Th = problem.vbStereo[i] ? chi2Stereo[it] : chi2Mono[it];
 
-            if(chi2>chi2Mono[it])
+            if(chi2>chi2Th)
             {                
                 pFrame->mvbOutlier[idx]=true;
-                e->setLevel(1);
+                problem.vbActive[i]=false;
                 nBad++;
             }
             else
             {
                 pFrame->mvbOutlier[idx]=false;
-                e->setLevel(0);
+                problem.vbActive[i]=true;
             }
-
-            if(it==2)
-                e->setRobustKernel(0);
         }
 
-        for(size_t i=0, iend=vpEdgesStereo.size(); i<iend; i++)
-        {
-            g2o::EdgeStereoSE3ProjectXYZOnlyPose* e = vpEdgesStereo[i];
-
-            const size_t idx = vnIndexEdgeStereo[i];
-
-            if(pFrame->mvbOutlier[idx])
-            {
-                e->computeError();
-            }
-
-            const float chi2 = e->chi2();
-
-            if(chi2>chi2Stereo[it])
-            {
-                pFrame->mvbOutlier[idx]=true;
-                e->setLevel(1);
-                nBad++;
-            }
-            else
-            {                
-                e->setLevel(0);
-                pFrame->mvbOutlier[idx]=false;
-            }
-
-            if(it==2)
-                e->setRobustKernel(0);
-        }
+        if(it==2)
+            problem.bRobust = false;
 
-        if(optimizer.edges().size()<10)
+        if(vnIndexObs.size()<10)
             break;
     }    
 
     // Recover optimized pose and return number of inliers
-    g2o::VertexSE3Expmap* vSE3_recov = static_cast<g2o::VertexSE3Expmap*>(optimizer.vertex(0));
-    g2o::SE3Quat SE3quat_recov = vSE3_recov->estimate();
-    cv::Mat pose = Converter::toCvMat(SE3quat_recov);
+    cv::Mat pose = Converter::toCvMat(Tcw);
     pFrame->SetPose(pose);
 
     return nInitialCorrespondences-nBad;
 }
 
-void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap)
+void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap, const eLinearSolver eSolver)
 {    
     // Local KeyFrames: First Breath Search from Current Keyframe
     list<KeyFrame*> lLocalKeyFrames;
@@ -500,7 +897,7 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
     g2o::SparseOptimizer optimizer;
     g2o::BlockSolver_6_3::LinearSolverType * linearSolver;
 
-    linearSolver = new g2o::LinearSolverEigen<g2o::BlockSolver_6_3::PoseMatrixType>();
+    linearSolver = CreateLinearSolver<g2o::BlockSolver_6_3>(eSolver);
 
     g2o::BlockSolver_6_3 * solver_ptr = new g2o::BlockSolver_6_3(linearSolver);
 
@@ -857,8 +1254,9 @@ double Optimizer::ComputeAvgChi2Double(std::vector<g2o::EdgeInverseDepthPatch*>
     return chi2Sum / chi2Count;
 }
 
-void Optimizer::LocalPhotometricBundleAdjustment(list<KeyFrame*> &lLocalKeyFrames, std::list<HighGradientPoint*> &lHGMap,
-                                                 bool* pbStopFlag, Map* pMap, int optimizationLvL, bool bDoMoreAtAll) {
+void Optimizer::LocalPhotometricBundleAdjustment(const list<KeyFrame*> &lPBAKeyFrames, std::list<HighGradientPoint*> &lHGMap,
+                                                 bool* pbStopFlag, Map* pMap, int optimizationLvL, bool bDoMoreAtAll,
+                                                 const eLinearSolver eSolver) {
     std::cout << "Optimizer::LocalPhotometricBundleAdjustment - lvl : " << optimizationLvL << std::endl;
     const float thHuber = 9; // DSO has 9
     const float thHuberSquared = thHuber*thHuber; // as in the DSO
@@ -867,22 +1265,16 @@ void Optimizer::LocalPhotometricBundleAdjustment(list<KeyFrame*> &lLocalKeyFrame
     const int blockSolverPoses = 1;
 
 
-    KeyFrame* firstKF = lLocalKeyFrames.back();
+    KeyFrame* firstKF = lPBAKeyFrames.back();
 
     firstKF->mnBALocalForKF = firstKF->mnId;
 
-    for (auto it = lLocalKeyFrames.begin(); it!= lLocalKeyFrames.end();) {
+    // Bad keyframes are skipped. Their pyramids are released by Local Mapping.
+    list<KeyFrame*> lLocalKeyFrames;
+    for (auto it = lPBAKeyFrames.begin(); it!= lPBAKeyFrames.end(); it++) {
         (*it)->mnBALocalForKF = firstKF->mnId;
-        if ((*it)->isBad()) {
-            for (int i = 0; i < (*it)->imagePyramidLeft.size(); i++) {
-                delete (*it)->imagePyramidLeft[i];
-                delete (*it)->imagePyramidRight[i];
-            }
-            it = lLocalKeyFrames.erase(it);
-        }
-        else {
-            it++;
-        }
+        if (!(*it)->isBad())
+            lLocalKeyFrames.push_back(*it);
     }
 
     // Local MapPoints seen in Local KeyFrames
@@ -904,7 +1296,7 @@ void Optimizer::LocalPhotometricBundleAdjustment(list<KeyFrame*> &lLocalKeyFrame
 
     typedef g2o::BlockSolver< g2o::BlockSolverTraits<blockSolverCameras, blockSolverPoses> > OurBlockSolver;
     OurBlockSolver::LinearSolverType *linearSolver;
-    linearSolver = new g2o::LinearSolverEigen<OurBlockSolver::PoseMatrixType>();
+    linearSolver = CreateLinearSolver<OurBlockSolver>(eSolver);
     OurBlockSolver *solver_ptr = new OurBlockSolver(linearSolver);
 
     g2o::OptimizationAlgorithmLevenberg *solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
@@ -1346,7 +1738,7 @@ void Optimizer::LocalPhotometricBundleAdjustment(list<KeyFrame*> &lLocalKeyFrame
 }
 
 
-double Optimizer::OptimizeInitialHGPointDepth(list<KeyFrame*> &lLocalKeyFrames, HighGradientPoint* hgPoint) {
+double Optimizer::OptimizeInitialHGPointDepth(list<KeyFrame*> &lLocalKeyFrames, HighGradientPoint* hgPoint, double &invDepth) {
 //    std::cout << "Optimizer::OptimizeInitialHGPointDepth" << std::endl;
     const int optimizationLvL = 0;
     const float thHuber = 9; // DSO has 9
@@ -1511,7 +1903,7 @@ double Optimizer::OptimizeInitialHGPointDepth(list<KeyFrame*> &lLocalKeyFrames,
 
     vPoint = static_cast<g2o::VertexSBAPointInvD *>(optimizer.vertex(hgPoint->id + maxKFid + 1));
 
-    hgPoint->invDepth = vPoint->estimate();
+    invDepth = vPoint->estimate();
 
     return Optimizer::ComputeAvgChi2Double(vpEdgesStereoHG, thHuberSquared);
 
@@ -1519,13 +1911,22 @@ double Optimizer::OptimizeInitialHGPointDepth(list<KeyFrame*> &lLocalKeyFrames,
 //    std::cout << "-- -- -- -- -- -- " << std::endl;
 }
 
-void Optimizer::OptimizeInitialHGPointDepth(list<KeyFrame*> &lLocalKeyFrames, vector<HighGradientPoint*> &hgMap) {
+void Optimizer::OptimizeInitialHGPointDepth(list<KeyFrame*> &lLocalKeyFrames, vector<HighGradientPoint*> &hgMap, Map* pMap) {
     std::vector<double> chi2stats;
-    for (auto &hgPoint : hgMap) {
-        double chi2 = Optimizer::OptimizeInitialHGPointDepth(lLocalKeyFrames, hgPoint);
+    std::vector<double> invDepths(hgMap.size());
+    for (size_t i = 0; i < hgMap.size(); i++) {
+        invDepths[i] = hgMap[i]->invDepth;
+        double chi2 = Optimizer::OptimizeInitialHGPointDepth(lLocalKeyFrames, hgMap[i], invDepths[i]);
         chi2stats.push_back(chi2);
     }
 
+    // Tracking reads the depths of the last keyframe under the map update mutex
+    {
+        unique_lock<mutex> lock(pMap->mMutexMapUpdate);
+        for (size_t i = 0; i < hgMap.size(); i++)
+            hgMap[i]->invDepth = invDepths[i];
+    }
+
     int count = 0;
     for (auto &chi2 : chi2stats) {
         if (chi2 < 100)
@@ -1541,13 +1942,14 @@ void Optimizer::OptimizeInitialHGPointDepth(list<KeyFrame*> &lLocalKeyFrames, ve
 void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* pCurKF,
                                        const LoopClosing::KeyFrameAndPose &NonCorrectedSim3,
                                        const LoopClosing::KeyFrameAndPose &CorrectedSim3,
-                                       const map<KeyFrame *, set<KeyFrame *> > &LoopConnections, const bool &bFixScale)
+                                       const map<KeyFrame *, set<KeyFrame *> > &LoopConnections, const bool &bFixScale,
+                                       const eLinearSolver eSolver)
 {
     // Setup optimizer
     g2o::SparseOptimizer optimizer;
     optimizer.setVerbose(false);
     g2o::BlockSolver_7_3::LinearSolverType * linearSolver =
-           new g2o::LinearSolverEigen<g2o::BlockSolver_7_3::PoseMatrixType>();
+           CreateLinearSolver<g2o::BlockSolver_7_3>(eSolver);
     g2o::BlockSolver_7_3 * solver_ptr= new g2o::BlockSolver_7_3(linearSolver);
     g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
 
@@ -2001,4 +2403,197 @@ int Optimizer::OptimizeSim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint *> &
 }
 
 
+// Same pattern as EdgeInverseDepthPatch
+static const int nDirectPattern = 9;
+static const int directPattern[nDirectPattern][2] = {{0,0},{0,2},{1,1},{2,0},{1,-1},{0,-2},{-1,-1},{-2,0},{-1,1}};
+
+// Normal equations of the photometric error for the relative pose Tcr at one pyramid level.
+// Returns the number of points whose mean residual is below thHuber.
+static int AccumulateDirectAlignment(const vector<Eigen::Vector3f> &vPr, const vector<float> &vRef,
+                                     const g2o::imgStr* pCur, const float invScale, const g2o::SE3Quat &Tcr,
+                                     const float thHuber, Eigen::Matrix<float,6,6> &H, Eigen::Matrix<float,6,1> &b,
+                                     float &error)
+{
+    const Eigen::Matrix3f R = Tcr.rotation().toRotationMatrix().cast<float>();
+    const Eigen::Vector3f t = Tcr.translation().cast<float>();
+
+    const float fx = Frame::fx*invScale;
+    const float fy = Frame::fy*invScale;
+    const float cx = Frame::cx*invScale;
+    const float cy = Frame::cy*invScale;
+
+    H.setZero();
+    b.setZero();
+    error = 0;
+
+    int nResiduals = 0;
+    int nInliers = 0;
+    Eigen::Matrix<float,6,1> J;
+
+    for(size_t i=0, iend=vPr.size(); i<iend; i++)
+    {
+        const Eigen::Vector3f Pc = R*vPr[i]+t;
+        if(Pc[2]<=0)
+            continue;
+
+        const float invz = 1.0f/Pc[2];
+        const float u = fx*Pc[0]*invz+cx;
+        const float v = fy*Pc[1]*invz+cy;
+
+        // Derivatives of the projection with respect to the point in the camera
+        const Eigen::Vector3f dudP(fx*invz, 0, -fx*Pc[0]*invz*invz);
+        const Eigen::Vector3f dvdP(0, fy*invz, -fy*Pc[1]*invz*invz);
+
+        const float* pRef = &vRef[i*nDirectPattern];
+        float sumAbs = 0;
+        int nValid = 0;
+        for(int k=0; k<nDirectPattern; k++)
+        {
+            float value, gu, gv;
+            if(pRef[k]<0 || !g2o::getSubpixValueAndGradient(pCur,u+directPattern[k][0],v+directPattern[k][1],value,gu,gv))
+                continue;
+
+            const float r = value-pRef[k];
+            const float absr = fabs(r);
+            const float w = absr<=thHuber ? 1.0f : thHuber/absr;
+
+            // Left update of the pose: dPc = [-[Pc]x I] * [omega; upsilon]
+            const Eigen::Vector3f a = gu*dudP+gv*dvdP;
+            J.head<3>() = Pc.cross(a);
+            J.tail<3>() = a;
+
+            H.noalias() += (w*J)*J.transpose();
+            b.noalias() += (w*r)*J;
+            error += w*r*r;
+
+            sumAbs += absr;
+            nValid++;
+        }
+
+        if(nValid>0)
+        {
+            nResiduals += nValid;
+            if(sumAbs<thHuber*nValid)
+                nInliers++;
+        }
+    }
+
+    if(nResiduals>0)
+        error /= nResiduals;
+    else
+        error = numeric_limits<float>::max();
+
+    return nInliers;
+}
+
+int Optimizer::PoseDirectAlignment(Frame *pFrame, KeyFrame *pRefKF)
+{
+    const vector<g2o::imgStr*> &vCurPyramid = pFrame->mpORBextractorLeft->photobaImagePyramid;
+
+    const int nMaxLevels = min(vCurPyramid.size(),(size_t)4);
+    if(nMaxLevels==0)
+        return 0;
+
+    const float thHuber = 9; // as in the photometric BA
+    const int nIterations = 10;
+
+    // Points in the reference camera and their intensities at every level. Local Mapping deletes
+    // the points and refines their depth under the map update mutex, which the caller holds.
+    // The caller keeps the pyramids.
+    vector<Eigen::Vector3f> vPr;
+    vector<vector<float> > vvRef;
+    int nLevels;
+    {
+        const vector<g2o::imgStr*> &vRefPyramid = pRefKF->imagePyramidLeft;
+        const vector<HighGradientPoint*> &vHGPoints = pRefKF->mHGPoints;
+
+        nLevels = min((size_t)nMaxLevels,vRefPyramid.size());
+        if(nLevels==0 || vHGPoints.size()<50)
+            return 0;
+
+        vPr.reserve(vHGPoints.size());
+        vector<Eigen::Vector2f> vUV;
+        vUV.reserve(vHGPoints.size());
+        for(size_t i=0; i<vHGPoints.size(); i++)
+        {
+            const HighGradientPoint* pHG = vHGPoints[i];
+            if(!(pHG->invDepth>0) || !std::isfinite(pHG->invDepth))
+                continue;
+            const float z = 1.0/pHG->invDepth;
+            vPr.push_back(Eigen::Vector3f((pHG->u-Frame::cx)*z*Frame::invfx, (pHG->v-Frame::cy)*z*Frame::invfy, z));
+            vUV.push_back(Eigen::Vector2f(pHG->u,pHG->v));
+        }
+
+        const int N = vPr.size();
+        vvRef.resize(nLevels,vector<float>(N*nDirectPattern));
+        for(int level=0; level<nLevels; level++)
+        {
+            const float invScale = 1.0f/vCurPyramid[level]->imageScale;
+            vector<float> &vRef = vvRef[level];
+            for(int i=0; i<N; i++)
+            {
+                const float u = vUV[i][0]*invScale;
+                const float v = vUV[i][1]*invScale;
+                for(int k=0; k<nDirectPattern; k++)
+                {
+                    float value, gu, gv;
+                    if(g2o::getSubpixValueAndGradient(vRefPyramid[level],u+directPattern[k][0],v+directPattern[k][1],value,gu,gv))
+                        vRef[i*nDirectPattern+k] = value;
+                    else
+                        vRef[i*nDirectPattern+k] = -1;
+                }
+            }
+        }
+    }
+
+    if(vPr.size()<50)
+        return 0;
+
+    g2o::SE3Quat Tcr = Converter::toSE3Quat(pFrame->mTcw)*Converter::toSE3Quat(pRefKF->GetPoseInverse());
+
+    Eigen::Matrix<float,6,6> H;
+    Eigen::Matrix<float,6,1> b;
+    int nInliers = 0;
+
+    for(int level=nLevels-1; level>=0; level--)
+    {
+        const float invScale = 1.0f/vCurPyramid[level]->imageScale;
+        const vector<float> &vRef = vvRef[level];
+
+        float lastError = numeric_limits<float>::max();
+        g2o::SE3Quat lastTcr = Tcr;
+        for(int it=0; it<nIterations; it++)
+        {
+            float error;
+            nInliers = AccumulateDirectAlignment(vPr,vRef,vCurPyramid[level],invScale,Tcr,thHuber,H,b,error);
+
+            // Revert the last step if the error increased
+            if(error>lastError)
+            {
+                Tcr = lastTcr;
+                break;
+            }
+
+            const Eigen::Matrix<float,6,1> delta = H.ldlt().solve(-b);
+            if(!delta.allFinite())
+                break;
+
+            lastTcr = Tcr;
+            lastError = error;
+            Tcr = g2o::SE3Quat::exp(delta.cast<double>())*Tcr;
+
+            if(delta.squaredNorm()<1e-10)
+                break;
+        }
+    }
+
+    // Inliers at the finest level with the final pose
+    float error;
+    nInliers = AccumulateDirectAlignment(vPr,vvRef[0],vCurPyramid[0],1.0f/vCurPyramid[0]->imageScale,Tcr,thHuber,H,b,error);
+
+    pFrame->SetPose(Converter::toCvMat(Tcr*Converter::toSE3Quat(pRefKF->GetPose())));
+
+    return nInliers;
+}
+
 } //namespace ORB_SLAM
@@ -0,0 +1,232 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "PatchTracker.h"
+#include "Converter.h"
+
+#include<cmath>
+
+namespace ORB_SLAM2
+{
+
+PatchTracker::PatchTracker(int nLevels, int halfPatchSize, int nIterations):
+    mnLevels(std::min(nLevels,4)), mnHalfPatchSize(halfPatchSize),
+    mnPatchArea((2*halfPatchSize+1)*(2*halfPatchSize+1)), mnIterations(nIterations)
+{
+    mvBuffer.resize(3*mnPatchArea);
+}
+
+void PatchTracker::Clear()
+{
+    mvpMapPoints.clear();
+    mvKeys.clear();
+    mvPatches.clear();
+    mvbValidPatch.clear();
+}
+
+void PatchTracker::SetReference(const Frame &F, const std::vector<g2o::imgStr*> &vPyramid)
+{
+    Clear();
+
+    const int nLevels = std::min(mnLevels,(int)vPyramid.size());
+    const int w = mnHalfPatchSize;
+
+    std::vector<float> vPatch(mnPatchArea);
+
+    for(int i=0; i<F.N; i++)
+    {
+        MapPoint* pMP = F.mvpMapPoints[i];
+        if(!pMP || F.mvbOutlier[i])
+            continue;
+
+        // Temporal (visual odometry) points are deleted after each frame
+        if(pMP->isBad() || pMP->Observations()<1)
+            continue;
+
+        const cv::KeyPoint &kp = F.mvKeysUn[i];
+
+        const size_t offset = mvPatches.size();
+        mvPatches.resize(offset+mnLevels*mnPatchArea,0.f);
+        mvbValidPatch.resize(mvbValidPatch.size()+mnLevels,0);
+        unsigned char* pbValid = &mvbValidPatch[mvbValidPatch.size()-mnLevels];
+
+        for(int level=0; level<nLevels; level++)
+        {
+            const g2o::imgStr* pImg = vPyramid[level];
+            const float u = kp.pt.x/pImg->imageScale;
+            const float v = kp.pt.y/pImg->imageScale;
+
+            bool bValid = true;
+            float mean = 0;
+            for(int dv=-w, k=0; dv<=w && bValid; dv++)
+            {
+                for(int du=-w; du<=w; du++, k++)
+                {
+                    float gu, gv;
+                    if(!g2o::getSubpixValueAndGradient(pImg,u+du,v+dv,vPatch[k],gu,gv))
+                    {
+                        bValid = false;
+                        break;
+                    }
+                    mean += vPatch[k];
+                }
+            }
+
+            if(!bValid)
+                continue;
+
+            mean /= mnPatchArea;
+            float* pPatch = &mvPatches[offset+level*mnPatchArea];
+            for(int k=0; k<mnPatchArea; k++)
+                pPatch[k] = vPatch[k]-mean;
+            pbValid[level] = 1;
+        }
+
+        // The finest level is required to track the point
+        if(!pbValid[0])
+        {
+            mvPatches.resize(offset);
+            mvbValidPatch.resize(mvbValidPatch.size()-mnLevels);
+            continue;
+        }
+
+        mvpMapPoints.push_back(pMP);
+        mvKeys.push_back(kp);
+    }
+}
+
+bool PatchTracker::TrackAtLevel(const g2o::imgStr* pImg, const float* pPatch, float &u, float &v, float &residual)
+{
+    const int w = mnHalfPatchSize;
+    float* values = &mvBuffer[0];
+    float* gus = &mvBuffer[mnPatchArea];
+    float* gvs = &mvBuffer[2*mnPatchArea];
+
+    for(int it=0; it<mnIterations; it++)
+    {
+        // Zero-mean residuals make the alignment invariant to brightness offsets
+        float mean = 0;
+        for(int dv=-w, k=0; dv<=w; dv++)
+        {
+            for(int du=-w; du<=w; du++, k++)
+            {
+                if(!g2o::getSubpixValueAndGradient(pImg,u+du,v+dv,values[k],gus[k],gvs[k]))
+                    return false;
+                mean += values[k];
+            }
+        }
+        mean /= mnPatchArea;
+
+        float H00=0, H01=0, H11=0, b0=0, b1=0;
+        residual = 0;
+        for(int k=0; k<mnPatchArea; k++)
+        {
+            const float r = values[k]-mean-pPatch[k];
+            H00 += gus[k]*gus[k];
+            H01 += gus[k]*gvs[k];
+            H11 += gvs[k]*gvs[k];
+            b0 += gus[k]*r;
+            b1 += gvs[k]*r;
+            residual += fabs(r);
+        }
+        residual /= mnPatchArea;
+
+        const float det = H00*H11-H01*H01;
+        if(det<1e-6f)
+            return false;
+
+        const float du = -( H11*b0-H01*b1)/det;
+        const float dv = -(-H01*b0+H00*b1)/det;
+
+        u += du;
+        v += dv;
+
+        if(du*du+dv*dv<1e-4f)
+            break;
+    }
+
+    return true;
+}
+
+int PatchTracker::Track(const std::vector<g2o::imgStr*> &vPyramid, const cv::Mat &Tcw,
+                        std::vector<cv::KeyPoint> &vKeys, std::vector<MapPoint*> &vpMapPoints)
+{
+    vKeys.clear();
+    vpMapPoints.clear();
+
+    const Eigen::Matrix3f Rcw = Converter::toMatrix3f(Tcw.rowRange(0,3).colRange(0,3));
+    const Eigen::Vector3f tcw = Converter::toVector3f(Tcw.rowRange(0,3).col(3));
+
+    const int nLevels = std::min(mnLevels,(int)vPyramid.size());
+    const float thResidual = 20.0f;
+
+    vKeys.reserve(mvpMapPoints.size());
+    vpMapPoints.reserve(mvpMapPoints.size());
+
+    for(size_t i=0, iend=mvpMapPoints.size(); i<iend; i++)
+    {
+        MapPoint* pMP = mvpMapPoints[i];
+        if(pMP->isBad())
+            continue;
+
+        // Initial guess from the predicted pose
+        const Eigen::Vector3f Pc = Rcw*pMP->GetWorldPosEig()+tcw;
+        if(Pc(2)<=0)
+            continue;
+
+        float u = Frame::fx*Pc(0)/Pc(2)+Frame::cx;
+        float v = Frame::fy*Pc(1)/Pc(2)+Frame::cy;
+
+        if(u<Frame::mnMinX || u>=Frame::mnMaxX || v<Frame::mnMinY || v>=Frame::mnMaxY)
+            continue;
+
+        // Coarse to fine
+        bool bOK = true;
+        float residual = 0;
+        for(int level=nLevels-1; level>=0 && bOK; level--)
+        {
+            if(!mvbValidPatch[i*mnLevels+level])
+                continue;
+
+            const g2o::imgStr* pImg = vPyramid[level];
+            float ul = u/pImg->imageScale;
+            float vl = v/pImg->imageScale;
+            bOK = TrackAtLevel(pImg,&mvPatches[(i*mnLevels+level)*mnPatchArea],ul,vl,residual);
+            u = ul*pImg->imageScale;
+            v = vl*pImg->imageScale;
+        }
+
+        if(!bOK || residual>thResidual)
+            continue;
+
+        if(u<Frame::mnMinX || u>=Frame::mnMaxX || v<Frame::mnMinY || v>=Frame::mnMaxY)
+            continue;
+
+        cv::KeyPoint kp = mvKeys[i];
+        kp.pt.x = u;
+        kp.pt.y = v;
+        vKeys.push_back(kp);
+        vpMapPoints.push_back(pMP);
+    }
+
+    return vKeys.size();
+}
+
+} //namespace ORB_SLAM
@@ -0,0 +1,72 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "SharedMutex.h"
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+SharedMutex::SharedMutex(): mnReaders(0), mnWaitingWriters(0), mbWriter(false)
+{
+}
+
+void SharedMutex::lock()
+{
+    unique_lock<mutex> lock(mMutex);
+    mnWaitingWriters++;
+    while(mbWriter || mnReaders>0)
+        mcvWriters.wait(lock);
+    mnWaitingWriters--;
+    mbWriter = true;
+}
+
+void SharedMutex::unlock()
+{
+    {
+        unique_lock<mutex> lock(mMutex);
+        mbWriter = false;
+    }
+    mcvWriters.notify_one();
+    mcvReaders.notify_all();
+}
+
+void SharedMutex::lock_shared()
+{
+    unique_lock<mutex> lock(mMutex);
+    while(mbWriter || mnWaitingWriters>0)
+        mcvReaders.wait(lock);
+    mnReaders++;
+}
+
+void SharedMutex::unlock_shared()
+{
+    bool bLast;
+    {
+        unique_lock<mutex> lock(mMutex);
+        mnReaders--;
+        bLast = mnReaders==0;
+    }
+    if(bLast)
+        mcvWriters.notify_one();
+}
+
+} //namespace ORB_SLAM
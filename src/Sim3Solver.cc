@@ -27,15 +27,14 @@
 
 #include "KeyFrame.h"
 #include "ORBmatcher.h"
-
-#include "Thirdparty/DBoW2/DUtils/Random.h"
+#include "Converter.h"
 
 namespace ORB_SLAM2
 {
 
 
 Sim3Solver::Sim3Solver(KeyFrame *pKF1, KeyFrame *pKF2, const vector<MapPoint *> &vpMatched12, const bool bFixScale):
-    mnIterations(0), mnBestInliers(0), mbFixScale(bFixScale)
+    mnIterations(0), mnBestInliers(0), mbFixScale(bFixScale), mRng(pKF1->mnId*1000003+pKF2->mnId)
 {
     mpKF1 = pKF1;
     mpKF2 = pKF2;
@@ -151,8 +150,8 @@ cv::Mat Sim3Solver::iterate(int nIterations, bool &bNoMore, vector<bool> &vbInli
 
     vector<size_t> vAvailableIndices;
 
-    cv::Mat P3Dc1i(3,3,CV_32F);
-    cv::Mat P3Dc2i(3,3,CV_32F);
+    Eigen::Matrix3f P3Dc1i;
+    Eigen::Matrix3f P3Dc2i;
 
     int nCurrentIterations = 0;
     while(mnIterations<mRansacMaxIts && nCurrentIterations<nIterations)
@@ -165,12 +164,14 @@ cv::Mat Sim3Solver::iterate(int nIterations, bool &bNoMore, vector<bool> &vbInli
         // Get min set of points
         for(short i = 0; i < 3; ++i)
         {
-            int randi = DUtils::Random::RandomInt(0, vAvailableIndices.size()-1);
+            int randi = uniform_int_distribution<int>(0, vAvailableIndices.size()-1)(mRng);
 
             int idx = vAvailableIndices[randi];
 
-            mvX3Dc1[idx].copyTo(P3Dc1i.col(i));
-            mvX3Dc2[idx].copyTo(P3Dc2i.col(i));
+            const cv::Mat &X3Dc1 = mvX3Dc1[idx];
+            const cv::Mat &X3Dc2 = mvX3Dc2[idx];
+            P3Dc1i.col(i) << X3Dc1.at<float>(0), X3Dc1.at<float>(1), X3Dc1.at<float>(2);
+            P3Dc2i.col(i) << X3Dc2.at<float>(0), X3Dc2.at<float>(1), X3Dc2.at<float>(2);
 
             vAvailableIndices[randi] = vAvailableIndices.back();
             vAvailableIndices.pop_back();
@@ -212,128 +213,80 @@ cv::Mat Sim3Solver::find(vector<bool> &vbInliers12, int &nInliers)
     return iterate(mRansacMaxIts,bFlag,vbInliers12,nInliers);
 }
 
-void Sim3Solver::ComputeCentroid(cv::Mat &P, cv::Mat &Pr, cv::Mat &C)
-{
-    cv::reduce(P,C,1,CV_REDUCE_SUM);
-    C = C/P.cols;
-
-    for(int i=0; i<P.cols; i++)
-    {
-        Pr.col(i)=P.col(i)-C;
-    }
-}
-
-void Sim3Solver::ComputeSim3(cv::Mat &P1, cv::Mat &P2)
+void Sim3Solver::ComputeSim3(const Eigen::Matrix3f &P1, const Eigen::Matrix3f &P2)
 {
     // Custom implementation of:
     // Horn 1987, Closed-form solution of absolute orientataion using unit quaternions
 
     // Step 1: Centroid and relative coordinates
 
-    cv::Mat Pr1(P1.size(),P1.type()); // Relative coordinates to centroid (set 1)
-    cv::Mat Pr2(P2.size(),P2.type()); // Relative coordinates to centroid (set 2)
-    cv::Mat O1(3,1,Pr1.type()); // Centroid of P1
-    cv::Mat O2(3,1,Pr2.type()); // Centroid of P2
-
-    ComputeCentroid(P1,Pr1,O1);
-    ComputeCentroid(P2,Pr2,O2);
+    const Eigen::Vector3f O1 = P1.rowwise().mean(); // Centroid of P1
+    const Eigen::Vector3f O2 = P2.rowwise().mean(); // Centroid of P2
+    const Eigen::Matrix3f Pr1 = P1.colwise()-O1; // Relative coordinates to centroid (set 1)
+    const Eigen::Matrix3f Pr2 = P2.colwise()-O2; // Relative coordinates to centroid (set 2)
 
     // Step 2: Compute M matrix
 
-    cv::Mat M = Pr2*Pr1.t();
+    const Eigen::Matrix3f M = Pr2*Pr1.transpose();
 
     // Step 3: Compute N matrix
 
-    double N11, N12, N13, N14, N22, N23, N24, N33, N34, N44;
-
-    cv::Mat N(4,4,P1.type());
-
-    N11 = M.at<float>(0,0)+M.at<float>(1,1)+M.at<float>(2,2);
-    N12 = M.at<float>(1,2)-M.at<float>(2,1);
-    N13 = M.at<float>(2,0)-M.at<float>(0,2);
-    N14 = M.at<float>(0,1)-M.at<float>(1,0);
-    N22 = M.at<float>(0,0)-M.at<float>(1,1)-M.at<float>(2,2);
-    N23 = M.at<float>(0,1)+M.at<float>(1,0);
-    N24 = M.at<float>(2,0)+M.at<float>(0,2);
-    N33 = -M.at<float>(0,0)+M.at<float>(1,1)-M.at<float>(2,2);
-    N34 = M.at<float>(1,2)+M.at<float>(2,1);
-    N44 = -M.at<float>(0,0)-M.at<float>(1,1)+M.at<float>(2,2);
-
-    N = (cv::Mat_<float>(4,4) << N11, N12, N13, N14,
-                                 N12, N22, N23, N24,
-                                 N13, N23, N33, N34,
-                                 N14, N24, N34, N44);
-
-
-    // Step 4: Eigenvector of the highest eigenvalue
+    Eigen::Matrix4f N;
+    N(0,0) = M(0,0)+M(1,1)+M(2,2);
+    N(0,1) = M(1,2)-M(2,1);
+    N(0,2) = M(2,0)-M(0,2);
+    N(0,3) = M(0,1)-M(1,0);
+    N(1,1) = M(0,0)-M(1,1)-M(2,2);
+    N(1,2) = M(0,1)+M(1,0);
+    N(1,3) = M(2,0)+M(0,2);
+    N(2,2) = -M(0,0)+M(1,1)-M(2,2);
+    N(2,3) = M(1,2)+M(2,1);
+    N(3,3) = -M(0,0)-M(1,1)+M(2,2);
 
-    cv::Mat eval, evec;
+    // Step 4: Eigenvector of the highest eigenvalue (eigenvalues are sorted in increasing order)
 
-    cv::eigen(N,eval,evec); //evec[0] is the quaternion of the desired rotation
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix4f> eigenSolver(N.selfadjointView<Eigen::Upper>());
+    const Eigen::Vector4f q = eigenSolver.eigenvectors().col(3); // quaternion (w,x,y,z) of the desired rotation
 
-    cv::Mat vec(1,3,evec.type());
-    (evec.row(0).colRange(1,4)).copyTo(vec); //extract imaginary part of the quaternion (sin*axis)
-
-    // Rotation angle. sin is the norm of the imaginary part, cos is the real part
-    double ang=atan2(norm(vec),evec.at<float>(0,0));
-
-    vec = 2*ang*vec/norm(vec); //Angle-axis representation. quaternion angle is the half
-
-    mR12i.create(3,3,P1.type());
-
-    cv::Rodrigues(vec,mR12i); // computes the rotation matrix from angle-axis
+    const Eigen::Matrix3f R12 = Eigen::Quaternionf(q(0),q(1),q(2),q(3)).normalized().toRotationMatrix();
 
     // Step 5: Rotate set 2
 
-    cv::Mat P3 = mR12i*Pr2;
+    const Eigen::Matrix3f P3 = R12*Pr2;
 
     // Step 6: Scale
 
     if(!mbFixScale)
-    {
-        double nom = Pr1.dot(P3);
-        cv::Mat aux_P3(P3.size(),P3.type());
-        aux_P3=P3;
-        cv::pow(P3,2,aux_P3);
-        double den = 0;
-
-        for(int i=0; i<aux_P3.rows; i++)
-        {
-            for(int j=0; j<aux_P3.cols; j++)
-            {
-                den+=aux_P3.at<float>(i,j);
-            }
-        }
-
-        ms12i = nom/den;
-    }
+        ms12i = Pr1.cwiseProduct(P3).sum()/P3.squaredNorm();
     else
         ms12i = 1.0f;
 
     // Step 7: Translation
 
-    mt12i.create(1,3,P1.type());
-    mt12i = O1 - ms12i*mR12i*O2;
+    const Eigen::Vector3f t12 = O1 - ms12i*R12*O2;
+
+    mR12i = Converter::toCvMat(R12);
+    mt12i = Converter::toCvMat(t12);
 
     // Step 8: Transformation
 
     // Step 8.1 T12
-    mT12i = cv::Mat::eye(4,4,P1.type());
+    mT12i = cv::Mat::eye(4,4,CV_32F);
 
-    cv::Mat sR = ms12i*mR12i;
+    const Eigen::Matrix3f sR = ms12i*R12;
 
-    sR.copyTo(mT12i.rowRange(0,3).colRange(0,3));
+    Converter::toCvMat(sR).copyTo(mT12i.rowRange(0,3).colRange(0,3));
     mt12i.copyTo(mT12i.rowRange(0,3).col(3));
 
     // Step 8.2 T21
 
-    mT21i = cv::Mat::eye(4,4,P1.type());
+    mT21i = cv::Mat::eye(4,4,CV_32F);
 
-    cv::Mat sRinv = (1.0/ms12i)*mR12i.t();
+    const Eigen::Matrix3f sRinv = (1.0f/ms12i)*R12.transpose();
+    const Eigen::Vector3f tinv = -sRinv*t12;
 
-    sRinv.copyTo(mT21i.rowRange(0,3).colRange(0,3));
-    cv::Mat tinv = -sRinv*mt12i;
-    tinv.copyTo(mT21i.rowRange(0,3).col(3));
+    Converter::toCvMat(sRinv).copyTo(mT21i.rowRange(0,3).colRange(0,3));
+    Converter::toCvMat(tinv).copyTo(mT21i.rowRange(0,3).col(3));
 }
 
 
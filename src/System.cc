@@ -22,6 +22,7 @@
 
 #include "System.h"
 #include "Converter.h"
+#include "MapSerializer.h"
 #include <thread>
 #include <pangolin/pangolin.h>
 #include <iomanip>
@@ -62,7 +63,11 @@ System::System(const string &strVocFile, const string &strSettingsFile, const eS
     cout << endl << "Loading ORB Vocabulary. This could take a while..." << endl;
 
     mpVocabulary = new ORBVocabulary();
-    bool bVocLoad = mpVocabulary->loadFromTextFile(strVocFile);
+    bool bVocLoad;
+    if(ORBVocabulary::isBinaryFile(strVocFile))
+        bVocLoad = mpVocabulary->loadFromBinaryFile(strVocFile);
+    else
+        bVocLoad = mpVocabulary->loadFromTextFile(strVocFile);
     if(!bVocLoad)
     {
         cerr << "Wrong path to vocabulary. " << endl;
@@ -92,6 +97,11 @@ System::System(const string &strVocFile, const string &strSettingsFile, const eS
 
     //Initialize the Loop Closing thread and launch
     mpLoopCloser = new LoopClosing(mpMap, mpKeyFrameDatabase, mpVocabulary, mSensor!=MONOCULAR);
+    int nGlobalBA = fsSettings["LoopClosing.GlobalBA"];
+    int nGBAPartitionSize = fsSettings["LoopClosing.GBAPartitionSize"];
+    mpLoopCloser->SetGlobalBundleAdjustment(nGlobalBA,nGBAPartitionSize);
+    if(nGlobalBA)
+        cout << endl << "Global bundle adjustment after each loop" << endl;
     mptLoopClosing = new thread(&ORB_SLAM2::LoopClosing::Run, mpLoopCloser);
 
     //Initialize the Viewer thread and launch
@@ -129,10 +139,7 @@ cv::Mat System::TrackStereo(const cv::Mat &imLeft, const cv::Mat &imRight, const
             mpLocalMapper->RequestStop();
 
             // Wait until Local Mapping has effectively stopped
-            while(!mpLocalMapper->isStopped())
-            {
-                usleep(1000);
-            }
+            mpLocalMapper->WaitUntilStopped();
 
             mpTracker->InformOnlyTracking(true);
             mbActivateLocalizationMode = false;
@@ -180,10 +187,7 @@ cv::Mat System::TrackRGBD(const cv::Mat &im, const cv::Mat &depthmap, const doub
             mpLocalMapper->RequestStop();
 
             // Wait until Local Mapping has effectively stopped
-            while(!mpLocalMapper->isStopped())
-            {
-                usleep(1000);
-            }
+            mpLocalMapper->WaitUntilStopped();
 
             mpTracker->InformOnlyTracking(true);
             mbActivateLocalizationMode = false;
@@ -231,10 +235,7 @@ cv::Mat System::TrackMonocular(const cv::Mat &im, const double &timestamp)
             mpLocalMapper->RequestStop();
 
             // Wait until Local Mapping has effectively stopped
-            while(!mpLocalMapper->isStopped())
-            {
-                usleep(1000);
-            }
+            mpLocalMapper->WaitUntilStopped();
 
             mpTracker->InformOnlyTracking(true);
             mbActivateLocalizationMode = false;
@@ -317,6 +318,62 @@ void System::Shutdown()
 
     if(mpViewer)
         pangolin::BindToContext("ORB-SLAM2: Map Viewer");
+
+    PrintQueueStats("Local Mapping",mpLocalMapper->GetKeyFrameQueue());
+    PrintQueueStats("Loop Closing",mpLoopCloser->GetKeyFrameQueue());
+}
+
+bool System::SaveMap(const string &filename)
+{
+    cout << endl << "Saving map to " << filename << " ..." << endl;
+
+    // Local Mapping must not modify the map while it is written
+    const bool bStopMapping = !mpLocalMapper->isFinished() && !mpLocalMapper->isStopped();
+    if(bStopMapping)
+    {
+        mpLocalMapper->RequestStop();
+        mpLocalMapper->WaitUntilStopped();
+    }
+
+    bool bSaved;
+    {
+        unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
+        bSaved = MapSerializer::Save(filename,mpMap);
+    }
+
+    if(bStopMapping)
+        mpLocalMapper->Release();
+
+    return bSaved;
+}
+
+bool System::LoadMap(const string &filename)
+{
+    cout << endl << "Loading map from " << filename << " ..." << endl;
+
+    unique_lock<mutex> lock(mMutexReset);
+
+    // Clear the current map and the state of all threads
+    mpTracker->Reset();
+    mbReset = false;
+
+    bool bLoaded;
+    {
+        unique_lock<mutex> lockMap(mpMap->mMutexMapUpdate);
+        bLoaded = MapSerializer::Load(filename,mpMap,mpKeyFrameDatabase,mpVocabulary);
+    }
+
+    if(bLoaded)
+        mpTracker->InformMapLoaded();
+
+    return bLoaded;
+}
+
+void System::PrintQueueStats(const string &name, const KeyFrameQueue &queue)
+{
+    cout << name << " keyframe queue: " << queue.Pushed() << " inserted, " << queue.Dropped() << " dropped, "
+         << "max depth " << queue.MaxDepth() << "/" << queue.Capacity() << ", "
+         << "wait time mean " << queue.MeanWaitTime() << " ms, max " << queue.MaxWaitTime() << " ms" << endl;
 }
 
 void System::SaveTrajectoryTUM(const string &filename)
@@ -46,7 +46,9 @@ namespace ORB_SLAM2
 Tracking::Tracking(System *pSys, ORBVocabulary* pVoc, FrameDrawer *pFrameDrawer, MapDrawer *pMapDrawer, Map *pMap, KeyFrameDatabase* pKFDB, const string &strSettingPath, const int sensor):
     mState(NO_IMAGES_YET), mSensor(sensor), mbOnlyTracking(false), mbVO(false), mpORBVocabulary(pVoc),
     mpKeyFrameDB(pKFDB), mpInitializer(static_cast<Initializer*>(NULL)), mpSystem(pSys), mpViewer(NULL),
-    mpFrameDrawer(pFrameDrawer), mpMapDrawer(pMapDrawer), mpMap(pMap), mnLastRelocFrameId(0)
+    mpFrameDrawer(pFrameDrawer), mpMapDrawer(pMapDrawer), mpMap(pMap), mnLastRelocFrameId(0),
+    mpLocalMapRefKF(static_cast<KeyFrame*>(NULL)), mnLocalMapChangeIdx(-1), mnLocalMapBigChangeIdx(-1),
+    mbFastTracking(false), mpPatchTracker(static_cast<PatchTracker*>(NULL)), mbDirectTracking(false)
 {
     // Load camera parameters from settings file
 
@@ -137,6 +139,22 @@ Tracking::Tracking(System *pSys, ORBVocabulary* pVoc, FrameDrawer *pFrameDrawer,
         cout << endl << "Depth Threshold (Close/Far Points): " << mThDepth << endl;
     }
 
+    if(sensor==System::STEREO)
+    {
+        int nFastMode = fSettings["Tracking.FastMode"];
+        mbFastTracking = nFastMode;
+        if(mbFastTracking)
+        {
+            mpPatchTracker = new PatchTracker(nLevels);
+            cout << endl << "Fast tracking mode: ORB features only on keyframes" << endl;
+        }
+
+        int nDirect = fSettings["Tracking.DirectAlignment"];
+        mbDirectTracking = nDirect;
+        if(mbDirectTracking)
+            cout << endl << "Direct alignment: initial pose from the last keyframe" << endl;
+    }
+
     if(sensor==System::RGBD)
     {
         mDepthMapFactor = fSettings["DepthMapFactor"];
@@ -196,6 +214,9 @@ cv::Mat Tracking::GrabImageStereo(const cv::Mat &imRectLeft, const cv::Mat &imRe
         }
     }
 
+    if(mbFastTracking && TrackWithPatches(mImGray,timestamp))
+        return mCurrentFrame.mTcw.clone();
+
     mCurrentFrame = Frame(mImGray,imGrayRight,timestamp,mpORBextractorLeft,mpORBextractorRight,mpORBVocabulary,mK,mDistCoef,mbf,mThDepth);
 
     Track();
@@ -276,6 +297,9 @@ void Tracking::Track()
     // Get Map Mutex -> Map cannot be changed
     unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
 
+    // The map initialization does not update the motion model
+    bool bTracked = false;
+
     if(mState==NOT_INITIALIZED)
     {
         if(mSensor==System::STEREO || mSensor==System::RGBD)
@@ -304,7 +328,11 @@ void Tracking::Track()
                 // Local Mapping might have changed some MapPoints tracked in last frame
                 CheckReplacedInLastFrame();
 
-                if(mVelocity.empty() || mCurrentFrame.mnId<mnLastRelocFrameId+2)
+                mDirectTcw = cv::Mat();
+                if(mbDirectTracking && mCurrentFrame.mnId>=mnLastRelocFrameId+2)
+                    TrackDirect();
+
+                if((mVelocity.empty() && mDirectTcw.empty()) || mCurrentFrame.mnId<mnLastRelocFrameId+2)
                 {
                     bOK = TrackReferenceKeyFrame();
                 }
@@ -314,6 +342,14 @@ void Tracking::Track()
                     if(!bOK)
                         bOK = TrackReferenceKeyFrame();
                 }
+
+                // Few features (e.g. low texture). The direct pose is validated by the local map.
+                if(!bOK && !mDirectTcw.empty())
+                {
+                    mCurrentFrame.SetPose(mDirectTcw);
+                    fill(mCurrentFrame.mvpMapPoints.begin(),mCurrentFrame.mvpMapPoints.end(),static_cast<MapPoint*>(NULL));
+                    bOK = true;
+                }
             }
             else
             {
@@ -420,19 +456,6 @@ void Tracking::Track()
         // If tracking were good, check if we insert a keyframe
         if(bOK)
         {
-            // Update motion model
-            if(!mLastFrame.mTcw.empty())
-            {
-                cv::Mat LastTwc = cv::Mat::eye(4,4,CV_32F);
-                mLastFrame.GetRotationInverse().copyTo(LastTwc.rowRange(0,3).colRange(0,3));
-                mLastFrame.GetCameraCenter().copyTo(LastTwc.rowRange(0,3).col(3));
-                mVelocity = mCurrentFrame.mTcw*LastTwc;
-            }
-            else
-                mVelocity = cv::Mat();
-
-            mpMapDrawer->SetCurrentCameraPose(mCurrentFrame.mTcw);
-
             // Clean VO matches
             for(int i=0; i<mCurrentFrame.N; i++)
             {
@@ -445,6 +468,10 @@ void Tracking::Track()
                     }
             }
 
+            // Patches for the next frames are taken from the last frame processed by the full pipeline
+            if(mbFastTracking)
+                mpPatchTracker->SetReference(mCurrentFrame, mCurrentFrame.mpORBextractorLeft->photobaImagePyramid);
+
             // Delete temporal MapPoints
             for(list<MapPoint*>::iterator lit = mlpTemporalPoints.begin(), lend =  mlpTemporalPoints.end(); lit!=lend; lit++)
             {
@@ -486,12 +513,35 @@ void Tracking::Track()
             }
         }
 
-        if(!mCurrentFrame.mpReferenceKF)
-            mCurrentFrame.mpReferenceKF = mpReferenceKF;
+        bTracked = bOK;
+    }
+
+    FinishFrame(bTracked);
+}
 
-        mLastFrame = Frame(mCurrentFrame);
+void Tracking::FinishFrame(const bool bTracked)
+{
+    if(bTracked)
+    {
+        // Update motion model
+        if(!mLastFrame.mTcw.empty())
+        {
+            cv::Mat LastTwc = cv::Mat::eye(4,4,CV_32F);
+            mLastFrame.GetRotationInverse().copyTo(LastTwc.rowRange(0,3).colRange(0,3));
+            mLastFrame.GetCameraCenter().copyTo(LastTwc.rowRange(0,3).col(3));
+            mVelocity = mCurrentFrame.mTcw*LastTwc;
+        }
+        else
+            mVelocity = cv::Mat();
+
+        mpMapDrawer->SetCurrentCameraPose(mCurrentFrame.mTcw);
     }
 
+    if(!mCurrentFrame.mpReferenceKF)
+        mCurrentFrame.mpReferenceKF = mpReferenceKF;
+
+    mLastFrame = Frame(mCurrentFrame);
+
     // Store frame pose information to retrieve the complete camera trajectory afterwards.
     if(!mCurrentFrame.mTcw.empty())
     {
@@ -501,15 +551,15 @@ void Tracking::Track()
         mlFrameTimes.push_back(mCurrentFrame.mTimeStamp);
         mlbLost.push_back(mState==LOST);
     }
-    else
+    else if(!mlRelativeFramePoses.empty())
     {
-        // This can happen if tracking is lost
+        // This can happen if tracking is lost (the list is empty if the map was loaded
+        // and the camera has not been relocalized yet)
         mlRelativeFramePoses.push_back(mlRelativeFramePoses.back());
         mlpReferences.push_back(mlpReferences.back());
         mlFrameTimes.push_back(mlFrameTimes.back());
         mlbLost.push_back(mState==LOST);
     }
-
 }
 
 
@@ -871,6 +921,29 @@ void Tracking::UpdateLastFrame()
     }
 }
 
+bool Tracking::TrackDirect()
+{
+    if(!mpLastKeyFrame || mpLastKeyFrame->isBad())
+        return false;
+
+    // Initial guess from the motion model or the last frame
+    if(!mVelocity.empty())
+        mCurrentFrame.SetPose(mVelocity*mLastFrame.mTcw);
+    else
+        mCurrentFrame.SetPose(mLastFrame.mTcw);
+
+    // Track holds the map update mutex, which keeps the points of the keyframe unchanged
+    mpLocalMapper->AcquirePyramids();
+    const int nInliers = Optimizer::PoseDirectAlignment(&mCurrentFrame,mpLastKeyFrame);
+    mpLocalMapper->ReleasePyramidKeyFrames();
+
+    if(nInliers<100)
+        return false;
+
+    mDirectTcw = mCurrentFrame.mTcw.clone();
+    return true;
+}
+
 bool Tracking::TrackWithMotionModel()
 {
     ORBmatcher matcher(0.9,true);
@@ -879,7 +952,11 @@ bool Tracking::TrackWithMotionModel()
     // Create "visual odometry" points if in Localization Mode
     UpdateLastFrame();
 
-    mCurrentFrame.SetPose(mVelocity*mLastFrame.mTcw);
+    // The direct alignment is a better prior, allowing a narrower search
+    if(!mDirectTcw.empty())
+        mCurrentFrame.SetPose(mDirectTcw);
+    else
+        mCurrentFrame.SetPose(mVelocity*mLastFrame.mTcw);
 
     fill(mCurrentFrame.mvpMapPoints.begin(),mCurrentFrame.mvpMapPoints.end(),static_cast<MapPoint*>(NULL));
 
@@ -889,6 +966,8 @@ bool Tracking::TrackWithMotionModel()
         th=15;
     else
         th=7;
+    if(!mDirectTcw.empty())
+        th = th/2+1;
     int nmatches = matcher.SearchByProjection(mCurrentFrame,mLastFrame,th,mSensor==System::MONOCULAR);
 
     // If few matches, uses a wider window search
@@ -981,7 +1060,7 @@ bool Tracking::TrackLocalMap()
 }
 
 
-bool Tracking::NeedNewKeyFrame()
+bool Tracking::NewKeyFrameDue()
 {
     if(mbOnlyTracking)
         return false;
@@ -990,6 +1069,10 @@ bool Tracking::NeedNewKeyFrame()
     if(mpLocalMapper->isStopped() || mpLocalMapper->stopRequested())
         return false;
 
+    // Local Mapping is too far behind, drop this keyframe
+    if(mpLocalMapper->KeyframeQueueFull())
+        return false;
+
     const int nKFs = mpMap->KeyFramesInMap();
 
     // Do not insert keyframes if not enough frames have passed from last relocalisation
@@ -1041,12 +1124,21 @@ bool Tracking::NeedNewKeyFrame()
     // Condition 2: Few tracked points compared to reference keyframe. Lots of visual odometry compared to map matches.
     const bool c2 = ((mnMatchesInliers<nRefMatches*thRefRatio|| bNeedToInsertClose) && mnMatchesInliers>15);
 
-//    if((c1a||c1b||c1c)&&c2)
-    if(true) // TODO: for now every frame is a keyframe
+    // Without fast tracking every tracked frame is due: NeedNewKeyFrame inserts it whenever
+    // Local Mapping accepts it (or, for stereo/RGB-D, its queue holds fewer than 3 keyframes).
+    // In fast tracking mode the original ORB-SLAM2 rule applies: a keyframe is due when tracking
+    // is weak compared to the reference keyframe (c2) and enough frames have passed or tracking
+    // is very weak (c1a/c1b/c1c). TrackWithPatches hands such frames to the full pipeline.
+    return !mbFastTracking || ((c1a||c1b||c1c)&&c2);
+}
+
+bool Tracking::NeedNewKeyFrame()
+{
+    if(NewKeyFrameDue())
     {
         // If the mapping accepts keyframes, insert keyframe.
         // Otherwise send a signal to interrupt BA
-        if(bLocalMappingIdle)
+        if(mpLocalMapper->AcceptKeyFrames())
         {
             return true;
         }
@@ -1169,9 +1261,8 @@ void Tracking::SearchLocalPoints()
         }
     }
 
-    int nToMatch=0;
-
-    // Project points in frame and check its visibility
+    // Gather the candidate points (one lock per point)
+    mLocalPointsBatch.clear();
     for(vector<MapPoint*>::iterator vit=mvpLocalMapPoints.begin(), vend=mvpLocalMapPoints.end(); vit!=vend; vit++)
     {
         MapPoint* pMP = *vit;
@@ -1179,12 +1270,26 @@ void Tracking::SearchLocalPoints()
             continue;
         if(pMP->isBad())
             continue;
-        // Project (this fills MapPoint variables for matching)
-        if(mCurrentFrame.isInFrustum(pMP,0.5))
-        {
-            pMP->IncreaseVisible();
-            nToMatch++;
-        }
+        mLocalPointsBatch.push_back(pMP);
+    }
+
+    // Project points in frame and check its visibility, all at once
+    const int nToMatch = mCurrentFrame.isInFrustum(mLocalPointsBatch,0.5);
+
+    // Fill MapPoint variables for matching
+    for(size_t i=0, iend=mLocalPointsBatch.size(); i<iend; i++)
+    {
+        MapPoint* pMP = mLocalPointsBatch.vpMapPoints[i];
+        pMP->mbTrackInView = mLocalPointsBatch.vbInView[i];
+        if(!pMP->mbTrackInView)
+            continue;
+
+        pMP->mTrackProjX = mLocalPointsBatch.vU[i];
+        pMP->mTrackProjXR = mLocalPointsBatch.vUR[i];
+        pMP->mTrackProjY = mLocalPointsBatch.vV[i];
+        pMP->mnTrackScaleLevel = mLocalPointsBatch.vLevel[i];
+        pMP->mTrackViewCos = mLocalPointsBatch.vViewCos[i];
+        pMP->IncreaseVisible();
     }
 
     if(nToMatch>0)
@@ -1205,9 +1310,42 @@ void Tracking::UpdateLocalMap()
     // This is for visualization
     mpMap->SetReferenceMapPoints(mvpLocalMapPoints);
 
+    // Between keyframes successive frames see the same local map. Rebuild it only if the
+    // reference keyframe changed or the map was modified by LocalMapping or LoopClosing.
+    // In localization mode no keyframes are inserted and the reference keyframe is only
+    // moved by UpdateLocalKeyFrames, so the local map is always rebuilt.
+    const int nLocalMapChangeIdx = mpMap->GetLastLocalMapChangeIdx();
+    const int nBigChangeIdx = mpMap->GetLastBigChangeIdx();
+
+    if(!mbOnlyTracking && mpLocalMapRefKF && mpLocalMapRefKF==mpReferenceKF && !mpReferenceKF->isBad() &&
+       mnLocalMapChangeIdx==nLocalMapChangeIdx && mnLocalMapBigChangeIdx==nBigChangeIdx)
+    {
+        // The local map is kept but the reference keyframe is still elected by covisibility.
+        // If it changes, the local map is rebuilt with the next frame.
+        map<KeyFrame*,int> keyframeCounter;
+        CountKeyFrameVotes(keyframeCounter);
+
+        int max=0;
+        for(map<KeyFrame*,int>::const_iterator it=keyframeCounter.begin(), itEnd=keyframeCounter.end(); it!=itEnd; it++)
+        {
+            if(it->second>max && !it->first->isBad())
+            {
+                max=it->second;
+                mpReferenceKF=it->first;
+            }
+        }
+
+        mCurrentFrame.mpReferenceKF = mpReferenceKF;
+        return;
+    }
+
     // Update
     UpdateLocalKeyFrames();
     UpdateLocalPoints();
+
+    mpLocalMapRefKF = mpReferenceKF;
+    mnLocalMapChangeIdx = nLocalMapChangeIdx;
+    mnLocalMapBigChangeIdx = nBigChangeIdx;
 }
 
 void Tracking::UpdateLocalPoints()
@@ -1236,10 +1374,9 @@ void Tracking::UpdateLocalPoints()
 }
 
 
-void Tracking::UpdateLocalKeyFrames()
+void Tracking::CountKeyFrameVotes(map<KeyFrame*,int> &keyframeCounter)
 {
     // Each map point vote for the keyframes in which it has been observed
-    map<KeyFrame*,int> keyframeCounter;
     for(int i=0; i<mCurrentFrame.N; i++)
     {
         if(mCurrentFrame.mvpMapPoints[i])
@@ -1257,6 +1394,12 @@ void Tracking::UpdateLocalKeyFrames()
             }
         }
     }
+}
+
+void Tracking::UpdateLocalKeyFrames()
+{
+    map<KeyFrame*,int> keyframeCounter;
+    CountKeyFrameVotes(keyframeCounter);
 
     if(keyframeCounter.empty())
         return;
@@ -1428,7 +1571,7 @@ bool Tracking::Relocalization()
             // If a Camera Pose is computed, optimize
             if(!Tcw.empty())
             {
-                Tcw.copyTo(mCurrentFrame.mTcw);
+                mCurrentFrame.SetPose(Tcw);
 
                 set<MapPoint*> sFound;
 
@@ -1504,11 +1647,85 @@ bool Tracking::Relocalization()
     else
     {
         mnLastRelocFrameId = mCurrentFrame.mnId;
+        // The camera may be far from the reference keyframe, force a new local map
+        mpLocalMapRefKF = static_cast<KeyFrame*>(NULL);
         return true;
     }
 
 }
 
+bool Tracking::TrackWithPatches(const cv::Mat &imGray, const double &timestamp)
+{
+    if(mState!=OK || mpPatchTracker->empty() || mVelocity.empty())
+        return false;
+
+    if(Frame::nNextId<mnLastRelocFrameId+2 || (mbOnlyTracking && mbVO))
+        return false;
+
+    vector<g2o::imgStr*> &vPyramid = mpORBextractorLeft->photobaImagePyramid;
+    mpORBextractorLeft->ComputePhotometricPyramid(imGray);
+
+    // Predict the pose with the motion model and track the last frame points
+    vector<cv::KeyPoint> vKeys;
+    vector<MapPoint*> vpMapPoints;
+    const int nTracked = mpPatchTracker->Track(vPyramid,mVelocity*mLastFrame.mTcw,vKeys,vpMapPoints);
+
+    bool bOK = false;
+    long unsigned int nFrameId = Frame::nNextId;
+    if(nTracked>=50)
+    {
+        unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
+
+        Frame frame(vKeys,vpMapPoints,timestamp,mpORBextractorLeft,mpORBextractorRight,mpORBVocabulary,mK,mDistCoef,mbf,mThDepth);
+        frame.SetPose(mVelocity*mLastFrame.mTcw);
+        frame.mpReferenceKF = mpReferenceKF;
+
+        // If rejected, mCurrentFrame and mnMatchesInliers are overwritten by the full pipeline
+        mCurrentFrame = frame;
+        mnMatchesInliers = Optimizer::PoseOptimization(&mCurrentFrame);
+
+        // Extract ORB features if tracking is weak or a keyframe is due
+        bOK = mnMatchesInliers>=50 && !NewKeyFrameDue();
+
+        if(bOK)
+        {
+            for(int i=0; i<mCurrentFrame.N; i++)
+            {
+                if(mCurrentFrame.mvpMapPoints[i] && !mCurrentFrame.mvbOutlier[i])
+                    mCurrentFrame.mvpMapPoints[i]->IncreaseFound();
+            }
+        }
+    }
+
+    if(!bOK)
+    {
+        // The full pipeline processes the same image: it reuses the frame id
+        // and the photometric pyramid computed here
+        Frame::nNextId = nFrameId;
+        mpORBextractorLeft->mbReusePhotometricPyramid = true;
+        return false;
+    }
+
+    mLastProcessedState=mState;
+
+    mpFrameDrawer->Update(this);
+
+    // The tracked points are the reference for the next frame
+    mpPatchTracker->SetReference(mCurrentFrame,vPyramid);
+    for(size_t i=0; i<vPyramid.size(); i++)
+        delete vPyramid[i];
+
+    for(int i=0; i<mCurrentFrame.N;i++)
+    {
+        if(mCurrentFrame.mvpMapPoints[i] && mCurrentFrame.mvbOutlier[i])
+            mCurrentFrame.mvpMapPoints[i]=static_cast<MapPoint*>(NULL);
+    }
+
+    FinishFrame(true);
+
+    return true;
+}
+
 void Tracking::Reset()
 {
 
@@ -1553,10 +1770,32 @@ void Tracking::Reset()
     mlFrameTimes.clear();
     mlbLost.clear();
 
+    mvpLocalKeyFrames.clear();
+    mvpLocalMapPoints.clear();
+    mpLocalMapRefKF = static_cast<KeyFrame*>(NULL);
+
+    if(mpPatchTracker)
+        mpPatchTracker->Clear();
+
     if(mpViewer)
         mpViewer->Release();
 }
 
+void Tracking::InformMapLoaded()
+{
+    vector<KeyFrame*> vpKFs = mpMap->GetAllKeyFrames();
+    if(vpKFs.empty())
+        return;
+
+    KeyFrame* pLastKF = *max_element(vpKFs.begin(),vpKFs.end(),KeyFrame::lId);
+    mpLastKeyFrame = pLastKF;
+    mpReferenceKF = pLastKF;
+    mnLastKeyFrameId = pLastKF->mnFrameId;
+
+    // The camera is relocalized in the loaded map with the first frames
+    mState = LOST;
+}
+
 void Tracking::ChangeCalibration(const string &strSettingPath)
 {
     cv::FileStorage fSettings(strSettingPath, cv::FileStorage::READ);
@@ -0,0 +1,220 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Runs the partitioned global bundle adjustment on a small synthetic stereo map, split in
+// several covisibility partitions. The poses and points are perturbed from the ground truth
+// and the exact observations must be fitted again.
+
+#include "Optimizer.h"
+#include "KeyFrame.h"
+#include "MapPoint.h"
+#include "Map.h"
+#include "Frame.h"
+#include "Converter.h"
+
+#include <Eigen/Dense>
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace ORB_SLAM2;
+
+static const float sBf = 40.0f;
+
+static KeyFrame* CreateKeyFrame(const vector<cv::KeyPoint> &vKeys, const vector<float> &vuRight,
+                                const cv::Mat &Tcw, Map* pMap)
+{
+    const int N = vKeys.size();
+
+    Frame F;
+    F.mpORBvocabulary = static_cast<ORBVocabulary*>(NULL);
+    F.mpORBextractorLeft = static_cast<ORBextractor*>(NULL);
+    F.mpORBextractorRight = static_cast<ORBextractor*>(NULL);
+    F.mpReferenceKF = static_cast<KeyFrame*>(NULL);
+    F.mnId = 0;
+    F.mTimeStamp = 0;
+    F.mbf = sBf;
+    F.mb = sBf/Frame::fx;
+    F.mThDepth = 40.0f*F.mb;
+    F.mK = cv::Mat::eye(3,3,CV_32F);
+    F.mK.at<float>(0,0) = Frame::fx;
+    F.mK.at<float>(1,1) = Frame::fy;
+    F.mK.at<float>(0,2) = Frame::cx;
+    F.mK.at<float>(1,2) = Frame::cy;
+    F.mnScaleLevels = 1;
+    F.mfScaleFactor = 1.2f;
+    F.mfLogScaleFactor = log(F.mfScaleFactor);
+    F.mvScaleFactors = vector<float>(1,1.0f);
+    F.mvLevelSigma2 = vector<float>(1,1.0f);
+    F.mvInvLevelSigma2 = vector<float>(1,1.0f);
+    F.N = N;
+    F.mvKeys = vKeys;
+    F.mvKeysUn = vKeys;
+    F.mvuRight = vuRight;
+    F.mvDepth = vector<float>(N,-1);
+    F.mDescriptors = cv::Mat::zeros(N,32,CV_8U);
+    F.mvpMapPoints = vector<MapPoint*>(N,static_cast<MapPoint*>(NULL));
+    F.mTcw = Tcw.clone();
+    return new KeyFrame(F,pMap,static_cast<KeyFrameDatabase*>(NULL));
+}
+
+// RMS of the left image reprojection errors, in pixels
+static double ReprojectionRMS(Map* pMap)
+{
+    double sum = 0;
+    int n = 0;
+    const vector<MapPoint*> vpMPs = pMap->GetAllMapPoints();
+    for(size_t i=0; i<vpMPs.size(); i++)
+    {
+        const Eigen::Vector3f x3Dw = Converter::toVector3f(vpMPs[i]->GetWorldPos());
+        const map<KeyFrame*,size_t> observations = vpMPs[i]->GetObservations();
+        for(map<KeyFrame*,size_t>::const_iterator mit=observations.begin(); mit!=observations.end(); mit++)
+        {
+            KeyFrame* pKF = mit->first;
+            const cv::Mat Tcw = pKF->GetPose();
+            const Eigen::Matrix3f Rcw = Converter::toMatrix3f(Tcw.rowRange(0,3).colRange(0,3));
+            const Eigen::Vector3f tcw = Converter::toVector3f(Tcw.rowRange(0,3).col(3));
+            const Eigen::Vector3f x3Dc = Rcw*x3Dw+tcw;
+            const cv::KeyPoint &kp = pKF->mvKeysUn[mit->second];
+            const double du = Frame::fx*x3Dc[0]/x3Dc[2]+Frame::cx-kp.pt.x;
+            const double dv = Frame::fy*x3Dc[1]/x3Dc[2]+Frame::cy-kp.pt.y;
+            sum += du*du+dv*dv;
+            n++;
+        }
+    }
+    return n>0 ? sqrt(sum/n) : 0;
+}
+
+int main()
+{
+    mt19937 rng(3);
+    uniform_real_distribution<float> value(-1.0f,1.0f);
+    normal_distribution<float> noise(0.0f,1.0f);
+    bool bOk = true;
+
+    Frame::fx = 500.0f; Frame::fy = 500.0f; Frame::cx = 320.0f; Frame::cy = 240.0f;
+    Frame::invfx = 1.0f/Frame::fx; Frame::invfy = 1.0f/Frame::fy;
+    Frame::mnMinX = 0.0f; Frame::mnMaxX = 640.0f; Frame::mnMinY = 0.0f; Frame::mnMaxY = 480.0f;
+    Frame::mfGridElementWidthInv = FRAME_GRID_COLS/(Frame::mnMaxX-Frame::mnMinX);
+    Frame::mfGridElementHeightInv = FRAME_GRID_ROWS/(Frame::mnMaxY-Frame::mnMinY);
+    Frame::mbInitialComputations = false;
+
+    // Cameras along the x axis looking at points in front of them. Each point is seen
+    // by the cameras closer than 1.2 m along x, so covisibility only links neighbors.
+    const int nKFs = 16;
+    const int nMPs = 400;
+    const float step = 0.4f;
+
+    vector<Eigen::Vector3f> vCenters(nKFs);
+    for(int i=0; i<nKFs; i++)
+        vCenters[i] = Eigen::Vector3f(step*i,0,0);
+
+    vector<Eigen::Vector3f> vPoints(nMPs);
+    for(int j=0; j<nMPs; j++)
+        vPoints[j] = Eigen::Vector3f(step*(nKFs-1)*0.5f*(value(rng)+1.0f),value(rng),6.0f+2.0f*value(rng));
+
+    vector<vector<cv::KeyPoint> > vvKeys(nKFs);
+    vector<vector<float> > vvuRight(nKFs);
+    vector<vector<pair<int,size_t> > > vvObservations(nMPs);
+    for(int i=0; i<nKFs; i++)
+    {
+        for(int j=0; j<nMPs; j++)
+        {
+            const Eigen::Vector3f x3Dc = vPoints[j]-vCenters[i];
+            if(fabs(x3Dc[0])>1.2f)
+                continue;
+            const float invz = 1.0f/x3Dc[2];
+            const float u = Frame::fx*x3Dc[0]*invz+Frame::cx;
+            const float v = Frame::fy*x3Dc[1]*invz+Frame::cy;
+            vvObservations[j].push_back(make_pair(i,vvKeys[i].size()));
+            vvKeys[i].push_back(cv::KeyPoint(cv::Point2f(u,v),31.0f));
+            vvuRight[i].push_back(u-sBf*invz);
+        }
+    }
+
+    // Keyframes and points start from a perturbed state, the first keyframe is fixed
+    Map map;
+    vector<KeyFrame*> vpKFs(nKFs);
+    for(int i=0; i<nKFs; i++)
+    {
+        Eigen::Matrix3f R = Eigen::Matrix3f::Identity();
+        Eigen::Vector3f C = vCenters[i];
+        if(i>0)
+        {
+            R = Eigen::AngleAxisf(0.01f*noise(rng),Eigen::Vector3f::UnitY()).toRotationMatrix();
+            C += 0.03f*Eigen::Vector3f(noise(rng),noise(rng),noise(rng));
+        }
+        cv::Mat Tcw = cv::Mat::eye(4,4,CV_32F);
+        Converter::toCvMat(Eigen::Matrix3f(R.transpose())).copyTo(Tcw.rowRange(0,3).colRange(0,3));
+        Converter::toCvMat(Eigen::Vector3f(-R.transpose()*C)).copyTo(Tcw.rowRange(0,3).col(3));
+        vpKFs[i] = CreateKeyFrame(vvKeys[i],vvuRight[i],Tcw,&map);
+        map.AddKeyFrame(vpKFs[i]);
+    }
+    map.mvpKeyFrameOrigins.push_back(vpKFs[0]);
+
+    for(int j=0; j<nMPs; j++)
+    {
+        if(vvObservations[j].size()<2)
+            continue;
+        const Eigen::Vector3f x3Dw = vPoints[j]+0.05f*Eigen::Vector3f(noise(rng),noise(rng),noise(rng));
+        MapPoint* pMP = new MapPoint(Converter::toCvMat(x3Dw),vpKFs[vvObservations[j][0].first],&map);
+        for(size_t k=0; k<vvObservations[j].size(); k++)
+        {
+            KeyFrame* pKF = vpKFs[vvObservations[j][k].first];
+            pMP->AddObservation(pKF,vvObservations[j][k].second);
+            pKF->AddMapPoint(pMP,vvObservations[j][k].second);
+        }
+        map.AddMapPoint(pMP);
+    }
+
+    for(int i=0; i<nKFs; i++)
+        vpKFs[i]->UpdateConnections();
+
+    const double rmsBefore = ReprojectionRMS(&map);
+
+    // Partitions of 4 keyframes
+    Optimizer::PartitionedGlobalBundleAdjustment(&map,4,10,10,NULL,0,false,Optimizer::LINEAR_SOLVER_CHOLESKY);
+
+    const double rmsAfter = ReprojectionRMS(&map);
+    if(!(rmsAfter<0.5 && rmsAfter<0.1*rmsBefore))
+    {
+        cout << "reprojection RMS " << rmsBefore << " px before, " << rmsAfter << " px after" << endl;
+        bOk = false;
+    }
+
+    // Stereo fixes the scale: the centers must come back to the ground truth
+    float maxError = 0;
+    for(int i=0; i<nKFs; i++)
+        maxError = max(maxError,(Converter::toVector3f(vpKFs[i]->GetCameraCenter())-vCenters[i]).norm());
+    if(!(maxError<0.02f))
+    {
+        cout << "camera center error " << maxError << " m" << endl;
+        bOk = false;
+    }
+
+    map.clear();
+
+    cout << (bOk ? "partitioned global BA: OK" : "partitioned global BA: FAILED") << endl;
+    return bOk ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,145 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Checks the block Cholesky and PCG linear solvers against a dense LDLT solution
+// on random symmetric positive definite block systems.
+
+#include "Thirdparty/g2o/g2o/core/sparse_block_matrix.h"
+#include "Thirdparty/g2o/g2o/solvers/linear_solver_block_cholesky.h"
+#include "Thirdparty/g2o/g2o/solvers/linear_solver_pcg.h"
+
+#include <Eigen/Dense>
+
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace std;
+
+typedef Eigen::Matrix<double,7,7> BlockType;
+
+// Random block sparse SPD matrix (upper triangle, as built by the block solver) and its dense copy
+static void CreateSystem(const int nBlocks, const double density, mt19937 &rng,
+                         g2o::SparseBlockMatrix<BlockType> &A, Eigen::MatrixXd &D)
+{
+    const int N = nBlocks*7;
+    uniform_real_distribution<double> value(-1.0,1.0);
+    uniform_real_distribution<double> coin(0.0,1.0);
+
+    // Sum of random rank-one updates on a few blocks, then a dominant diagonal
+    Eigen::MatrixXd M = Eigen::MatrixXd::Zero(N,N);
+    for(int j=0; j<nBlocks; j++)
+    {
+        for(int i=0; i<j; i++)
+        {
+            if(i!=j-1 && coin(rng)>density)
+                continue;
+            Eigen::VectorXd v = Eigen::VectorXd::Zero(N);
+            for(int k=0; k<7; k++)
+            {
+                v[i*7+k] = value(rng);
+                v[j*7+k] = value(rng);
+            }
+            M += v*v.transpose();
+        }
+    }
+    M += Eigen::MatrixXd::Identity(N,N);
+
+    for(int j=0; j<nBlocks; j++)
+    {
+        for(int i=0; i<=j; i++)
+        {
+            const BlockType B = M.block<7,7>(i*7,j*7);
+            if(B.isZero())
+                continue;
+            *A.block(i,j,true) = B;
+        }
+    }
+    D = M;
+}
+
+template<class TSolver>
+static bool CheckSolver(const char* name, TSolver &solver, const int nBlocks, const double density,
+                        const double tolerance, mt19937 &rng)
+{
+    vector<int> vBlockIndices(nBlocks);
+    for(int i=0; i<nBlocks; i++)
+        vBlockIndices[i] = (i+1)*7;
+
+    g2o::SparseBlockMatrix<BlockType> A(&vBlockIndices[0],&vBlockIndices[0],nBlocks,nBlocks);
+    Eigen::MatrixXd D;
+    CreateSystem(nBlocks,density,rng,A,D);
+
+    const int N = nBlocks*7;
+    Eigen::VectorXd b = Eigen::VectorXd::Random(N);
+    Eigen::VectorXd x = Eigen::VectorXd::Zero(N);
+
+    if(!solver.solve(A,x.data(),b.data()))
+    {
+        cout << name << ": solve failed with " << nBlocks << " blocks" << endl;
+        return false;
+    }
+
+    const Eigen::VectorXd xRef = D.ldlt().solve(b);
+    const double error = (x-xRef).norm()/xRef.norm();
+    if(!(error<tolerance))
+    {
+        cout << name << ": relative error " << error << " with " << nBlocks << " blocks" << endl;
+        return false;
+    }
+    return true;
+}
+
+int main()
+{
+    mt19937 rng(42);
+    bool bOk = true;
+
+    // The pattern changes between solves, the symbolic factorization must be recomputed
+    g2o::LinearSolverBlockCholesky<BlockType> cholesky;
+    for(int n=1; n<=40; n+=3)
+    {
+        cholesky.init();
+        bOk &= CheckSolver("block Cholesky",cholesky,n,0.2,1e-9,rng);
+    }
+
+    // Parallel factorization of the independent subtrees
+    g2o::LinearSolverBlockCholesky<BlockType> parallelCholesky;
+    parallelCholesky.setMinBlocksForThreads(1);
+    parallelCholesky.setNumThreads(4);
+    for(int n=2; n<=120; n+=17)
+    {
+        parallelCholesky.init();
+        bOk &= CheckSolver("parallel block Cholesky",parallelCholesky,n,0.05,1e-9,rng);
+    }
+
+    g2o::LinearSolverPCG<BlockType> pcg;
+    pcg.setTolerance(1e-14);
+    pcg.setMaxIterations(1000);
+    for(int n=1; n<=40; n+=3)
+    {
+        pcg.init();
+        bOk &= CheckSolver("PCG",pcg,n,0.2,1e-5,rng);
+    }
+
+    cout << (bOk ? "linear solvers: OK" : "linear solvers: FAILED") << endl;
+    return bOk ? EXIT_SUCCESS : EXIT_FAILURE;
+}
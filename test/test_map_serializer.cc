@@ -0,0 +1,356 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Saves a small synthetic map, loads it into an empty map and checks that keyframes, map points,
+// observations, the covisibility graph, the spanning tree and the loop edges come back unchanged.
+// A truncated file must be rejected without adding anything to the map.
+
+#include "Map.h"
+#include "MapSerializer.h"
+#include "KeyFrame.h"
+#include "KeyFrameDatabase.h"
+#include "MapPoint.h"
+#include "Frame.h"
+#include "HighGradientPoint.h"
+#include "ORBVocabulary.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <vector>
+
+using namespace std;
+using namespace ORB_SLAM2;
+
+static const char* sFilename = "test_map.bin";
+static const char* sTruncatedFilename = "test_map_truncated.bin";
+
+static cv::Mat RandomDescriptors(const int n, mt19937 &rng)
+{
+    uniform_int_distribution<int> byte(0,255);
+    cv::Mat D(n,32,CV_8U);
+    for(int i=0; i<n; i++)
+    {
+        unsigned char* p = D.ptr<unsigned char>(i);
+        for(int j=0; j<32; j++)
+            p[j] = byte(rng);
+    }
+    return D;
+}
+
+// Keyframe built the same way MapSerializer::Load builds them, from a Frame without images
+static KeyFrame* CreateKeyFrame(const int nId, const int N, Map* pMap, KeyFrameDatabase* pKFDB,
+                                ORBVocabulary* pVoc, mt19937 &rng)
+{
+    uniform_real_distribution<float> u(Frame::mnMinX,Frame::mnMaxX);
+    uniform_real_distribution<float> v(Frame::mnMinY,Frame::mnMaxY);
+    uniform_int_distribution<int> octave(0,7);
+
+    Frame F;
+    F.mpORBvocabulary = pVoc;
+    F.mpORBextractorLeft = static_cast<ORBextractor*>(NULL);
+    F.mpORBextractorRight = static_cast<ORBextractor*>(NULL);
+    F.mpReferenceKF = static_cast<KeyFrame*>(NULL);
+    F.mnId = 10*nId;
+    F.mTimeStamp = 0.1*nId;
+    F.mbf = 40.0f;
+    F.mb = 0.1f;
+    F.mThDepth = 4.0f;
+    F.mK = cv::Mat::eye(3,3,CV_32F);
+    F.mK.at<float>(0,0) = Frame::fx;
+    F.mK.at<float>(1,1) = Frame::fy;
+    F.mK.at<float>(0,2) = Frame::cx;
+    F.mK.at<float>(1,2) = Frame::cy;
+
+    F.mnScaleLevels = 8;
+    F.mfScaleFactor = 1.2f;
+    F.mfLogScaleFactor = log(F.mfScaleFactor);
+    F.mvScaleFactors.resize(F.mnScaleLevels);
+    F.mvLevelSigma2.resize(F.mnScaleLevels);
+    F.mvInvLevelSigma2.resize(F.mnScaleLevels);
+    F.mvScaleFactors[0] = 1.0f;
+    for(int i=1; i<F.mnScaleLevels; i++)
+        F.mvScaleFactors[i] = F.mvScaleFactors[i-1]*F.mfScaleFactor;
+    for(int i=0; i<F.mnScaleLevels; i++)
+    {
+        F.mvLevelSigma2[i] = F.mvScaleFactors[i]*F.mvScaleFactors[i];
+        F.mvInvLevelSigma2[i] = 1.0f/F.mvLevelSigma2[i];
+    }
+
+    F.N = N;
+    F.mvKeys.resize(N);
+    for(int i=0; i<N; i++)
+        F.mvKeys[i] = cv::KeyPoint(cv::Point2f(u(rng),v(rng)),31.0f,0.5f*i,0,octave(rng));
+    F.mvKeysUn = F.mvKeys;
+    F.mvuRight = vector<float>(N,-1);
+    F.mvDepth = vector<float>(N,-1);
+    F.mDescriptors = RandomDescriptors(N,rng);
+
+    F.mTcw = cv::Mat::eye(4,4,CV_32F);
+    F.mTcw.at<float>(0,3) = -0.1f*nId;
+    F.mTcw.at<float>(1,3) = 0.02f*nId;
+
+    for(int j=0; j<5; j++)
+    {
+        HighGradientPoint* pHG = new HighGradientPoint(u(rng),v(rng),0.25+0.1*j);
+        pHG->curKF_u = pHG->u+0.5;
+        pHG->curKF_v = pHG->v-0.5;
+        pHG->obsCounter = j;
+        F.mHGPoints.push_back(pHG);
+    }
+
+    F.mvpMapPoints = vector<MapPoint*>(N,static_cast<MapPoint*>(NULL));
+    for(int i=0; i<N; i++)
+    {
+        int nGridPosX, nGridPosY;
+        if(F.PosInGrid(F.mvKeysUn[i],nGridPosX,nGridPosY))
+            F.mGrid[nGridPosX][nGridPosY].push_back(i);
+    }
+
+    KeyFrame* pKF = new KeyFrame(F,pMap,pKFDB);
+    pKF->affineAL = 0.01*nId;
+    pKF->affineBL = -0.5*nId;
+    pKF->ComputeBoW();
+    return pKF;
+}
+
+static void DescribeMat(ostream &os, const cv::Mat &M)
+{
+    os << M.rows << "x" << M.cols << ":" << M.type() << "[";
+    const size_t rowBytes = M.cols*M.elemSize();
+    for(int r=0; r<M.rows; r++)
+    {
+        const unsigned char* p = M.ptr<unsigned char>(r);
+        for(size_t c=0; c<rowBytes; c++)
+            os << (int)p[c] << ",";
+    }
+    os << "] ";
+}
+
+// Canonical description of the map, with every container ordered by id
+static string DescribeMap(Map* pMap)
+{
+    ostringstream os;
+    os << setprecision(17);
+
+    vector<KeyFrame*> vpKFs = pMap->GetAllKeyFrames();
+    sort(vpKFs.begin(),vpKFs.end(),KeyFrame::lId);
+    for(size_t i=0; i<vpKFs.size(); i++)
+    {
+        KeyFrame* pKF = vpKFs[i];
+        os << "KF " << pKF->mnId << " " << pKF->mnFrameId << " " << pKF->mTimeStamp << " "
+           << pKF->fx << " " << pKF->fy << " " << pKF->cx << " " << pKF->cy << " "
+           << pKF->mbf << " " << pKF->mThDepth << " " << pKF->N << " " << pKF->mnScaleLevels << "\n";
+        for(int j=0; j<pKF->N; j++)
+            os << pKF->mvKeysUn[j].pt.x << " " << pKF->mvKeysUn[j].pt.y << " " << pKF->mvKeysUn[j].octave
+               << " " << pKF->mvKeysUn[j].angle << ";";
+        os << "\n";
+        DescribeMat(os,pKF->mDescriptors);
+        DescribeMat(os,pKF->GetPose());
+        os << pKF->affineAL << " " << pKF->affineBL << " " << pKF->affineAR << " " << pKF->affineBR << "\n";
+        for(size_t j=0; j<pKF->mHGPoints.size(); j++)
+        {
+            HighGradientPoint* pHG = pKF->mHGPoints[j];
+            os << pHG->u << " " << pHG->v << " " << pHG->invDepth << " " << pHG->curKF_u << " "
+               << pHG->curKF_v << " " << pHG->obsCounter << ";";
+        }
+        os << "\n";
+
+        KeyFrame* pParent = pKF->GetParent();
+        os << "parent " << (pParent ? (long)pParent->mnId : -1) << " covisibles ";
+        vector<pair<unsigned long,int> > vConnections;
+        set<KeyFrame*> spConnected = pKF->GetConnectedKeyFrames();
+        for(set<KeyFrame*>::iterator sit=spConnected.begin(); sit!=spConnected.end(); sit++)
+            vConnections.push_back(make_pair((*sit)->mnId,pKF->GetWeight(*sit)));
+        sort(vConnections.begin(),vConnections.end());
+        for(size_t j=0; j<vConnections.size(); j++)
+            os << vConnections[j].first << ":" << vConnections[j].second << " ";
+        os << "loops ";
+        vector<unsigned long> vLoops;
+        set<KeyFrame*> spLoops = pKF->GetLoopEdges();
+        for(set<KeyFrame*>::iterator sit=spLoops.begin(); sit!=spLoops.end(); sit++)
+            vLoops.push_back((*sit)->mnId);
+        sort(vLoops.begin(),vLoops.end());
+        for(size_t j=0; j<vLoops.size(); j++)
+            os << vLoops[j] << " ";
+        os << "\n";
+    }
+
+    vector<MapPoint*> vpMPs = pMap->GetAllMapPoints();
+    sort(vpMPs.begin(),vpMPs.end(),[](MapPoint* a, MapPoint* b){ return a->mnId<b->mnId; });
+    for(size_t i=0; i<vpMPs.size(); i++)
+    {
+        MapPoint* pMP = vpMPs[i];
+        os << "MP " << pMP->mnId << " " << pMP->mnFirstKFid << " " << pMP->mnFirstFrame << " "
+           << pMP->GetReferenceKeyFrame()->mnId << " " << pMP->GetMinDistanceInvariance() << " "
+           << pMP->GetMaxDistanceInvariance() << " " << pMP->GetFound() << " " << pMP->GetFoundRatio() << " ";
+        DescribeMat(os,pMP->GetWorldPos());
+        DescribeMat(os,pMP->GetNormal());
+        DescribeMat(os,pMP->GetDescriptor());
+        vector<pair<unsigned long,size_t> > vObs;
+        map<KeyFrame*,size_t> observations = pMP->GetObservations();
+        for(map<KeyFrame*,size_t>::iterator mit=observations.begin(); mit!=observations.end(); mit++)
+            vObs.push_back(make_pair(mit->first->mnId,mit->second));
+        sort(vObs.begin(),vObs.end());
+        for(size_t j=0; j<vObs.size(); j++)
+            os << vObs[j].first << ":" << vObs[j].second << " ";
+        os << "\n";
+    }
+
+    os << "origins ";
+    for(size_t i=0; i<pMap->mvpKeyFrameOrigins.size(); i++)
+        os << pMap->mvpKeyFrameOrigins[i]->mnId << " ";
+    os << "\n";
+
+    return os.str();
+}
+
+int main()
+{
+    mt19937 rng(11);
+    bool bOk = true;
+
+    // Small vocabulary, only needed to compute the bag of words of the loaded keyframes
+    vector<vector<cv::Mat> > vvTraining(5);
+    for(size_t i=0; i<vvTraining.size(); i++)
+    {
+        cv::Mat D = RandomDescriptors(100,rng);
+        for(int j=0; j<D.rows; j++)
+            vvTraining[i].push_back(D.row(j));
+    }
+    ORBVocabulary voc(4,2,DBoW2::TF_IDF,DBoW2::L1_NORM);
+    voc.create(vvTraining);
+
+    Frame::fx = 500.0f; Frame::fy = 500.0f; Frame::cx = 320.0f; Frame::cy = 240.0f;
+    Frame::invfx = 1.0f/Frame::fx; Frame::invfy = 1.0f/Frame::fy;
+    Frame::mnMinX = 0.0f; Frame::mnMaxX = 640.0f; Frame::mnMinY = 0.0f; Frame::mnMaxY = 480.0f;
+    Frame::mfGridElementWidthInv = FRAME_GRID_COLS/(Frame::mnMaxX-Frame::mnMinX);
+    Frame::mfGridElementHeightInv = FRAME_GRID_ROWS/(Frame::mnMaxY-Frame::mnMinY);
+    Frame::mbInitialComputations = false;
+
+    Map savedMap;
+    KeyFrameDatabase database(voc);
+
+    const int nKFs = 4;
+    const int N = 80;
+    vector<KeyFrame*> vpKFs;
+    for(int i=0; i<nKFs; i++)
+    {
+        vpKFs.push_back(CreateKeyFrame(i,N,&savedMap,&database,&voc,rng));
+        savedMap.AddKeyFrame(vpKFs.back());
+    }
+    savedMap.mvpKeyFrameOrigins.push_back(vpKFs[0]);
+
+    // Each map point is seen by a run of consecutive keyframes, so the covisibility weights differ
+    uniform_real_distribution<float> coord(-1.0f,1.0f);
+    for(int j=0; j<60; j++)
+    {
+        const int first = j%nKFs;
+        const int nObs = 2+j%3;
+        cv::Mat Pos = (cv::Mat_<float>(3,1) << coord(rng), coord(rng), 4.0f+coord(rng));
+        MapPoint* pMP = new MapPoint(Pos,vpKFs[first],&savedMap);
+        for(int k=0; k<nObs && first+k<nKFs; k++)
+        {
+            pMP->AddObservation(vpKFs[first+k],j);
+            vpKFs[first+k]->AddMapPoint(pMP,j);
+        }
+        pMP->ComputeDistinctiveDescriptors();
+        pMP->UpdateNormalAndDepth();
+        pMP->IncreaseVisible(1+j%5);
+        savedMap.AddMapPoint(pMP);
+    }
+
+    for(int i=0; i<nKFs; i++)
+        vpKFs[i]->UpdateConnections();
+    vpKFs[0]->AddLoopEdge(vpKFs[nKFs-1]);
+    vpKFs[nKFs-1]->AddLoopEdge(vpKFs[0]);
+
+    const string sOriginal = DescribeMap(&savedMap);
+
+    if(!MapSerializer::Save(sFilename,&savedMap))
+    {
+        cout << "could not save " << sFilename << endl;
+        return EXIT_FAILURE;
+    }
+
+    {
+        Map loaded;
+        KeyFrameDatabase loadedDatabase(voc);
+        if(!MapSerializer::Load(sFilename,&loaded,&loadedDatabase,&voc))
+        {
+            cout << "could not load " << sFilename << endl;
+            bOk = false;
+        }
+        else
+        {
+            if(loaded.KeyFramesInMap()!=savedMap.KeyFramesInMap() || loaded.MapPointsInMap()!=savedMap.MapPointsInMap())
+            {
+                cout << "loaded " << loaded.KeyFramesInMap() << " keyframes and " << loaded.MapPointsInMap()
+                     << " map points instead of " << savedMap.KeyFramesInMap() << " and " << savedMap.MapPointsInMap() << endl;
+                bOk = false;
+            }
+            else if(DescribeMap(&loaded)!=sOriginal)
+            {
+                cout << "the loaded map differs from the saved one" << endl;
+                bOk = false;
+            }
+
+            // New keyframes must not reuse a loaded id
+            if(KeyFrame::nNextId<=vpKFs.back()->mnId)
+            {
+                cout << "keyframe ids restart at " << KeyFrame::nNextId << endl;
+                bOk = false;
+            }
+        }
+        loaded.clear();
+    }
+
+    {
+        ifstream f(sFilename, ios_base::in | ios_base::binary);
+        vector<char> vData((istreambuf_iterator<char>(f)),istreambuf_iterator<char>());
+        ofstream g(sTruncatedFilename, ios_base::out | ios_base::binary | ios_base::trunc);
+        g.write(&vData[0],vData.size()/2);
+    }
+
+    {
+        Map truncated;
+        KeyFrameDatabase truncatedDatabase(voc);
+        if(MapSerializer::Load(sTruncatedFilename,&truncated,&truncatedDatabase,&voc) ||
+           truncated.KeyFramesInMap()!=0 || truncated.MapPointsInMap()!=0)
+        {
+            cout << "a truncated map file was loaded" << endl;
+            bOk = false;
+        }
+    }
+
+    savedMap.clear();
+    remove(sFilename);
+    remove(sTruncatedFilename);
+
+    cout << (bOk ? "map serialization: OK" : "map serialization: FAILED") << endl;
+    return bOk ? EXIT_SUCCESS : EXIT_FAILURE;
+}
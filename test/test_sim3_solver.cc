@@ -0,0 +1,237 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Checks the closed-form Sim3 of Sim3Solver on minimal sets with a known similarity, and the
+// RANSAC on two synthetic keyframes whose matches contain outliers. Solvers built on the same
+// keyframes use the same random sequence and must give the same result.
+
+#include "Sim3Solver.h"
+#include "KeyFrame.h"
+#include "MapPoint.h"
+#include "Map.h"
+#include "Frame.h"
+#include "Converter.h"
+
+#include <Eigen/Dense>
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace ORB_SLAM2;
+
+// Gives access to the minimal solver and its estimate
+class MinimalSim3Solver : public Sim3Solver
+{
+public:
+    MinimalSim3Solver(KeyFrame* pKF1, KeyFrame* pKF2, const vector<MapPoint*> &vpMatched12, const bool bFixScale):
+        Sim3Solver(pKF1,pKF2,vpMatched12,bFixScale) {}
+
+    void Compute(const Eigen::Matrix3f &P1, const Eigen::Matrix3f &P2,
+                 Eigen::Matrix3f &R12, Eigen::Vector3f &t12, float &s12)
+    {
+        ComputeSim3(P1,P2);
+        R12 = Converter::toMatrix3f(mR12i);
+        t12 = Converter::toVector3f(mt12i);
+        s12 = ms12i;
+    }
+};
+
+// Keyframe at the origin, without features; the matched points are added afterwards
+static KeyFrame* CreateKeyFrame(const int N, Map* pMap)
+{
+    Frame F;
+    F.mpORBvocabulary = static_cast<ORBVocabulary*>(NULL);
+    F.mpORBextractorLeft = static_cast<ORBextractor*>(NULL);
+    F.mpORBextractorRight = static_cast<ORBextractor*>(NULL);
+    F.mpReferenceKF = static_cast<KeyFrame*>(NULL);
+    F.mnId = 0;
+    F.mTimeStamp = 0;
+    F.mbf = 0;
+    F.mb = 0;
+    F.mThDepth = 0;
+    F.mK = cv::Mat::eye(3,3,CV_32F);
+    F.mK.at<float>(0,0) = Frame::fx;
+    F.mK.at<float>(1,1) = Frame::fy;
+    F.mK.at<float>(0,2) = Frame::cx;
+    F.mK.at<float>(1,2) = Frame::cy;
+    F.mnScaleLevels = 1;
+    F.mfScaleFactor = 1.2f;
+    F.mfLogScaleFactor = log(F.mfScaleFactor);
+    F.mvScaleFactors = vector<float>(1,1.0f);
+    F.mvLevelSigma2 = vector<float>(1,1.0f);
+    F.mvInvLevelSigma2 = vector<float>(1,1.0f);
+    F.N = N;
+    F.mvKeys = vector<cv::KeyPoint>(N,cv::KeyPoint(cv::Point2f(Frame::cx,Frame::cy),31.0f));
+    F.mvKeysUn = F.mvKeys;
+    F.mvuRight = vector<float>(N,-1);
+    F.mvDepth = vector<float>(N,-1);
+    F.mDescriptors = cv::Mat::zeros(N,32,CV_8U);
+    F.mvpMapPoints = vector<MapPoint*>(N,static_cast<MapPoint*>(NULL));
+    F.mTcw = cv::Mat::eye(4,4,CV_32F);
+    return new KeyFrame(F,pMap,static_cast<KeyFrameDatabase*>(NULL));
+}
+
+static MapPoint* CreateMapPoint(const Eigen::Vector3f &x, KeyFrame* pKF, const int idx, Map* pMap)
+{
+    MapPoint* pMP = new MapPoint(Converter::toCvMat(x),pKF,pMap);
+    pMP->AddObservation(pKF,idx);
+    pKF->AddMapPoint(pMP,idx);
+    pMap->AddMapPoint(pMP);
+    return pMP;
+}
+
+static Eigen::Matrix3f RandomRotation(mt19937 &rng, const float maxAngle)
+{
+    uniform_real_distribution<float> value(-1.0f,1.0f);
+    const Eigen::Vector3f axis = Eigen::Vector3f(value(rng),value(rng),value(rng)).normalized();
+    return Eigen::AngleAxisf(maxAngle*value(rng),axis).toRotationMatrix();
+}
+
+static bool CheckEstimate(const char* name, const Eigen::Matrix3f &R, const Eigen::Vector3f &t, const float s,
+                          const Eigen::Matrix3f &RTrue, const Eigen::Vector3f &tTrue, const float sTrue)
+{
+    const float errorR = (R-RTrue).norm();
+    const float errorT = (t-tTrue).norm()/max(tTrue.norm(),1.0f);
+    const float errorS = fabs(s-sTrue)/sTrue;
+    if(!(errorR<1e-3f && errorT<1e-3f && errorS<1e-3f))
+    {
+        cout << name << ": rotation error " << errorR << ", translation error " << errorT
+             << ", scale error " << errorS << endl;
+        return false;
+    }
+    return true;
+}
+
+int main()
+{
+    mt19937 rng(5);
+    uniform_real_distribution<float> value(-1.0f,1.0f);
+    bool bOk = true;
+
+    Frame::fx = 500.0f; Frame::fy = 500.0f; Frame::cx = 320.0f; Frame::cy = 240.0f;
+    Frame::invfx = 1.0f/Frame::fx; Frame::invfy = 1.0f/Frame::fy;
+    Frame::mnMinX = 0.0f; Frame::mnMaxX = 640.0f; Frame::mnMinY = 0.0f; Frame::mnMaxY = 480.0f;
+    Frame::mfGridElementWidthInv = FRAME_GRID_COLS/(Frame::mnMaxX-Frame::mnMinX);
+    Frame::mfGridElementHeightInv = FRAME_GRID_ROWS/(Frame::mnMaxY-Frame::mnMinY);
+    Frame::mbInitialComputations = false;
+
+    Map map;
+
+    // Matches between the points of keyframe 1 and keyframe 2, seen in front of both cameras:
+    // X1 = s12*R12*X2 + t12. Every fifth match is an outlier.
+    const int N = 100;
+    const Eigen::Matrix3f R12 = RandomRotation(rng,0.3f);
+    const Eigen::Vector3f t12(0.3f,-0.1f,0.2f);
+    const float s12 = 1.7f;
+
+    KeyFrame* pKF1 = CreateKeyFrame(N,&map);
+    KeyFrame* pKF2 = CreateKeyFrame(N,&map);
+    map.AddKeyFrame(pKF1);
+    map.AddKeyFrame(pKF2);
+
+    vector<MapPoint*> vpMatched12(N,static_cast<MapPoint*>(NULL));
+    vector<bool> vbOutlier(N,false);
+    for(int i=0; i<N; i++)
+    {
+        const Eigen::Vector3f X1(2.0f*value(rng),1.5f*value(rng),6.0f+2.0f*value(rng));
+        Eigen::Vector3f X2 = R12.transpose()*(X1-t12)/s12;
+        vbOutlier[i] = i%5==4;
+        if(vbOutlier[i])
+            X2 = Eigen::Vector3f(value(rng),value(rng),3.0f+value(rng));
+        CreateMapPoint(X1,pKF1,i,&map);
+        vpMatched12[i] = CreateMapPoint(X2,pKF2,i,&map);
+    }
+
+    // Minimal sets: the closed form must be exact, with and without fixed scale
+    {
+        MinimalSim3Solver solver(pKF1,pKF2,vpMatched12,false);
+        MinimalSim3Solver solverFixed(pKF1,pKF2,vpMatched12,true);
+        for(int k=0; k<20; k++)
+        {
+            const Eigen::Matrix3f RTrue = RandomRotation(rng,3.0f);
+            const Eigen::Vector3f tTrue(value(rng),value(rng),value(rng));
+            const float sTrue = 0.5f+1.5f*(value(rng)+1.0f);
+            Eigen::Matrix3f P2;
+            for(int j=0; j<3; j++)
+                P2.col(j) = 3.0f*Eigen::Vector3f(value(rng),value(rng),value(rng));
+            const Eigen::Matrix3f P1 = (sTrue*RTrue*P2).colwise()+tTrue;
+            const Eigen::Matrix3f P1Fixed = (RTrue*P2).colwise()+tTrue;
+
+            Eigen::Matrix3f R;
+            Eigen::Vector3f t;
+            float s;
+            solver.Compute(P1,P2,R,t,s);
+            bOk &= CheckEstimate("minimal set",R,t,s,RTrue,tTrue,sTrue);
+            solverFixed.Compute(P1Fixed,P2,R,t,s);
+            bOk &= CheckEstimate("minimal set with fixed scale",R,t,s,RTrue,tTrue,1.0f);
+        }
+    }
+
+    // RANSAC on all the matches
+    {
+        Sim3Solver solver(pKF1,pKF2,vpMatched12,false);
+        solver.SetRansacParameters(0.99,20,300);
+        vector<bool> vbInliers;
+        int nInliers;
+        cv::Mat T12 = solver.find(vbInliers,nInliers);
+        if(T12.empty())
+        {
+            cout << "RANSAC: no solution found" << endl;
+            bOk = false;
+        }
+        else
+        {
+            bOk &= CheckEstimate("RANSAC",Converter::toMatrix3f(solver.GetEstimatedRotation()),
+                                 Converter::toVector3f(solver.GetEstimatedTranslation()),
+                                 solver.GetEstimatedScale(),R12,t12,s12);
+
+            int nWrong = 0;
+            for(int i=0; i<N; i++)
+                if(vbInliers[i]==vbOutlier[i])
+                    nWrong++;
+            if(nWrong>0 || nInliers!=N-N/5)
+            {
+                cout << "RANSAC: " << nInliers << " inliers, " << nWrong << " wrongly classified" << endl;
+                bOk = false;
+            }
+
+            // Same keyframes, same random sequence
+            Sim3Solver solver2(pKF1,pKF2,vpMatched12,false);
+            solver2.SetRansacParameters(0.99,20,300);
+            vector<bool> vbInliers2;
+            int nInliers2;
+            cv::Mat T12b = solver2.find(vbInliers2,nInliers2);
+            if(T12b.empty() || cv::norm(T12-T12b)!=0 || vbInliers2!=vbInliers)
+            {
+                cout << "RANSAC: two solvers on the same keyframes differ" << endl;
+                bOk = false;
+            }
+        }
+    }
+
+    map.clear();
+
+    cout << (bOk ? "sim3 solver: OK" : "sim3 solver: FAILED") << endl;
+    return bOk ? EXIT_SUCCESS : EXIT_FAILURE;
+}
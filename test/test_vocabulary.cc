@@ -0,0 +1,292 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Saves a small vocabulary trained on random ORB descriptors to the binary format, loads it
+// back and checks that the loaded (memory mapped) vocabulary transforms features exactly as
+// the original one. Both are also checked against a plain descent of the node tree, which does
+// not use the flattened tree. Truncated files and files with a node saved before its parent
+// must be rejected.
+
+#include "ORBVocabulary.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace ORB_SLAM2;
+
+static const char* sFilename = "test_vocabulary.bin";
+static const char* sCorruptFilename = "test_vocabulary_corrupt.bin";
+
+static vector<cv::Mat> RandomDescriptors(const int n, mt19937 &rng)
+{
+    uniform_int_distribution<int> byte(0,255);
+    vector<cv::Mat> vDesc(n);
+    for(int i=0; i<n; i++)
+    {
+        vDesc[i] = cv::Mat(1,DBoW2::FORB::L,CV_8U);
+        unsigned char* p = vDesc[i].ptr<unsigned char>();
+        for(int j=0; j<DBoW2::FORB::L; j++)
+            p[j] = byte(rng);
+    }
+    return vDesc;
+}
+
+static bool ReadFile(const char* filename, vector<char> &vData)
+{
+    ifstream f(filename, ios_base::in | ios_base::binary);
+    if(!f.is_open())
+        return false;
+    vData.assign(istreambuf_iterator<char>(f),istreambuf_iterator<char>());
+    return true;
+}
+
+static bool WriteFile(const char* filename, const vector<char> &vData, const size_t size)
+{
+    ofstream f(filename, ios_base::out | ios_base::binary | ios_base::trunc);
+    if(!f.is_open())
+        return false;
+    f.write(&vData[0],size);
+    return f.good();
+}
+
+// Vocabulary with access to the node tree, to transform features without the flattened tree
+class ReferenceVocabulary : public ORBVocabulary
+{
+public:
+    using ORBVocabulary::ORBVocabulary;
+
+    bool HasFlatTree() const { return !m_flat_nodes.empty(); }
+
+    // Descends m_nodes from the root to a leaf, choosing the closest child at each level
+    void ReferenceTransform(const cv::Mat &feature, DBoW2::WordId &id, DBoW2::WordValue &weight,
+                            DBoW2::NodeId &nid, const int levelsup) const
+    {
+        const int nidLevel = m_L - levelsup;
+        DBoW2::NodeId node = 0;
+        nid = 0;
+        for(int level=1; !m_nodes[node].isLeaf(); level++)
+        {
+            const vector<DBoW2::NodeId> &vChildren = m_nodes[node].children;
+            DBoW2::NodeId best = vChildren[0];
+            int bestDist = DBoW2::FORB::distance(feature,m_nodes[best].descriptor);
+            for(size_t i=1; i<vChildren.size(); i++)
+            {
+                const int dist = DBoW2::FORB::distance(feature,m_nodes[vChildren[i]].descriptor);
+                if(dist<bestDist)
+                {
+                    bestDist = dist;
+                    best = vChildren[i];
+                }
+            }
+            node = best;
+            if(level==nidLevel)
+                nid = node;
+        }
+        id = m_nodes[node].word_id;
+        weight = m_nodes[node].weight;
+    }
+
+    // Bag of words of an image from the reference descent (TF-IDF weighting)
+    void ReferenceTransform(const vector<cv::Mat> &vFeatures, DBoW2::BowVector &bow,
+                            DBoW2::FeatureVector &feat, const int levelsup) const
+    {
+        bow.clear();
+        feat.clear();
+        for(size_t i=0; i<vFeatures.size(); i++)
+        {
+            DBoW2::WordId id;
+            DBoW2::WordValue weight;
+            DBoW2::NodeId nid;
+            ReferenceTransform(vFeatures[i],id,weight,nid,levelsup);
+            if(weight>0)
+            {
+                bow.addWeight(id,weight);
+                feat.addFeature(nid,i);
+            }
+        }
+        DBoW2::LNorm norm;
+        if(m_scoring_object->mustNormalize(norm))
+            bow.normalize(norm);
+    }
+
+    // Compares the word, weight and node of every feature and the bag of words of every image
+    // with the reference descent
+    bool CheckReferenceTransform(const char* name, const vector<vector<cv::Mat> > &vvFeatures) const
+    {
+        if(!HasFlatTree())
+        {
+            cout << name << ": the flattened tree was not built" << endl;
+            return false;
+        }
+
+        for(size_t i=0; i<vvFeatures.size(); i++)
+        {
+            for(size_t j=0; j<vvFeatures[i].size(); j++)
+            {
+                DBoW2::WordId id, idRef;
+                DBoW2::WordValue weight, weightRef;
+                DBoW2::NodeId nid, nidRef;
+                transform(vvFeatures[i][j],id,weight,&nid,2);
+                ReferenceTransform(vvFeatures[i][j],idRef,weightRef,nidRef,2);
+                if(id!=idRef || weight!=weightRef || nid!=nidRef)
+                {
+                    cout << name << ": different word of feature " << j << " of image " << i << endl;
+                    return false;
+                }
+            }
+
+            DBoW2::BowVector bow, bowRef;
+            DBoW2::FeatureVector feat, featRef;
+            ORBVocabulary::transform(vvFeatures[i],bow,feat,2);
+            ReferenceTransform(vvFeatures[i],bowRef,featRef,2);
+            if(bow!=bowRef || feat!=featRef)
+            {
+                cout << name << ": different bag of words of image " << i << " than the node tree" << endl;
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+static bool CheckSameTransform(const char* name, const ORBVocabulary &voc, const ORBVocabulary &ref,
+                               const vector<vector<cv::Mat> > &vvFeatures)
+{
+    if(voc.size()!=ref.size() || voc.getBranchingFactor()!=ref.getBranchingFactor() ||
+       voc.getDepthLevels()!=ref.getDepthLevels())
+    {
+        cout << name << ": different vocabulary size" << endl;
+        return false;
+    }
+
+    for(size_t i=0; i<vvFeatures.size(); i++)
+    {
+        DBoW2::BowVector bow, bowRef;
+        DBoW2::FeatureVector feat, featRef;
+        voc.transform(vvFeatures[i],bow,feat,2);
+        ref.transform(vvFeatures[i],bowRef,featRef,2);
+        if(bow!=bowRef || feat!=featRef)
+        {
+            cout << name << ": different transform of image " << i << endl;
+            return false;
+        }
+    }
+
+    for(unsigned int w=0; w<ref.size(); w++)
+    {
+        if(voc.getWordWeight(w)!=ref.getWordWeight(w) ||
+           DBoW2::FORB::distance(voc.getWord(w),ref.getWord(w))!=0)
+        {
+            cout << name << ": different word " << w << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main()
+{
+    mt19937 rng(7);
+    bool bOk = true;
+
+    vector<vector<cv::Mat> > vvTraining(20);
+    for(size_t i=0; i<vvTraining.size(); i++)
+        vvTraining[i] = RandomDescriptors(200,rng);
+
+    ReferenceVocabulary voc(5,3,DBoW2::TF_IDF,DBoW2::L1_NORM);
+    voc.create(vvTraining);
+
+    vector<vector<cv::Mat> > vvQuery(10);
+    for(size_t i=0; i<vvQuery.size(); i++)
+        vvQuery[i] = RandomDescriptors(500,rng);
+
+    bOk &= voc.CheckReferenceTransform("created",vvQuery);
+
+    if(!voc.saveToBinaryFile(sFilename))
+    {
+        cout << "could not save " << sFilename << endl;
+        return EXIT_FAILURE;
+    }
+
+    // The copy owns its descriptors and must outlive the mapping of the loaded vocabulary
+    ORBVocabulary copy;
+    {
+        ReferenceVocabulary loaded;
+        if(!loaded.loadFromBinaryFile(sFilename))
+        {
+            cout << "could not load " << sFilename << endl;
+            return EXIT_FAILURE;
+        }
+        bOk &= loaded.CheckReferenceTransform("binary load",vvQuery);
+        bOk &= CheckSameTransform("binary load",loaded,voc,vvQuery);
+        copy = loaded;
+    }
+    bOk &= CheckSameTransform("copy of the binary load",copy,voc,vvQuery);
+
+    vector<char> vData;
+    if(!ReadFile(sFilename,vData))
+    {
+        cout << "could not read " << sFilename << endl;
+        return EXIT_FAILURE;
+    }
+
+    // Header: magic[8], version, k, L, scoring, weighting, nodes, descriptor_bytes, record_bytes
+    uint32_t nNodes, recordBytes;
+    memcpy(&nNodes,&vData[28],4);
+    memcpy(&recordBytes,&vData[36],4);
+    const size_t headerBytes = vData.size() - (size_t)(nNodes-1)*recordBytes;
+
+    {
+        ORBVocabulary truncated;
+        WriteFile(sCorruptFilename,vData,vData.size()-recordBytes/2);
+        if(truncated.loadFromBinaryFile(sCorruptFilename))
+        {
+            cout << "a truncated file was loaded" << endl;
+            bOk = false;
+        }
+    }
+
+    {
+        // The second record declares itself as its own parent
+        vector<char> vCorrupt = vData;
+        const uint32_t parent = 2;
+        memcpy(&vCorrupt[headerBytes+recordBytes],&parent,4);
+        WriteFile(sCorruptFilename,vCorrupt,vCorrupt.size());
+
+        ORBVocabulary corrupt;
+        if(corrupt.loadFromBinaryFile(sCorruptFilename) || !corrupt.empty())
+        {
+            cout << "a file with a node saved before its parent was loaded" << endl;
+            bOk = false;
+        }
+    }
+
+    remove(sFilename);
+    remove(sCorruptFilename);
+
+    cout << (bOk ? "vocabulary: OK" : "vocabulary: FAILED") << endl;
+    return bOk ? EXIT_SUCCESS : EXIT_FAILURE;
+}